@@ -24,6 +24,14 @@ using namespace std;
 
 namespace baseutils {
 
+Buffer::Buffer() :
+        mData(NULL),
+        mCapacity(0),
+        mRangeOffset(0),
+        mRangeLength(0),
+        mInt32Data(0) {
+}
+
 Buffer::Buffer(const size_t capacity) :
         mData(malloc(capacity)),
         mCapacity(capacity),
@@ -42,16 +50,42 @@ Buffer::Buffer(const void* data, const size_t capacity) :
 }
 
 Buffer::~Buffer() {
-    if (mData != NULL) {
+    if (mRelease) {
+        mRelease(mData);
+    } else if (mData != NULL && mParent == NULL) {
         free(mData);
-        mData = NULL;
     }
+    mData = NULL;
 
     if (mFarewell != NULL) {
         mFarewell->post();
     }
 }
 
+// static
+shared_ptr<Buffer> Buffer::Wrap(void* data, const size_t capacity, const ReleaseCallback& release) {
+    // Buffer() is protected.
+    shared_ptr<Buffer> buffer(new Buffer());
+    buffer->mData = data;
+    buffer->mCapacity = capacity;
+    buffer->mRangeLength = capacity;
+    buffer->mRelease = release;
+    return buffer;
+}
+
+shared_ptr<Buffer> Buffer::slice(const size_t offset, const size_t size) {
+    assert(offset <= mCapacity);
+    assert(offset + size <= mCapacity);
+
+    shared_ptr<Buffer> slice(new Buffer());
+    slice->mData = base() + offset;
+    slice->mCapacity = size;
+    slice->mRangeLength = size;
+    // Slices of slices hang on to the owner directly.
+    slice->mParent = mParent != NULL ? mParent : shared_from_this();
+    return slice;
+}
+
 void Buffer::consume(const size_t size) {
     assert(size <= mRangeLength);
     mRangeOffset += size;
@@ -83,7 +117,7 @@ void Buffer::setFarewellMessage(const shared_ptr<Message>& msg) {
 
 shared_ptr<Message> Buffer::meta() {
     if (mMeta == NULL) {
-        mMeta = make_shared<Message>();
+        mMeta = Message::obtain();
     }
     return mMeta;
 }
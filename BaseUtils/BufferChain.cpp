@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cassert>
+#include <cstring>
+
+#include <baseutils/Buffer.h>
+#include <baseutils/BufferChain.h>
+#include <baseutils/BufferPool.h>
+
+using namespace std;
+
+namespace baseutils {
+
+BufferChain::BufferChain()
+    : mSize(0) {
+}
+
+BufferChain::BufferChain(const shared_ptr<Buffer>& buffer)
+    : mSize(0) {
+    append(buffer);
+}
+
+void BufferChain::append(const shared_ptr<Buffer>& buffer) {
+    if (buffer == NULL || buffer->size() == 0) {
+        return;
+    }
+    mSegments.push_back(buffer);
+    mSize += buffer->size();
+}
+
+void BufferChain::append(const BufferChain& chain) {
+    // Copy first, chain may be this.
+    deque<shared_ptr<Buffer>> segments(chain.mSegments);
+    for (auto& segment : segments) {
+        append(segment);
+    }
+}
+
+void BufferChain::prepend(const shared_ptr<Buffer>& buffer) {
+    if (buffer == NULL || buffer->size() == 0) {
+        return;
+    }
+    mSegments.push_front(buffer);
+    mSize += buffer->size();
+}
+
+void BufferChain::prepend(const BufferChain& chain) {
+    deque<shared_ptr<Buffer>> segments(chain.mSegments);
+    for (auto it = segments.rbegin(); it != segments.rend(); ++it) {
+        prepend(*it);
+    }
+}
+
+void BufferChain::clear() {
+    mSegments.clear();
+    mSize = 0;
+}
+
+shared_ptr<BufferChain> BufferChain::split(const size_t offset) {
+    auto tail(make_shared<BufferChain>());
+    if (offset >= mSize) {
+        return tail;
+    }
+
+    // Find the segment holding offset.
+    size_t index = 0;
+    size_t start = 0;
+    while (start + mSegments[index]->size() <= offset) {
+        start += mSegments[index]->size();
+        index++;
+    }
+
+    size_t cut = offset - start;
+    if (cut > 0) {
+        shared_ptr<Buffer>& segment = mSegments[index];
+        tail->append(segment->slice(segment->offset() + cut, segment->size() - cut));
+        segment = segment->slice(segment->offset(), cut);
+        index++;
+    }
+    for (size_t i = index; i < mSegments.size(); i++) {
+        tail->append(mSegments[i]);
+    }
+
+    mSegments.erase(mSegments.begin() + index, mSegments.end());
+    mSize = offset;
+    return tail;
+}
+
+shared_ptr<Buffer> BufferChain::coalesce() {
+    if (mSegments.empty()) {
+        return NULL;
+    }
+    if (mSegments.size() == 1) {
+        return mSegments.front();
+    }
+
+    shared_ptr<Buffer> buffer(BufferPool::getInstance()->acquire(mSize));
+    copyTo(buffer->base(), 0, mSize);
+    buffer->setSize(mSize);
+
+    mSegments.clear();
+    mSegments.push_back(buffer);
+    return buffer;
+}
+
+size_t BufferChain::copyTo(void* dst, const size_t offset, const size_t size) const {
+    uint8_t* out = static_cast<uint8_t*>(dst);
+    size_t skip = offset;
+    size_t copied = 0;
+    for (auto& segment : mSegments) {
+        if (copied == size) {
+            break;
+        }
+        if (skip >= segment->size()) {
+            skip -= segment->size();
+            continue;
+        }
+
+        size_t length = segment->size() - skip;
+        if (length > size - copied) {
+            length = size - copied;
+        }
+        memcpy(out + copied, segment->data() + skip, length);
+        copied += length;
+        skip = 0;
+    }
+    return copied;
+}
+
+size_t BufferChain::fillIovec(struct iovec* iov, const size_t count) const {
+    size_t filled = 0;
+    for (auto& segment : mSegments) {
+        if (filled == count) {
+            break;
+        }
+        iov[filled].iov_base = segment->data();
+        iov[filled].iov_len = segment->size();
+        filled++;
+    }
+    return filled;
+}
+
+} // namespace baseutils
@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cstdlib>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <baseutils/Buffer.h>
+#include <baseutils/BufferPool.h>
+
+using namespace std;
+
+namespace baseutils {
+
+/**
+ * Blocks the calling thread keeps per class, handed out without locking.
+ * Whatever is left when the thread exits goes back to the shared lists.
+ */
+class BufferPool::ThreadCache {
+public:
+    vector<void*> mBlocks[kNumClasses];
+
+    // Set once the calling thread's cache is gone, buffers destroyed after
+    // that (by other thread_local objects) go straight to the shared lists.
+    static thread_local bool tDestroyed;
+
+    ThreadCache() = default;
+
+    ~ThreadCache() {
+        tDestroyed = true;
+        BufferPool* pool = BufferPool::getInstance();
+        for (size_t i = 0; i < kNumClasses; i++) {
+            pool->give(i, &mBlocks[i], mBlocks[i].size());
+        }
+    }
+};
+
+thread_local bool BufferPool::ThreadCache::tDestroyed = false;
+
+/**
+ * Buffer over a pooled block, giving the block back instead of freeing it.
+ */
+class BufferPool::PooledBuffer : public Buffer {
+public:
+    PooledBuffer(void* block, const size_t capacity, const size_t index)
+        : mIndex(index) {
+        mData = block;
+        mCapacity = capacity;
+    }
+
+    virtual ~PooledBuffer() {
+        BufferPool::getInstance()->release(mIndex, mData);
+        mData = NULL;
+    }
+
+private:
+    size_t mIndex;
+};
+
+// static
+BufferPool* BufferPool::getInstance() {
+    // Never destroyed, so buffers that outlive main() can still go back.
+    static BufferPool* sInstance = new BufferPool();
+    return sInstance;
+}
+
+BufferPool::BufferPool()
+    : mIdleBytes(0),
+      mHighWaterMark(64 * 1024 * 1024),
+      mSystemAllocations(0),
+      mPrefault(false),
+      mLockMemory(false),
+      mLockedAny(false) {
+}
+
+shared_ptr<Buffer> BufferPool::acquire(const size_t capacity) {
+    if (capacity > kMaxClassSize) {
+        return make_shared<Buffer>(capacity);
+    }
+
+    size_t index = ClassIndex(capacity);
+    return make_shared<PooledBuffer>(allocate(index), capacity, index);
+}
+
+void BufferPool::reserve(const size_t capacity, const size_t count) {
+    if (capacity > kMaxClassSize) {
+        return;
+    }
+
+    size_t index = ClassIndex(capacity);
+    vector<void*> blocks;
+    for (size_t i = 0; i < count; i++) {
+        blocks.push_back(allocateBlock(index));
+    }
+    give(index, &blocks, blocks.size());
+}
+
+void BufferPool::setHighWaterMark(const size_t bytes) {
+    mHighWaterMark.store(bytes, memory_order_relaxed);
+}
+
+void BufferPool::setPrefault(const bool prefault) {
+    mPrefault.store(prefault, memory_order_relaxed);
+}
+
+void BufferPool::setLockMemory(const bool lock) {
+    mLockMemory.store(lock, memory_order_relaxed);
+}
+
+// static
+size_t BufferPool::ClassIndex(const size_t capacity) {
+    size_t index = 0;
+    while (ClassSize(index) < capacity) {
+        index++;
+    }
+    return index;
+}
+
+// static
+size_t BufferPool::ClassSize(const size_t index) {
+    return (size_t)kMinClassSize << index;
+}
+
+// static
+size_t BufferPool::ThreadCacheLimit(const size_t index) {
+    size_t limit = kThreadCacheBytes / ClassSize(index);
+    return limit < kMaxThreadCacheBlocks ? limit : (size_t)kMaxThreadCacheBlocks;
+}
+
+// static
+BufferPool::ThreadCache* BufferPool::LocalCache() {
+    if (ThreadCache::tDestroyed) {
+        return NULL;
+    }
+    static thread_local ThreadCache sCache;
+    return &sCache;
+}
+
+void* BufferPool::allocate(const size_t index) {
+    ThreadCache* cache = LocalCache();
+    if (cache == NULL) {
+        vector<void*> blocks;
+        take(index, &blocks, 1);
+        return blocks.empty() ? allocateBlock(index) : blocks.back();
+    }
+
+    vector<void*>& blocks = cache->mBlocks[index];
+    if (blocks.empty()) {
+        // Refill half the cache, so alternating acquire and release doesn't
+        // bounce on the shared list.
+        take(index, &blocks, (ThreadCacheLimit(index) + 1) / 2);
+        if (blocks.empty()) {
+            return allocateBlock(index);
+        }
+    }
+
+    void* block = blocks.back();
+    blocks.pop_back();
+    return block;
+}
+
+void BufferPool::release(const size_t index, void* block) {
+    ThreadCache* cache = LocalCache();
+    if (cache == NULL) {
+        vector<void*> blocks(1, block);
+        give(index, &blocks, 1);
+        return;
+    }
+
+    vector<void*>& blocks = cache->mBlocks[index];
+    size_t limit = ThreadCacheLimit(index);
+    if (blocks.size() >= limit) {
+        give(index, &blocks, limit - limit / 2);
+    }
+    blocks.push_back(block);
+}
+
+void* BufferPool::allocateBlock(const size_t index) {
+    size_t size = ClassSize(index);
+    void* block = NULL;
+    if (posix_memalign(&block, kMinClassSize, size) != 0) {
+        throw bad_alloc();
+    }
+    mSystemAllocations.fetch_add(1, memory_order_relaxed);
+
+    if (mPrefault.load(memory_order_relaxed)) {
+        size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+        for (size_t offset = 0; offset < size; offset += pageSize) {
+            static_cast<volatile uint8_t*>(block)[offset] = 0;
+        }
+    }
+    if (mLockMemory.load(memory_order_relaxed) && mlock(block, size) == 0) {
+        mLockedAny.store(true, memory_order_relaxed);
+    }
+    return block;
+}
+
+void BufferPool::freeBlock(const size_t index, void* block) {
+    if (mLockedAny.load(memory_order_relaxed)) {
+        munlock(block, ClassSize(index));
+    }
+    free(block);
+}
+
+void BufferPool::take(const size_t index, vector<void*>* blocks, const size_t count) {
+    SizeClass& sizeClass = mClasses[index];
+    lock_guard<mutex> autoLock(sizeClass.mLock);
+
+    size_t n = count < sizeClass.mFree.size() ? count : sizeClass.mFree.size();
+    blocks->insert(blocks->end(), sizeClass.mFree.end() - n, sizeClass.mFree.end());
+    sizeClass.mFree.resize(sizeClass.mFree.size() - n);
+    mIdleBytes.fetch_sub(n * ClassSize(index), memory_order_relaxed);
+}
+
+void BufferPool::give(const size_t index, vector<void*>* blocks, const size_t count) {
+    SizeClass& sizeClass = mClasses[index];
+    size_t size = ClassSize(index);
+    size_t highWaterMark = mHighWaterMark.load(memory_order_relaxed);
+    size_t n = count;
+    {
+        lock_guard<mutex> autoLock(sizeClass.mLock);
+        for (; n > 0 && mIdleBytes.load(memory_order_relaxed) + size <= highWaterMark; n--) {
+            sizeClass.mFree.push_back(blocks->back());
+            blocks->pop_back();
+            mIdleBytes.fetch_add(size, memory_order_relaxed);
+        }
+    }
+
+    for (; n > 0; n--) {
+        freeBlock(index, blocks->back());
+        blocks->pop_back();
+    }
+}
+
+} // namespace baseutils
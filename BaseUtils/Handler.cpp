@@ -1,5 +1,6 @@
 
 #include <baseutils/Handler.h>
+#include <baseutils/Message.h>
 #include "LooperRoster.h"
 
 namespace baseutils {
@@ -9,4 +10,111 @@ Handler::looper() {
     return LooperRoster::getInstance()->findLooper(id());
 }
 
+void
+Handler::onMessagesReceived(const std::vector<std::shared_ptr<Message>>& msgs) {
+    for (const std::shared_ptr<Message>& msg : msgs) {
+        onMessageReceived(msg);
+    }
+}
+
+Handler::~Handler() {
+    delete mStatsBlock.load();
+}
+
+Handler::StatsBlock*
+Handler::obtainStatsBlock() {
+    StatsBlock* block = mStatsBlock.load();
+    if (block == NULL) {
+        StatsBlock* created = new StatsBlock;
+        if (mStatsBlock.compare_exchange_strong(block, created)) {
+            block = created;
+        } else {
+            delete created;
+        }
+    }
+    return block;
+}
+
+void
+Handler::setStatsEnabled(bool enable) {
+    StatsBlock* block = enable ? obtainStatsBlock() : mStatsBlock.load();
+    if (block == NULL) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> autoLock(block->mLock);
+    if (enable && !mStatsEnabled.load()) {
+        block->mStats = Stats();
+        block->mSince = Looper::GetNow();
+    }
+    mStatsEnabled.store(enable);
+}
+
+void
+Handler::getStats(Stats* stats) {
+    StatsBlock* block = mStatsBlock.load();
+    if (block == NULL) {
+        *stats = Stats();
+        return;
+    }
+
+    std::unique_lock<std::mutex> autoLock(block->mLock);
+    *stats = block->mStats;
+    if (mStatsEnabled.load()) {
+        stats->mPeriod = Looper::GetNow() - block->mSince;
+    }
+}
+
+void
+Handler::resetStats() {
+    StatsBlock* block = mStatsBlock.load();
+    if (block == NULL) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> autoLock(block->mLock);
+    block->mStats = Stats();
+    block->mSince = Looper::GetNow();
+}
+
+double
+Handler::Stats::rate(uint32_t what) const {
+    auto search = mMessagesPerWhat.find(what);
+    double seconds = std::chrono::duration<double>(mPeriod).count();
+    if (search == mMessagesPerWhat.end() || seconds <= 0) {
+        return 0;
+    }
+    return search->second / seconds;
+}
+
+void
+Handler::recordDelivery(uint32_t what, const Looper::clock::duration& elapsed) {
+    StatsBlock* block = mStatsBlock.load();
+    if (block == NULL) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> autoLock(block->mLock);
+    block->mStats.mMessages++;
+    block->mStats.mExecTimes.record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    block->mStats.mMessagesPerWhat[what]++;
+}
+
+void
+Handler::recordDelivery(const std::vector<uint32_t>& whats,
+                        const Looper::clock::duration& elapsed) {
+    StatsBlock* block = mStatsBlock.load();
+    if (block == NULL) {
+        return;
+    }
+    int64_t average = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / whats.size();
+
+    std::unique_lock<std::mutex> autoLock(block->mLock);
+    for (uint32_t what : whats) {
+        block->mStats.mMessages++;
+        block->mStats.mExecTimes.record(average);
+        block->mStats.mMessagesPerWhat[what]++;
+    }
+}
+
 } // namespace baseutils
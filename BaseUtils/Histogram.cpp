@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <algorithm>
+
+#include <baseutils/Histogram.h>
+
+using namespace std;
+
+namespace baseutils {
+
+Histogram::Histogram()
+    : mBuckets(kNumBuckets, 0),
+      mCount(0),
+      mMin(0),
+      mMax(0),
+      mSum(0) {
+}
+
+void Histogram::record(int64_t value) {
+    if (value < 0) {
+        value = 0;
+    }
+
+    mBuckets[bucketOf((uint64_t)value)]++;
+    if (mCount == 0 || value < mMin) {
+        mMin = value;
+    }
+    if (mCount == 0 || value > mMax) {
+        mMax = value;
+    }
+    mCount++;
+    mSum += value;
+}
+
+void Histogram::merge(const Histogram& other) {
+    if (other.mCount == 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < kNumBuckets; i++) {
+        mBuckets[i] += other.mBuckets[i];
+    }
+    mMin = mCount > 0 ? std::min(mMin, other.mMin) : other.mMin;
+    mMax = mCount > 0 ? std::max(mMax, other.mMax) : other.mMax;
+    mCount += other.mCount;
+    mSum += other.mSum;
+}
+
+void Histogram::reset() {
+    fill(mBuckets.begin(), mBuckets.end(), 0);
+    mCount = 0;
+    mMin = 0;
+    mMax = 0;
+    mSum = 0;
+}
+
+int64_t Histogram::percentile(double percent) const {
+    if (mCount == 0) {
+        return 0;
+    }
+
+    // The rank of the value asked for, 1 based.
+    uint64_t rank = (uint64_t)(percent / 100 * mCount + 0.5);
+    rank = std::max<uint64_t>(1, std::min<uint64_t>(rank, mCount));
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kNumBuckets; i++) {
+        seen += mBuckets[i];
+        if (seen >= rank) {
+            return std::max(mMin, std::min(mMax, (int64_t)upperBound(i)));
+        }
+    }
+    return mMax;
+}
+
+// static
+size_t Histogram::bucketOf(uint64_t value) {
+    if (value < kSubBuckets) {
+        return (size_t)value;
+    }
+
+    // The top bit picks the power of two, the kSubBucketBits below it the
+    // bucket within.
+    int exponent = 63 - __builtin_clzll(value);
+    int shift = exponent - kSubBucketBits;
+    return (size_t)((shift + 1) * kSubBuckets + ((value >> shift) & (kSubBuckets - 1)));
+}
+
+// static
+uint64_t Histogram::upperBound(size_t bucket) {
+    if (bucket < kSubBuckets) {
+        return bucket;
+    }
+
+    int shift = (int)(bucket / kSubBuckets) - 1;
+    uint64_t base = (uint64_t)(kSubBuckets + bucket % kSubBuckets) << shift;
+    return base + ((1ULL << shift) - 1);
+}
+
+} // namespace baseutils
@@ -14,9 +14,17 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <cassert>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
 #include <baseutils/Handler.h>
 #include <baseutils/Looper.h>
 #include <baseutils/Message.h>
+#include <baseutils/Tracer.h>
 #include "BaseThread.h"
 #include "LooperRoster.h"
 
@@ -25,11 +33,20 @@ using namespace std::chrono;
 
 namespace baseutils {
 
+static const MessageKey kKeyFd("fd");
+static const MessageKey kKeyEvents("events");
+
+// Reused by loop() for batched deliveries, to keep its capacity around.
+static thread_local vector<shared_ptr<Message>> tDeliveryBatch;
+
+static atomic<uint32_t> sNextSerial(1);
+
 class Looper::LooperThread : public BaseThread {
 public:
-    LooperThread(Looper* looper)
+    LooperThread(Looper* looper, const string& name)
         : BaseThread(),
           mLooper(looper),
+          mName(name),
           mThreadId() {
     }
 
@@ -37,6 +54,9 @@ public:
 
     virtual Result readyToRun() {
         mThreadId = getThreadId();
+        if (!mName.empty()) {
+            Tracer::setThreadName(mName);
+        }
 
         return BaseThread::readyToRun();
     }
@@ -55,34 +75,97 @@ private:
     LooperThread& operator=(const LooperThread&) = delete;
 
     Looper* mLooper;
+    string mName;
     thread::id mThreadId;
 };
 
 // static
 int64_t Looper::GetNowUs() {
-    time_point<high_resolution_clock> now = high_resolution_clock::now();
-    high_resolution_clock::duration time = now.time_since_epoch();
-    return duration_cast<microseconds>(time).count();
+    return duration_cast<microseconds>(GetNow().time_since_epoch()).count();
 }
 
 // static
-chrono::system_clock::duration Looper::GetNow() {
-    time_point<system_clock> now = system_clock::now();
-    return now.time_since_epoch();
+Looper::clock::time_point Looper::GetNow() {
+    return clock::now();
 }
 
 Looper::Looper()
-    : mRunningLocally(false) {
+    : mEpollFd(epoll_create1(EPOLL_CLOEXEC)),
+      mWakeFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      mTimerFd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)),
+      mArmedDeadline(clock::time_point::max()),
+      mNextFdSeq(0),
+      mDeliveriesSincePoll(0),
+      mSleeping(false),
+      mCachedNow(0),
+      mPolicy(kSchedulingStrict),
+      mTrackLatency(0),
+      mTrackDispatch(0),
+      mNextSeq(0),
+      mCapacity(0),
+      mDepth(0),
+      mHighWaterMark(0),
+      mOverflowPolicy(kOverflowFail),
+      mBlockTimeout(milliseconds(100)),
+      mBlockedProducers(0),
+      mCancelledEvents(0),
+      mDelivered(0),
+      mRunningLocally(false),
+      mSerial(sNextSerial++) {
+    assert(mEpollFd >= 0 && mWakeFd >= 0 && mTimerFd >= 0);
+
+    mLanes[kPriorityUrgent].mWeight = 16;
+    mLanes[kPriorityNormal].mWeight = 4;
+    mLanes[kPriorityBackground].mWeight = 1;
+
+    // steady_clock is CLOCK_MONOTONIC, so mTimerFd takes its deadlines as is.
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = mWakeFd;
+    epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mWakeFd, &event);
+    event.data.fd = mTimerFd;
+    epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mTimerFd, &event);
 }
 
 Looper::~Looper() {
 	stop();
+
+    unique_lock<mutex> autoLock(mLock);
+    drainIngress_l();
+    for (Lane& lane : mLanes) {
+        for (Event* event : lane.mReadyQueue) {
+            if (event->mMessage != NULL) {
+                event->mMessage->mPendingEvents = NULL;
+                releasePending(event->mMessage.get());
+                LooperRoster::getInstance()->failRequest(*event->mMessage);
+            }
+            delete event;
+        }
+        for (Event* event : lane.mTimerHeap) {
+            if (event->mMessage != NULL) {
+                event->mMessage->mPendingEvents = NULL;
+                releasePending(event->mMessage.get());
+                LooperRoster::getInstance()->failRequest(*event->mMessage);
+            }
+            delete event;
+        }
+    }
+
+    close(mTimerFd);
+    close(mWakeFd);
+    close(mEpollFd);
 }
 
 void Looper::setName(const std::string& name) {
+    unique_lock<mutex> autoLock(mLock);
     mName = name;
 }
 
+string Looper::name() {
+    unique_lock<mutex> autoLock(mLock);
+    return mName;
+}
+
 Looper::handler_id Looper::registerHandler(const shared_ptr<Handler>& handler) {
     return LooperRoster::getInstance()->registerHandler(shared_from_this(), handler);
 }
@@ -101,6 +184,7 @@ Result Looper::start(bool runOnCallingThread) {
             }
 
             mRunningLocally = true;
+            mLocalThreadId = this_thread::get_id();
         }
 
         do {
@@ -115,7 +199,7 @@ Result Looper::start(bool runOnCallingThread) {
         return Result::ER_ALREADY_OPERATED;
     }
 
-    mThread = make_shared<LooperThread>(this);
+    mThread = make_shared<LooperThread>(this, mName);
 
     Result err = mThread->run();
     if (err != Result::OK) {
@@ -146,7 +230,7 @@ Result Looper::stop() {
         thread->requestExit();
     }
 
-    mQueueChangedCondition.notify_one();
+    wake();
 
     if (!runningLocally && !thread->isCurrentThread()) {
         // If not running locally and this thread _is_ the looper thread,
@@ -154,77 +238,1074 @@ Result Looper::stop() {
         thread->requestExitAndWait();
     }
 
+    // Nobody is going to answer what is still queued.
+    LooperRoster::getInstance()->failRequests(this);
+    return Result::OK;
+}
+
+Result Looper::post(const shared_ptr<Message>& msg, const clock::time_point& when) {
+    if (!claimPending(msg.get())) {
+        return Result::ER_INVALID_OPERATION;
+    }
+    Result err = admit(msg);
+    if (err != Result::OK) {
+        releasePending(msg.get());
+        return err;
+    }
+
+    Event* event = new Event;
+    event->mWhen = when;
+    event->mMessage = msg;
+    if (mTrackLatency.load(memory_order_relaxed)) {
+        event->mPostedAt = GetNow();
+    }
+
+    if (when.time_since_epoch().count() <= mCachedNow.load(memory_order_relaxed)) {
+        mIngress.push(event);
+
+        // Pairs with the mSleeping store in loop(): either the looper sees
+        // our event before it waits, or we see it sleeping and wake it. A
+        // wakeup written before it gets to epoll_wait() isn't lost.
+        if (mSleeping.load()) {
+            wake();
+        }
+        return Result::OK;
+    }
+
+    unique_lock<mutex> autoLock(mLock);
+
+    event->mSeq = mNextSeq++;
+    track_l(event);
+
+    Lane& lane = laneFor(msg);
+    lane.mTimerHeap.push_back(event);
+    push_heap(lane.mTimerHeap.begin(), lane.mTimerHeap.end(), EventLater());
+
+    // Only a new earliest deadline changes how long the loop has to wait,
+    // and a looper that isn't sleeping re-arms the timer before it does.
+    if (when < mArmedDeadline && mSleeping.load()) {
+        wake();
+    }
+    return Result::OK;
+}
+
+Result Looper::postAtFront(const shared_ptr<Message>& msg) {
+    if (!claimPending(msg.get())) {
+        return Result::ER_INVALID_OPERATION;
+    }
+    Result err = admit(msg);
+    if (err != Result::OK) {
+        releasePending(msg.get());
+        return err;
+    }
+
+    Event* event = new Event;
+    event->mMessage = msg;
+    if (mTrackLatency.load(memory_order_relaxed)) {
+        event->mPostedAt = GetNow();
+    }
+
+    unique_lock<mutex> autoLock(mLock);
+
+    // Whatever is in the ingress was posted earlier, and has to queue
+    // behind this. The epoch mWhen puts it ahead of due timers as well.
+    drainIngress_l();
+    track_l(event);
+    laneFor(msg).mReadyQueue.push_front(event);
+
+    if (mSleeping.load()) {
+        wake();
+    }
+    return Result::OK;
+}
+
+Result Looper::postBatch(const vector<shared_ptr<Message>>& msgs) {
+    if (msgs.empty()) {
+        return Result::OK;
+    }
+
+    for (const shared_ptr<Message>& msg : msgs) {
+        if (LooperRoster::getInstance()->findLooper(msg->target()).get() != this) {
+            return Result::ER_BAD_VALUE;
+        }
+    }
+    for (size_t i = 0; i < msgs.size(); i++) {
+        if (!claimPending(msgs[i].get())) {
+            while (i > 0) {
+                releasePending(msgs[--i].get());
+            }
+            return Result::ER_INVALID_OPERATION;
+        }
+    }
+    if (Tracer::isEnabled()) {
+        for (const shared_ptr<Message>& msg : msgs) {
+            Tracer::tracePost(*msg);
+        }
+    }
+
+    if (mCapacity.load(memory_order_relaxed) == 0) {
+        addQueued(msgs.size());
+    } else {
+        for (size_t i = 0; i < msgs.size(); i++) {
+            Result err = admit(msgs[i]);
+            if (err != Result::OK) {
+                removeQueued(i);
+                for (const shared_ptr<Message>& msg : msgs) {
+                    releasePending(msg.get());
+                }
+                return err;
+            }
+        }
+    }
+
+    bool trackLatency = mTrackLatency.load(memory_order_relaxed);
+    clock::time_point now = trackLatency ? GetNow() : clock::time_point();
+
+    Event* first = NULL;
+    Event* last = NULL;
+    for (const shared_ptr<Message>& msg : msgs) {
+        Event* event = new Event;
+        event->mMessage = msg;
+        event->mPostedAt = now;
+        if (last != NULL) {
+            last->mNext.store(event, memory_order_relaxed);
+        } else {
+            first = event;
+        }
+        last = event;
+    }
+    mIngress.pushChain(first, last);
+
+    if (mSleeping.load()) {
+        wake();
+    }
     return Result::OK;
 }
 
-void Looper::post(const shared_ptr<Message>& msg, const system_clock::duration& delay) {
+Result Looper::postReplacing(const shared_ptr<Message>& msg, const clock::time_point& when) {
+    if (!claimPending(msg.get())) {
+        return Result::ER_INVALID_OPERATION;
+    }
+
+    {
+        unique_lock<mutex> autoLock(mLock);
+
+        auto search = mReplaceableEvents.find(replaceKey(msg->target(), msg->what()));
+        if (search != mReplaceableEvents.end()) {
+            Event* event = search->second;
+            untrack_l(event);
+            if (event->mMessage != msg) {
+                LooperRoster::getInstance()->failRequest(*event->mMessage);
+            }
+            event->mMessage = msg;
+            track_l(event);
+            return Result::OK;
+        }
+    }
+
+    Result err = admit(msg);
+    if (err != Result::OK) {
+        releasePending(msg.get());
+        return err;
+    }
+
+    Event* event = new Event;
+    event->mWhen = when;
+    event->mMessage = msg;
+    event->mReplaceable = true;
+    if (mTrackLatency.load(memory_order_relaxed)) {
+        event->mPostedAt = GetNow();
+    }
+
     unique_lock<mutex> autoLock(mLock);
 
-    system_clock::duration when;
-    if (delay > system_clock::duration(0)) {
-        when = GetNow() + delay;
+    // Someone else may have posted the same key while admit() ran.
+    uint64_t key = replaceKey(msg->target(), msg->what());
+    auto result = mReplaceableEvents.emplace(key, event);
+    if (!result.second) {
+        Event* pending = result.first->second;
+        untrack_l(pending);
+        if (pending->mMessage != msg) {
+            LooperRoster::getInstance()->failRequest(*pending->mMessage);
+        }
+        pending->mMessage = msg;
+        track_l(pending);
+        delete event;
+        removeQueued_l(1);
+        return Result::OK;
+    }
+
+    // Queued under the lock so the index only points into the lanes, after
+    // the posts still in the ingress.
+    drainIngress_l();
+    track_l(event);
+    Lane& lane = laneFor(msg);
+    if (when.time_since_epoch().count() <= mCachedNow.load(memory_order_relaxed)) {
+        event->mWhen = clock::time_point(clock::duration(mCachedNow.load(memory_order_relaxed)));
+        lane.mReadyQueue.push_back(event);
     } else {
-        when = GetNow();
+        event->mSeq = mNextSeq++;
+        lane.mTimerHeap.push_back(event);
+        push_heap(lane.mTimerHeap.begin(), lane.mTimerHeap.end(), EventLater());
+    }
+
+    if (when < mArmedDeadline && mSleeping.load()) {
+        wake();
+    }
+    return Result::OK;
+}
+
+Result Looper::admit(const shared_ptr<Message>& msg) {
+    size_t capacity = mCapacity.load(memory_order_relaxed);
+    size_t depth = mDepth.fetch_add(1) + 1;
+    if (capacity == 0 || depth <= capacity) {
+        raiseHighWaterMark(depth);
+        return Result::OK;
+    }
+
+    OverflowPolicy policy;
+    clock::duration timeout;
+    {
+        unique_lock<mutex> autoLock(mLock);
+        policy = mOverflowPolicy;
+        timeout = mBlockTimeout;
+    }
+
+    // msg keeps its slot while a message is dropped for it, so nobody
+    // else can take the room meanwhile.
+    if ((policy == kOverflowDropOldest || policy == kOverflowCoalesce)
+            && makeRoom(msg, policy)) {
+        return Result::OK;
+    }
+    removeQueued(1);
+
+    if (policy != kOverflowBlock) {
+        return Result::ER_WOULD_BLOCK;
+    }
+
+    unique_lock<mutex> autoLock(mLock);
+    if (isDeliveryThread_l()) {
+        return Result::ER_WOULD_BLOCK;
+    }
+
+    clock::time_point deadline = GetNow() + timeout;
+    mBlockedProducers++;
+    for (;;) {
+        if (!mSpaceCondition.wait_until(autoLock, deadline, [this, capacity] {
+                return mDepth.load() < capacity; })) {
+            mBlockedProducers--;
+            return Result::ER_TIMED_OUT;
+        }
+        // Another producer may have taken the room meanwhile.
+        depth = mDepth.fetch_add(1) + 1;
+        if (depth <= capacity) {
+            raiseHighWaterMark(depth);
+            break;
+        }
+        mDepth--;
+    }
+    mBlockedProducers--;
+    return Result::OK;
+}
+
+void Looper::addQueued(size_t count) {
+    raiseHighWaterMark(mDepth += count);
+}
+
+void Looper::raiseHighWaterMark(size_t depth) {
+    size_t high = mHighWaterMark.load(memory_order_relaxed);
+    while (depth > high && !mHighWaterMark.compare_exchange_weak(high, depth)) {
     }
+}
+
+void Looper::removeQueued(size_t count) {
+    mDepth -= count;
 
-    list<Event>::iterator itr = mEventQueue.begin();
-    while (itr != mEventQueue.end() && (*itr).mWhen <= when) {
-        ++itr;
+    // The lock orders this against a producer about to wait.
+    if (mBlockedProducers.load() > 0) {
+        unique_lock<mutex> autoLock(mLock);
+        mSpaceCondition.notify_all();
     }
+}
 
-    Event event;
-    event.mWhen = when;
-    event.mMessage = msg;
+void Looper::removeQueued_l(size_t count) {
+    mDepth -= count;
+    if (mBlockedProducers.load() > 0) {
+        mSpaceCondition.notify_all();
+    }
+}
 
-    if (itr == mEventQueue.begin()) {
-        mQueueChangedCondition.notify_one();
+bool Looper::makeRoom(const shared_ptr<Message>& msg, OverflowPolicy policy) {
+    unique_lock<mutex> autoLock(mLock);
+
+    drainIngress_l();
+    pruneCancelled_l();
+
+    if (policy == kOverflowCoalesce) {
+        auto search = mReplaceableEvents.find(replaceKey(msg->target(), msg->what()));
+        if (search != mReplaceableEvents.end()) {
+            cancelEvent_l(search->second);
+            return true;
+        }
     }
 
-    mEventQueue.insert(itr, event);
+    for (int priority = kNumPriorities - 1; priority >= 0; priority--) {
+        Lane& lane = mLanes[priority];
+
+        if (policy == kOverflowDropOldest) {
+            // The front of a lane was pruned, so it isn't cancelled.
+            Event* oldest = NULL;
+            if (!lane.mReadyQueue.empty()) {
+                oldest = lane.mReadyQueue.front();
+            } else if (!lane.mTimerHeap.empty()) {
+                oldest = lane.mTimerHeap.front();
+            }
+            if (oldest != NULL) {
+                cancelEvent_l(oldest);
+                pruneCancelled_l();
+                return true;
+            }
+            continue;
+        }
+
+        for (Event* event : lane.mReadyQueue) {
+            if (event->mMessage != NULL && event->mMessage->target() == msg->target()
+                    && event->mMessage->what() == msg->what()) {
+                cancelEvent_l(event);
+                return true;
+            }
+        }
+        for (Event* event : lane.mTimerHeap) {
+            if (event->mMessage != NULL && event->mMessage->target() == msg->target()
+                    && event->mMessage->what() == msg->what()) {
+                cancelEvent_l(event);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void Looper::setQueueCapacity(size_t capacity, OverflowPolicy policy,
+                              const clock::duration& blockTimeout) {
+    unique_lock<mutex> autoLock(mLock);
+
+    mCapacity.store(capacity);
+    mOverflowPolicy = policy;
+    mBlockTimeout = blockTimeout;
+
+    // A larger capacity may have made room.
+    mSpaceCondition.notify_all();
 }
 
 Result Looper::cancel(const shared_ptr<Message>& msg) {
+    // Pending elsewhere, its events are none of ours to look at.
+    uint64_t pendingOn = msg->mPendingOn.load();
+    if ((uint32_t)pendingOn == 0 || (uint32_t)(pendingOn >> 32) != mSerial) {
+        return Result::ER_NAME_NOT_FOUND;
+    }
+
+    unique_lock<mutex> autoLock(mLock);
+
+    drainIngress_l();
+
+    Event* event = msg->mPendingEvents;
+    if (event == NULL) {
+        return Result::ER_NAME_NOT_FOUND;
+    }
+
+    cancelEvent_l(event);
+    compact_l(false);
+    return Result::OK;
+}
+
+size_t Looper::removeMessages(handler_id target, uint32_t what) {
+    unique_lock<mutex> autoLock(mLock);
+
+    drainIngress_l();
+
+    size_t removed = 0;
+    auto matches = [target, what](const shared_ptr<Message>& msg) {
+        return msg != NULL && msg->target() == target && msg->what() == what;
+    };
+
+    auto remove = [&](Event* event) {
+        if (matches(event->mMessage)) {
+            cancelEvent_l(event);
+            removed++;
+        }
+    };
+    for (Lane& lane : mLanes) {
+        for_each(lane.mReadyQueue.begin(), lane.mReadyQueue.end(), remove);
+        for_each(lane.mTimerHeap.begin(), lane.mTimerHeap.end(), remove);
+    }
+
+    removed += mTimerWheel.removeMessages(target, what);
+    for (auto itr = mExpiredTimers.begin(); itr != mExpiredTimers.end();) {
+        if (matches(*itr)) {
+            LooperRoster::getInstance()->failRequest(**itr);
+            itr = mExpiredTimers.erase(itr);
+            removed++;
+        } else {
+            ++itr;
+        }
+    }
+
+    // Already paid for a full pass, one more leaves the queues clean.
+    if (removed > 0) {
+        compact_l(true);
+    }
+    return removed;
+}
+
+Result Looper::postTimer(const shared_ptr<Message>& msg, const clock::time_point& when,
+                         TimerHandle* handle) {
+    unique_lock<mutex> autoLock(mLock);
+
+    TimerWheel::timer_id id = mTimerWheel.add(when, updateNow_l(), msg);
+    if (handle != NULL) {
+        handle->mLooper = shared_from_this();
+        handle->mId = id;
+    }
+
+    if (mSleeping.load() && mTimerWheel.nextDeadline() < mArmedDeadline) {
+        wake();
+    }
+    return Result::OK;
+}
+
+Result Looper::cancelTimer(TimerWheel::timer_id id) {
+    unique_lock<mutex> autoLock(mLock);
+
+    return mTimerWheel.remove(id) ? Result::OK : Result::ER_NAME_NOT_FOUND;
+}
+
+Result Looper::TimerHandle::cancel() {
+    shared_ptr<Looper> looper = mLooper.lock();
+    if (looper == NULL) {
+        return Result::ER_NAME_NOT_FOUND;
+    }
+    return looper->cancelTimer(mId);
+}
+
+Result Looper::setTimerTick(const clock::duration& tick) {
+    unique_lock<mutex> autoLock(mLock);
+
+    if (tick <= clock::duration::zero()) {
+        return Result::ER_BAD_VALUE;
+    }
+    return mTimerWheel.setTick(tick) ? Result::OK : Result::ER_INVALID_OPERATION;
+}
+
+void Looper::setSchedulingPolicy(SchedulingPolicy policy) {
+    unique_lock<mutex> autoLock(mLock);
+    mPolicy = policy;
+}
+
+Result Looper::setLaneWeight(Priority priority, uint32_t weight) {
+    if (priority < 0 || priority >= kNumPriorities || weight == 0) {
+        return Result::ER_BAD_VALUE;
+    }
+
+    unique_lock<mutex> autoLock(mLock);
+    mLanes[priority].mWeight = weight;
+    mLanes[priority].mCredit = min(mLanes[priority].mCredit, weight);
+    return Result::OK;
+}
+
+void Looper::setLatencyTracking(bool enable) {
+    countTracking(&mTrackLatency, enable);
+}
+
+Result Looper::getQueueLatency(Priority priority, Histogram* waits) {
+    if (priority < 0 || priority >= kNumPriorities || waits == NULL) {
+        return Result::ER_BAD_VALUE;
+    }
+
+    unique_lock<mutex> autoLock(mLock);
+    *waits = mLanes[priority].mWaitTimes;
+    return Result::OK;
+}
+
+void Looper::resetQueueLatency() {
+    unique_lock<mutex> autoLock(mLock);
+    for (Lane& lane : mLanes) {
+        lane.mWaitTimes.reset();
+    }
+}
+
+void Looper::setDispatchTracking(bool enable) {
+    countTracking(&mTrackDispatch, enable);
+}
+
+// static
+void Looper::countTracking(atomic<uint32_t>* users, bool enable) {
+    if (enable) {
+        (*users)++;
+        return;
+    }
+    uint32_t count = users->load();
+    while (count > 0 && !users->compare_exchange_weak(count, count - 1)) {
+    }
+}
+
+void Looper::getActiveDispatches(vector<ActiveDispatch>* dispatches) {
+    ActiveDispatch dispatch;
+    if (mDispatchSlot.sample(&dispatch)) {
+        dispatches->push_back(dispatch);
+    }
+}
+
+Looper::clock::duration Looper::oldestPendingAge() {
+    unique_lock<mutex> autoLock(mLock);
+    drainIngress_l();
+    pruneCancelled_l();
+
+    clock::time_point now = GetNow();
+    clock::time_point oldest = now;
+    for (const Lane& lane : mLanes) {
+        if (!lane.mReadyQueue.empty() && lane.mReadyQueue.front()->mPostedAt != clock::time_point()) {
+            oldest = min(oldest, lane.mReadyQueue.front()->mPostedAt);
+        }
+        if (!lane.mTimerHeap.empty() && lane.mTimerHeap.front()->mWhen <= now) {
+            oldest = min(oldest, lane.mTimerHeap.front()->mWhen);
+        }
+    }
+    return now - oldest;
+}
+
+void Looper::DispatchSlot::begin(handler_id target, uint32_t what) {
+    mStartedAt.store(0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    mTarget.store(target, memory_order_relaxed);
+    mWhat.store(what, memory_order_relaxed);
+    mStartedAt.store(max<clock::rep>(GetNow().time_since_epoch().count(), 1), memory_order_release);
+}
+
+bool Looper::DispatchSlot::sample(ActiveDispatch* dispatch) const {
+    clock::rep startedAt = mStartedAt.load(memory_order_acquire);
+    if (startedAt == 0) {
+        return false;
+    }
+
+    dispatch->mTarget = mTarget.load(memory_order_relaxed);
+    dispatch->mWhat = mWhat.load(memory_order_relaxed);
+    dispatch->mStartedAt = clock::time_point(clock::duration(startedAt));
+    atomic_thread_fence(memory_order_acquire);
+    return mStartedAt.load(memory_order_relaxed) == startedAt;
+}
+
+void Looper::getStats(Stats* stats) {
+    unique_lock<mutex> autoLock(mLock);
+    stats->mQueueDepth = queueDepth();
+    stats->mQueueHighWaterMark = queueHighWaterMark();
+    stats->mPendingTimers = mTimerWheel.size();
+    stats->mDelivered = mDelivered;
+    for (int i = 0; i < kNumPriorities; i++) {
+        stats->mQueueLatency[i] = mLanes[i].mWaitTimes;
+    }
+}
+
+Result Looper::addFd(int fd, uint32_t events, const FdCallback& callback) {
+    auto request(make_shared<FdRequest>());
+    request->mCallback = callback;
+    return addFdRequest(fd, events, request);
+}
+
+Result Looper::addFd(int fd, uint32_t events, const shared_ptr<Message>& notify) {
+    auto request(make_shared<FdRequest>());
+    request->mNotify = notify;
+    return addFdRequest(fd, events, request);
+}
+
+Result Looper::addFdRequest(int fd, uint32_t events, const shared_ptr<FdRequest>& request) {
+    if (fd < 0) {
+        return Result::ER_BAD_VALUE;
+    }
+
+    unique_lock<mutex> autoLock(mLock);
+
+    // The sequence number tells events of a removed fd from those of one
+    // added again with the same number.
+    request->mSeq = mNextFdSeq++;
+
+    struct epoll_event event = {};
+    event.events = events;
+    event.data.u64 = ((uint64_t)request->mSeq << 32) | (uint32_t)fd;
+
+    bool exists = mFdRequests.find(fd) != mFdRequests.end();
+    if (epoll_ctl(mEpollFd, exists ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event) != 0) {
+        return Result::ER_BAD_VALUE;
+    }
+
+    mFdRequests[fd] = request;
+    return Result::OK;
+}
+
+Result Looper::removeFd(int fd) {
     unique_lock<mutex> autoLock(mLock);
-    Result ret = Result::ER_NAME_NOT_FOUND;
 
-    for(auto itr = mEventQueue.begin(); itr != mEventQueue.end(); ++itr) {
-    	if(itr->mMessage == msg) {
-        	mEventQueue.erase(itr);
-			ret = Result::OK;
-			break;
-    	}
+    if (mFdRequests.erase(fd) == 0) {
+        return Result::ER_NAME_NOT_FOUND;
+    }
+
+    // Fails if fd was closed already, which removed it from the set anyway.
+    epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, NULL);
+    return Result::OK;
+}
+
+void Looper::wake() {
+    uint64_t value = 1;
+    ssize_t written = write(mWakeFd, &value, sizeof(value));
+    (void)written;
+}
+
+void Looper::armTimer_l(const clock::time_point& when) {
+    if (when == mArmedDeadline) {
+        return;
+    }
+    mArmedDeadline = when;
+
+    nanoseconds deadline = duration_cast<nanoseconds>(when.time_since_epoch());
+    struct itimerspec spec = {};
+    spec.it_value.tv_sec = deadline.count() / 1000000000;
+    spec.it_value.tv_nsec = deadline.count() % 1000000000;
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+        // A zero it_value disarms the timer.
+        spec.it_value.tv_nsec = 1;
+    }
+    timerfd_settime(mTimerFd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+void Looper::pollOnce(int timeoutMs) {
+    struct epoll_event events[kMaxPollEvents];
+    int count = epoll_wait(mEpollFd, events, kMaxPollEvents, timeoutMs);
+
+    for (int i = 0; i < count; i++) {
+        uint64_t value;
+        if (events[i].data.fd == mWakeFd) {
+            ssize_t bytes = read(mWakeFd, &value, sizeof(value));
+            (void)bytes;
+        } else if (events[i].data.fd == mTimerFd) {
+            ssize_t bytes = read(mTimerFd, &value, sizeof(value));
+            (void)bytes;
+
+            unique_lock<mutex> autoLock(mLock);
+            mArmedDeadline = clock::time_point::max();
+        } else {
+            handleFdEvent((int)(events[i].data.u64 & 0xffffffff),
+                    (uint32_t)(events[i].data.u64 >> 32), events[i].events);
+        }
+    }
+}
+
+void Looper::handleFdEvent(int fd, uint32_t seq, uint32_t events) {
+    shared_ptr<FdRequest> request;
+    {
+        unique_lock<mutex> autoLock(mLock);
+
+        auto search = mFdRequests.find(fd);
+        if (search == mFdRequests.end() || search->second->mSeq != seq) {
+            return;
+        }
+        request = search->second;
+    }
+
+    if (request->mCallback) {
+        if (!request->mCallback(fd, events)) {
+            unique_lock<mutex> autoLock(mLock);
+
+            // Unless the callback replaced it meanwhile.
+            auto search = mFdRequests.find(fd);
+            if (search != mFdRequests.end() && search->second == request) {
+                mFdRequests.erase(search);
+                epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, NULL);
+            }
+        }
+        return;
+    }
+
+    shared_ptr<Message> msg(request->mNotify->duplicate());
+    msg->setInt32(kKeyFd, fd);
+    msg->setInt32(kKeyEvents, (int32_t)events);
+    if (isDispatchTracking()) {
+        mDispatchSlot.begin(msg->target(), msg->what());
+    }
+    dispatch(msg);
+}
+
+void Looper::dispatch(const shared_ptr<Message>& msg) {
+    LooperRoster::getInstance()->deliverMessage(msg);
+}
+
+void Looper::dispatchBatch(const vector<shared_ptr<Message>>& msgs) {
+    LooperRoster::getInstance()->deliverMessages(msgs);
+}
+
+void Looper::drainIngress_l() {
+    clock::time_point now(clock::duration(mCachedNow.load(memory_order_relaxed)));
+
+    Event* event;
+    while ((event = mIngress.pop()) != NULL) {
+        // Ordering against due timers only needs a lower bound on when the
+        // event became ready, so the cached reading will do.
+        event->mWhen = now;
+        track_l(event);
+        laneFor(event->mMessage).mReadyQueue.push_back(event);
+    }
+}
+
+void Looper::track_l(Event* event) {
+    Message* msg = event->mMessage.get();
+    event->mSibling = msg->mPendingEvents;
+    msg->mPendingEvents = event;
+}
+
+void Looper::untrack_l(Event* event) {
+    Message* msg = event->mMessage.get();
+
+    // A message rarely has more than one post pending, so this is short.
+    Event** link = &msg->mPendingEvents;
+    while (*link != NULL) {
+        if (*link == event) {
+            *link = event->mSibling;
+            break;
+        }
+        link = &(*link)->mSibling;
+    }
+    event->mSibling = NULL;
+    releasePending(msg);
+}
+
+bool Looper::claimPending(Message* msg) {
+    uint64_t pendingOn = msg->mPendingOn.load();
+    for (;;) {
+        uint32_t posts = (uint32_t)pendingOn;
+        if (posts != 0 && (uint32_t)(pendingOn >> 32) != mSerial) {
+            return false;
+        }
+        if (msg->mPendingOn.compare_exchange_weak(pendingOn, ((uint64_t)mSerial << 32) | (posts + 1))) {
+            return true;
+        }
+    }
+}
+
+void Looper::releasePending(Message* msg) {
+    // The low half is at least 1, nothing borrows from the serial.
+    msg->mPendingOn--;
+}
+
+Looper::Lane& Looper::laneFor(const shared_ptr<Message>& msg) {
+    Priority priority = msg->priority();
+    return mLanes[priority >= 0 && priority < kNumPriorities ? priority : kPriorityNormal];
+}
+
+shared_ptr<Message> Looper::retire_l(Lane* lane, Event* event) {
+    if (mTrackLatency.load(memory_order_relaxed)) {
+        // Waiting starts at posting, or at the deadline of a delayed post.
+        clock::time_point since = max(event->mWhen, event->mPostedAt);
+        lane->mWaitTimes.record(duration_cast<nanoseconds>(GetNow() - since).count());
+    }
+
+    unlistReplaceable_l(event);
+    untrack_l(event);
+    shared_ptr<Message> msg(move(event->mMessage));
+    delete event;
+    if (!keepsDispatchedQueued()) {
+        removeQueued_l(1);
+    }
+    mDelivered++;
+    return msg;
+}
+
+void Looper::cancelEvent_l(Event* event) {
+    // Left in place, the lanes skip it.
+    unlistReplaceable_l(event);
+    untrack_l(event);
+    LooperRoster::getInstance()->failRequest(*event->mMessage);
+    event->mCancelled = true;
+    event->mMessage.reset();
+    mCancelledEvents++;
+    removeQueued_l(1);
+}
+
+void Looper::unlistReplaceable_l(Event* event) {
+    if (event->mReplaceable) {
+        mReplaceableEvents.erase(replaceKey(event->mMessage->target(), event->mMessage->what()));
+        event->mReplaceable = false;
+    }
+}
+
+bool Looper::isDeliveryThread_l() const {
+    return isLooperThread_l();
+}
+
+bool Looper::isLooperThread_l() const {
+    if (mThread != NULL) {
+        return mThread->isCurrentThread();
+    }
+    return mRunningLocally && mLocalThreadId == this_thread::get_id();
+}
+
+void Looper::pruneCancelled_l() {
+    for (Lane& lane : mLanes) {
+        while (!lane.mReadyQueue.empty() && lane.mReadyQueue.front()->mCancelled) {
+            delete lane.mReadyQueue.front();
+            lane.mReadyQueue.pop_front();
+            mCancelledEvents--;
+        }
+        while (!lane.mTimerHeap.empty() && lane.mTimerHeap.front()->mCancelled) {
+            pop_heap(lane.mTimerHeap.begin(), lane.mTimerHeap.end(), EventLater());
+            delete lane.mTimerHeap.back();
+            lane.mTimerHeap.pop_back();
+            mCancelledEvents--;
+        }
+    }
+}
+
+void Looper::compact_l(bool force) {
+    size_t queued = 0;
+    for (const Lane& lane : mLanes) {
+        queued += lane.mReadyQueue.size() + lane.mTimerHeap.size();
+    }
+
+    // Compacting once cancelled events make up half the queues keeps
+    // cancel() amortized O(1) and the queues at most twice their size.
+    if (!force && (mCancelledEvents < kMinCompaction || mCancelledEvents * 2 < queued)) {
+        return;
+    }
+
+    auto cancelled = [](Event* event) {
+        if (event->mCancelled) {
+            delete event;
+            return true;
+        }
+        return false;
+    };
+    for (Lane& lane : mLanes) {
+        lane.mReadyQueue.erase(remove_if(lane.mReadyQueue.begin(), lane.mReadyQueue.end(), cancelled),
+                lane.mReadyQueue.end());
+        lane.mTimerHeap.erase(remove_if(lane.mTimerHeap.begin(), lane.mTimerHeap.end(), cancelled),
+                lane.mTimerHeap.end());
+        make_heap(lane.mTimerHeap.begin(), lane.mTimerHeap.end(), EventLater());
+    }
+    mCancelledEvents = 0;
+}
+
+bool Looper::isDue_l(const Lane& lane, const clock::time_point& now) const {
+    return !lane.mReadyQueue.empty()
+            || (!lane.mTimerHeap.empty() && lane.mTimerHeap.front()->mWhen <= now);
+}
+
+Looper::Lane* Looper::pickLane_l(const clock::time_point& now) {
+    Lane* due = NULL;
+    for (Lane& lane : mLanes) {
+        if (!isDue_l(lane, now)) {
+            continue;
+        }
+        if (mPolicy == kSchedulingStrict) {
+            return &lane;
+        }
+        if (lane.mCredit > 0) {
+            lane.mCredit--;
+            return &lane;
+        }
+        if (due == NULL) {
+            due = &lane;
+        }
+    }
+
+    // Every due lane used up its share, so a new round starts. Lanes that
+    // had nothing due don't carry unused credit over.
+    if (due != NULL) {
+        for (Lane& lane : mLanes) {
+            lane.mCredit = lane.mWeight;
+        }
+        due->mCredit--;
     }
-    return ret;
+    return due;
+}
+
+Looper::clock::time_point Looper::updateNow_l() {
+    clock::time_point now = GetNow();
+    mCachedNow.store(now.time_since_epoch().count(), memory_order_relaxed);
+    return now;
 }
 
 bool Looper::loop() {
-    Event event;
+    shared_ptr<Message> msg;
+    vector<shared_ptr<Message>> batch;
+
+    // Done with what the previous call delivered, if anything. Not cleared
+    // right after, the looper may be gone by then.
+    mDispatchSlot.end();
 
     {
         unique_lock<mutex> autoLock(mLock);
         if (mThread == NULL && !mRunningLocally) {
             return false;
         }
-        if (mEventQueue.empty()) {
-            mQueueChangedCondition.wait(autoLock);
+
+        drainIngress_l();
+        pruneCancelled_l();
+
+        // Without timers there is nothing to compare against, so the clock
+        // is left alone.
+        clock::time_point now(clock::duration(mCachedNow.load(memory_order_relaxed)));
+        clock::time_point deadline = clock::time_point::max();
+        for (const Lane& lane : mLanes) {
+            if (!lane.mTimerHeap.empty()) {
+                deadline = min(deadline, lane.mTimerHeap.front()->mWhen);
+            }
+        }
+        if (deadline != clock::time_point::max()) {
+            now = updateNow_l();
+        }
+
+        bool due = false;
+        for (const Lane& lane : mLanes) {
+            due = due || isDue_l(lane, now);
+        }
+
+        // Everything the wheel has due comes out in one go, and is delivered
+        // before the queues get another look.
+        if (mExpiredTimers.empty() && !mTimerWheel.empty()) {
+            mTimerWheel.advance(updateNow_l(), &mExpiredTimers);
+        }
+
+        if (!due && mExpiredTimers.empty()) {
+            mSleeping.store(true);
+
+            // A producer may have pushed after the drain above without
+            // seeing mSleeping set; it won't wake us, so don't wait.
+            if (!mIngress.empty()) {
+                mSleeping.store(false);
+                return true;
+            }
+
+            deadline = min(deadline, mTimerWheel.nextDeadline());
+            if (deadline != clock::time_point::max()) {
+                armTimer_l(deadline);
+            }
+            mDeliveriesSincePoll = 0;
+            autoLock.unlock();
+
+            pollOnce(-1);
+
+            mSleeping.store(false);
+            return true;
+        }
+
+        // Busy with messages, but watched fds get their turn too.
+        if (!mFdRequests.empty() && ++mDeliveriesSincePoll >= kFdPollInterval) {
+            mDeliveriesSincePoll = 0;
+            autoLock.unlock();
+
+            pollOnce(0);
             return true;
         }
 
-        system_clock::duration when = (*mEventQueue.begin()).mWhen;
-        system_clock::duration now = GetNow();
+        if (!mExpiredTimers.empty()) {
+            msg = move(mExpiredTimers.front());
+            mExpiredTimers.pop_front();
+            mDelivered++;
+            autoLock.unlock();
 
-        if (when > now) {
-        	system_clock::duration delay = when - now;
-            mQueueChangedCondition.wait_for(autoLock, delay);
+            // Timers aren't admitted, but whoever keeps dispatched messages
+            // queued removes them again.
+            if (keepsDispatchedQueued()) {
+                addQueued(1);
+            }
+
+            // Whoever queues it again traces it once it leaves that queue.
+            if (Tracer::isEnabled() && !keepsDispatchedQueued()) {
+                Tracer::traceDequeue(*msg);
+            }
+            if (isDispatchTracking()) {
+                mDispatchSlot.begin(msg->target(), msg->what());
+            }
+            dispatch(msg);
             return true;
         }
 
-        event = *mEventQueue.begin();
-        mEventQueue.erase(mEventQueue.begin());
+        Lane* lane = pickLane_l(now);
+
+        // A due timer goes first only if it was scheduled no later than the
+        // oldest ready message, which keeps delivery in mWhen order.
+        bool timerDue = !lane->mTimerHeap.empty() && lane->mTimerHeap.front()->mWhen <= now;
+        if (timerDue && !lane->mReadyQueue.empty()) {
+            timerDue = lane->mTimerHeap.front()->mWhen <= lane->mReadyQueue.front()->mWhen;
+        }
+
+        Event* event;
+        if (timerDue) {
+            pop_heap(lane->mTimerHeap.begin(), lane->mTimerHeap.end(), EventLater());
+            event = lane->mTimerHeap.back();
+            lane->mTimerHeap.pop_back();
+        } else {
+            event = lane->mReadyQueue.front();
+            lane->mReadyQueue.pop_front();
+        }
+        msg = retire_l(lane, event);
+
+        // Ready messages for the same handler that follow go along, if it
+        // wants batches, as long as no due timer of the lane should come
+        // first and, when weighted, the lane has credit left.
+        handler_id target = msg->target();
+        bool batched = !timerDue && !lane->mReadyQueue.empty()
+                && LooperRoster::getInstance()->wantsBatches(target);
+        while (batched && !lane->mReadyQueue.empty()
+                && max<size_t>(batch.size(), 1) < kMaxDeliveryBatch) {
+            event = lane->mReadyQueue.front();
+            if (event->mCancelled) {
+                lane->mReadyQueue.pop_front();
+                delete event;
+                mCancelledEvents--;
+                continue;
+            }
+            if (event->mMessage->target() != target
+                    || (!lane->mTimerHeap.empty() && lane->mTimerHeap.front()->mWhen <= now
+                        && lane->mTimerHeap.front()->mWhen <= event->mWhen)
+                    || (mPolicy == kSchedulingWeighted && lane->mCredit == 0)) {
+                break;
+            }
+            if (mPolicy == kSchedulingWeighted) {
+                lane->mCredit--;
+            }
+            lane->mReadyQueue.pop_front();
+            if (batch.empty()) {
+                // Borrowed, so a looper run locally from a handler gets its
+                // own.
+                batch.swap(tDeliveryBatch);
+                batch.push_back(move(msg));
+            }
+            batch.push_back(retire_l(lane, event));
+        }
+    }
+
+    if (Tracer::isEnabled() && !keepsDispatchedQueued()) {
+        if (batch.empty()) {
+            Tracer::traceDequeue(*msg);
+        }
+        for (const shared_ptr<Message>& queued : batch) {
+            Tracer::traceDequeue(*queued);
+        }
+    }
+
+    if (isDispatchTracking()) {
+        const shared_ptr<Message>& first = batch.empty() ? msg : batch.front();
+        mDispatchSlot.begin(first->target(), first->what());
     }
 
-    LooperRoster::getInstance()->deliverMessage(event.mMessage);
+    if (batch.empty()) {
+        dispatch(msg);
+    } else {
+        dispatchBatch(batch);
 
+        // The looper may be gone by now, the vector is thread local.
+        batch.clear();
+        tDeliveryBatch.swap(batch);
+    }
 
     // NOTE: It's important to note that at this point our "Looper" object
     // may no longer exist (its final reference may have gone away while
@@ -0,0 +1,482 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <algorithm>
+#include <thread>
+
+#include <baseutils/LooperPool.h>
+#include <baseutils/Message.h>
+#include <baseutils/Tracer.h>
+#include "BaseThread.h"
+#include "LooperRoster.h"
+
+using namespace std;
+
+namespace baseutils {
+
+namespace {
+
+// The pool and worker index of the calling thread, if it is a worker, so
+// strands it schedules stay on it.
+thread_local const LooperPool* tPool = NULL;
+thread_local size_t tWorkerIndex = 0;
+
+// Reused by runStrand(), every message in it is for the same handler.
+thread_local vector<shared_ptr<Message>> tStrandBatch;
+
+} // namespace
+
+class LooperPool::WorkerThread : public BaseThread {
+public:
+    WorkerThread(LooperPool* pool, size_t index)
+        : BaseThread(),
+          mPool(pool),
+          mIndex(index),
+          mThreadId() {
+    }
+
+    virtual ~WorkerThread() { }
+
+    virtual Result readyToRun() {
+        mThreadId = getThreadId();
+        tPool = mPool;
+        tWorkerIndex = mIndex;
+
+        return BaseThread::readyToRun();
+    }
+
+    virtual bool threadLoop() {
+        return mPool->runWorker(mIndex);
+    }
+
+    bool isCurrentThread() const {
+        return mThreadId == getThreadId();
+    }
+
+private:
+    WorkerThread(const WorkerThread&) = delete;
+
+    WorkerThread& operator=(const WorkerThread&) = delete;
+
+    LooperPool* mPool;
+    size_t mIndex;
+    thread::id mThreadId;
+};
+
+LooperPool::LooperPool(size_t numWorkers)
+    : mNextWorker(0),
+      mPendingStrands(0),
+      mIdleWorkers(0),
+      mStopping(false) {
+    if (numWorkers == 0) {
+        numWorkers = max(thread::hardware_concurrency(), 1u);
+    }
+    for (size_t i = 0; i < numWorkers; i++) {
+        mWorkers.push_back(unique_ptr<Worker>(new Worker()));
+    }
+}
+
+LooperPool::~LooperPool() {
+    stop();
+
+    for (Bucket& bucket : mBuckets) {
+        unique_lock<mutex> autoLock(bucket.mLock);
+        for (auto& entry : bucket.mStrands) {
+            for (Event* event : entry.second.mQueue) {
+                if (event->mMessage != NULL) {
+                    untrackStrandEvent_l(event);
+                    LooperRoster::getInstance()->failRequest(*event->mMessage);
+                }
+                delete event;
+            }
+        }
+        bucket.mStrands.clear();
+    }
+}
+
+Result LooperPool::start(bool runOnCallingThread) {
+    {
+        unique_lock<mutex> autoLock(mIdleLock);
+
+        if (mWorkers.front()->mThread != NULL) {
+            return Result::ER_ALREADY_OPERATED;
+        }
+
+        mSelf = shared_from_this();
+        mStopping.store(false);
+        for (size_t i = 0; i < mWorkers.size(); i++) {
+            mWorkers[i]->mThread = make_shared<WorkerThread>(this, i);
+            mWorkers[i]->mThread->run();
+        }
+    }
+
+    // The looper thread only fires timers into the strands.
+    return Looper::start(runOnCallingThread);
+}
+
+Result LooperPool::stop() {
+    vector<shared_ptr<WorkerThread>> threads;
+    {
+        unique_lock<mutex> autoLock(mIdleLock);
+
+        for (auto& worker : mWorkers) {
+            if (worker->mThread != NULL) {
+                threads.push_back(worker->mThread);
+                worker->mThread.reset();
+            }
+        }
+        mStopping.store(true);
+        mIdleCondition.notify_all();
+    }
+
+    for (auto& thread : threads) {
+        thread->requestExit();
+        // A handler stopping its own pool can't wait for its own worker,
+        // which exits once the strand it runs returns.
+        if (!thread->isCurrentThread()) {
+            thread->requestExitAndWait();
+        }
+    }
+
+    Result err = Looper::stop();
+    return threads.empty() ? err : Result::OK;
+}
+
+Result LooperPool::post(const shared_ptr<Message>& msg, const clock::time_point& when) {
+    // Immediate posts skip the looper thread, but are still claimed like
+    // any other, so a message is pending on one looper at a time.
+    if (when == clock::time_point()) {
+        if (!claimPending(msg.get())) {
+            return Result::ER_INVALID_OPERATION;
+        }
+        Result err = admit(msg);
+        if (err != Result::OK) {
+            releasePending(msg.get());
+            return err;
+        }
+        enqueue(msg, true);
+        return Result::OK;
+    }
+
+    return Looper::post(msg, when);
+}
+
+Result LooperPool::postAtFront(const shared_ptr<Message>& msg) {
+    if (!claimPending(msg.get())) {
+        return Result::ER_INVALID_OPERATION;
+    }
+    Result err = admit(msg);
+    if (err != Result::OK) {
+        releasePending(msg.get());
+        return err;
+    }
+    enqueue(msg, true, true);
+    return Result::OK;
+}
+
+Result LooperPool::cancel(const shared_ptr<Message>& msg) {
+    if (Looper::cancel(msg) == Result::OK) {
+        return Result::OK;
+    }
+
+    Bucket& bucket = bucketFor(msg->target());
+    unique_lock<mutex> autoLock(bucket.mLock);
+
+    // The strand stays scheduled, it drops the event the next time it runs.
+    Event* event = msg->mStrandEvents;
+    if (event == NULL) {
+        return Result::ER_NAME_NOT_FOUND;
+    }
+    cancelStrandEvent_l(event);
+    return Result::OK;
+}
+
+size_t LooperPool::removeMessages(handler_id target, uint32_t what) {
+    size_t removed = Looper::removeMessages(target, what);
+
+    Bucket& bucket = bucketFor(target);
+    unique_lock<mutex> autoLock(bucket.mLock);
+
+    auto search = bucket.mStrands.find(target);
+    if (search == bucket.mStrands.end()) {
+        return removed;
+    }
+
+    for (Event* event : search->second.mQueue) {
+        if (event->mMessage != NULL && event->mMessage->what() == what) {
+            cancelStrandEvent_l(event);
+            removed++;
+        }
+    }
+    return removed;
+}
+
+void LooperPool::getActiveDispatches(vector<ActiveDispatch>* dispatches) {
+    Looper::getActiveDispatches(dispatches);
+
+    for (auto& worker : mWorkers) {
+        ActiveDispatch dispatch;
+        if (worker->mDispatchSlot.sample(&dispatch)) {
+            dispatches->push_back(dispatch);
+        }
+    }
+}
+
+bool LooperPool::keepsDispatchedQueued() const {
+    // A message the looper lets go still counts until a worker takes it.
+    return true;
+}
+
+bool LooperPool::isDeliveryThread_l() const {
+    return tPool == this || Looper::isDeliveryThread_l();
+}
+
+// The looper let go of these, or never claimed them, so they are claimed
+// again. One posted elsewhere meanwhile is still delivered, just untracked.
+void LooperPool::dispatch(const shared_ptr<Message>& msg) {
+    enqueue(msg, claimPending(msg.get()));
+}
+
+void LooperPool::dispatchBatch(const vector<shared_ptr<Message>>& msgs) {
+    for (const shared_ptr<Message>& msg : msgs) {
+        enqueue(msg, claimPending(msg.get()));
+    }
+}
+
+bool LooperPool::makeRoom(const shared_ptr<Message>& msg, OverflowPolicy policy) {
+    if (Looper::makeRoom(msg, policy)) {
+        return true;
+    }
+
+    // Only the strand of msg's own handler is looked at.
+    Bucket& bucket = bucketFor(msg->target());
+    unique_lock<mutex> autoLock(bucket.mLock);
+
+    auto search = bucket.mStrands.find(msg->target());
+    if (search == bucket.mStrands.end()) {
+        return false;
+    }
+
+    deque<Event*>& queue = search->second.mQueue;
+    uint32_t what = msg->what();
+    auto itr = find_if(queue.begin(), queue.end(), [policy, what](const Event* event) {
+        return event->mMessage != NULL
+                && (policy != kOverflowCoalesce || event->mMessage->what() == what);
+    });
+    if (itr == queue.end()) {
+        return false;
+    }
+    cancelStrandEvent_l(*itr);
+    return true;
+}
+
+void LooperPool::enqueue(const shared_ptr<Message>& msg, bool claimed, bool atFront) {
+    Event* event = new Event;
+    event->mMessage = msg;
+
+    Strand* strand;
+    {
+        Bucket& bucket = bucketFor(msg->target());
+        unique_lock<mutex> autoLock(bucket.mLock);
+
+        auto result = bucket.mStrands.emplace(msg->target(), Strand());
+        strand = &result.first->second;
+        if (result.second) {
+            // Written once, before anyone else can see the strand.
+            strand->mId = msg->target();
+        }
+        if (claimed) {
+            trackStrandEvent_l(event);
+        }
+        if (atFront) {
+            strand->mQueue.push_front(event);
+        } else {
+            strand->mQueue.push_back(event);
+        }
+        if (strand->mScheduled) {
+            return;
+        }
+        strand->mScheduled = true;
+    }
+
+    schedule(strand);
+}
+
+void LooperPool::trackStrandEvent_l(Event* event) {
+    Message* msg = event->mMessage.get();
+    event->mSibling = msg->mStrandEvents;
+    msg->mStrandEvents = event;
+}
+
+void LooperPool::untrackStrandEvent_l(Event* event) {
+    Message* msg = event->mMessage.get();
+
+    Event** link = &msg->mStrandEvents;
+    while (*link != NULL) {
+        if (*link == event) {
+            *link = event->mSibling;
+            event->mSibling = NULL;
+            releasePending(msg);
+            return;
+        }
+        link = &(*link)->mSibling;
+    }
+}
+
+void LooperPool::cancelStrandEvent_l(Event* event) {
+    untrackStrandEvent_l(event);
+    LooperRoster::getInstance()->failRequest(*event->mMessage);
+    event->mCancelled = true;
+    event->mMessage.reset();
+    removeQueued(1);
+}
+
+void LooperPool::schedule(Strand* strand) {
+    size_t index = tPool == this
+            ? tWorkerIndex
+            : mNextWorker.fetch_add(1, memory_order_relaxed) % mWorkers.size();
+
+    // Counted before it is pushed, so taking it never drives the count
+    // below zero. Pairs with the predicate check in runWorker(): either an
+    // idle worker sees the pending strand, or we see it idle and wake it.
+    mPendingStrands.fetch_add(1);
+    {
+        Worker& worker = *mWorkers[index];
+        unique_lock<mutex> autoLock(worker.mLock);
+        worker.mStrands.push_back(strand);
+    }
+
+    if (mIdleWorkers.load() > 0) {
+        unique_lock<mutex> autoLock(mIdleLock);
+        mIdleCondition.notify_one();
+    }
+}
+
+LooperPool::Strand* LooperPool::take(size_t index) {
+    {
+        Worker& worker = *mWorkers[index];
+        unique_lock<mutex> autoLock(worker.mLock);
+        if (!worker.mStrands.empty()) {
+            Strand* strand = worker.mStrands.front();
+            worker.mStrands.pop_front();
+            return strand;
+        }
+    }
+
+    for (size_t i = 1; i < mWorkers.size(); i++) {
+        Worker& victim = *mWorkers[(index + i) % mWorkers.size()];
+        unique_lock<mutex> autoLock(victim.mLock);
+        if (!victim.mStrands.empty()) {
+            Strand* strand = victim.mStrands.back();
+            victim.mStrands.pop_back();
+            return strand;
+        }
+    }
+
+    return NULL;
+}
+
+void LooperPool::runStrand(Strand* strand, Worker* worker) {
+    Bucket& bucket = bucketFor(strand->mId);
+
+    // A handler that doesn't want batches takes its messages off the queue
+    // one at a time, so it can still cancel those that follow.
+    size_t take = LooperRoster::getInstance()->wantsBatches(strand->mId) ? kStrandBatch : 1;
+    vector<shared_ptr<Message>> batch;
+    batch.swap(tStrandBatch);
+    for (size_t delivered = 0; delivered < kStrandBatch; delivered += batch.size()) {
+        batch.clear();
+        {
+            unique_lock<mutex> autoLock(bucket.mLock);
+            while (batch.size() < min<size_t>(take, kStrandBatch - delivered) && !strand->mQueue.empty()) {
+                Event* event = strand->mQueue.front();
+                strand->mQueue.pop_front();
+                if (!event->mCancelled) {
+                    untrackStrandEvent_l(event);
+                    batch.push_back(move(event->mMessage));
+                }
+                delete event;
+            }
+        }
+        if (batch.empty()) {
+            break;
+        }
+        removeQueued(batch.size());
+
+        if (Tracer::isEnabled()) {
+            for (const shared_ptr<Message>& msg : batch) {
+                Tracer::traceDequeue(*msg);
+            }
+        }
+
+        bool tracked = isDispatchTracking();
+        if (tracked) {
+            worker->mDispatchSlot.begin(batch.front()->target(), batch.front()->what());
+        }
+        if (batch.size() == 1) {
+            LooperRoster::getInstance()->deliverMessage(batch.front());
+        } else {
+            LooperRoster::getInstance()->deliverMessages(batch);
+        }
+        if (tracked) {
+            worker->mDispatchSlot.end();
+        }
+    }
+    batch.clear();
+    batch.swap(tStrandBatch);
+
+    {
+        unique_lock<mutex> autoLock(bucket.mLock);
+        if (strand->mQueue.empty()) {
+            bucket.mStrands.erase(strand->mId);
+            return;
+        }
+    }
+
+    // More arrived meanwhile, go to the back of the line.
+    schedule(strand);
+}
+
+bool LooperPool::runWorker(size_t index) {
+    if (mStopping.load()) {
+        return false;
+    }
+
+    Strand* strand = take(index);
+    if (strand != NULL) {
+        mPendingStrands.fetch_sub(1);
+
+        // A handler may drop the last reference to the pool, in which case
+        // it is destroyed on this thread once the strand is done.
+        shared_ptr<Looper> self(mSelf.lock());
+        if (self == NULL) {
+            return false;
+        }
+        runStrand(strand, mWorkers[index].get());
+        return true;
+    }
+
+    unique_lock<mutex> autoLock(mIdleLock);
+    mIdleWorkers.fetch_add(1);
+    mIdleCondition.wait(autoLock, [this] {
+        return mPendingStrands.load() > 0 || mStopping.load();
+    });
+    mIdleWorkers.fetch_sub(1);
+    return true;
+}
+
+} // namespace baseutils
@@ -15,9 +15,12 @@
  */
 
 #include <cassert>
+#include <thread>
 
 #include <baseutils/Handler.h>
 #include <baseutils/Message.h>
+#include <baseutils/Tracer.h>
+#include "BaseThread.h"
 #include "LooperRoster.h"
 
 using namespace std;
@@ -25,9 +28,29 @@ using namespace chrono;
 
 namespace baseutils {
 
+static const MessageKey kKeyReplyId("replyId");
+
 //static variable
 LooperRoster* LooperRoster::mInstance = NULL;
 
+class LooperRoster::ReplyThread : public BaseThread {
+public:
+    explicit ReplyThread(LooperRoster* roster) : mRoster(roster) {}
+
+    virtual ~ReplyThread() { }
+
+    virtual bool threadLoop() {
+        return mRoster->settleFailedReplies();
+    }
+
+private:
+    ReplyThread(const ReplyThread&) = delete;
+
+    ReplyThread& operator=(const ReplyThread&) = delete;
+
+    LooperRoster* mRoster;
+};
+
 LooperRoster* LooperRoster::getInstance()
 {
     if (!mInstance) {
@@ -37,13 +60,64 @@ LooperRoster* LooperRoster::getInstance()
 }
 
 LooperRoster::LooperRoster()
-    : mNextHandlerId(1),
+    : mNextSlot(1),
       mNextReplyId(1) {
+    for (auto& chunk : mChunks) {
+        chunk.store(nullptr, memory_order_relaxed);
+    }
 }
 
 LooperRoster::~LooperRoster() {
 }
 
+LooperRoster::HandlerSlot* LooperRoster::slotFor(Looper::handler_id handlerId) const {
+    if (handlerId <= 0) {
+        return NULL;
+    }
+
+    uint32_t index = handlerId & kSlotMask;
+    HandlerSlot* chunk = mChunks[index >> kChunkBits].load(memory_order_acquire);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    return &chunk[index & (kChunkSize - 1)];
+}
+
+bool LooperRoster::lookup(Looper::handler_id handlerId,
+        shared_ptr<Looper>* looper, shared_ptr<Handler>* handler) {
+    HandlerSlot* slot = slotFor(handlerId);
+    if (slot == NULL) {
+        return false;
+    }
+
+    bool found = false;
+    bool stale = false;
+
+    slot->mReaders.fetch_add(1);
+    HandlerInfo* info = slot->mInfo.load();
+    if (info != NULL && info->mId == handlerId) {
+        found = true;
+        if (looper != NULL) {
+            *looper = info->mLooper.lock();
+            found = found && (*looper != NULL);
+        }
+        if (handler != NULL) {
+            *handler = info->mHandler.lock();
+            found = found && (*handler != NULL);
+        }
+        stale = !found;
+    }
+    // info may be freed as soon as we are out.
+    slot->mReaders.fetch_sub(1);
+
+    if (stale) {
+        // Its looper or handler is gone, free the slot up for reuse.
+        unregisterHandler(handlerId);
+    }
+
+    return found;
+}
+
 Looper::handler_id LooperRoster::registerHandler(
         const shared_ptr<Looper>& looper, const shared_ptr<Handler>& handler) {
     unique_lock<mutex> autoLock(mLock);
@@ -53,162 +127,412 @@ Looper::handler_id LooperRoster::registerHandler(
         return 0;
     }
 
-    HandlerInfo info;
-    info.mLooper = looper;
-    info.mHandler = handler;
-    Looper::handler_id handlerId = mNextHandlerId++;
-    mHandlers.insert(pair<Looper::handler_id, HandlerInfo>(handlerId, info));
+    uint32_t index;
+    if (!mFreeSlots.empty()) {
+        index = mFreeSlots.back();
+        mFreeSlots.pop_back();
+    } else if (mNextSlot <= kSlotMask) {
+        index = mNextSlot++;
+    } else {
+//        ALOGE("failed to register handler. Handler table full.");
+        return 0;
+    }
+
+    if (mChunks[index >> kChunkBits].load(memory_order_relaxed) == NULL) {
+        mChunks[index >> kChunkBits].store(new HandlerSlot[kChunkSize], memory_order_release);
+    }
+    HandlerSlot* slot = slotFor(index);
+
+    HandlerInfo* info = new HandlerInfo;
+    info->mId = (Looper::handler_id)((slot->mGeneration << kSlotBits) | index);
+    info->mLooper = looper;
+    info->mHandler = handler;
+    info->mBatched = handler->wantsBatches();
 
-    handler->setID(handlerId);
+    handler->setID(info->mId);
+    slot->mInfo.store(info);
 
-    return handlerId;
+    return info->mId;
 }
 
 void LooperRoster::unregisterHandler(Looper::handler_id handlerId) {
     unique_lock<mutex> autoLock(mLock);
 
+    HandlerSlot* slot = slotFor(handlerId);
+    if (slot == NULL) {
+        return;
+    }
 
-    auto search = mHandlers.find(handlerId);
-    if (search == mHandlers.end()) {
+    HandlerInfo* info = slot->mInfo.load();
+    if (info == NULL || info->mId != handlerId) {
         return;
     }
 
-    shared_ptr<Handler> handler = search->second.mHandler.lock();
+    slot->mInfo.store(nullptr);
+
+    // Anyone who loaded info before the store above has already announced
+    // itself in mReaders; they are out once it drops to zero.
+    while (slot->mReaders.load() != 0) {
+        this_thread::yield();
+    }
+
+    shared_ptr<Handler> handler = info->mHandler.lock();
     if (handler != NULL) {
         handler->setID(0);
     }
+    delete info;
 
-    mHandlers.erase(search);
-}
+    slot->mGeneration = (slot->mGeneration + 1) & kGenerationMask;
+    mFreeSlots.push_back(handlerId & kSlotMask);
+    autoLock.unlock();
 
-Result LooperRoster::postMessage(const shared_ptr<Message>& msg, const system_clock::duration& delay) {
-    unique_lock<mutex> autoLock(mLock);
-    return postMessage_l(msg, delay);
+    failReplySlots([handlerId](uint32_t, const ReplySlot& slot) {
+        return slot.mTarget == handlerId;
+    });
 }
 
-Result LooperRoster::postMessage_l(const shared_ptr<Message>& msg, const system_clock::duration& delay) {
-    auto search = mHandlers.find(msg->target());
-    if (search == mHandlers.end()) {
+Result LooperRoster::postMessage(const shared_ptr<Message>& msg, const Looper::clock::time_point& when) {
+    shared_ptr<Looper> looper = findLooper(msg->target());
+    if (looper == NULL) {
 //        ALOGW("failed to post message '%s'. Target handler not registered.",
 //              msg->debugString().c_str());
         return Result::ER_NAME_NOT_FOUND;
     }
 
-    shared_ptr<Looper> looper = search->second.mLooper.lock();
-    if (NULL == looper.get()) {
-//        ALOGW("failed to post message. "
-//             "Target handler %d still registered, but object gone.",
-//             msg->target());
-        mHandlers.erase(search);
-        return Result::ER_NAME_NOT_FOUND;
+    if (Tracer::isEnabled()) {
+        Tracer::tracePost(*msg);
     }
-
-    looper->post(msg, delay);
-
-    return Result::OK;
+    return looper->post(msg, when);
 }
 
-Result LooperRoster::cancelMessage(const shared_ptr<Message>& msg) {
-    unique_lock<mutex> autoLock(mLock);
-    return cancelMessage_l(msg);
-}
+Result LooperRoster::postAtFront(const shared_ptr<Message>& msg) {
+    shared_ptr<Looper> looper = findLooper(msg->target());
+    if (looper == NULL) {
+        return Result::ER_NAME_NOT_FOUND;
+    }
 
+    if (Tracer::isEnabled()) {
+        Tracer::tracePost(*msg);
+    }
+    return looper->postAtFront(msg);
+}
 
-Result LooperRoster::cancelMessage_l(const shared_ptr<Message>& msg) {
-    auto search = mHandlers.find(msg->target());
-    if (search == mHandlers.end()) {
-//        ALOGW("failed to post message '%s'. Target handler not registered.",
-//              msg->debugString().c_str());
+Result LooperRoster::postReplacing(const shared_ptr<Message>& msg, const Looper::clock::time_point& when) {
+    shared_ptr<Looper> looper = findLooper(msg->target());
+    if (looper == NULL) {
         return Result::ER_NAME_NOT_FOUND;
     }
 
-    shared_ptr<Looper> looper = search->second.mLooper.lock();
-    if (NULL == looper.get()) {
-//        ALOGW("failed to post message. "
-//             "Target handler %d still registered, but object gone.",
-//             msg->target());
-        mHandlers.erase(search);
+    if (Tracer::isEnabled()) {
+        Tracer::tracePost(*msg);
+    }
+    return looper->postReplacing(msg, when);
+}
+
+Result LooperRoster::cancelMessage(const shared_ptr<Message>& msg) {
+    shared_ptr<Looper> looper = findLooper(msg->target());
+    if (looper == NULL) {
         return Result::ER_NAME_NOT_FOUND;
     }
 
     return looper->cancel(msg);
 }
 
+Result LooperRoster::postTimer(const shared_ptr<Message>& msg, const Looper::clock::time_point& when,
+                               Looper::TimerHandle* handle) {
+    shared_ptr<Looper> looper = findLooper(msg->target());
+    if (looper == NULL) {
+        return Result::ER_NAME_NOT_FOUND;
+    }
+
+    if (Tracer::isEnabled()) {
+        Tracer::tracePost(*msg);
+    }
+    return looper->postTimer(msg, when, handle);
+}
 
 void LooperRoster::deliverMessage(const shared_ptr<Message>& msg) {
     shared_ptr<Handler> handler;
 
-    {
-        unique_lock<mutex> autoLock(mLock);
+    if (!lookup(msg->target(), NULL, &handler)) {
+//        ALOGW("failed to deliver message. Target handler %d not registered "
+//              "or object gone.", msg->target());
+        failRequest(*msg);
+        return;
+    }
 
-        auto search = mHandlers.find(msg->target());
-        if (mHandlers.end() == search) {
-//            ALOGW("failed to deliver message. Target handler not registered.");
-            return;
-        }
+    bool timed = handler->mStatsEnabled.load(memory_order_relaxed);
+    bool traced = Tracer::isEnabled();
+    if (!timed && !traced) {
+        handler->onMessageReceived(msg);
+        return;
+    }
 
-        handler = search->second.mHandler.lock();
-        if (handler == NULL) {
-//            ALOGW("failed to deliver message. "
-//                 "Target handler %d registered, but object gone.",
-//                 msg->target());
-            mHandlers.erase(search);
-            return;
+    if (traced) {
+        Tracer::traceHandlerBegin(*msg);
+    }
+    if (timed) {
+        // The handler may change msg.
+        uint32_t what = msg->what();
+        Looper::clock::time_point start(Looper::GetNow());
+        handler->onMessageReceived(msg);
+        handler->recordDelivery(what, Looper::GetNow() - start);
+    } else {
+        handler->onMessageReceived(msg);
+    }
+    if (traced) {
+        Tracer::traceHandlerEnd();
+    }
+}
+
+bool LooperRoster::wantsBatches(Looper::handler_id handlerId) {
+    HandlerSlot* slot = slotFor(handlerId);
+    if (slot == NULL) {
+        return false;
+    }
+
+    slot->mReaders.fetch_add(1);
+    HandlerInfo* info = slot->mInfo.load();
+    bool batched = info != NULL && info->mId == handlerId && info->mBatched;
+    slot->mReaders.fetch_sub(1);
+    return batched;
+}
+
+void LooperRoster::deliverMessages(const vector<shared_ptr<Message>>& msgs) {
+    shared_ptr<Handler> handler;
+
+    if (msgs.empty()) {
+        return;
+    }
+    if (!lookup(msgs.front()->target(), NULL, &handler)) {
+        for (const shared_ptr<Message>& msg : msgs) {
+            failRequest(*msg);
         }
+        return;
+    }
+
+    bool timed = handler->mStatsEnabled.load(memory_order_relaxed);
+    bool traced = Tracer::isEnabled();
+    if (!timed && !traced) {
+        handler->onMessagesReceived(msgs);
+        return;
     }
 
-    handler->onMessageReceived(msg);
+    if (traced) {
+        Tracer::traceHandlerBegin(*msgs.front());
+        for (size_t i = 1; i < msgs.size(); i++) {
+            Tracer::traceHandlerJoin(*msgs[i]);
+        }
+    }
+    if (timed) {
+        // The handler may change the messages.
+        vector<uint32_t> whats;
+        whats.reserve(msgs.size());
+        for (const shared_ptr<Message>& msg : msgs) {
+            whats.push_back(msg->what());
+        }
+        Looper::clock::time_point start(Looper::GetNow());
+        handler->onMessagesReceived(msgs);
+        handler->recordDelivery(whats, Looper::GetNow() - start);
+    } else {
+        handler->onMessagesReceived(msgs);
+    }
+    if (traced) {
+        Tracer::traceHandlerEnd();
+    }
 }
 
 shared_ptr<Looper> LooperRoster::findLooper(Looper::handler_id handlerId) {
-    unique_lock<mutex> autoLock(mLock);
+    shared_ptr<Looper> looper;
 
-    auto search = mHandlers.find(handlerId);
-    if (search == mHandlers.end()) {
+    if (!lookup(handlerId, &looper, NULL)) {
         return NULL;
     }
 
-    shared_ptr<Looper> looper = search->second.mLooper.lock();
-    if (looper == NULL) {
-        mHandlers.erase(search);
-        return NULL;
+    return looper;
+}
+
+Result LooperRoster::postAndAwaitResponse(const shared_ptr<Message>& msg, shared_ptr<Message>& response,
+                                          const Looper::clock::time_point& deadline) {
+    ReplySlot slot;
+    future<shared_ptr<Message>> reply(slot.mPromise.get_future());
+    uint32_t replyId;
+
+    Result status = postWithReplySlot(msg, move(slot), &replyId);
+    if (status != Result::OK) {
+        response.reset();
+        return status;
     }
 
-    return looper;
+    if (deadline == Looper::clock::time_point::max()) {
+        reply.wait();
+    } else if (reply.wait_until(deadline) == future_status::timeout && dropReplySlot(replyId)) {
+        response.reset();
+        return Result::ER_TIMED_OUT;
+    }
+
+    // Either replied in time, or the reply took the slot while we timed out
+    // and the value is on its way. Failed requests get no response.
+    response = reply.get();
+    return response != NULL ? Result::OK : Result::ER_DEAD_OBJECT;
 }
 
-Result LooperRoster::postAndAwaitResponse(const shared_ptr<Message>& msg, shared_ptr<Message>& response) {
-    unique_lock<mutex> autoLock(mLock);
+Result LooperRoster::postWithReply(const shared_ptr<Message>& msg, future<shared_ptr<Message>>* response,
+                                   const Looper::clock::time_point& deadline) {
+    ReplySlot slot;
+    slot.mDeadline = deadline;
+    *response = slot.mPromise.get_future();
+    uint32_t replyId;
+    return postWithReplySlot(msg, move(slot), &replyId);
+}
 
-    uint32_t replyId = mNextReplyId++;
+Result LooperRoster::postWithReply(const shared_ptr<Message>& msg, const Message::ReplyCallback& callback,
+                                   const Looper::clock::time_point& deadline) {
+    ReplySlot slot;
+    slot.mCallback = callback;
+    slot.mDeadline = deadline;
+    uint32_t replyId;
+    return postWithReplySlot(msg, move(slot), &replyId);
+}
+
+Result LooperRoster::postWithReplySlot(const shared_ptr<Message>& msg, ReplySlot&& slot, uint32_t* replyId) {
+    shared_ptr<Looper> looper = findLooper(msg->target());
+    if (looper == NULL) {
+        return Result::ER_NAME_NOT_FOUND;
+    }
 
-    msg->setInt32(string("replyId"), replyId);
+    slot.mTarget = msg->target();
+    slot.mLooper = looper.get();
+    {
+        lock_guard<mutex> autoLock(mRepliesLock);
+        *replyId = mNextReplyId++;
+        if (slot.mDeadline != Looper::clock::time_point::max()) {
+            mDeadlines.push(make_pair(slot.mDeadline, *replyId));
+            wakeReplyThread_l();
+        }
+        mReplies.insert(make_pair(*replyId, move(slot)));
+    }
 
-    Result status = postMessage_l(msg, system_clock::duration(0));
+    msg->setInt32(kKeyReplyId, *replyId);
 
+    if (Tracer::isEnabled()) {
+        Tracer::tracePost(*msg);
+    }
+    Result status = looper->post(msg, Looper::clock::time_point());
     if (status != Result::OK) {
-        response.reset();
-        return status;
+        dropReplySlot(*replyId);
+    }
+    return status;
+}
+
+bool LooperRoster::dropReplySlot(uint32_t replyId) {
+    lock_guard<mutex> autoLock(mRepliesLock);
+    return mReplies.erase(replyId) > 0;
+}
+
+void LooperRoster::postReply(uint32_t replyId, const shared_ptr<Message>& reply) {
+    ReplySlot slot;
+    {
+        lock_guard<mutex> autoLock(mRepliesLock);
+
+        auto itr = mReplies.find(replyId);
+        if (itr == mReplies.end()) {
+            // The sender gave up waiting, or the request failed.
+            return;
+        }
+        slot = move(itr->second);
+        mReplies.erase(itr);
+    }
+
+    slot.settle(reply);
+}
+
+void LooperRoster::ReplySlot::settle(const shared_ptr<Message>& reply) {
+    if (mCallback) {
+        mCallback(reply);
+    } else {
+        mPromise.set_value(reply);
     }
+}
 
-    map<uint32_t, shared_ptr<Message> >::iterator itr;
-    while ((itr = mReplies.find(replyId)) == mReplies.end()) {
-        mRepliesCondition.wait(autoLock);
+void LooperRoster::failRequest(const Message& msg) {
+    uint32_t replyId;
+    if (!msg.senderAwaitsResponse(replyId)) {
+        return;
     }
 
-    response = itr->second;
+    lock_guard<mutex> autoLock(mRepliesLock);
+
+    auto itr = mReplies.find(replyId);
+    if (itr == mReplies.end()) {
+        return;
+    }
+    mFailedReplies.push_back(move(itr->second));
     mReplies.erase(itr);
+    wakeReplyThread_l();
+}
 
-    return Result::OK;
+void LooperRoster::failRequests(const Looper* looper) {
+    failReplySlots([looper](uint32_t, const ReplySlot& slot) {
+        return slot.mLooper == looper;
+    });
 }
 
-void LooperRoster::postReply(uint32_t replyId, const shared_ptr<Message>& reply) {
-    unique_lock<mutex> autoLock(mLock);
+void LooperRoster::failReplySlots(const function<bool(uint32_t replyId, const ReplySlot& slot)>& matches) {
+    lock_guard<mutex> autoLock(mRepliesLock);
 
-    assert(mReplies.find(replyId) == mReplies.end());
+    size_t failed = mFailedReplies.size();
+    for (auto itr = mReplies.begin(); itr != mReplies.end();) {
+        if (matches(itr->first, itr->second)) {
+            mFailedReplies.push_back(move(itr->second));
+            itr = mReplies.erase(itr);
+        } else {
+            ++itr;
+        }
+    }
+    if (mFailedReplies.size() > failed) {
+        wakeReplyThread_l();
+    }
+}
 
-    mReplies.insert(pair<uint32_t, shared_ptr<Message> >(replyId, reply));
-    mRepliesCondition.notify_all();
+void LooperRoster::wakeReplyThread_l() {
+    if (mReplyThread == NULL) {
+        mReplyThread = make_shared<ReplyThread>(this);
+        mReplyThread->run();
+    }
+    mRepliesCondition.notify_one();
+}
+
+bool LooperRoster::settleFailedReplies() {
+    vector<ReplySlot> failed;
+    {
+        unique_lock<mutex> autoLock(mRepliesLock);
+
+        Looper::clock::time_point now = Looper::GetNow();
+        while (!mDeadlines.empty() && mDeadlines.top().first <= now) {
+            auto itr = mReplies.find(mDeadlines.top().second);
+            if (itr != mReplies.end() && itr->second.mDeadline == mDeadlines.top().first) {
+                mFailedReplies.push_back(move(itr->second));
+                mReplies.erase(itr);
+            }
+            mDeadlines.pop();
+        }
+
+        if (mFailedReplies.empty()) {
+            if (mDeadlines.empty()) {
+                mRepliesCondition.wait(autoLock);
+            } else {
+                mRepliesCondition.wait_until(autoLock, mDeadlines.top().first);
+            }
+            return true;
+        }
+        failed.swap(mFailedReplies);
+    }
+
+    for (ReplySlot& slot : failed) {
+        slot.settle(NULL);
+    }
+    return true;
 }
 
 } // namespace baseutils
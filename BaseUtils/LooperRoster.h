@@ -17,10 +17,17 @@
 #ifndef LOOPER_ROSTER_H_
 #define LOOPER_ROSTER_H_
 
+#include <atomic>
 #include <condition_variable>
-#include <map>
+#include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
+#include <vector>
 #include <baseutils/Looper.h>
+#include <baseutils/Message.h>
 
 namespace baseutils {
 
@@ -32,43 +39,168 @@ public:
 
     void unregisterHandler(Looper::handler_id handlerId);
 
-    Result postMessage(const std::shared_ptr<Message>& msg, const std::chrono::system_clock::duration& delay);
+    Result postMessage(const std::shared_ptr<Message>& msg, const Looper::clock::time_point& when);
+
+    Result postAtFront(const std::shared_ptr<Message>& msg);
+
+    Result postReplacing(const std::shared_ptr<Message>& msg, const Looper::clock::time_point& when);
 
     Result cancelMessage(const std::shared_ptr<Message>& msg);
 
+    Result postTimer(const std::shared_ptr<Message>& msg, const Looper::clock::time_point& when,
+                     Looper::TimerHandle* handle);
+
     void deliverMessage(const std::shared_ptr<Message>& msg);
 
-    Result postAndAwaitResponse(const std::shared_ptr<Message>& msg, std::shared_ptr<Message>& response);
+    // Whether the handler asked for its messages in batches. Takes no lock
+    // and doesn't resolve the looper or handler, so a looper can ask while
+    // holding its own lock.
+    bool wantsBatches(Looper::handler_id handlerId);
+
+    // All of msgs have the same target.
+    void deliverMessages(const std::vector<std::shared_ptr<Message>>& msgs);
+
+    // Waits until deadline, clock::time_point::max() waits for good.
+    Result postAndAwaitResponse(const std::shared_ptr<Message>& msg, std::shared_ptr<Message>& response,
+                                const Looper::clock::time_point& deadline);
+
+    // The response is NULL if it didn't arrive by deadline, or if the
+    // request failed.
+    Result postWithReply(const std::shared_ptr<Message>& msg, std::future<std::shared_ptr<Message>>* response,
+                         const Looper::clock::time_point& deadline);
+
+    Result postWithReply(const std::shared_ptr<Message>& msg, const Message::ReplyCallback& callback,
+                         const Looper::clock::time_point& deadline);
 
     void postReply(uint32_t replyID, const std::shared_ptr<Message>& reply);
 
+    // Called by loopers when msg leaves them without being delivered. Fails
+    // the request it carries, if any. Only takes the replies lock, so
+    // loopers may call it under their own.
+    void failRequest(const Message& msg);
+
+    // Fails the requests whose messages were posted to looper, once it
+    // stopped.
+    void failRequests(const Looper* looper);
+
     std::shared_ptr<Looper> findLooper(Looper::handler_id handlerId);
 
 private:
     class HandlerInfo {
     public:
+        Looper::handler_id mId;
         std::weak_ptr<Looper> mLooper;
         std::weak_ptr<Handler> mHandler;
+        bool mBatched;
+    };
+
+    /**
+     * A handler_id is a slot index in the low kSlotBits bits and the slot's
+     * generation above them. The generation changes every time a slot is
+     * reused, so a stale id never resolves to a newer handler.
+     */
+    enum {
+        kSlotBits = 16,
+        kSlotMask = (1 << kSlotBits) - 1,
+        kGenerationMask = 0x7fff,
+        kChunkBits = 10,
+        kChunkSize = 1 << kChunkBits,
+        kMaxChunks = (1 << kSlotBits) / kChunkSize,
+    };
+
+    /**
+     * mInfo is published and retired with atomic exchanges. Readers bump
+     * mReaders around their access, and unregistration waits for it to
+     * drain before freeing the HandlerInfo it took out.
+     */
+    struct HandlerSlot {
+        std::atomic<uint32_t> mReaders;
+        std::atomic<HandlerInfo*> mInfo;
+        // Only touched under mLock.
+        uint32_t mGeneration;
+        // Posts to different handlers shouldn't bounce the same cache line.
+        char mPadding[64 - sizeof(std::atomic<uint32_t>) - sizeof(std::atomic<HandlerInfo*>) - sizeof(uint32_t)];
+
+        HandlerSlot() : mReaders(0), mInfo(nullptr), mGeneration(0), mPadding() {}
     };
 
     static LooperRoster* mInstance;
 
+    /**
+     * Where the response to one request goes, either a promise the sender
+     * waits on or a callback. Each request has its own, so a reply wakes
+     * exactly the sender waiting for it.
+     */
+    class ReplySlot {
+    public:
+        std::promise<std::shared_ptr<Message>> mPromise;
+        Message::ReplyCallback mCallback;
+        // Where the request went, so it fails when they go away.
+        Looper::handler_id mTarget;
+        const Looper* mLooper;
+        // clock::time_point::max() if there is none.
+        Looper::clock::time_point mDeadline;
+
+        ReplySlot() : mTarget(0), mLooper(NULL), mDeadline(Looper::clock::time_point::max()) {}
+
+        // Hands the response, NULL if the request failed, to whoever waits.
+        void settle(const std::shared_ptr<Message>& reply);
+    };
+
+    class ReplyThread;
+
+    // Serializes registration. Posting and delivering never take it.
     std::mutex mLock;
 
     /**
-     * key : handler ID
-     * value : HandlerInfo
+     * Slot storage, allocated a chunk at a time and never freed, so readers
+     * can index it without a lock.
      */
-    std::map<Looper::handler_id, HandlerInfo> mHandlers;
-    Looper::handler_id mNextHandlerId;
+    std::atomic<HandlerSlot*> mChunks[kMaxChunks];
+    uint32_t mNextSlot;
+    std::vector<uint32_t> mFreeSlots;
+
+    // Guards the reply bookkeeping below. Nothing else is locked while it is
+    // held.
+    std::mutex mRepliesLock;
     uint32_t mNextReplyId;
-    std::condition_variable mRepliesCondition;
 
     /**
      * key : replyId
-     * value : Message
+     * value : where its response goes
+     */
+    std::unordered_map<uint32_t, ReplySlot> mReplies;
+
+    typedef std::pair<Looper::clock::time_point, uint32_t> ReplyDeadline;
+
+    // Deadlines of slots in mReplies, earliest on top. Entries of slots
+    // that are gone are skipped once they come up.
+    std::priority_queue<ReplyDeadline, std::vector<ReplyDeadline>, std::greater<ReplyDeadline>> mDeadlines;
+
+    /**
+     * Slots of failed or expired requests, settled with a NULL response by
+     * mReplyThread. Callbacks then never run under a looper's lock. The
+     * thread is started the first time it has something to do.
      */
-    std::map<uint32_t, std::shared_ptr<Message>> mReplies;
+    std::vector<ReplySlot> mFailedReplies;
+    std::condition_variable mRepliesCondition;
+    std::shared_ptr<ReplyThread> mReplyThread;
+
+    // Files slot under a new reply id, tags msg with it and posts msg. The
+    // slot is dropped again if posting fails.
+    Result postWithReplySlot(const std::shared_ptr<Message>& msg, ReplySlot&& slot, uint32_t* replyId);
+
+    // Removes the slot of replyId, returns false if a reply already took it.
+    bool dropReplySlot(uint32_t replyId);
+
+    // Moves every slot that matches to mFailedReplies.
+    void failReplySlots(const std::function<bool(uint32_t replyId, const ReplySlot& slot)>& matches);
+
+    void wakeReplyThread_l();
+
+    // One round of mReplyThread: waits for failed slots or the next
+    // deadline, and settles what there is.
+    bool settleFailedReplies();
 
     // Singleton
     LooperRoster();
@@ -79,10 +211,10 @@ private:
 
     LooperRoster& operator=(const LooperRoster&) = delete;
 
-    Result postMessage_l(const std::shared_ptr<Message>& msg, const std::chrono::system_clock::duration& delay);
-
-    Result cancelMessage_l(const std::shared_ptr<Message>& msg);
+    HandlerSlot* slotFor(Looper::handler_id handlerId) const;
 
+    bool lookup(Looper::handler_id handlerId,
+            std::shared_ptr<Looper>* looper, std::shared_ptr<Handler>* handler);
 };
 
 } // namespace baseutils
@@ -14,15 +14,22 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <cstdint>
 #include <cstdio>
 #include <cctype>
 #include <cassert>
 #include <cstring>
 #include <cstdarg>
+#include <atomic>
+#include <mutex>
 #include <string>
 #include <memory>
+#include <new>
+#include <vector>
 
 #include <baseutils/Buffer.h>
+#include <baseutils/BufferChain.h>
 #include <baseutils/Message.h>
 #include <baseutils/Parcelable.h>
 #include "LooperRoster.h"
@@ -32,20 +39,209 @@ using namespace chrono;
 
 namespace baseutils {
 
+static const MessageKey kKeyReplyId("replyId");
+
+namespace {
+
+enum {
+    kDefaultPoolCapacity = 256,
+    // Idle blocks move between a thread and the shared depot this many at
+    // a time.
+    kPoolBatchSize = 32,
+};
+
+atomic<size_t> gPoolCapacity(kDefaultPoolCapacity);
+
+thread_local Message::PoolStats tPoolStats;
+
+/**
+ * Free list of Size byte blocks for the calling thread.
+ *
+ * Messages are typically obtained on one thread and released on the looper
+ * thread, so a thread whose list is full parks a batch in a depot shared by
+ * all threads, and a thread whose list is empty picks one up from there.
+ */
+template<size_t Size>
+class BlockPool {
+public:
+    static void* allocate() {
+        BlockPool* pool = local();
+        void* block = pool != NULL ? pool->get() : NULL;
+        if (block != NULL) {
+            tPoolStats.hits++;
+            return block;
+        }
+        tPoolStats.misses++;
+        return ::operator new(Size);
+    }
+
+    static void deallocate(void* block) {
+        BlockPool* pool = local();
+        if (pool == NULL || !pool->put(block)) {
+            ::operator delete(block);
+        }
+    }
+
+private:
+    struct Depot {
+        mutex mLock;
+        vector<vector<void*>> mBatches;
+    };
+
+    vector<void*> mFree;
+
+    // Set once the calling thread's pool is gone, blocks released after that
+    // (by other thread_local objects) are simply freed.
+    static thread_local bool tDestroyed;
+
+    BlockPool() = default;
+
+    ~BlockPool() {
+        tDestroyed = true;
+        while (mFree.size() >= kPoolBatchSize && park()) {
+        }
+        for (void* block : mFree) {
+            ::operator delete(block);
+        }
+    }
+
+    static BlockPool* local() {
+        if (tDestroyed) {
+            return NULL;
+        }
+        static thread_local BlockPool sPool;
+        return &sPool;
+    }
+
+    // Never destroyed, so messages released during exit are still safe.
+    static Depot& depot() {
+        static Depot* sDepot = new Depot;
+        return *sDepot;
+    }
+
+    void* get() {
+        if (mFree.empty()) {
+            Depot& depot = BlockPool::depot();
+            lock_guard<mutex> autoLock(depot.mLock);
+            if (depot.mBatches.empty()) {
+                return NULL;
+            }
+            mFree.swap(depot.mBatches.back());
+            depot.mBatches.pop_back();
+        }
+
+        void* block = mFree.back();
+        mFree.pop_back();
+        return block;
+    }
+
+    bool put(void* block) {
+        if (mFree.size() >= gPoolCapacity.load(memory_order_relaxed) && !park()) {
+            return false;
+        }
+        mFree.push_back(block);
+        return true;
+    }
+
+    // Moves a batch of idle blocks to the depot, if it has room for them.
+    bool park() {
+        size_t capacity = gPoolCapacity.load(memory_order_relaxed);
+        if (mFree.size() < kPoolBatchSize) {
+            return false;
+        }
+
+        Depot& depot = BlockPool::depot();
+        lock_guard<mutex> autoLock(depot.mLock);
+        if ((depot.mBatches.size() + 1) * kPoolBatchSize > capacity) {
+            return false;
+        }
+        depot.mBatches.emplace_back(mFree.end() - kPoolBatchSize, mFree.end());
+        mFree.resize(mFree.size() - kPoolBatchSize);
+        return true;
+    }
+};
+
+template<size_t Size>
+thread_local bool BlockPool<Size>::tDestroyed = false;
+
+// Hands out storage for allocate_shared from a BlockPool, one block holds a
+// message together with its control block.
+template<typename T>
+struct PoolAllocator {
+    typedef T value_type;
+
+    PoolAllocator() = default;
+
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        if (n != 1) {
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+        return static_cast<T*>(BlockPool<sizeof(T)>::allocate());
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (n != 1) {
+            ::operator delete(p);
+            return;
+        }
+        BlockPool<sizeof(T)>::deallocate(p);
+    }
+};
+
+template<typename T, typename U>
+bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&) {
+    return true;
+}
+
+template<typename T, typename U>
+bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&) {
+    return false;
+}
+
+} // namespace
+
 Message::Message(const Looper::handler_id target)
     : mWhat(0),
-      mTarget(target) {
+      mTarget(target),
+      mPriority(Looper::kPriorityNormal),
+      mPendingEvents(NULL),
+      mStrandEvents(NULL),
+      mPendingOn(0),
+      mTraceFlow(0) {
 }
 
 Message::Message(const Looper::handler_id target, const uint32_t what)
     : mWhat(what),
-      mTarget(target) {
+      mTarget(target),
+      mPriority(Looper::kPriorityNormal),
+      mPendingEvents(NULL),
+      mStrandEvents(NULL),
+      mPendingOn(0),
+      mTraceFlow(0) {
 }
 
 Message::~Message() {
     clear();
 }
 
+// static
+shared_ptr<Message> Message::obtain(const Looper::handler_id target, const uint32_t what) {
+    return allocate_shared<Message>(PoolAllocator<Message>(), target, what);
+}
+
+// static
+Message::PoolStats Message::GetPoolStats() {
+    return tPoolStats;
+}
+
+// static
+void Message::SetPoolCapacity(size_t capacity) {
+    gPoolCapacity.store(capacity, memory_order_relaxed);
+}
+
 
 void Message::setWhat(const uint32_t what) {
     mWhat = what;
@@ -63,78 +259,153 @@ Looper::handler_id Message::target() const {
     return mTarget;
 }
 
+void Message::setPriority(const Looper::Priority priority) {
+    mPriority = priority;
+}
+
+Looper::Priority Message::priority() const {
+    return mPriority;
+}
+
 void Message::clear() {
     mItems.clear();
 }
 
-void Message::clearItem(shared_ptr<Item>& item) {
-    switch (item->mType) {
+Message::Item::Item(const Item& other)
+    : mKey(other.mKey),
+      mType(other.mType) {
+    switch (mType) {
         case kTypeString:
-            item->stringValue.clear();
+            new (&value.stringValue) string(other.value.stringValue);
             break;
         case kTypeMessage:
-            if (item->messagePtr != nullptr) {
-                item->messagePtr.reset();
-            }
+            new (&value.messagePtr) shared_ptr<Message>(other.value.messagePtr);
             break;
         case kTypeBuffer:
-            if (item->bufferPtr != nullptr) {
-                item->bufferPtr.reset();
-            }
+            new (&value.bufferPtr) shared_ptr<Buffer>(other.value.bufferPtr);
+            break;
         case kTypeObject:
-            if(item->objectPtr != nullptr) {
-                item->objectPtr.reset();
-            }
+            new (&value.objectPtr) shared_ptr<Parcelable>(other.value.objectPtr);
+            break;
+        case kTypeBufferChain:
+            new (&value.chainPtr) shared_ptr<BufferChain>(other.value.chainPtr);
+            break;
+        default:
+            memcpy(static_cast<void*>(&value), &other.value, sizeof(value));
+            break;
+    }
+}
+
+Message::Item::Item(Item&& other) noexcept
+    : mKey(other.mKey),
+      mType(other.mType) {
+    switch (mType) {
+        case kTypeString:
+            new (&value.stringValue) string(move(other.value.stringValue));
+            break;
+        case kTypeMessage:
+            new (&value.messagePtr) shared_ptr<Message>(move(other.value.messagePtr));
+            break;
+        case kTypeBuffer:
+            new (&value.bufferPtr) shared_ptr<Buffer>(move(other.value.bufferPtr));
+            break;
+        case kTypeObject:
+            new (&value.objectPtr) shared_ptr<Parcelable>(move(other.value.objectPtr));
+            break;
+        case kTypeBufferChain:
+            new (&value.chainPtr) shared_ptr<BufferChain>(move(other.value.chainPtr));
             break;
         default:
+            memcpy(static_cast<void*>(&value), &other.value, sizeof(value));
             break;
     }
 }
 
-shared_ptr<Message::Item> Message::allocateItem(const string& name) {
-    bool found = false;
-    shared_ptr<Item> item;
-    for(auto& temp : mItems) {
-        if(!temp->mName.compare(name)) {
-            clearItem(temp);
-            item = temp;
-            found = true;
+void Message::Item::clear() {
+    switch (mType) {
+        case kTypeString:
+            value.stringValue.~string();
             break;
+        case kTypeMessage:
+            value.messagePtr.~shared_ptr<Message>();
+            break;
+        case kTypeBuffer:
+            value.bufferPtr.~shared_ptr<Buffer>();
+            break;
+        case kTypeObject:
+            value.objectPtr.~shared_ptr<Parcelable>();
+            break;
+        case kTypeBufferChain:
+            value.chainPtr.~shared_ptr<BufferChain>();
+            break;
+        default:
+            break;
+    }
+    mType = kTypeUnknown;
+}
+
+Message::Item* Message::allocateItem(const MessageKey& key) {
+    for (auto& temp : mItems) {
+        if (temp.mKey == key) {
+            temp.clear();
+            return &temp;
         }
     }
-    if(!found) {
-        item = make_shared<Item>();
-        item->mName = name;
-        mItems.push_back(item);
+
+    return &mItems.emplace_back(key);
+}
+
+const Message::Item* Message::findItem(const MessageKey& key, Type type) const {
+    for (auto& temp : mItems) {
+        if (temp.mKey == key && temp.mType == type) {
+            return &temp;
+        }
     }
-    return item;
+    return NULL;
 }
 
-const shared_ptr<Message::Item> Message::findItem(const string& name, Type type) const {
-    shared_ptr<Item> item;
-    for(auto& temp : mItems) {
-        if(temp->mType == type && !temp->mName.compare(name)) {
-            item = temp;
-            break;
+const Message::Item* Message::findItem(const string& name, Type type) const {
+    MessageKey key;
+    if (MessageKey::Find(name, &key)) {
+        return findItem(key, type);
+    }
+
+    // Never interned, so only a field set by that name can match.
+    for (auto& temp : mItems) {
+        if (temp.mType == type && temp.mKey.name() == name) {
+            return &temp;
         }
     }
-    return item;
+    return NULL;
 }
 
-#define BASIC_TYPE(NAME,FIELDNAME,TYPENAME)                                 \
-void Message::set##NAME(const string& name, TYPENAME value) {         \
-    auto item(allocateItem(name));                                          \
-    item->mType = kType##NAME;                                              \
-    item->value.FIELDNAME = value;                                          \
-}                                                                           \
-                                                                            \
-bool Message::find##NAME(const string& name, TYPENAME* const value) const { \
-    auto item(findItem(name, kType##NAME));                                 \
-    if (item) {                                                             \
-        (*value) = item->value.FIELDNAME;                                   \
-        return true;                                                        \
-    }                                                                       \
-    return false;                                                           \
+#define BASIC_TYPE(NAME,FIELDNAME,TYPENAME)                                     \
+void Message::set##NAME(const MessageKey& key, TYPENAME value) {                \
+    Item* item = allocateItem(key);                                             \
+    item->value.FIELDNAME = value;                                              \
+    item->mType = kType##NAME;                                                  \
+}                                                                               \
+                                                                                \
+void Message::set##NAME(const string& name, TYPENAME value) {                   \
+    set##NAME(MessageKey::Named(name), value);                                  \
+}                                                                               \
+                                                                                \
+bool Message::find##NAME(const MessageKey& key, TYPENAME* const value) const {  \
+    const Item* item = findItem(key, kType##NAME);                              \
+    if (item) {                                                                 \
+        (*value) = item->value.FIELDNAME;                                       \
+        return true;                                                            \
+    }                                                                           \
+    return false;                                                               \
+}                                                                               \
+                                                                                \
+bool Message::find##NAME(const string& name, TYPENAME* const value) const {     \
+    const Item* item = findItem(name, kType##NAME);                             \
+    if (item) {                                                                 \
+        (*value) = item->value.FIELDNAME;                                       \
+        return true;                                                            \
+    }                                                                           \
+    return false;                                                               \
 }
 
 BASIC_TYPE(Boolean,boolValue,bool)
@@ -147,77 +418,92 @@ BASIC_TYPE(Pointer,ptrValue,void*)
 
 #undef BASIC_TYPE
 
-void Message::setString(const string& name, const string& str) {
-    auto item(allocateItem(name));
-    item->mType = kTypeString;
-    item->stringValue = str;
+#define OBJECT_TYPE(NAME,FIELDNAME,TYPENAME)                                    \
+void Message::set##NAME(const MessageKey& key, const TYPENAME& value) {         \
+    Item* item = allocateItem(key);                                             \
+    new (&item->value.FIELDNAME) TYPENAME(value);                               \
+    item->mType = kType##NAME;                                                  \
+}                                                                               \
+                                                                                \
+void Message::set##NAME(const string& name, const TYPENAME& value) {            \
+    set##NAME(MessageKey::Named(name), value);                                  \
+}                                                                               \
+                                                                                \
+bool Message::find##NAME(const MessageKey& key, TYPENAME* const value) const {  \
+    const Item* item = findItem(key, kType##NAME);                              \
+    if (item) {                                                                 \
+        (*value) = item->value.FIELDNAME;                                       \
+        return true;                                                            \
+    }                                                                           \
+    return false;                                                               \
+}                                                                               \
+                                                                                \
+bool Message::find##NAME(const string& name, TYPENAME* const value) const {     \
+    const Item* item = findItem(name, kType##NAME);                             \
+    if (item) {                                                                 \
+        (*value) = item->value.FIELDNAME;                                       \
+        return true;                                                            \
+    }                                                                           \
+    return false;                                                               \
 }
 
-void Message::setBuffer(const string& name, const shared_ptr<Buffer>& buffer) {
-    auto item(allocateItem(name));
-    item->mType = kTypeBuffer;
-    item->bufferPtr = buffer;
-}
+OBJECT_TYPE(String,stringValue,string)
+OBJECT_TYPE(Buffer,bufferPtr,shared_ptr<Buffer>)
+OBJECT_TYPE(Message,messagePtr,shared_ptr<Message>)
+OBJECT_TYPE(Object,objectPtr,shared_ptr<Parcelable>)
+OBJECT_TYPE(BufferChain,chainPtr,shared_ptr<BufferChain>)
 
-void Message::setMessage(const string& name, const shared_ptr<Message>& message) {
-    auto item(allocateItem(name));
-    item->mType = kTypeMessage;
-    item->messagePtr = message;
+#undef OBJECT_TYPE
+
+Result Message::post(const int64_t delayUs) {
+    return postMessage(duration_cast<Looper::clock::duration>(microseconds(delayUs)));
 }
 
-void Message::setObject(const string& name, const shared_ptr<Parcelable>& object) {
-    auto item(allocateItem(name));
-    item->mType = kTypeObject;
-    item->objectPtr = object;
+Result Message::postAt(const Looper::clock::time_point& when) {
+    return LooperRoster::getInstance()->postMessage(shared_from_this(), when);
 }
 
-bool Message::findString(const string& name, string* const value) const {
-    auto item(findItem(name, kTypeString));
-    if (item) {
-        (*value) = item->stringValue;
-        return true;
+Result Message::postReplacing(const int64_t delayUs) {
+    Looper::clock::time_point when;
+    if (delayUs > 0) {
+        when = Looper::GetNow() + microseconds(delayUs);
     }
-    return false;
+    return LooperRoster::getInstance()->postReplacing(shared_from_this(), when);
 }
 
-bool Message::findBuffer(const string& name, shared_ptr<Buffer>* const buf) const {
-    auto item(findItem(name, kTypeBuffer));
-    if (item) {
-        (*buf) = item->bufferPtr;
-        return true;
-    }
-    return false;
+Result Message::postAtFront() {
+    return LooperRoster::getInstance()->postAtFront(shared_from_this());
 }
 
-bool Message::findMessage(const string& name, shared_ptr<Message>* const message) const {
-    auto item(findItem(name, kTypeMessage));
-    if (item) {
-        (*message) = item->messagePtr;
-        return true;
-    }
-    return false;
+Result Message::cancel() {
+    return LooperRoster::getInstance()->cancelMessage(shared_from_this());
 }
 
-bool Message::findObject(const string& name, shared_ptr<Parcelable>* const object) const {
-    auto item(findItem(name, kTypeObject));
-    if (item) {
-        (*object) = item->objectPtr;
-        return true;
-    }
-    return false;
+Result Message::postAndAwaitResponse(shared_ptr<Message>& response) {
+    return postAndAwaitResponseUntil(response, Looper::clock::time_point::max());
 }
 
-Result Message::post(const int64_t delayUs) {
-    microseconds delay(delayUs);
-	return LooperRoster::getInstance()->postMessage(shared_from_this(), duration_cast<system_clock::duration>(delay));
+Result Message::postAndAwaitResponseUntil(shared_ptr<Message>& response,
+                                          const Looper::clock::time_point& deadline) {
+    return LooperRoster::getInstance()->postAndAwaitResponse(shared_from_this(), response, deadline);
 }
 
-Result Message::cancel() {
-    return LooperRoster::getInstance()->cancelMessage(shared_from_this());
+Result Message::postWithReply(future<shared_ptr<Message>>* response) {
+    return postWithReplyUntil(response, Looper::clock::time_point::max());
 }
 
-Result Message::postAndAwaitResponse(shared_ptr<Message>& response) {
-    return LooperRoster::getInstance()->postAndAwaitResponse(shared_from_this(), response);
+Result Message::postWithReplyUntil(future<shared_ptr<Message>>* response,
+                                   const Looper::clock::time_point& deadline) {
+    return LooperRoster::getInstance()->postWithReply(shared_from_this(), response, deadline);
+}
+
+Result Message::postWithReply(const ReplyCallback& callback) {
+    return postWithReplyUntil(callback, Looper::clock::time_point::max());
+}
+
+Result Message::postWithReplyUntil(const ReplyCallback& callback,
+                                   const Looper::clock::time_point& deadline) {
+    return LooperRoster::getInstance()->postWithReply(shared_from_this(), callback, deadline);
 }
 
 void Message::postReply(const uint32_t replyId) {
@@ -226,7 +512,7 @@ void Message::postReply(const uint32_t replyId) {
 
 bool Message::senderAwaitsResponse(uint32_t& replyId) const {
     int32_t tmp;
-    bool found = findInt32("replyId", &tmp);
+    bool found = findInt32(kKeyReplyId, &tmp);
     if (!found) {
         return false;
     }
@@ -236,29 +522,12 @@ bool Message::senderAwaitsResponse(uint32_t& replyId) const {
 }
 
 shared_ptr<Message> Message::duplicate() const {
-    auto msg(make_shared<Message>(mTarget, mWhat));
+    auto msg(obtain(mTarget, mWhat));
+    msg->mPriority = mPriority;
 
+    msg->mItems.reserve(mItems.size());
     for (auto& from : mItems) {
-        auto to(make_shared<Item>());
-        to->mName = from->mName;
-        to->mType = from->mType;
-
-        switch (from->mType) {
-            case kTypeString:
-                to->stringValue = from->stringValue;
-                break;
-            case kTypeBuffer:
-                to->bufferPtr = from->bufferPtr;
-                break;
-            case kTypeMessage:
-                to->messagePtr = from->messagePtr;
-                break;
-            default:
-                to->value = from->value;
-                break;
-        }
-
-        msg->mItems.push_back(to);
+        msg->mItems.emplace_back(from);
     }
 
     return msg;
@@ -373,51 +642,58 @@ string Message::debugString(int32_t indent) const {
     s.append(") = {\n");
 
     for (auto& item : mItems) {
-        switch (item->mType) {
+        switch (item.mType) {
             case kTypeInt32:
                 tmp = stringPrintf(
-                        "int32_t %s = %d", item->mName.c_str(), item->value.int32Value);
+                        "int32_t %s = %d", item.mKey.name().c_str(), item.value.int32Value);
                 break;
             case kTypeInt64:
                 tmp = stringPrintf(
-                        "int64_t %s = %lld", item->mName.c_str(), item->value.int64Value);
+                        "int64_t %s = %lld", item.mKey.name().c_str(), item.value.int64Value);
                 break;
             case kTypeSize:
                 tmp = stringPrintf(
-                        "size_t %s = %d", item->mName.c_str(), item->value.sizeValue);
+                        "size_t %s = %d", item.mKey.name().c_str(), item.value.sizeValue);
                 break;
             case kTypeFloat:
                 tmp = stringPrintf(
-                        "float %s = %f", item->mName.c_str(), item->value.floatValue);
+                        "float %s = %f", item.mKey.name().c_str(), item.value.floatValue);
                 break;
             case kTypeDouble:
                 tmp = stringPrintf(
-                        "double %s = %f", item->mName.c_str(), item->value.doubleValue);
+                        "double %s = %f", item.mKey.name().c_str(), item.value.doubleValue);
                 break;
             case kTypePointer:
                 tmp = stringPrintf(
-                        "void *%s = %p", item->mName.c_str(), item->value.ptrValue);
+                        "void *%s = %p", item.mKey.name().c_str(), item.value.ptrValue);
                 break;
             case kTypeString:
                 tmp = stringPrintf(
                         "string %s = \"%s\"",
-                        item->mName.c_str(),
-                        item->stringValue.c_str());
+                        item.mKey.name().c_str(),
+                        item.value.stringValue.c_str());
                 break;
             case kTypeBuffer:
-                if (item->bufferPtr != nullptr && item->bufferPtr->size() <= 64) {
-                    tmp = stringPrintf("Buffer %s = {\n", item->mName.c_str());
-                    hexDump(item->bufferPtr->data(), item->bufferPtr->size(), indent + 4, &tmp);
+                if (item.value.bufferPtr != nullptr && item.value.bufferPtr->size() <= 64) {
+                    tmp = stringPrintf("Buffer %s = {\n", item.mKey.name().c_str());
+                    hexDump(item.value.bufferPtr->data(), item.value.bufferPtr->size(), indent + 4, &tmp);
                     appendIndent(&tmp, indent + 2);
                     tmp.append("}");
                 } else {
-                    tmp = stringPrintf("Buffer *%s = %p", item->mName.c_str(), item->bufferPtr.get());
+                    tmp = stringPrintf("Buffer *%s = %p", item.mKey.name().c_str(), item.value.bufferPtr.get());
                 }
                 break;
+            case kTypeBufferChain:
+                tmp = stringPrintf(
+                        "BufferChain *%s = %p (%zu bytes in %zu segments)",
+                        item.mKey.name().c_str(), item.value.chainPtr.get(),
+                        item.value.chainPtr != nullptr ? item.value.chainPtr->size() : 0,
+                        item.value.chainPtr != nullptr ? item.value.chainPtr->countSegments() : 0);
+                break;
             case kTypeMessage:
                 tmp = stringPrintf(
                         "Message %s = %s",
-                        item->mName.c_str(), item->messagePtr->debugString(indent + item->mName.size() + 14).c_str());
+                        item.mKey.name().c_str(), item.value.messagePtr->debugString(indent + item.mKey.name().size() + 14).c_str());
                 break;
             default:
                 break;
@@ -445,12 +721,681 @@ const string Message::getEntryNameAt(const size_t index, Type& type) const {
         return string("Unknown");
     }
 
-    type = mItems[index]->mType;
-    return mItems[index]->mName;
+    type = mItems[index].mType;
+    return mItems[index].mKey.name();
+}
+
+namespace {
+
+enum {
+    // Tells a reader on a host of the other byte order apart, too.
+    kWireMagic = 0x424d5347,
+    kWireVersion = 1,
+    // Magic, version and the length of the fields that follow.
+    kWireHeaderSize = 12,
+    kMaxWireDepth = 32,
+    // Inline buffers this big are appended to a chain rather than copied.
+    kMinSegmentSize = 256,
+    kScratchSize = 1024,
+};
+
+// How a buffer, chain, message or object field is written.
+enum {
+    kWireNull,
+    kWireInline,
+    kWireReference,
+};
+
+} // namespace
+
+/**
+ * Destination of writeTo(), either the room after the range of a buffer or
+ * scratch buffers appended to a chain. Each write is contiguous, so the
+ * header can be patched once the length is known.
+ */
+class Message::Writer {
+public:
+    explicit Writer(const shared_ptr<Buffer>& buffer)
+        : mChain(NULL),
+          mBuffer(buffer),
+          mBase(buffer->data() + buffer->size()),
+          mRoom(buffer->capacity() - buffer->offset() - buffer->size()),
+          mUsed(0),
+          mFlushed(0),
+          mWritten(0) {
+    }
+
+    explicit Writer(BufferChain* chain)
+        : mChain(chain),
+          mBase(NULL),
+          mRoom(0),
+          mUsed(0),
+          mFlushed(0),
+          mWritten(0) {
+    }
+
+    size_t written() const { return mWritten; }
+
+    // Returns where data went, NULL if it doesn't fit.
+    uint8_t* write(const void* data, const size_t size) {
+        if (size > mRoom - mUsed) {
+            if (mChain == NULL) {
+                return NULL;
+            }
+            flush();
+            mBuffer = make_shared<Buffer>(max<size_t>(kScratchSize, size));
+            mBase = mBuffer->base();
+            mRoom = mBuffer->capacity();
+            mUsed = mFlushed = 0;
+        }
+
+        uint8_t* dst = mBase + mUsed;
+        memcpy(dst, data, size);
+        mUsed += size;
+        mWritten += size;
+        return dst;
+    }
+
+    Result putBytes(const void* data, const size_t size) {
+        return size == 0 || write(data, size) != NULL ? Result::OK : Result::ER_NO_MEMORY;
+    }
+
+    template<typename T>
+    Result put(const T value) {
+        return putBytes(&value, sizeof(value));
+    }
+
+    Result putString(const string& str) {
+        if (str.size() > UINT32_MAX) {
+            return Result::ER_BAD_VALUE;
+        }
+        Result err = put<uint32_t>(str.size());
+        if (err != Result::OK) {
+            return err;
+        }
+        return putBytes(str.data(), str.size());
+    }
+
+    Result putBuffer(const shared_ptr<Buffer>& buffer, References* refs) {
+        if (buffer == NULL) {
+            return put<uint8_t>(kWireNull);
+        }
+        if (refs != NULL && buffer->size() >= refs->mMinBufferSize) {
+            Result err = put<uint8_t>(kWireReference);
+            if (err != Result::OK) {
+                return err;
+            }
+            refs->mBuffers.push_back(buffer);
+            return put<uint32_t>(refs->mBuffers.size() - 1);
+        }
+        if (buffer->size() > UINT32_MAX) {
+            return Result::ER_BAD_VALUE;
+        }
+
+        Result err = put<uint8_t>(kWireInline);
+        if (err == Result::OK) {
+            err = put<int32_t>(buffer->int32Data());
+        }
+        if (err == Result::OK) {
+            err = put<uint32_t>(buffer->size());
+        }
+        if (err != Result::OK) {
+            return err;
+        }
+        if (mChain != NULL && buffer->size() >= kMinSegmentSize) {
+            flush();
+            mChain->append(buffer->slice(buffer->offset(), buffer->size()));
+            mWritten += buffer->size();
+            return Result::OK;
+        }
+        return putBytes(buffer->data(), buffer->size());
+    }
+
+    // Hands what was written over to the chain, or the buffer's range.
+    void flush() {
+        if (mChain == NULL) {
+            mBuffer->setRange(mBuffer->offset(), mBuffer->size() + mUsed);
+            mRoom -= mUsed;
+            mBase += mUsed;
+            mUsed = 0;
+        } else if (mUsed > mFlushed) {
+            mChain->append(mBuffer->slice(mFlushed, mUsed - mFlushed));
+            mFlushed = mUsed;
+        }
+    }
+
+private:
+    BufferChain* mChain;
+    // The destination, or the scratch buffer being filled for mChain.
+    shared_ptr<Buffer> mBuffer;
+    uint8_t* mBase;
+    size_t mRoom;
+    size_t mUsed;
+    // Bytes of the scratch buffer already in mChain.
+    size_t mFlushed;
+    size_t mWritten;
+};
+
+/**
+ * Source of readFrom(), the range of a buffer or the segments of a chain.
+ * Buffers are sliced out of the source wherever they sit in one segment.
+ */
+class Message::Reader {
+public:
+    explicit Reader(const shared_ptr<Buffer>& buffer)
+        : mBuffer(&buffer),
+          mChain(NULL),
+          mIndex(0),
+          mOffset(0),
+          mRemaining(buffer->size()),
+          mConsumed(0) {
+    }
+
+    explicit Reader(const BufferChain& chain)
+        : mBuffer(NULL),
+          mChain(&chain),
+          mIndex(0),
+          mOffset(0),
+          mRemaining(chain.size()),
+          mConsumed(0) {
+    }
+
+    size_t remaining() const { return mRemaining; }
+
+    size_t consumed() const { return mConsumed; }
+
+    // Stops reading size bytes from here.
+    void limit(const size_t size) {
+        mRemaining = min(mRemaining, size);
+    }
+
+    bool read(void* dst, size_t size) {
+        if (size > mRemaining) {
+            return false;
+        }
+        uint8_t* out = static_cast<uint8_t*>(dst);
+        while (size > 0) {
+            size_t length = min(contiguous(), size);
+            memcpy(out, segment()->data() + mOffset, length);
+            advance(length);
+            out += length;
+            size -= length;
+        }
+        return true;
+    }
+
+    template<typename T>
+    bool get(T* value) {
+        return read(value, sizeof(*value));
+    }
+
+    bool getString(string* str) {
+        uint32_t size;
+        if (!get(&size) || size > mRemaining) {
+            return false;
+        }
+        if (contiguous() >= size) {
+            str->assign(reinterpret_cast<const char*>(segment()->data() + mOffset), size);
+            advance(size);
+            return true;
+        }
+        str->resize(size);
+        return read(&(*str)[0], size);
+    }
+
+    Result getBuffer(const References* refs, shared_ptr<Buffer>* buffer) {
+        uint8_t how;
+        if (!get(&how)) {
+            return Result::ER_BAD_VALUE;
+        }
+        switch (how) {
+            case kWireNull:
+                buffer->reset();
+                return Result::OK;
+            case kWireReference: {
+                uint32_t index;
+                if (!get(&index)) {
+                    return Result::ER_BAD_VALUE;
+                }
+                if (refs == NULL || index >= refs->mBuffers.size()) {
+                    return Result::ER_BAD_INDEX;
+                }
+                *buffer = refs->mBuffers[index];
+                return Result::OK;
+            }
+            case kWireInline:
+                break;
+            default:
+                return Result::ER_BAD_VALUE;
+        }
+
+        int32_t int32Data;
+        uint32_t size;
+        if (!get(&int32Data) || !get(&size) || size > mRemaining) {
+            return Result::ER_BAD_VALUE;
+        }
+        if (size > 0 && contiguous() >= size) {
+            const shared_ptr<Buffer>& source = segment();
+            *buffer = source->slice(source->offset() + mOffset, size);
+            advance(size);
+        } else {
+            *buffer = make_shared<Buffer>(size);
+            read((*buffer)->base(), size);
+            (*buffer)->setSize(size);
+        }
+        (*buffer)->setInt32Data(int32Data);
+        return Result::OK;
+    }
+
+private:
+    const shared_ptr<Buffer>* mBuffer;
+    const BufferChain* mChain;
+    size_t mIndex;
+    // Into the range of the current segment.
+    size_t mOffset;
+    size_t mRemaining;
+    size_t mConsumed;
+
+    const shared_ptr<Buffer>& segment() const {
+        return mChain != NULL ? mChain->segmentAt(mIndex) : *mBuffer;
+    }
+
+    // Bytes left in the current segment.
+    size_t contiguous() const {
+        return mRemaining == 0 ? 0 : min(mRemaining, segment()->size() - mOffset);
+    }
+
+    void advance(const size_t size) {
+        mOffset += size;
+        mRemaining -= size;
+        mConsumed += size;
+        // Chains hold no empty segments.
+        if (mChain != NULL && mOffset == segment()->size() && mIndex + 1 < mChain->countSegments()) {
+            mIndex++;
+            mOffset = 0;
+        }
+    }
+};
+
+Result Message::writeTo(BufferChain* chain, References* refs) const {
+    size_t size = chain->size();
+    Writer writer(chain);
+    Result err = writeTo(&writer, refs);
+    writer.flush();
+    if (err != Result::OK) {
+        chain->split(size);
+    }
+    return err;
+}
+
+Result Message::writeTo(const shared_ptr<Buffer>& buffer, References* refs) const {
+    Writer writer(buffer);
+    Result err = writeTo(&writer, refs);
+    if (err == Result::OK) {
+        writer.flush();
+    }
+    return err;
+}
+
+Result Message::writeTo(Writer* writer, References* refs) const {
+    size_t numBuffers = refs != NULL ? refs->mBuffers.size() : 0;
+    size_t numObjects = refs != NULL ? refs->mObjects.size() : 0;
+
+    const uint32_t header[] = { kWireMagic, kWireVersion, 0 };
+    uint8_t* headerAt = writer->write(header, sizeof(header));
+    Result err = headerAt != NULL ? writeFields(writer, refs, 0) : Result::ER_NO_MEMORY;
+
+    size_t length = writer->written() - kWireHeaderSize;
+    if (err == Result::OK && length > UINT32_MAX) {
+        err = Result::ER_BAD_VALUE;
+    }
+    if (err != Result::OK) {
+        if (refs != NULL) {
+            refs->mBuffers.resize(numBuffers);
+            refs->mObjects.resize(numObjects);
+        }
+        return err;
+    }
+
+    uint32_t length32 = length;
+    memcpy(headerAt + 2 * sizeof(uint32_t), &length32, sizeof(length32));
+    return Result::OK;
+}
+
+Result Message::writeFields(Writer* writer, References* refs, int32_t depth) const {
+    // Whatever readFields() would refuse, a cycle included.
+    if (depth > kMaxWireDepth) {
+        return Result::ER_BAD_VALUE;
+    }
+
+    Result err = writer->put<uint32_t>(mWhat);
+    if (err == Result::OK) {
+        err = writer->put<int32_t>(mTarget);
+    }
+    if (err == Result::OK) {
+        err = writer->put<uint8_t>(mPriority);
+    }
+    if (err == Result::OK) {
+        err = writer->put<uint32_t>(mItems.size());
+    }
+
+    for (auto itr = mItems.begin(); err == Result::OK && itr != mItems.end(); ++itr) {
+        const Item& item = *itr;
+        err = writer->put<uint8_t>(item.mType);
+        if (err == Result::OK) {
+            err = writer->putString(item.mKey.name());
+        }
+        if (err != Result::OK) {
+            break;
+        }
+
+        switch (item.mType) {
+            case kTypeBoolean:
+                err = writer->put<uint8_t>(item.value.boolValue);
+                break;
+            case kTypeInt32:
+                err = writer->put<int32_t>(item.value.int32Value);
+                break;
+            case kTypeInt64:
+                err = writer->put<int64_t>(item.value.int64Value);
+                break;
+            case kTypeSize:
+                err = writer->put<uint64_t>(item.value.sizeValue);
+                break;
+            case kTypeFloat:
+                err = writer->put<float>(item.value.floatValue);
+                break;
+            case kTypeDouble:
+                err = writer->put<double>(item.value.doubleValue);
+                break;
+            case kTypePointer:
+                err = writer->put<uint64_t>(reinterpret_cast<uintptr_t>(item.value.ptrValue));
+                break;
+            case kTypeString:
+                err = writer->putString(item.value.stringValue);
+                break;
+            case kTypeMessage:
+                if (item.value.messagePtr == NULL) {
+                    err = writer->put<uint8_t>(kWireNull);
+                    break;
+                }
+                err = writer->put<uint8_t>(kWireInline);
+                if (err == Result::OK) {
+                    err = item.value.messagePtr->writeFields(writer, refs, depth + 1);
+                }
+                break;
+            case kTypeBuffer:
+                err = writer->putBuffer(item.value.bufferPtr, refs);
+                break;
+            case kTypeBufferChain: {
+                const shared_ptr<BufferChain>& chain = item.value.chainPtr;
+                if (chain == NULL) {
+                    err = writer->put<uint8_t>(kWireNull);
+                    break;
+                }
+                err = writer->put<uint8_t>(kWireInline);
+                if (err == Result::OK) {
+                    err = writer->put<uint32_t>(chain->countSegments());
+                }
+                for (size_t i = 0; err == Result::OK && i < chain->countSegments(); i++) {
+                    err = writer->putBuffer(chain->segmentAt(i), refs);
+                }
+                break;
+            }
+            case kTypeObject:
+                if (item.value.objectPtr == NULL) {
+                    err = writer->put<uint8_t>(kWireNull);
+                    break;
+                }
+                if (refs == NULL) {
+                    err = Result::ER_BAD_TYPE;
+                    break;
+                }
+                err = writer->put<uint8_t>(kWireReference);
+                if (err == Result::OK) {
+                    refs->mObjects.push_back(item.value.objectPtr);
+                    err = writer->put<uint32_t>(refs->mObjects.size() - 1);
+                }
+                break;
+            default:
+                err = Result::ER_BAD_TYPE;
+                break;
+        }
+    }
+    return err;
+}
+
+// static
+Result Message::readFrom(const shared_ptr<Buffer>& buffer, shared_ptr<Message>* msg,
+                         const References* refs) {
+    Reader reader(buffer);
+    Result err = readFrom(&reader, refs, msg);
+    if (err == Result::OK) {
+        buffer->consume(reader.consumed());
+    }
+    return err;
+}
+
+// static
+Result Message::readFrom(BufferChain* chain, shared_ptr<Message>* msg, const References* refs) {
+    Reader reader(*chain);
+    Result err = readFrom(&reader, refs, msg);
+    if (err == Result::OK) {
+        *chain = *chain->split(reader.consumed());
+    }
+    return err;
+}
+
+// static
+Result Message::readFrom(Reader* reader, const References* refs, shared_ptr<Message>* msg) {
+    uint32_t header[3];
+    if (!reader->read(header, sizeof(header))) {
+        return Result::ER_NOT_ENOUGH_DATA;
+    }
+    if (header[0] != kWireMagic || header[1] != kWireVersion) {
+        return Result::ER_BAD_VALUE;
+    }
+    if (reader->remaining() < header[2]) {
+        return Result::ER_NOT_ENOUGH_DATA;
+    }
+
+    reader->limit(header[2]);
+    shared_ptr<Message> result;
+    Result err = readFields(reader, refs, 0, &result);
+    if (err == Result::OK && reader->remaining() != 0) {
+        err = Result::ER_BAD_VALUE;
+    }
+    if (err == Result::OK) {
+        *msg = result;
+    }
+    return err;
+}
+
+// static
+Result Message::readFields(Reader* reader, const References* refs, int32_t depth,
+                           shared_ptr<Message>* msg) {
+    uint32_t what;
+    int32_t target;
+    uint8_t priority;
+    uint32_t count;
+    if (depth > kMaxWireDepth
+            || !reader->get(&what) || !reader->get(&target) || !reader->get(&priority)
+            || !reader->get(&count) || priority >= Looper::kNumPriorities
+            // No field takes less than 5 bytes.
+            || count > reader->remaining() / 5) {
+        return Result::ER_BAD_VALUE;
+    }
+
+    shared_ptr<Message> result(obtain(target, what));
+    result->setPriority(static_cast<Looper::Priority>(priority));
+    result->mItems.reserve(count);
+
+    string name;
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t type;
+        if (!reader->get(&type) || !reader->getString(&name)) {
+            return Result::ER_BAD_VALUE;
+        }
+        MessageKey key(MessageKey::Named(name));
+
+        bool ok = true;
+        Result err = Result::OK;
+        switch (type) {
+            case kTypeBoolean: {
+                uint8_t value;
+                if ((ok = reader->get(&value))) {
+                    result->setBoolean(key, value != 0);
+                }
+                break;
+            }
+            case kTypeInt32: {
+                int32_t value;
+                if ((ok = reader->get(&value))) {
+                    result->setInt32(key, value);
+                }
+                break;
+            }
+            case kTypeInt64: {
+                int64_t value;
+                if ((ok = reader->get(&value))) {
+                    result->setInt64(key, value);
+                }
+                break;
+            }
+            case kTypeSize: {
+                uint64_t value;
+                if ((ok = reader->get(&value))) {
+                    result->setSize(key, value);
+                }
+                break;
+            }
+            case kTypeFloat: {
+                float value;
+                if ((ok = reader->get(&value))) {
+                    result->setFloat(key, value);
+                }
+                break;
+            }
+            case kTypeDouble: {
+                double value;
+                if ((ok = reader->get(&value))) {
+                    result->setDouble(key, value);
+                }
+                break;
+            }
+            case kTypePointer: {
+                uint64_t value;
+                if ((ok = reader->get(&value))) {
+                    result->setPointer(key, reinterpret_cast<void*>(static_cast<uintptr_t>(value)));
+                }
+                break;
+            }
+            case kTypeString: {
+                Item* item = result->allocateItem(key);
+                new (&item->value.stringValue) string();
+                item->mType = kTypeString;
+                ok = reader->getString(&item->value.stringValue);
+                break;
+            }
+            case kTypeMessage: {
+                uint8_t how;
+                shared_ptr<Message> nested;
+                if (!(ok = reader->get(&how))) {
+                    break;
+                }
+                if (how == kWireInline) {
+                    err = readFields(reader, refs, depth + 1, &nested);
+                } else if (how != kWireNull) {
+                    err = Result::ER_BAD_VALUE;
+                }
+                if (err == Result::OK) {
+                    result->setMessage(key, nested);
+                }
+                break;
+            }
+            case kTypeBuffer: {
+                shared_ptr<Buffer> buffer;
+                err = reader->getBuffer(refs, &buffer);
+                if (err == Result::OK) {
+                    result->setBuffer(key, buffer);
+                }
+                break;
+            }
+            case kTypeBufferChain: {
+                uint8_t how;
+                uint32_t segments = 0;
+                shared_ptr<BufferChain> chain;
+                if (!(ok = reader->get(&how))) {
+                    break;
+                }
+                if (how == kWireInline) {
+                    ok = reader->get(&segments);
+                    chain = make_shared<BufferChain>();
+                } else if (how != kWireNull) {
+                    err = Result::ER_BAD_VALUE;
+                }
+                for (uint32_t j = 0; ok && err == Result::OK && j < segments; j++) {
+                    shared_ptr<Buffer> segment;
+                    err = reader->getBuffer(refs, &segment);
+                    if (err == Result::OK && segment == NULL) {
+                        err = Result::ER_BAD_VALUE;
+                    } else if (err == Result::OK) {
+                        chain->append(segment);
+                    }
+                }
+                if (ok && err == Result::OK) {
+                    result->setBufferChain(key, chain);
+                }
+                break;
+            }
+            case kTypeObject: {
+                uint8_t how;
+                uint32_t index;
+                if (!(ok = reader->get(&how))) {
+                    break;
+                }
+                if (how == kWireNull) {
+                    result->setObject(key, shared_ptr<Parcelable>());
+                } else if (how != kWireReference) {
+                    err = Result::ER_BAD_VALUE;
+                } else if (!(ok = reader->get(&index))) {
+                    break;
+                } else if (refs == NULL || index >= refs->mObjects.size()) {
+                    err = Result::ER_BAD_INDEX;
+                } else {
+                    result->setObject(key, refs->mObjects[index]);
+                }
+                break;
+            }
+            default:
+                err = Result::ER_BAD_VALUE;
+                break;
+        }
+
+        if (!ok) {
+            return Result::ER_BAD_VALUE;
+        }
+        if (err != Result::OK) {
+            return err;
+        }
+    }
+
+    *msg = result;
+    return Result::OK;
+}
+
+Result Message::postMessage(const Looper::clock::duration& delay) {
+    // The clock's epoch is never ahead of a looper, so immediate posts don't
+    // have to read the clock at all.
+    Looper::clock::time_point when;
+    if (delay > Looper::clock::duration::zero()) {
+        when = Looper::GetNow() + delay;
+    }
+    return postAt(when);
 }
 
-Result Message::postMessage(const chrono::system_clock::duration& delay) {
-    return LooperRoster::getInstance()->postMessage(shared_from_this(), delay);
+Result Message::postTimerMessage(const Looper::clock::duration& delay, Looper::TimerHandle* handle) {
+    return LooperRoster::getInstance()->postTimer(shared_from_this(), Looper::GetNow() + delay, handle);
 }
 
 } // namespace baseutils
@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <baseutils/MessageKey.h>
+#include <baseutils/Singleton.h>
+
+using namespace std;
+
+namespace baseutils {
+
+namespace {
+
+const string kNoName;
+
+struct InternedName {
+    uint32_t mId;
+    const string* mName;
+};
+
+// Process wide table. Keys are usually static objects, so it must be
+// reachable during static initialization, hence the Meyers singleton.
+class KeyTable {
+public:
+    KeyTable() = default;
+
+    InternedName intern(const string& name) {
+        unique_lock<mutex> autoLock(mLock);
+
+        auto search = mIds.find(name);
+        if (search != mIds.end()) {
+            return InternedName{ search->second, &mNames[search->second - 1] };
+        }
+        return add_l(name);
+    }
+
+    bool find(const string& name, InternedName* interned) {
+        unique_lock<mutex> autoLock(mLock);
+
+        auto search = mIds.find(name);
+        if (search == mIds.end()) {
+            return false;
+        }
+        *interned = InternedName{ search->second, &mNames[search->second - 1] };
+        return true;
+    }
+
+private:
+    mutex mLock;
+    unordered_map<string, uint32_t> mIds;
+    // Ids are 1-based indices. A deque never moves its elements, so the
+    // name pointers handed out stay valid.
+    deque<string> mNames;
+
+    InternedName add_l(const string& name) {
+        mNames.push_back(name);
+        uint32_t id = (uint32_t)mNames.size();
+        mIds.insert(make_pair(name, id));
+        return InternedName{ id, &mNames.back() };
+    }
+};
+
+// Names are never un-interned, so each thread can remember what it has
+// already resolved and skip the table lock for the string based API.
+typedef unordered_map<string, InternedName> KeyCache;
+
+KeyCache& keyCache() {
+    static thread_local KeyCache cache;
+    return cache;
+}
+
+} // namespace
+
+MessageKey::MessageKey()
+    : mId(0),
+      mName(&kNoName) {
+}
+
+MessageKey::MessageKey(const char* name) {
+    intern(string(name));
+}
+
+MessageKey::MessageKey(const string& name) {
+    intern(name);
+}
+
+void MessageKey::intern(const string& name) {
+    KeyCache& cache = keyCache();
+
+    auto search = cache.find(name);
+    InternedName interned;
+    if (search != cache.end()) {
+        interned = search->second;
+    } else {
+        interned = Singleton<KeyTable>::GetInstance().intern(name);
+        cache.insert(make_pair(name, interned));
+    }
+
+    mId = interned.mId;
+    mName = interned.mName;
+}
+
+// static
+bool MessageKey::Find(const string& name, MessageKey* key) {
+    KeyCache& cache = keyCache();
+
+    InternedName interned;
+    auto search = cache.find(name);
+    if (search != cache.end()) {
+        interned = search->second;
+    } else if (Singleton<KeyTable>::GetInstance().find(name, &interned)) {
+        cache.insert(make_pair(name, interned));
+    } else {
+        return false;
+    }
+
+    key->mId = interned.mId;
+    key->mName = interned.mName;
+    return true;
+}
+
+// static
+MessageKey MessageKey::Named(const string& name) {
+    MessageKey key;
+    if (!Find(name, &key)) {
+        key.mOwnedName = make_shared<const string>(name);
+        key.mName = key.mOwnedName.get();
+    }
+    return key;
+}
+
+bool MessageKey::sameName(const MessageKey& other) const {
+    bool none = mId == 0 && mOwnedName == NULL;
+    bool otherNone = other.mId == 0 && other.mOwnedName == NULL;
+    if (none || otherNone) {
+        return none == otherNone;
+    }
+    return *mName == *other.mName;
+}
+
+} // namespace baseutils
@@ -0,0 +1,710 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+#include <new>
+
+#include <baseutils/Buffer.h>
+#include <baseutils/Handler.h>
+#include <baseutils/Message.h>
+#include <baseutils/RemoteLooper.h>
+
+using namespace std;
+
+namespace baseutils {
+
+namespace {
+
+enum {
+    kSegmentMagic = 0x524c5052,
+    kSegmentVersion = 2,
+    kCacheLine = 64,
+    // Records start and end on this boundary.
+    kRecordAlign = 16,
+    kMinRingSize = 4096,
+    // Marks a record that only fills the end of the ring.
+    kRecordPadding = 1,
+};
+
+// What the position word of every record boundary in a ring holds until a
+// record is committed there. No record is ever at this position.
+const uint64_t kNoPosition = UINT64_MAX;
+
+size_t alignUp(size_t size, size_t alignment) {
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+struct SegmentHeader {
+    uint32_t mMagic;
+    uint32_t mVersion;
+    uint64_t mRingSize;
+    uint64_t mBlockSize;
+    uint64_t mNumBlocks;
+    // Free blocks, a stack: a tag in the upper half against ABA, the
+    // index of the top block plus one in the lower half.
+    atomic<uint64_t> mFreeBlocks;
+};
+
+// One direction. Producers reserve space by moving mHead, and commit a
+// record by storing its position in it; the consumer moves mTail.
+struct RingHeader {
+    alignas(kCacheLine) atomic<uint64_t> mHead;
+    alignas(kCacheLine) atomic<uint64_t> mTail;
+    // Set while the consumer may be asleep, whoever clears it wakes it up.
+    alignas(kCacheLine) atomic<uint32_t> mConsumerIdle;
+};
+
+struct BlockState {
+    atomic<uint32_t> mRefs;
+    // Below it on the free stack, plus one.
+    atomic<uint32_t> mNext;
+};
+
+struct Record {
+    // Position of the record once it's committed, kNoPosition before. A
+    // record may start on any boundary, so the consumer resets them all
+    // when it drops a record, or the payload it leaves behind could hold a
+    // future position.
+    atomic<uint64_t> mPosition;
+    uint32_t mLength;
+    uint32_t mFlags;
+};
+
+// Follows the record header, then come the encoded message and a
+// BufferRef for each buffer it references.
+static_assert(sizeof(Record) % kRecordAlign == 0, "records must stay aligned");
+
+struct Frame {
+    Looper::handler_id mTarget;
+    uint32_t mNumBuffers;
+    uint64_t mMessageLength;
+};
+
+struct BufferRef {
+    uint32_t mBlock;
+    int32_t mInt32Data;
+    uint64_t mOffset;
+    uint64_t mSize;
+};
+
+// Of a Channel created with these sizes, which both sides agree on.
+struct Layout {
+    size_t mRingHeaders;
+    size_t mBlockStates;
+    size_t mRings;
+    size_t mBlocks;
+    size_t mSize;
+
+    Layout(size_t ringSize, size_t blockSize, size_t numBlocks) {
+        mRingHeaders = alignUp(sizeof(SegmentHeader), kCacheLine);
+        mBlockStates = mRingHeaders + 2 * sizeof(RingHeader);
+        mRings = alignUp(mBlockStates + numBlocks * sizeof(BlockState), kCacheLine);
+        mBlocks = alignUp(mRings + 2 * ringSize, 4096);
+        mSize = mBlocks + numBlocks * blockSize;
+    }
+};
+
+} // namespace
+
+/**
+ * The mapped segment. Outlives the RemoteLooper while buffers in its block
+ * pool are around.
+ */
+class RemoteLooper::Segment {
+public:
+    Segment(uint8_t* base, const Layout& layout)
+        : mBase(base),
+          mLayout(layout),
+          mHeader(reinterpret_cast<SegmentHeader*>(base)),
+          mRingSize(mHeader->mRingSize),
+          mBlockSize(mHeader->mBlockSize),
+          mNumBlocks(mHeader->mNumBlocks) {
+    }
+
+    ~Segment() {
+        munmap(mBase, mLayout.mSize);
+    }
+
+    size_t ringSize() const { return mRingSize; }
+
+    size_t blockSize() const { return mBlockSize; }
+
+    size_t numBlocks() const { return mNumBlocks; }
+
+    uint8_t* block(uint32_t index) { return mBase + mLayout.mBlocks + (size_t)index * mBlockSize; }
+
+    // The block holding [data, data + size), or -1.
+    int64_t blockOf(const uint8_t* data, size_t size) {
+        const uint8_t* blocks = mBase + mLayout.mBlocks;
+        if (data < blocks || data >= blocks + mNumBlocks * mBlockSize) {
+            return -1;
+        }
+        size_t index = (data - blocks) / mBlockSize;
+        return data + size <= block(index) + mBlockSize ? (int64_t)index : -1;
+    }
+
+    // Returns the index of a block with one reference, or -1.
+    int64_t allocateBlock() {
+        uint64_t top = mHeader->mFreeBlocks.load(memory_order_acquire);
+        while (true) {
+            uint32_t index = (uint32_t)top;
+            if (index == 0) {
+                return -1;
+            }
+            uint32_t next = blockState(index - 1).mNext.load(memory_order_relaxed);
+            uint64_t popped = ((top >> 32) + 1) << 32 | next;
+            if (mHeader->mFreeBlocks.compare_exchange_weak(top, popped, memory_order_acq_rel)) {
+                blockState(index - 1).mRefs.store(1, memory_order_relaxed);
+                return index - 1;
+            }
+        }
+    }
+
+    void acquireBlock(uint32_t index) {
+        blockState(index).mRefs.fetch_add(1, memory_order_relaxed);
+    }
+
+    void releaseBlock(uint32_t index) {
+        if (blockState(index).mRefs.fetch_sub(1, memory_order_acq_rel) != 1) {
+            return;
+        }
+        uint64_t top = mHeader->mFreeBlocks.load(memory_order_relaxed);
+        uint64_t pushed;
+        do {
+            blockState(index).mNext.store((uint32_t)top, memory_order_relaxed);
+            pushed = ((top >> 32) + 1) << 32 | (index + 1);
+        } while (!mHeader->mFreeBlocks.compare_exchange_weak(top, pushed, memory_order_release));
+    }
+
+    // Reserves a record of length bytes, a multiple of kRecordAlign, in
+    // ring, to be committed at position. Any number of threads may write
+    // at once.
+    Record* reserve(int ring, size_t length, uint64_t* position) {
+        RingHeader& header = ringHeader(ring);
+        uint64_t head = header.mHead.load(memory_order_relaxed);
+        size_t padding;
+        while (true) {
+            size_t offset = head & (mRingSize - 1);
+            padding = offset + length > mRingSize ? mRingSize - offset : 0;
+            if (head + padding + length - header.mTail.load(memory_order_acquire) > mRingSize) {
+                return NULL;
+            }
+            if (header.mHead.compare_exchange_weak(head, head + padding + length,
+                                                   memory_order_relaxed)) {
+                break;
+            }
+        }
+
+        if (padding > 0) {
+            Record* filler = recordAt(ring, head);
+            filler->mLength = padding;
+            filler->mFlags = kRecordPadding;
+            filler->mPosition.store(head, memory_order_release);
+            head += padding;
+        }
+        Record* record = recordAt(ring, head);
+        record->mLength = length;
+        record->mFlags = 0;
+        *position = head;
+        return record;
+    }
+
+    // Publishes record and returns whether the consumer needs waking.
+    bool commit(int ring, Record* record, uint64_t position) {
+        RingHeader& header = ringHeader(ring);
+        record->mPosition.store(position, memory_order_release);
+        // Pairs with the one in idle(): either the consumer sees the record,
+        // or we see it idle.
+        atomic_thread_fence(memory_order_seq_cst);
+        return header.mConsumerIdle.load(memory_order_relaxed) != 0
+                && header.mConsumerIdle.exchange(0) != 0;
+    }
+
+    // The next committed record of ring, NULL if none. Single consumer.
+    Record* front(int ring) {
+        uint64_t tail = ringHeader(ring).mTail.load(memory_order_relaxed);
+        Record* record = recordAt(ring, tail);
+        return record->mPosition.load(memory_order_acquire) == tail ? record : NULL;
+    }
+
+    // Whether the front record of ring may be length bytes long: no
+    // shorter than its header, aligned, and not past the end of the ring.
+    bool fits(int ring, size_t length) {
+        uint64_t tail = ringHeader(ring).mTail.load(memory_order_relaxed);
+        return length >= sizeof(Record) && length % kRecordAlign == 0
+                && (tail & (mRingSize - 1)) + length <= mRingSize;
+    }
+
+    // Drops the front record of ring, length bytes long, which fits().
+    void pop(int ring, size_t length) {
+        RingHeader& header = ringHeader(ring);
+        uint64_t tail = header.mTail.load(memory_order_relaxed);
+        for (size_t offset = 0; offset < length; offset += kRecordAlign) {
+            recordAt(ring, tail + offset)->mPosition.store(kNoPosition, memory_order_relaxed);
+        }
+        // Producers only write there once they see the new tail.
+        header.mTail.store(tail + length, memory_order_release);
+    }
+
+    // Marks the consumer idle, unless a record came in meanwhile.
+    bool idle(int ring) {
+        ringHeader(ring).mConsumerIdle.store(1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (front(ring) == NULL) {
+            return true;
+        }
+        ringHeader(ring).mConsumerIdle.store(0);
+        return false;
+    }
+
+private:
+    uint8_t* mBase;
+    Layout mLayout;
+    SegmentHeader* mHeader;
+    // Copied out of the header, the other side can't change them on us.
+    size_t mRingSize;
+    size_t mBlockSize;
+    size_t mNumBlocks;
+
+    RingHeader& ringHeader(int ring) {
+        return reinterpret_cast<RingHeader*>(mBase + mLayout.mRingHeaders)[ring];
+    }
+
+    BlockState& blockState(uint32_t index) {
+        return reinterpret_cast<BlockState*>(mBase + mLayout.mBlockStates)[index];
+    }
+
+    Record* recordAt(int ring, uint64_t position) {
+        return reinterpret_cast<Record*>(mBase + mLayout.mRings + ring * mRingSize
+                + (position & (mRingSize - 1)));
+    }
+};
+
+// Stands in for an imported handler, nothing is ever delivered to it.
+class RemoteLooper::Proxy : public Handler {
+protected:
+    virtual void onMessageReceived(const shared_ptr<Message>&) { }
+};
+
+// static
+Result RemoteLooper::CreateChannel(Channel* channel, size_t ringSize, size_t blockSize,
+                                   size_t numBlocks) {
+    size_t size = kMinRingSize;
+    while (size < ringSize) {
+        size <<= 1;
+    }
+    ringSize = size;
+    blockSize = alignUp(max<size_t>(blockSize, kMinSharedBufferSize), kCacheLine);
+    if (numBlocks >= UINT32_MAX) {
+        return Result::ER_BAD_VALUE;
+    }
+    Layout layout(ringSize, blockSize, numBlocks);
+
+    Channel created;
+    created.mMemFd = memfd_create("RemoteLooper", 0);
+    created.mEventFds[kSideA] = eventfd(0, EFD_NONBLOCK);
+    created.mEventFds[kSideB] = eventfd(0, EFD_NONBLOCK);
+    if (created.mMemFd < 0 || created.mEventFds[kSideA] < 0 || created.mEventFds[kSideB] < 0
+            || ftruncate(created.mMemFd, layout.mSize) != 0) {
+        CloseChannel(&created);
+        return Result::ER_NO_MEMORY;
+    }
+
+    void* base = mmap(NULL, layout.mSize, PROT_READ | PROT_WRITE, MAP_SHARED, created.mMemFd, 0);
+    if (base == MAP_FAILED) {
+        CloseChannel(&created);
+        return Result::ER_NO_MEMORY;
+    }
+
+    uint8_t* bytes = static_cast<uint8_t*>(base);
+    SegmentHeader* header = new (bytes) SegmentHeader();
+    header->mRingSize = ringSize;
+    header->mBlockSize = blockSize;
+    header->mNumBlocks = numBlocks;
+    new (bytes + layout.mRingHeaders) RingHeader[2]();
+    for (size_t offset = 0; offset < 2 * ringSize; offset += kRecordAlign) {
+        Record* record = new (bytes + layout.mRings + offset) Record();
+        record->mPosition.store(kNoPosition, memory_order_relaxed);
+    }
+    BlockState* blocks = new (bytes + layout.mBlockStates) BlockState[numBlocks]();
+    for (size_t i = 0; i < numBlocks; i++) {
+        blocks[i].mNext.store(i);
+    }
+    header->mFreeBlocks.store(numBlocks);
+    RingHeader* rings = reinterpret_cast<RingHeader*>(bytes + layout.mRingHeaders);
+    rings[kSideA].mConsumerIdle.store(1);
+    rings[kSideB].mConsumerIdle.store(1);
+    header->mVersion = kSegmentVersion;
+    header->mMagic = kSegmentMagic;
+    munmap(base, layout.mSize);
+
+    *channel = created;
+    return Result::OK;
+}
+
+// static
+void RemoteLooper::CloseChannel(Channel* channel) {
+    int* fds[] = { &channel->mMemFd, &channel->mEventFds[kSideA], &channel->mEventFds[kSideB] };
+    for (int* fd : fds) {
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+RemoteLooper::RemoteLooper()
+    : mSide(kSideA),
+      mEventFd(-1),
+      mPeerEventFd(-1),
+      mDropped(0),
+      mBroken(false) {
+}
+
+RemoteLooper::~RemoteLooper() {
+    stop();
+    if (mEventFd >= 0) {
+        close(mEventFd);
+    }
+    if (mPeerEventFd >= 0) {
+        close(mPeerEventFd);
+    }
+}
+
+Result RemoteLooper::attach(const Channel& channel, Side side) {
+    if (mSegment != NULL) {
+        return Result::ER_ALREADY_OPERATED;
+    }
+
+    struct stat st;
+    SegmentHeader header;
+    if (fstat(channel.mMemFd, &st) != 0 || (size_t)st.st_size < sizeof(header)
+            || pread(channel.mMemFd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+            || header.mMagic != kSegmentMagic || header.mVersion != kSegmentVersion
+            || header.mRingSize < kMinRingSize || (header.mRingSize & (header.mRingSize - 1)) != 0
+            || header.mBlockSize < kMinSharedBufferSize || header.mNumBlocks >= UINT32_MAX) {
+        return Result::ER_BAD_VALUE;
+    }
+    Layout layout(header.mRingSize, header.mBlockSize, header.mNumBlocks);
+    if ((size_t)st.st_size != layout.mSize) {
+        return Result::ER_BAD_VALUE;
+    }
+
+    void* base = mmap(NULL, layout.mSize, PROT_READ | PROT_WRITE, MAP_SHARED, channel.mMemFd, 0);
+    if (base == MAP_FAILED) {
+        return Result::ER_NO_MEMORY;
+    }
+    int eventFd = dup(channel.mEventFds[side]);
+    int peerEventFd = dup(channel.mEventFds[side == kSideA ? kSideB : kSideA]);
+    if (eventFd < 0 || peerEventFd < 0) {
+        munmap(base, layout.mSize);
+        if (eventFd >= 0) {
+            close(eventFd);
+        }
+        if (peerEventFd >= 0) {
+            close(peerEventFd);
+        }
+        return Result::ER_BAD_VALUE;
+    }
+
+    mSegment = make_shared<Segment>(static_cast<uint8_t*>(base), layout);
+    mSide = side;
+    mEventFd = eventFd;
+    mPeerEventFd = peerEventFd;
+    return Result::OK;
+}
+
+Result RemoteLooper::start(bool runOnCallingThread) {
+    if (mSegment == NULL) {
+        return Result::ER_NO_INIT;
+    }
+
+    Result err = addFd(mEventFd, kEventInput, [this](int, uint32_t) {
+        receive();
+        return true;
+    });
+    if (err != Result::OK) {
+        return err;
+    }
+    return Looper::start(runOnCallingThread);
+}
+
+Result RemoteLooper::stop() {
+    if (mEventFd >= 0) {
+        removeFd(mEventFd);
+    }
+    return Looper::stop();
+}
+
+Looper::handler_id RemoteLooper::importHandler(handler_id remoteId) {
+    handler_id id = registerHandler(make_shared<Proxy>());
+    if (id != 0) {
+        unique_lock<mutex> autoLock(mImportLock);
+        mImports[id] = remoteId;
+    }
+    return id;
+}
+
+shared_ptr<Buffer> RemoteLooper::allocateBuffer(size_t size) {
+    if (mSegment == NULL || size > mSegment->blockSize()) {
+        return NULL;
+    }
+    int64_t index = mSegment->allocateBlock();
+    if (index < 0) {
+        return NULL;
+    }
+    shared_ptr<Segment> segment(mSegment);
+    return Buffer::Wrap(segment->block(index), size, [segment, index](void*) {
+        segment->releaseBlock(index);
+    });
+}
+
+Result RemoteLooper::post(const shared_ptr<Message>& msg, const clock::time_point& when) {
+    // Refused up front, the reply id would name a slot of this process
+    // over there.
+    uint32_t replyId;
+    if (msg->senderAwaitsResponse(replyId)) {
+        return Result::ER_INVALID_OPERATION;
+    }
+
+    // Immediate posts skip the looper thread.
+    if (when == clock::time_point()) {
+        return send(msg);
+    }
+
+    return Looper::post(msg, when);
+}
+
+void RemoteLooper::dispatch(const shared_ptr<Message>& msg) {
+    if (send(msg) != Result::OK) {
+        mDropped.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+void RemoteLooper::dispatchBatch(const vector<shared_ptr<Message>>& msgs) {
+    for (const shared_ptr<Message>& msg : msgs) {
+        dispatch(msg);
+    }
+}
+
+namespace {
+
+// Encoded messages are staged here, then copied to the ring in one go.
+thread_local shared_ptr<Buffer> tSendBuffer;
+
+} // namespace
+
+Result RemoteLooper::send(const shared_ptr<Message>& msg) {
+    if (mSegment == NULL) {
+        return Result::ER_NO_INIT;
+    }
+    if (mBroken.load(memory_order_relaxed)) {
+        return Result::ER_DEAD_OBJECT;
+    }
+
+    handler_id target;
+    {
+        unique_lock<mutex> autoLock(mImportLock);
+        auto search = mImports.find(msg->target());
+        if (search == mImports.end()) {
+            return Result::ER_NAME_NOT_FOUND;
+        }
+        target = search->second;
+    }
+
+    uint32_t replyId;
+    if (msg->senderAwaitsResponse(replyId)) {
+        return Result::ER_INVALID_OPERATION;
+    }
+
+    Message::References refs;
+    refs.mMinBufferSize = mSegment->numBlocks() > 0 ? (size_t)kMinSharedBufferSize : SIZE_MAX;
+    vector<BufferRef> shared;
+    Result err;
+    while (true) {
+        if (tSendBuffer == NULL) {
+            tSendBuffer = make_shared<Buffer>(4096);
+        }
+        tSendBuffer->setRange(0, 0);
+        refs.mBuffers.clear();
+        err = msg->writeTo(tSendBuffer, &refs);
+        if (err == Result::ER_NO_MEMORY && tSendBuffer->capacity() < mSegment->ringSize()) {
+            tSendBuffer = make_shared<Buffer>(tSendBuffer->capacity() * 2);
+            continue;
+        }
+        if (err != Result::OK) {
+            return err;
+        }
+        if (!refs.mObjects.empty()) {
+            return Result::ER_BAD_TYPE;
+        }
+
+        // Moves the referenced buffers into the block pool, if there's room.
+        for (const shared_ptr<Buffer>& buffer : refs.mBuffers) {
+            BufferRef ref;
+            ref.mInt32Data = buffer->int32Data();
+            ref.mSize = buffer->size();
+            int64_t index = mSegment->blockOf(buffer->data(), buffer->size());
+            if (index >= 0) {
+                mSegment->acquireBlock(index);
+                ref.mOffset = buffer->data() - mSegment->block(index);
+            } else if (buffer->size() <= mSegment->blockSize()
+                    && (index = mSegment->allocateBlock()) >= 0) {
+                memcpy(mSegment->block(index), buffer->data(), buffer->size());
+                ref.mOffset = 0;
+            } else {
+                break;
+            }
+            ref.mBlock = index;
+            shared.push_back(ref);
+        }
+        if (shared.size() == refs.mBuffers.size()) {
+            break;
+        }
+
+        // Some didn't fit, send them all inline.
+        for (const BufferRef& ref : shared) {
+            mSegment->releaseBlock(ref.mBlock);
+        }
+        shared.clear();
+        refs.mMinBufferSize = SIZE_MAX;
+    }
+
+    size_t messageLength = tSendBuffer->size();
+    size_t length = alignUp(sizeof(Record) + sizeof(Frame) + messageLength
+            + shared.size() * sizeof(BufferRef), kRecordAlign);
+    int ring = mSide == kSideA ? kSideB : kSideA;
+    uint64_t position;
+    Record* record = length <= mSegment->ringSize() ? mSegment->reserve(ring, length, &position) : NULL;
+    if (record == NULL) {
+        for (const BufferRef& ref : shared) {
+            mSegment->releaseBlock(ref.mBlock);
+        }
+        // Bigger than the ring, it would never fit.
+        return length <= mSegment->ringSize() ? Result::ER_WOULD_BLOCK : Result::ER_NO_MEMORY;
+    }
+
+    Frame frame;
+    frame.mTarget = target;
+    frame.mNumBuffers = shared.size();
+    frame.mMessageLength = messageLength;
+    uint8_t* out = reinterpret_cast<uint8_t*>(record + 1);
+    memcpy(out, &frame, sizeof(frame));
+    out += sizeof(frame);
+    memcpy(out, tSendBuffer->data(), messageLength);
+    out += messageLength;
+    if (!shared.empty()) {
+        memcpy(out, shared.data(), shared.size() * sizeof(BufferRef));
+    }
+
+    if (mSegment->commit(ring, record, position)) {
+        uint64_t value = 1;
+        ssize_t written = write(mPeerEventFd, &value, sizeof(value));
+        (void)written;
+    }
+    return Result::OK;
+}
+
+void RemoteLooper::receive() {
+    uint64_t value;
+    ssize_t bytes = read(mEventFd, &value, sizeof(value));
+    (void)bytes;
+    if (mBroken.load(memory_order_relaxed)) {
+        return;
+    }
+
+    int ring = mSide;
+    size_t received = 0;
+    while (true) {
+        Record* record = mSegment->front(ring);
+        if (record == NULL) {
+            if (mSegment->idle(ring)) {
+                return;
+            }
+            continue;
+        }
+        if (received++ == kReceiveBatch) {
+            // Let the rest of the looper run, and come back for more.
+            value = 1;
+            bytes = write(mEventFd, &value, sizeof(value));
+            return;
+        }
+
+        // Read once, the other side could change it under us. A bad length
+        // loses where the next record starts, so nothing after it can be
+        // trusted either.
+        size_t recordLength = record->mLength;
+        if (!mSegment->fits(ring, recordLength)) {
+            mBroken.store(true);
+            return;
+        }
+
+        if (record->mFlags & kRecordPadding) {
+            mSegment->pop(ring, recordLength);
+            continue;
+        }
+
+        // Copied out, so the ring can be reused right away. Large buffers
+        // stay in the block pool.
+        Frame frame;
+        const uint8_t* in = reinterpret_cast<const uint8_t*>(record + 1);
+        size_t length = recordLength - sizeof(Record);
+        memcpy(&frame, in, min(sizeof(frame), length));
+        bool valid = length >= sizeof(frame)
+                && frame.mMessageLength <= length - sizeof(frame)
+                && frame.mNumBuffers <= (length - sizeof(frame) - frame.mMessageLength)
+                        / sizeof(BufferRef);
+        shared_ptr<Buffer> encoded;
+        Message::References refs;
+        if (valid) {
+            encoded = make_shared<Buffer>(in + sizeof(frame), frame.mMessageLength);
+            const uint8_t* refsAt = in + sizeof(frame) + frame.mMessageLength;
+            shared_ptr<Segment> segment(mSegment);
+            for (uint32_t i = 0; i < frame.mNumBuffers; i++) {
+                BufferRef ref;
+                memcpy(&ref, refsAt + i * sizeof(ref), sizeof(ref));
+                if (ref.mBlock >= segment->numBlocks() || ref.mOffset > segment->blockSize()
+                        || ref.mSize > segment->blockSize() - ref.mOffset) {
+                    // The block can't be told apart, it leaks.
+                    valid = false;
+                    continue;
+                }
+                uint32_t index = ref.mBlock;
+                auto buffer(Buffer::Wrap(segment->block(index) + ref.mOffset, ref.mSize,
+                        [segment, index](void*) {
+                    segment->releaseBlock(index);
+                }));
+                buffer->setInt32Data(ref.mInt32Data);
+                refs.mBuffers.push_back(buffer);
+            }
+        }
+        mSegment->pop(ring, recordLength);
+
+        shared_ptr<Message> msg;
+        if (valid && Message::readFrom(encoded, &msg, &refs) == Result::OK) {
+            msg->setTarget(frame.mTarget);
+            msg->post();
+        }
+    }
+}
+
+} // namespace baseutils
@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <algorithm>
+#include <cassert>
+
+#include <baseutils/Message.h>
+#include <baseutils/TimerWheel.h>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace baseutils {
+
+TimerWheel::TimerWheel(const clock::duration& tick)
+    : mTick(tick),
+      mCurrent(0),
+      mSize(0) {
+    assert(tick > clock::duration::zero());
+
+    for (size_t i = 0; i < kNumLists; i++) {
+        mHeads[i] = kNil;
+        mTails[i] = kNil;
+    }
+    for (size_t i = 0; i < kNumSlots / 64; i++) {
+        mLevel0Bits[i] = 0;
+    }
+}
+
+bool TimerWheel::setTick(const clock::duration& tick) {
+    if (mSize > 0 || tick <= clock::duration::zero()) {
+        return false;
+    }
+    mTick = tick;
+    mCurrent = 0;
+    return true;
+}
+
+TimerWheel::timer_id TimerWheel::add(const clock::time_point& when, const clock::time_point& now,
+                                     const shared_ptr<Message>& msg) {
+    uint32_t index;
+    if (mFreeNodes.empty()) {
+        index = (uint32_t)mNodes.size();
+        mNodes.push_back(Node());
+        mNodes.back().mGeneration = 1;
+    } else {
+        index = mFreeNodes.back();
+        mFreeNodes.pop_back();
+    }
+
+    if (mSize == 0) {
+        // Nothing pending, so the ticks the wheel slept through don't matter.
+        uint64_t current = tickOf(now, false);
+        if (current > mCurrent) {
+            mCurrent = current;
+        }
+    }
+
+    Node& node = mNodes[index];
+    node.mMessage = msg;
+    node.mExpiry = max(tickOf(when, true), mCurrent);
+    link(index);
+    mSize++;
+
+    return ((uint64_t)node.mGeneration << 32) | index;
+}
+
+bool TimerWheel::remove(timer_id id) {
+    uint32_t index = (uint32_t)(id & 0xffffffff);
+    if (index >= mNodes.size()
+            || mNodes[index].mGeneration != (uint32_t)(id >> 32)
+            || mNodes[index].mList == kNil) {
+        return false;
+    }
+
+    unlink(index);
+    release(index);
+    return true;
+}
+
+size_t TimerWheel::removeMessages(int32_t target, uint32_t what) {
+    size_t removed = 0;
+    for (uint32_t index = 0; index < mNodes.size(); index++) {
+        Node& node = mNodes[index];
+        if (node.mList != kNil && node.mMessage->target() == target
+                && node.mMessage->what() == what) {
+            unlink(index);
+            release(index);
+            removed++;
+        }
+    }
+    return removed;
+}
+
+void TimerWheel::advance(const clock::time_point& now, deque<shared_ptr<Message>>* expired) {
+    uint64_t target = tickOf(now, false);
+
+    while (mCurrent <= target) {
+        if (mSize == 0) {
+            mCurrent = target + 1;
+            return;
+        }
+
+        // Crossing a slot boundary of a level pulls that level's slot down,
+        // higher levels first so their timers can fall through.
+        if ((mCurrent & ((1ULL << (kNumLevels * kSlotBits)) - 1)) == 0) {
+            cascade(kOverflow);
+        }
+        for (int level = kNumLevels - 1; level > 0; level--) {
+            if ((mCurrent & ((1ULL << (level * kSlotBits)) - 1)) == 0) {
+                cascade(level * kNumSlots + ((mCurrent >> (level * kSlotBits)) & (kNumSlots - 1)));
+            }
+        }
+
+        uint32_t slot = mCurrent & (kNumSlots - 1);
+        while (mHeads[slot] != kNil) {
+            uint32_t index = mHeads[slot];
+            unlink(index);
+            expired->push_back(move(mNodes[index].mMessage));
+            release(index);
+        }
+
+        // Skip straight to the next busy slot or level boundary, but no
+        // further than now, or add() would push new timers out to it.
+        uint64_t next = (mCurrent | (kNumSlots - 1)) + 1;
+        for (uint32_t s = slot + 1; s < kNumSlots; s++) {
+            if (mLevel0Bits[s / 64] & (1ULL << (s % 64))) {
+                next = (mCurrent & ~(uint64_t)(kNumSlots - 1)) + s;
+                break;
+            }
+        }
+        mCurrent = min(next, target + 1);
+    }
+}
+
+TimerWheel::clock::time_point TimerWheel::nextDeadline() const {
+    if (mSize == 0) {
+        return clock::time_point::max();
+    }
+
+    // advance() may stop on a boundary it hasn't cascaded yet, whose timers
+    // are still up in the higher levels.
+    if ((mCurrent & ((1ULL << (kNumLevels * kSlotBits)) - 1)) == 0 && mHeads[kOverflow] != kNil) {
+        return clock::time_point(mTick * mCurrent);
+    }
+    for (int level = kNumLevels - 1; level > 0; level--) {
+        if ((mCurrent & ((1ULL << (level * kSlotBits)) - 1)) == 0
+                && mHeads[level * kNumSlots + ((mCurrent >> (level * kSlotBits)) & (kNumSlots - 1))] != kNil) {
+            return clock::time_point(mTick * mCurrent);
+        }
+    }
+
+    uint64_t next = (mCurrent | (kNumSlots - 1)) + 1;
+    for (uint32_t s = mCurrent & (kNumSlots - 1); s < kNumSlots; s++) {
+        if (mLevel0Bits[s / 64] & (1ULL << (s % 64))) {
+            next = (mCurrent & ~(uint64_t)(kNumSlots - 1)) + s;
+            break;
+        }
+    }
+    return clock::time_point(mTick * next);
+}
+
+uint64_t TimerWheel::tickOf(const clock::time_point& when, bool roundUp) const {
+    clock::rep ticks = when.time_since_epoch().count();
+    if (ticks <= 0) {
+        return 0;
+    }
+    clock::rep tick = mTick.count();
+    return (uint64_t)(roundUp ? (ticks + tick - 1) / tick : ticks / tick);
+}
+
+void TimerWheel::link(uint32_t index) {
+    Node& node = mNodes[index];
+
+    // The lowest level whose slots span both now and the expiry.
+    uint32_t list = kOverflow;
+    for (uint32_t level = 0; level < kNumLevels; level++) {
+        uint32_t shift = (level + 1) * kSlotBits;
+        if ((node.mExpiry >> shift) == (mCurrent >> shift)) {
+            list = level * kNumSlots + ((node.mExpiry >> (level * kSlotBits)) & (kNumSlots - 1));
+            break;
+        }
+    }
+
+    node.mList = list;
+    node.mNext = kNil;
+    node.mPrev = mTails[list];
+    if (mTails[list] != kNil) {
+        mNodes[mTails[list]].mNext = index;
+    } else {
+        mHeads[list] = index;
+    }
+    mTails[list] = index;
+
+    if (list < kNumSlots) {
+        mLevel0Bits[list / 64] |= 1ULL << (list % 64);
+    }
+}
+
+void TimerWheel::unlink(uint32_t index) {
+    Node& node = mNodes[index];
+    uint32_t list = node.mList;
+
+    if (node.mPrev != kNil) {
+        mNodes[node.mPrev].mNext = node.mNext;
+    } else {
+        mHeads[list] = node.mNext;
+    }
+    if (node.mNext != kNil) {
+        mNodes[node.mNext].mPrev = node.mPrev;
+    } else {
+        mTails[list] = node.mPrev;
+    }
+
+    if (list < kNumSlots && mHeads[list] == kNil) {
+        mLevel0Bits[list / 64] &= ~(1ULL << (list % 64));
+    }
+    node.mList = kNil;
+}
+
+void TimerWheel::release(uint32_t index) {
+    Node& node = mNodes[index];
+    node.mMessage.reset();
+    node.mGeneration++;
+    mFreeNodes.push_back(index);
+    mSize--;
+}
+
+void TimerWheel::cascade(uint32_t list) {
+    uint32_t index = mHeads[list];
+    mHeads[list] = kNil;
+    mTails[list] = kNil;
+
+    while (index != kNil) {
+        uint32_t next = mNodes[index].mNext;
+        link(index);
+        index = next;
+    }
+}
+
+} // namespace baseutils
@@ -0,0 +1,409 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <unistd.h>
+#include <cctype>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+#include <baseutils/Looper.h>
+#include <baseutils/Message.h>
+#include <baseutils/Singleton.h>
+#include <baseutils/Tracer.h>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace baseutils {
+
+atomic<bool> Tracer::sEnabled(false);
+
+namespace {
+
+enum Phase : uint8_t {
+    kPhasePost,
+    kPhaseDequeue,
+    kPhaseBegin,
+    kPhaseJoin,
+    kPhaseEnd,
+};
+
+struct Event {
+    int64_t mTimeNs;
+    uint64_t mFlow;
+    int32_t mTarget;
+    uint32_t mWhat;
+    Phase mPhase;
+};
+
+/**
+ * Ring of events written by one thread and read by dump() from any other.
+ * Each slot is a seqlock: mSeq is odd while the slot is written, and
+ * 2 * (index + 1) once event number index is in it, so a reader can tell
+ * a torn or overwritten slot and skip it.
+ */
+class ThreadBuffer {
+public:
+    ThreadBuffer(size_t capacity, uint32_t tid)
+        : mRetired(false),
+          mSlots(new Slot[capacity]),
+          mCapacity(capacity),
+          mNext(0),
+          mFirst(0),
+          mTid(tid) {
+    }
+
+    uint32_t tid() const { return mTid; }
+
+    void append(const Event& event) {
+        uint64_t index = mNext.load(memory_order_relaxed);
+        Slot& slot = mSlots[index % mCapacity];
+
+        slot.mSeq.store(2 * index + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        slot.mTimeNs.store(event.mTimeNs, memory_order_relaxed);
+        slot.mFlow.store(event.mFlow, memory_order_relaxed);
+        slot.mTarget.store(event.mTarget, memory_order_relaxed);
+        slot.mWhat.store(event.mWhat, memory_order_relaxed);
+        slot.mPhase.store(event.mPhase, memory_order_relaxed);
+        slot.mSeq.store(2 * index + 2, memory_order_release);
+
+        mNext.store(index + 1, memory_order_release);
+    }
+
+    // Appends the events still intact, oldest first.
+    void read(vector<Event>* events) const {
+        uint64_t end = mNext.load(memory_order_acquire);
+        uint64_t begin = max(mFirst.load(memory_order_relaxed), end > mCapacity ? end - mCapacity : 0);
+
+        for (uint64_t index = begin; index < end; index++) {
+            const Slot& slot = mSlots[index % mCapacity];
+            uint64_t seq = slot.mSeq.load(memory_order_acquire);
+            if (seq != 2 * index + 2) {
+                continue;
+            }
+
+            Event event;
+            event.mTimeNs = slot.mTimeNs.load(memory_order_relaxed);
+            event.mFlow = slot.mFlow.load(memory_order_relaxed);
+            event.mTarget = slot.mTarget.load(memory_order_relaxed);
+            event.mWhat = slot.mWhat.load(memory_order_relaxed);
+            event.mPhase = slot.mPhase.load(memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+            if (slot.mSeq.load(memory_order_relaxed) == seq) {
+                events->push_back(event);
+            }
+        }
+    }
+
+    // Hides what was written so far from read().
+    void clear() {
+        mFirst.store(mNext.load(memory_order_acquire), memory_order_relaxed);
+    }
+
+    // Guarded by the registry lock.
+    string mName;
+
+    // Set once the thread is gone, the buffer goes with the next clear().
+    atomic<bool> mRetired;
+
+private:
+    struct Slot {
+        atomic<uint64_t> mSeq;
+        atomic<int64_t> mTimeNs;
+        atomic<uint64_t> mFlow;
+        atomic<int32_t> mTarget;
+        atomic<uint32_t> mWhat;
+        atomic<Phase> mPhase;
+
+        Slot() : mSeq(0), mTimeNs(0), mFlow(0), mTarget(0), mWhat(0), mPhase(kPhasePost) {}
+    };
+
+    unique_ptr<Slot[]> mSlots;
+    const uint64_t mCapacity;
+    atomic<uint64_t> mNext;
+    atomic<uint64_t> mFirst;
+    const uint32_t mTid;
+};
+
+class TraceRegistry {
+public:
+    TraceRegistry() : mCapacity(16384), mNextTid(1), mNextFlow(1) {}
+
+    shared_ptr<ThreadBuffer> create(const string& name) {
+        unique_lock<mutex> autoLock(mLock);
+        auto buffer(make_shared<ThreadBuffer>(mCapacity, mNextTid++));
+        buffer->mName = name;
+        mBuffers.push_back(buffer);
+        return buffer;
+    }
+
+    void setCapacity(size_t capacity) {
+        unique_lock<mutex> autoLock(mLock);
+        mCapacity = max<size_t>(capacity, 1);
+    }
+
+    void setName(ThreadBuffer* buffer, const string& name) {
+        unique_lock<mutex> autoLock(mLock);
+        buffer->mName = name;
+    }
+
+    uint64_t nextFlow() {
+        return mNextFlow.fetch_add(1, memory_order_relaxed);
+    }
+
+    void clear() {
+        unique_lock<mutex> autoLock(mLock);
+        auto itr = mBuffers.begin();
+        while (itr != mBuffers.end()) {
+            if ((*itr)->mRetired.load()) {
+                itr = mBuffers.erase(itr);
+            } else {
+                (*itr)->clear();
+                ++itr;
+            }
+        }
+    }
+
+    void dump(string* json);
+
+private:
+    mutex mLock;
+    vector<shared_ptr<ThreadBuffer>> mBuffers;
+    size_t mCapacity;
+    uint32_t mNextTid;
+    atomic<uint64_t> mNextFlow;
+};
+
+// Owns the calling thread's buffer, created by its first event.
+class ThreadBufferHolder {
+public:
+    ~ThreadBufferHolder() {
+        if (mBuffer != NULL) {
+            mBuffer->mRetired.store(true);
+        }
+    }
+
+    shared_ptr<ThreadBuffer> mBuffer;
+    string mName;
+};
+
+thread_local ThreadBufferHolder tHolder;
+
+void record(Phase phase, uint64_t flow, int32_t target, uint32_t what) {
+    ThreadBufferHolder& holder = tHolder;
+    if (holder.mBuffer == NULL) {
+        holder.mBuffer = Singleton<TraceRegistry>::GetInstance().create(holder.mName);
+    }
+
+    Event event;
+    event.mTimeNs = duration_cast<nanoseconds>(Looper::GetNow().time_since_epoch()).count();
+    event.mFlow = flow;
+    event.mTarget = target;
+    event.mWhat = what;
+    event.mPhase = phase;
+    holder.mBuffer->append(event);
+}
+
+void appendEscaped(const string& str, string* json) {
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            json->push_back('\\');
+            json->push_back(c);
+        } else if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            json->append(escaped);
+        } else {
+            json->push_back(c);
+        }
+    }
+}
+
+string whatName(uint32_t what) {
+    char name[16];
+    if (isprint(what & 0xff) && isprint((what >> 8) & 0xff)
+            && isprint((what >> 16) & 0xff) && isprint((what >> 24) & 0xff)) {
+        snprintf(name, sizeof(name), "'%c%c%c%c'",
+                 (char)(what >> 24), (char)((what >> 16) & 0xff),
+                 (char)((what >> 8) & 0xff), (char)(what & 0xff));
+    } else {
+        snprintf(name, sizeof(name), "0x%08x", what);
+    }
+
+    string escaped;
+    appendEscaped(name, &escaped);
+    return escaped;
+}
+
+void TraceRegistry::dump(string* json) {
+    vector<pair<shared_ptr<ThreadBuffer>, string>> buffers;
+    {
+        unique_lock<mutex> autoLock(mLock);
+        for (auto& buffer : mBuffers) {
+            buffers.push_back(make_pair(buffer, buffer->mName));
+        }
+    }
+
+    int pid = getpid();
+    char line[256];
+    bool first = true;
+    auto append = [&](const string& entry) {
+        json->append(first ? "\n" : ",\n");
+        json->append(entry);
+        first = false;
+    };
+
+    json->assign("{\"traceEvents\":[");
+    vector<Event> events;
+    for (auto& entry : buffers) {
+        uint32_t tid = entry.first->tid();
+        if (!entry.second.empty()) {
+            string name;
+            appendEscaped(entry.second, &name);
+            snprintf(line, sizeof(line),
+                     "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"",
+                     pid, tid);
+            append(line + name + "\"}}");
+        }
+
+        events.clear();
+        entry.first->read(&events);
+
+        // Handler calls cut off by the ring have no begin to end.
+        int32_t depth = 0;
+        for (const Event& event : events) {
+            double ts = event.mTimeNs / 1000.0;
+            string what = whatName(event.mWhat);
+
+            switch (event.mPhase) {
+                case kPhasePost:
+                case kPhaseDequeue:
+                    snprintf(line, sizeof(line),
+                             "{\"name\":\"%s\",\"cat\":\"message\",\"ph\":\"X\",\"dur\":0,\"ts\":%.3f,"
+                             "\"pid\":%d,\"tid\":%u,\"args\":{\"target\":%d,\"what\":\"%s\"}}",
+                             event.mPhase == kPhasePost ? "post" : "dequeue",
+                             ts, pid, tid, event.mTarget, what.c_str());
+                    append(line);
+                    break;
+                case kPhaseBegin:
+                    snprintf(line, sizeof(line),
+                             "{\"name\":\"%s\",\"cat\":\"handler\",\"ph\":\"B\",\"ts\":%.3f,"
+                             "\"pid\":%d,\"tid\":%u,\"args\":{\"target\":%d}}",
+                             what.c_str(), ts, pid, tid, event.mTarget);
+                    append(line);
+                    depth++;
+                    break;
+                case kPhaseJoin:
+                    break;
+                case kPhaseEnd:
+                    if (depth == 0) {
+                        continue;
+                    }
+                    snprintf(line, sizeof(line),
+                             "{\"ph\":\"E\",\"ts\":%.3f,\"pid\":%d,\"tid\":%u}", ts, pid, tid);
+                    append(line);
+                    depth--;
+                    continue;
+            }
+
+            // Messages posted while tracing was off have no flow.
+            if (event.mFlow == 0 || (event.mPhase == kPhaseJoin && depth == 0)) {
+                continue;
+            }
+            static const char* const kFlowPhases[] = { "s", "t", "f", "f" };
+            snprintf(line, sizeof(line),
+                     "{\"name\":\"message\",\"cat\":\"message\",\"ph\":\"%s\",%s\"id\":%" PRIu64 ","
+                     "\"ts\":%.3f,\"pid\":%d,\"tid\":%u}",
+                     kFlowPhases[event.mPhase], event.mPhase >= kPhaseBegin ? "\"bp\":\"e\"," : "",
+                     event.mFlow, ts, pid, tid);
+            append(line);
+        }
+    }
+    json->append("\n]}\n");
+}
+
+} // namespace
+
+void Tracer::setEnabled(bool enable) {
+    sEnabled.store(enable);
+}
+
+void Tracer::setBufferCapacity(size_t events) {
+    Singleton<TraceRegistry>::GetInstance().setCapacity(events);
+}
+
+void Tracer::setThreadName(const string& name) {
+    ThreadBufferHolder& holder = tHolder;
+    holder.mName = name;
+    if (holder.mBuffer != NULL) {
+        Singleton<TraceRegistry>::GetInstance().setName(holder.mBuffer.get(), name);
+    }
+}
+
+void Tracer::dump(string* json) {
+    Singleton<TraceRegistry>::GetInstance().dump(json);
+}
+
+Result Tracer::dump(int fd) {
+    string json;
+    dump(&json);
+
+    size_t written = 0;
+    while (written < json.size()) {
+        ssize_t n = write(fd, json.data() + written, json.size() - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return Result::ER_IO;
+        }
+        written += n;
+    }
+    return Result::OK;
+}
+
+void Tracer::clear() {
+    Singleton<TraceRegistry>::GetInstance().clear();
+}
+
+void Tracer::tracePost(Message& msg) {
+    uint64_t flow = Singleton<TraceRegistry>::GetInstance().nextFlow();
+    msg.mTraceFlow.store(flow, memory_order_relaxed);
+    record(kPhasePost, flow, msg.target(), msg.what());
+}
+
+void Tracer::traceDequeue(const Message& msg) {
+    record(kPhaseDequeue, msg.mTraceFlow.load(memory_order_relaxed), msg.target(), msg.what());
+}
+
+void Tracer::traceHandlerBegin(const Message& msg) {
+    record(kPhaseBegin, msg.mTraceFlow.load(memory_order_relaxed), msg.target(), msg.what());
+}
+
+void Tracer::traceHandlerJoin(const Message& msg) {
+    record(kPhaseJoin, msg.mTraceFlow.load(memory_order_relaxed), msg.target(), msg.what());
+}
+
+void Tracer::traceHandlerEnd() {
+    record(kPhaseEnd, 0, 0, 0);
+}
+
+} // namespace baseutils
@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <algorithm>
+
+#include <baseutils/Message.h>
+#include <baseutils/Watchdog.h>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace baseutils {
+
+static const MessageKey kKeyGeneration("generation");
+
+Watchdog::Watchdog(const Looper::clock::duration& handlerBudget,
+                   const Looper::clock::duration& queueAgeLimit,
+                   const ReportCallback& callback)
+    : mHandlerBudget(handlerBudget),
+      mQueueAgeLimit(queueAgeLimit),
+      mCallback(callback),
+      mInterval(Looper::clock::duration::zero()),
+      mGeneration(0) {
+}
+
+Watchdog::~Watchdog() {
+    for (const Watched& watched : mWatched) {
+        shared_ptr<Looper> looper = watched.mLooper.lock();
+        if (looper != NULL) {
+            untrack(looper);
+        }
+    }
+}
+
+Result Watchdog::watch(const shared_ptr<Looper>& looper) {
+    if (looper == NULL) {
+        return Result::ER_BAD_VALUE;
+    }
+
+    unique_lock<mutex> autoLock(mLock);
+    for (const Watched& watched : mWatched) {
+        if (watched.mLooper.lock() == looper) {
+            return Result::ER_ALREADY_EXISTS;
+        }
+    }
+
+    looper->setDispatchTracking(true);
+    if (mQueueAgeLimit > Looper::clock::duration::zero()) {
+        looper->setLatencyTracking(true);
+    }
+
+    Watched watched;
+    watched.mLooper = looper;
+    watched.mStale = false;
+    mWatched.push_back(watched);
+    return Result::OK;
+}
+
+void Watchdog::unwatch(const shared_ptr<Looper>& looper) {
+    if (looper == NULL) {
+        return;
+    }
+
+    unique_lock<mutex> autoLock(mLock);
+    auto itr = remove_if(mWatched.begin(), mWatched.end(), [&looper](const Watched& watched) {
+        return watched.mLooper.lock() == looper;
+    });
+    if (itr == mWatched.end()) {
+        // Not ours, leave its tracking to whoever turned it on.
+        return;
+    }
+    mWatched.erase(itr, mWatched.end());
+    untrack(looper);
+}
+
+void Watchdog::untrack(const shared_ptr<Looper>& looper) {
+    looper->setDispatchTracking(false);
+    if (mQueueAgeLimit > Looper::clock::duration::zero()) {
+        looper->setLatencyTracking(false);
+    }
+}
+
+void Watchdog::check() {
+    vector<Report> reports;
+    vector<Looper::ActiveDispatch> dispatches;
+    {
+        unique_lock<mutex> autoLock(mLock);
+
+        auto itr = mWatched.begin();
+        while (itr != mWatched.end()) {
+            shared_ptr<Looper> looper = itr->mLooper.lock();
+            if (looper == NULL) {
+                itr = mWatched.erase(itr);
+                continue;
+            }
+
+            Report report;
+            report.mTarget = 0;
+            report.mWhat = 0;
+
+            if (mHandlerBudget > Looper::clock::duration::zero()) {
+                dispatches.clear();
+                looper->getActiveDispatches(&dispatches);
+
+                Looper::clock::time_point now = Looper::GetNow();
+                vector<Looper::clock::time_point> reported;
+                for (const Looper::ActiveDispatch& dispatch : dispatches) {
+                    if (now - dispatch.mStartedAt < mHandlerBudget) {
+                        continue;
+                    }
+                    reported.push_back(dispatch.mStartedAt);
+                    if (find(itr->mReportedDispatches.begin(), itr->mReportedDispatches.end(),
+                             dispatch.mStartedAt) != itr->mReportedDispatches.end()) {
+                        continue;
+                    }
+
+                    report.mKind = Report::kSlowHandler;
+                    report.mLooperName = looper->name();
+                    report.mTarget = dispatch.mTarget;
+                    report.mWhat = dispatch.mWhat;
+                    report.mElapsed = now - dispatch.mStartedAt;
+                    report.mQueueDepth = looper->queueDepth();
+                    reports.push_back(report);
+                }
+                itr->mReportedDispatches.swap(reported);
+            }
+
+            if (mQueueAgeLimit > Looper::clock::duration::zero()) {
+                Looper::clock::duration age = looper->oldestPendingAge();
+                if (age < mQueueAgeLimit) {
+                    itr->mStale = false;
+                } else if (!itr->mStale) {
+                    itr->mStale = true;
+
+                    report.mKind = Report::kStaleQueue;
+                    report.mLooperName = looper->name();
+                    report.mTarget = 0;
+                    report.mWhat = 0;
+                    report.mElapsed = age;
+                    report.mQueueDepth = looper->queueDepth();
+                    reports.push_back(report);
+                }
+            }
+            ++itr;
+        }
+    }
+
+    if (mCallback) {
+        for (const Report& report : reports) {
+            mCallback(report);
+        }
+    }
+}
+
+Result Watchdog::start(const Looper::clock::duration& interval) {
+    if (interval <= Looper::clock::duration::zero()) {
+        return Result::ER_BAD_VALUE;
+    }
+    if (id() == 0) {
+        return Result::ER_NO_INIT;
+    }
+
+    unique_lock<mutex> autoLock(mLock);
+    mInterval = interval;
+    mGeneration++;
+    scheduleCheck_l();
+    return Result::OK;
+}
+
+void Watchdog::stop() {
+    unique_lock<mutex> autoLock(mLock);
+    mGeneration++;
+}
+
+void Watchdog::onMessageReceived(const shared_ptr<Message>& msg) {
+    switch (msg->what()) {
+        case kWhatCheck: {
+            int32_t generation;
+            if (!msg->findInt32(kKeyGeneration, &generation)) {
+                break;
+            }
+            {
+                unique_lock<mutex> autoLock(mLock);
+                if (generation != mGeneration) {
+                    break;
+                }
+            }
+
+            check();
+
+            unique_lock<mutex> autoLock(mLock);
+            if (generation == mGeneration) {
+                scheduleCheck_l();
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void Watchdog::scheduleCheck_l() {
+    auto msg(Message::obtain(id(), kWhatCheck));
+    msg->setInt32(kKeyGeneration, mGeneration);
+    msg->post(duration_cast<microseconds>(mInterval).count());
+}
+
+} // namespace baseutils
@@ -19,6 +19,7 @@
 
 //#include <sys/types.h>
 //#include <stdint.h>
+#include <functional>
 #include <memory>
 #include <baseutils/Message.h>
 
@@ -26,14 +27,30 @@ namespace baseutils {
 
 class Message;
 
-class Buffer {
+class Buffer : public std::enable_shared_from_this<Buffer> {
 public:
+    typedef std::function<void(void* data)> ReleaseCallback;
+
     Buffer(const size_t capacity);
 
+    // Copies capacity bytes of data.
     Buffer(const void* data, const size_t capacity);
 
     virtual ~Buffer();
 
+    // Wraps memory the caller owns without copying it. release, if set, is
+    // called with data once the buffer is gone. The range covers it all.
+    static std::shared_ptr<Buffer> Wrap(void* data, const size_t capacity,
+                                        const ReleaseCallback& release = ReleaseCallback());
+
+    // Returns a buffer over bytes [offset, offset + size) of base(), sharing
+    // this buffer's memory and keeping it alive. The slice has its own range
+    // and meta, covering the whole slice to begin with. This buffer has to be
+    // owned by a shared_ptr, as those from Wrap(), pools and make_shared
+    // are; slicing one on the stack or held otherwise throws
+    // std::bad_weak_ptr.
+    std::shared_ptr<Buffer> slice(const size_t offset, const size_t size);
+
     void setFarewellMessage(const std::shared_ptr<Message>& msg);
 
     uint8_t* base() { return (uint8_t*)mData; }
@@ -63,8 +80,14 @@ public:
     bool operator!=(const Buffer &other) const;
 
 protected:
+    // For subclasses that provide their own memory.
+    Buffer();
+
     std::shared_ptr<Message> mFarewell;
     std::shared_ptr<Message> mMeta;
+    // Owner of the memory of a slice.
+    std::shared_ptr<Buffer> mParent;
+    ReleaseCallback mRelease;
 
     void *mData;
     size_t mCapacity;
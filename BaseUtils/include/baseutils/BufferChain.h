@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef BUFFER_CHAIN_H_
+#define BUFFER_CHAIN_H_
+
+#include <sys/uio.h>
+#include <cstddef>
+#include <deque>
+#include <memory>
+
+namespace baseutils {
+
+class Buffer;
+
+/**
+ *  @class BufferChain
+ *  @brief Payload made of a sequence of Buffer segments
+ *
+ *  Each segment contributes the bytes in its range, [data(), data() + size()).
+ *  Segments are shared, never copied: splitting a segment slices it, and only
+ *  coalesce() moves bytes. A segment's range must not change while it is
+ *  part of a chain.
+ */
+class BufferChain {
+public:
+    BufferChain();
+
+    explicit BufferChain(const std::shared_ptr<Buffer>& buffer);
+
+    // Total number of bytes in the chain.
+    size_t size() const { return mSize; }
+
+    bool empty() const { return mSize == 0; }
+
+    size_t countSegments() const { return mSegments.size(); }
+
+    const std::shared_ptr<Buffer>& segmentAt(const size_t index) const { return mSegments[index]; }
+
+    void append(const std::shared_ptr<Buffer>& buffer);
+
+    void append(const BufferChain& chain);
+
+    void prepend(const std::shared_ptr<Buffer>& buffer);
+
+    void prepend(const BufferChain& chain);
+
+    void clear();
+
+    // Keeps the first offset bytes and returns a chain with the rest.
+    std::shared_ptr<BufferChain> split(const size_t offset);
+
+    // Returns the payload as one buffer. A single segment is returned as is,
+    // otherwise the segments are copied into a new buffer which then
+    // replaces them.
+    std::shared_ptr<Buffer> coalesce();
+
+    // Copies up to size bytes starting at offset into dst, returns how many.
+    size_t copyTo(void* dst, const size_t offset, const size_t size) const;
+
+    // Fills iov with up to count entries, one per segment, for writev() or
+    // readv(), and returns how many were filled.
+    size_t fillIovec(struct iovec* iov, const size_t count) const;
+
+private:
+    std::deque<std::shared_ptr<Buffer>> mSegments;
+    size_t mSize;
+};
+
+} // namespace baseutils
+
+#endif  // BUFFER_CHAIN_H_
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef BUFFER_POOL_H_
+#define BUFFER_POOL_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace baseutils {
+
+class Buffer;
+
+/**
+ *  @class BufferPool
+ *  @brief Recycles Buffer memory in power of two size classes
+ *
+ *  Classes run from kMinClassSize to kMaxClassSize. Each thread caches a few
+ *  blocks per class in front of the shared lists, so a steady acquire and
+ *  release pattern neither locks nor calls malloc. Larger buffers are not
+ *  pooled.
+ */
+class BufferPool {
+public:
+    enum {
+        kMinClassSize = 4 * 1024,
+        kMaxClassSize = 2 * 1024 * 1024,
+        kNumClasses = 10,
+    };
+
+    static BufferPool* getInstance();
+
+    // The buffer's memory comes back to the pool when it is destroyed.
+    std::shared_ptr<Buffer> acquire(const size_t capacity);
+
+    // Fills the class of capacity with count idle blocks ahead of time.
+    void reserve(const size_t capacity, const size_t count);
+
+    // Idle memory in the shared lists above this is freed. Thread caches
+    // hold on to at most kThreadCacheBytes per class on top of that.
+    void setHighWaterMark(const size_t bytes);
+
+    // Touches every page of newly allocated blocks, so the first write
+    // into a buffer doesn't page fault.
+    void setPrefault(const bool prefault);
+
+    // mlock()s newly allocated blocks. A block the process isn't allowed
+    // to lock is used unlocked.
+    void setLockMemory(const bool lock);
+
+    size_t idleBytes() const { return mIdleBytes.load(std::memory_order_relaxed); }
+
+    // Blocks allocated from the system so far.
+    uint64_t systemAllocations() const { return mSystemAllocations.load(std::memory_order_relaxed); }
+
+private:
+    enum {
+        kThreadCacheBytes = 4 * 1024 * 1024,
+        kMaxThreadCacheBlocks = 16,
+    };
+
+    class ThreadCache;
+    class PooledBuffer;
+
+    struct SizeClass {
+        std::mutex mLock;
+        std::vector<void*> mFree;
+    };
+
+    SizeClass mClasses[kNumClasses];
+    std::atomic<size_t> mIdleBytes;
+    std::atomic<size_t> mHighWaterMark;
+    std::atomic<uint64_t> mSystemAllocations;
+    std::atomic<bool> mPrefault;
+    std::atomic<bool> mLockMemory;
+    // Whether any block was ever locked, and so must be unlocked when freed.
+    std::atomic<bool> mLockedAny;
+
+    BufferPool();
+
+    static size_t ClassIndex(const size_t capacity);
+
+    static size_t ClassSize(const size_t index);
+
+    static size_t ThreadCacheLimit(const size_t index);
+
+    static ThreadCache* LocalCache();
+
+    void* allocate(const size_t index);
+
+    void release(const size_t index, void* block);
+
+    void* allocateBlock(const size_t index);
+
+    void freeBlock(const size_t index, void* block);
+
+    // Moves up to count idle blocks of the class into blocks.
+    void take(const size_t index, std::vector<void*>* blocks, const size_t count);
+
+    // Keeps what fits under the high water mark, frees the rest.
+    void give(const size_t index, std::vector<void*>* blocks, const size_t count);
+
+    BufferPool(const BufferPool&) = delete;
+
+    BufferPool& operator=(const BufferPool&) = delete;
+};
+
+} // namespace baseutils
+
+#endif  // BUFFER_POOL_H_
@@ -17,6 +17,12 @@
 #ifndef HANDLER_H_
 #define HANDLER_H_
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <baseutils/Histogram.h>
 #include <baseutils/Looper.h>
 
 namespace baseutils {
@@ -26,22 +32,82 @@ class LooperRoster;
 
 class Handler {
 public:
-    Handler() : mID(0) { }
+    Handler() : mID(0), mStatsEnabled(false), mStatsBlock(NULL) { }
+
+    virtual ~Handler();
 
     Looper::handler_id id() const { return mID; }
 
     std::shared_ptr<Looper> looper();
 
+    /**
+     * Times every delivery to this handler and counts its messages by
+     * what. Off by default, delivery then only checks the flag and the
+     * stats take no memory until first turned on. Turning it on starts over.
+     */
+    void setStatsEnabled(bool enable);
+
+    struct Stats {
+        // Since stats were turned on or last reset.
+        Looper::clock::duration mPeriod;
+        uint64_t mMessages;
+        // Nanoseconds spent in the handler per message. A batch is only timed
+        // as a whole, each of its messages records the batch's average, so
+        // the spread within a batch doesn't show.
+        Histogram mExecTimes;
+        std::unordered_map<uint32_t, uint64_t> mMessagesPerWhat;
+
+        Stats() : mPeriod(Looper::clock::duration::zero()), mMessages(0) {}
+
+        // Messages per second with this what over mPeriod.
+        double rate(uint32_t what) const;
+    };
+
+    void getStats(Stats* stats);
+
+    void resetStats();
+
 protected:
     virtual void onMessageReceived(const std::shared_ptr<Message>& msg) = 0;
 
+    // Consecutive messages queued for a handler that wantsBatches() may be
+    // delivered together. The default hands them to onMessageReceived() one
+    // by one, override to process a batch at once.
+    virtual void onMessagesReceived(const std::vector<std::shared_ptr<Message>>& msgs);
+
+    // Asked once, when the handler is registered. A batch is taken off the
+    // queue as a whole, so cancelling or removing one of its messages from
+    // within the handler no longer stops it. Off by default.
+    virtual bool wantsBatches() const { return false; }
+
 private:
     friend class LooperRoster;
 
     Looper::handler_id mID;
 
+    struct StatsBlock {
+        std::mutex mLock;
+        Stats mStats;
+        Looper::clock::time_point mSince;
+    };
+
+    // Read on every delivery, the block is only touched while it is set.
+    std::atomic<bool> mStatsEnabled;
+    // Allocated the first time stats are turned on, kept until the handler
+    // goes away.
+    std::atomic<StatsBlock*> mStatsBlock;
+
     void setID(Looper::handler_id id) { mID = id; }
 
+    StatsBlock* obtainStatsBlock();
+
+    // Called by the delivering thread after the handler returned.
+    void recordDelivery(uint32_t what, const Looper::clock::duration& elapsed);
+
+    // For a batch, given the what of each of its messages.
+    void recordDelivery(const std::vector<uint32_t>& whats,
+                        const Looper::clock::duration& elapsed);
+
     Handler(const Handler&) = delete;
 
     Handler& operator=(const Handler&) = delete;
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#include <cstdint>
+#include <vector>
+
+namespace baseutils {
+
+/**
+ *  @class Histogram
+ *  @brief Log-linear histogram of non-negative values
+ *
+ *  Each power of two is split in 16 buckets, so percentiles come within
+ *  about 6% of the true value at any magnitude. Recording is O(1) and
+ *  doesn't allocate. Not thread safe.
+ */
+class Histogram {
+public:
+    Histogram();
+
+    // Negative values count as 0.
+    void record(int64_t value);
+
+    void merge(const Histogram& other);
+
+    void reset();
+
+    uint64_t count() const { return mCount; }
+
+    int64_t min() const { return mCount > 0 ? mMin : 0; }
+
+    int64_t max() const { return mCount > 0 ? mMax : 0; }
+
+    double mean() const { return mCount > 0 ? (double)mSum / mCount : 0; }
+
+    // Value below which percent (0 to 100) of the recorded values fall,
+    // 0 if nothing was recorded.
+    int64_t percentile(double percent) const;
+
+private:
+    enum {
+        kSubBucketBits = 4,
+        kSubBuckets = 1 << kSubBucketBits,
+        // Values below kSubBuckets get a bucket each, every power of two
+        // above gets kSubBuckets.
+        kNumBuckets = (64 - kSubBucketBits + 1) * kSubBuckets,
+    };
+
+    std::vector<uint64_t> mBuckets;
+    uint64_t mCount;
+    int64_t mMin;
+    int64_t mMax;
+    // Wraps only after ~292 years worth of nanoseconds.
+    int64_t mSum;
+
+    static size_t bucketOf(uint64_t value);
+
+    // Largest value that lands in bucket.
+    static uint64_t upperBound(size_t bucket);
+};
+
+} // namespace baseutils
+
+#endif  // HISTOGRAM_H_
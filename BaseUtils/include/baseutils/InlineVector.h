@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INLINE_VECTOR_H_
+#define INLINE_VECTOR_H_
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace baseutils {
+
+/**
+ *  @class InlineVector
+ *  @brief Contiguous array with room for N elements inside the object
+ *
+ *  Only spills to the heap once more than N elements are stored. T must be
+ *  nothrow move constructible. Growing invalidates pointers to elements.
+ */
+template<typename T, size_t N>
+class InlineVector {
+public:
+    typedef T* iterator;
+    typedef const T* const_iterator;
+
+    InlineVector()
+        : mData(inlineData()),
+          mSize(0),
+          mCapacity(N) {
+    }
+
+    ~InlineVector() {
+        clear();
+        if (mData != inlineData()) {
+            ::operator delete(mData);
+        }
+    }
+
+    size_t size() const { return mSize; }
+
+    bool empty() const { return mSize == 0; }
+
+    size_t capacity() const { return mCapacity; }
+
+    T& operator[](size_t index) { return mData[index]; }
+
+    const T& operator[](size_t index) const { return mData[index]; }
+
+    T& back() { return mData[mSize - 1]; }
+
+    iterator begin() { return mData; }
+
+    iterator end() { return mData + mSize; }
+
+    const_iterator begin() const { return mData; }
+
+    const_iterator end() const { return mData + mSize; }
+
+    template<typename... Args>
+    T& emplace_back(Args&&... args) {
+        if (mSize == mCapacity) {
+            grow(mCapacity * 2);
+        }
+        new (mData + mSize) T(std::forward<Args>(args)...);
+        return mData[mSize++];
+    }
+
+    void reserve(size_t capacity) {
+        if (capacity > mCapacity) {
+            grow(capacity);
+        }
+    }
+
+    // Destroys the elements but keeps the storage, heap or inline.
+    void clear() {
+        for (size_t i = 0; i < mSize; i++) {
+            mData[i].~T();
+        }
+        mSize = 0;
+    }
+
+private:
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type mInline[N];
+    T* mData;
+    size_t mSize;
+    size_t mCapacity;
+
+    T* inlineData() { return reinterpret_cast<T*>(mInline); }
+
+    void grow(size_t capacity) {
+        T* data = static_cast<T*>(::operator new(capacity * sizeof(T)));
+        for (size_t i = 0; i < mSize; i++) {
+            new (data + i) T(std::move(mData[i]));
+            mData[i].~T();
+        }
+        if (mData != inlineData()) {
+            ::operator delete(mData);
+        }
+        mData = data;
+        mCapacity = capacity;
+    }
+
+    InlineVector(const InlineVector&) = delete;
+
+    InlineVector& operator=(const InlineVector&) = delete;
+};
+
+} // namespace baseutils
+
+#endif  // INLINE_VECTOR_H_
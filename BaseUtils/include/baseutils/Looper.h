@@ -17,13 +17,22 @@
 #ifndef LOOPER_H_
 #define LOOPER_H_
 
+#include <sys/epoll.h>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
-#include <list>
+#include <deque>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <baseutils/Histogram.h>
+#include <baseutils/MpscQueue.h>
 #include <baseutils/Result.h>
+#include <baseutils/TimerWheel.h>
 
 namespace baseutils {
 
@@ -42,47 +51,509 @@ public:
     // Takes effect in a subsequent call to start().
     void setName(const std::string& name);
 
+    std::string name();
+
     handler_id registerHandler(const std::shared_ptr<Handler>& handler);
 
     void unregisterHandler(handler_id handlerID);
 
-    Result start(bool runOnCallingThread = false);
+    virtual Result start(bool runOnCallingThread = false);
+
+    virtual Result stop();
 
-    Result stop();
+    typedef std::chrono::steady_clock clock;
 
+    // Monotonic time; all scheduling is based on this clock.
     static int64_t GetNowUs();
 
-    static std::chrono::system_clock::duration GetNow();
+    static clock::time_point GetNow();
 
-private:
+    enum {
+        kEventInput = EPOLLIN,
+        kEventOutput = EPOLLOUT,
+        kEventError = EPOLLERR,
+        kEventHangup = EPOLLHUP,
+    };
+
+    // Called on the looper thread with the ready events of fd. Returning
+    // false stops watching fd.
+    typedef std::function<bool(int fd, uint32_t events)> FdCallback;
+
+    // Watches fd for events (kEventInput, kEventOutput), level triggered.
+    // Errors and hangups are always reported. Adding an fd again replaces
+    // its events and callback.
+    Result addFd(int fd, uint32_t events, const FdCallback& callback);
+
+    // Same, but every time fd is ready, a copy of notify with "fd" and
+    // "events" int32 fields set is delivered to notify's target from the
+    // looper thread, without going through the queue.
+    Result addFd(int fd, uint32_t events, const std::shared_ptr<Message>& notify);
+
+    Result removeFd(int fd);
+
+    /**
+     *  @class TimerHandle
+     *  @brief Cancels a message posted with Message::postTimer()
+     *
+     *  Copyable, and safe to use after the timer fired or the looper went
+     *  away, cancel() just fails then.
+     */
+    class TimerHandle {
+    public:
+        TimerHandle() : mId(0) {}
+
+        // Returns ER_NAME_NOT_FOUND if the timer fired or was cancelled.
+        Result cancel();
+
+    private:
+        friend class Looper;
+
+        std::weak_ptr<Looper> mLooper;
+        TimerWheel::timer_id mId;
+    };
+
+    // Tick of the timer wheel behind Message::postTimer(), 1 ms by default.
+    // Can only change while no such timer is pending.
+    Result setTimerTick(const clock::duration& tick);
+
+    /**
+     * Each message goes through the lane of its Message::priority(), a lane
+     * delivers in deadline order like the looper always did. Wheel timers
+     * (Message::postTimer()) bypass the lanes.
+     */
+    enum Priority {
+        kPriorityUrgent,
+        kPriorityNormal,
+        kPriorityBackground,
+        kNumPriorities,
+    };
+
+    enum SchedulingPolicy {
+        // The most urgent lane with a due message always goes next. The
+        // default.
+        kSchedulingStrict,
+        // Lanes with due messages take turns, each delivering up to its
+        // weight in messages per round, most urgent first.
+        kSchedulingWeighted,
+    };
+
+    void setSchedulingPolicy(SchedulingPolicy policy);
+
+    // Weights default to 16, 4 and 1, from urgent to background.
+    Result setLaneWeight(Priority priority, uint32_t weight);
+
+    /**
+     * Records how long each message waited between being posted, or due if
+     * delayed, and its delivery, per lane and in nanoseconds. Off by
+     * default, it costs two clock readings per message. Calls pair up, so
+     * independent users can share it: tracking stays on until every
+     * enable has been matched by a disable.
+     */
+    void setLatencyTracking(bool enable);
+
+    Result getQueueLatency(Priority priority, Histogram* waits);
+
+    void resetQueueLatency();
+
+    /**
+     * Snapshot of the looper, taken under its lock. Per handler numbers are
+     * kept by each Handler, see Handler::setStatsEnabled().
+     */
+    struct Stats {
+        size_t mQueueDepth;
+        size_t mQueueHighWaterMark;
+        // Waiting on the timer wheel.
+        size_t mPendingTimers;
+        // Messages taken off the queues for delivery so far.
+        uint64_t mDelivered;
+        // Empty unless latency tracking is on.
+        Histogram mQueueLatency[kNumPriorities];
+
+        Stats() : mQueueDepth(0), mQueueHighWaterMark(0), mPendingTimers(0), mDelivered(0) {}
+    };
+
+    void getStats(Stats* stats);
+
+    /**
+     * Lets another thread see which handler the looper is running and
+     * since when, see Watchdog. Off by default; on, each delivery costs a
+     * clock reading and a few atomic stores, without locking. Calls pair up
+     * as with setLatencyTracking().
+     */
+    void setDispatchTracking(bool enable);
+
+    struct ActiveDispatch {
+        handler_id mTarget;
+        // Of the first message, for a batch.
+        uint32_t mWhat;
+        clock::time_point mStartedAt;
+    };
+
+    // Appends what every thread of the looper is delivering right now,
+    // nothing for those that are idle.
+    virtual void getActiveDispatches(std::vector<ActiveDispatch>* dispatches);
+
+    // How long the oldest due message has been waiting, zero if none.
+    // Messages posted without delay only count while latency tracking is
+    // on, they aren't timestamped otherwise.
+    clock::duration oldestPendingAge();
+
+    /**
+     * Posts msgs without delay, in order, with one atomic exchange and at
+     * most one wakeup. Every message must target a handler of this looper,
+     * else ER_BAD_VALUE and nothing is posted. A bounded queue admits them
+     * one at a time; if one is refused, none are posted and its error is
+     * returned.
+     */
+    virtual Result postBatch(const std::vector<std::shared_ptr<Message>>& msgs);
+
+    enum OverflowPolicy {
+        // Waits for room up to the block timeout, then fails with
+        // ER_TIMED_OUT. Handlers posting to their own looper fail right away
+        // with ER_WOULD_BLOCK instead of waiting for themselves.
+        kOverflowBlock,
+        // Fails with ER_WOULD_BLOCK.
+        kOverflowFail,
+        // Drops the oldest pending message of the least urgent lane.
+        kOverflowDropOldest,
+        // Drops a pending message with the same target and what, so only
+        // the newest is delivered. Fails with ER_WOULD_BLOCK if none.
+        kOverflowCoalesce,
+    };
+
+    /**
+     * Caps the messages pending delivery, those waiting on the timer wheel
+     * aside. 0, the default, leaves the queue unbounded. Posts that would
+     * exceed the capacity are handled according to policy.
+     */
+    void setQueueCapacity(size_t capacity, OverflowPolicy policy = kOverflowFail,
+                          const clock::duration& blockTimeout = std::chrono::milliseconds(100));
+
+    // Messages pending delivery right now, and the most there ever were.
+    size_t queueDepth() const { return mDepth.load(std::memory_order_relaxed); }
+
+    size_t queueHighWaterMark() const { return mHighWaterMark.load(std::memory_order_relaxed); }
+
+    // Removes every pending message with this target and what, whether
+    // posted with a delay or on the timer wheel. Returns how many.
+    virtual size_t removeMessages(handler_id target, uint32_t what);
+
+protected:
     friend class LooperRoster;
+    friend class Message;
+
+    // Deadlines not after the looper's cached clock are queued as immediate.
+    virtual Result post(const std::shared_ptr<Message>& msg, const clock::time_point& when);
+
+    // Queues msg ahead of everything pending in its lane, due timers too.
+    virtual Result postAtFront(const std::shared_ptr<Message>& msg);
+
+    // Same as post(), unless a message with the same target and what that
+    // was posted this way is still pending: msg then takes its place in the
+    // queue and its deadline, and the old one is dropped.
+    Result postReplacing(const std::shared_ptr<Message>& msg, const clock::time_point& when);
+
+    virtual Result cancel(const std::shared_ptr<Message>& msg);
+
+    Result postTimer(const std::shared_ptr<Message>& msg, const clock::time_point& when,
+                     TimerHandle* handle);
+
+    Result cancelTimer(TimerWheel::timer_id id);
+
+    // Called on the looper thread with each message that is due, delivers
+    // it to its handler.
+    virtual void dispatch(const std::shared_ptr<Message>& msg);
+
+    // Same for a run of consecutive due messages with the same target,
+    // delivered to Handler::onMessagesReceived().
+    virtual void dispatchBatch(const std::vector<std::shared_ptr<Message>>& msgs);
+
+    // Counts msg against the queue capacity, applying the overflow policy
+    // if the queue is full. Everything admitted must be removed again with
+    // removeQueued() once it leaves the queue.
+    Result admit(const std::shared_ptr<Message>& msg);
+
+    // Counts messages that bypass admission, e.g. handed over from another
+    // queue that already let them in.
+    void addQueued(size_t count);
+
+    void removeQueued(size_t count);
+
+    // Whether messages handed to dispatch() and dispatchBatch() still count
+    // against the capacity, for a subclass that queues them again. Their
+    // count then carries over instead of dropping in between, and the
+    // subclass removes it with removeQueued() once they leave its queue,
+    // and traces their dequeue then too.
+    virtual bool keepsDispatchedQueued() const { return false; }
+
+    // Whether the calling thread delivers messages of this looper, so that
+    // waiting for room would wait on itself. Called with the looper's lock
+    // held.
+    virtual bool isDeliveryThread_l() const;
+
+    // Drops one pending message according to policy, kOverflowDropOldest
+    // or kOverflowCoalesce, to make room for msg. Returns false if there
+    // was nothing to drop.
+    virtual bool makeRoom(const std::shared_ptr<Message>& msg, OverflowPolicy policy);
+
+    /**
+     * Published by a thread while it delivers, and sampled from others.
+     * mStartedAt doubles as a sequence number, it is 0 while the slot is
+     * idle or being written.
+     */
+    class DispatchSlot {
+    public:
+        DispatchSlot() : mStartedAt(0), mTarget(0), mWhat(0) {}
+
+        void begin(handler_id target, uint32_t what);
+
+        void end() { mStartedAt.store(0, std::memory_order_relaxed); }
+
+        // False if idle, or if the slot changed while being read.
+        bool sample(ActiveDispatch* dispatch) const;
+
+    private:
+        std::atomic<clock::rep> mStartedAt;
+        std::atomic<handler_id> mTarget;
+        std::atomic<uint32_t> mWhat;
+    };
+
+    bool isDispatchTracking() const { return mTrackDispatch.load(std::memory_order_relaxed) != 0; }
 
     struct Event {
-        std::chrono::system_clock::duration mWhen;
+        clock::time_point mWhen;
+        // Posting order of delayed events, breaks ties between equal mWhen.
+        uint64_t mSeq;
+        // Set while latency tracking is on.
+        clock::time_point mPostedAt;
         std::shared_ptr<Message> mMessage;
+        // Link in mIngress.
+        std::atomic<Event*> mNext;
+        // Next pending event of the same message, see Message::mPendingEvents
+        // and Message::mStrandEvents.
+        Event* mSibling;
+        // Cancelled events stay queued, without a message, until they reach
+        // the front or the queues get compacted.
+        bool mCancelled;
+        // Posted with postReplacing(), so listed in mReplaceableEvents.
+        bool mReplaceable;
+
+        Event() : mSeq(0), mNext(nullptr), mSibling(NULL), mCancelled(false), mReplaceable(false) {}
     };
 
-    std::mutex mLock;
+    // Orders the timer heap so that the earliest (mWhen, mSeq) is on top.
+    struct EventLater {
+        bool operator()(const Event* lhs, const Event* rhs) const {
+            return lhs->mWhen > rhs->mWhen
+                    || (lhs->mWhen == rhs->mWhen && lhs->mSeq > rhs->mSeq);
+        }
+    };
+
+    // Counts a post of msg as pending here. Fails if it is still pending on
+    // another looper, whose lock guards msg->mPendingEvents until then.
+    bool claimPending(Message* msg);
 
-    std::condition_variable mQueueChangedCondition;
+    void releasePending(Message* msg);
+
+private:
+
+    enum {
+        kMaxPollEvents = 16,
+        // While messages keep the looper busy, watched fds are still polled
+        // after this many deliveries.
+        kFdPollInterval = 32,
+        // Below this many cancelled events the queues aren't worth compacting.
+        kMinCompaction = 64,
+        // Most messages handed to a handler in one dispatchBatch().
+        kMaxDeliveryBatch = 16,
+    };
+
+    class FdRequest {
+    public:
+        uint32_t mSeq;
+        FdCallback mCallback;
+        std::shared_ptr<Message> mNotify;
+    };
+
+    std::mutex mLock;
 
     std::string mName;
 
-    std::list<Event> mEventQueue;
+    /**
+     * The looper thread sleeps in epoll_wait() on mEpollFd, which watches
+     * mWakeFd (an eventfd producers write to), mTimerFd (armed with the
+     * earliest timer deadline) and the fds added with addFd().
+     */
+    int mEpollFd;
+    int mWakeFd;
+    int mTimerFd;
+
+    // Deadline mTimerFd is armed with, so it is only re-armed when the
+    // earliest timer changes.
+    clock::time_point mArmedDeadline;
+
+    /**
+     * key : fd
+     * value : what to do when it is ready
+     */
+    std::unordered_map<int, std::shared_ptr<FdRequest>> mFdRequests;
+    uint32_t mNextFdSeq;
+    uint32_t mDeliveriesSincePoll;
+
+    /**
+     * Lock-free ingress for messages posted without delay. Whoever holds
+     * mLock is the single consumer and moves them to mReadyQueue.
+     */
+    MpscQueue<Event> mIngress;
+
+    // Set by the looper thread while it waits in epoll_wait(), so producers
+    // only write to mWakeFd when there is someone to wake.
+    std::atomic<bool> mSleeping;
+
+    /**
+     * Clock reading taken by loop() at most once per iteration, and only
+     * when a timer may be due. Stamps drained ready events, and lets post()
+     * tell past deadlines from future ones without reading the clock.
+     */
+    std::atomic<clock::rep> mCachedNow;
+
+    struct Lane {
+        /**
+         * Messages posted without delay, in posting order.
+         */
+        std::deque<Event*> mReadyQueue;
+
+        /**
+         * Delayed messages, kept as a min-heap on (mWhen, mSeq).
+         */
+        std::vector<Event*> mTimerHeap;
+
+        uint32_t mWeight;
+        // Messages the lane may still deliver this round.
+        uint32_t mCredit;
+
+        Histogram mWaitTimes;
+
+        Lane() : mWeight(1), mCredit(0) {}
+    };
+
+    Lane mLanes[kNumPriorities];
+    SchedulingPolicy mPolicy;
+
+    // Enables not yet matched by a disable. Read by post() without the
+    // lock.
+    std::atomic<uint32_t> mTrackLatency;
+
+    // The looper thread's delivery, while mTrackDispatch is non-zero.
+    std::atomic<uint32_t> mTrackDispatch;
+    DispatchSlot mDispatchSlot;
+
+    uint64_t mNextSeq;
+
+    /**
+     * Queue bounds. mDepth counts admitted messages, producers bump it
+     * before queueing and back off if that overshoots mCapacity. Blocked
+     * producers wait for mSpaceCondition under mLock.
+     */
+    std::atomic<size_t> mCapacity;
+    std::atomic<size_t> mDepth;
+    std::atomic<size_t> mHighWaterMark;
+    OverflowPolicy mOverflowPolicy;
+    clock::duration mBlockTimeout;
+    std::condition_variable mSpaceCondition;
+    std::atomic<uint32_t> mBlockedProducers;
+
+    /**
+     * key : target and what of a message posted with postReplacing()
+     * value : its pending event
+     */
+    std::unordered_map<uint64_t, Event*> mReplaceableEvents;
+
+    // Cancelled events left in the lanes.
+    size_t mCancelledEvents;
+
+    uint64_t mDelivered;
+
+    /**
+     * Messages posted with postTimer(), and those of them that expired but
+     * weren't delivered yet.
+     */
+    TimerWheel mTimerWheel;
+    std::deque<std::shared_ptr<Message>> mExpiredTimers;
 
     class LooperThread;
 
     std::shared_ptr<LooperThread> mThread;
 
     bool mRunningLocally;
+    std::thread::id mLocalThreadId;
+
+    // Tells loopers apart in Message::mPendingOn.
+    const uint32_t mSerial;
 
     Looper(const Looper&) = delete;
 
     Looper& operator=(const Looper&) = delete;
 
-    void post(const std::shared_ptr<Message>& msg, const std::chrono::system_clock::duration& delay);
+    Result addFdRequest(int fd, uint32_t events, const std::shared_ptr<FdRequest>& request);
+
+    void wake();
+
+    void armTimer_l(const clock::time_point& when);
+
+    // Waits up to timeoutMs (-1 for good) for the wake fd, the timer or a
+    // watched fd, and handles what became ready.
+    void pollOnce(int timeoutMs);
+
+    void handleFdEvent(int fd, uint32_t seq, uint32_t events);
+
+    void drainIngress_l();
+
+    // Links event to its message, so cancel() finds it without a search.
+    void track_l(Event* event);
+
+    void untrack_l(Event* event);
+
+    // Takes the message out of an event that was removed from lane for
+    // delivery, and frees the event.
+    std::shared_ptr<Message> retire_l(Lane* lane, Event* event);
+
+    // Marks a queued event cancelled, leaving it for the lanes to skip.
+    void cancelEvent_l(Event* event);
+
+    static uint64_t replaceKey(handler_id target, uint32_t what) {
+        return ((uint64_t)(uint32_t)target << 32) | what;
+    }
+
+    // Takes event out of mReplaceableEvents, once it is delivered or gone.
+    void unlistReplaceable_l(Event* event);
+
+    void removeQueued_l(size_t count);
+
+    // Counts an enable or disable of one of the tracking switches. Unmatched
+    // disables are ignored.
+    static void countTracking(std::atomic<uint32_t>* users, bool enable);
+
+    // Records depth in mHighWaterMark if it is a new maximum.
+    void raiseHighWaterMark(size_t depth);
+
+    bool isLooperThread_l() const;
+
+    Lane& laneFor(const std::shared_ptr<Message>& msg);
+
+    // Drops cancelled events from the front of every lane.
+    void pruneCancelled_l();
+
+    // Whether lane has a message to deliver at now.
+    bool isDue_l(const Lane& lane, const clock::time_point& now) const;
+
+    // The lane to deliver from next under mPolicy, NULL if none is due.
+    Lane* pickLane_l(const clock::time_point& now);
+
+    // Drops all cancelled events, once there are enough to be worth it.
+    void compact_l(bool force);
 
-    Result cancel(const std::shared_ptr<Message>& msg);
+    clock::time_point updateNow_l();
 
     bool loop();
 };
@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef LOOPER_POOL_H_
+#define LOOPER_POOL_H_
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <vector>
+#include <baseutils/Looper.h>
+
+namespace baseutils {
+
+/**
+ *  @class LooperPool
+ *  @brief Looper whose handlers run on a pool of worker threads
+ *
+ *  Handlers register exactly as with a Looper. Each handler gets a strand,
+ *  its messages are delivered one at a time and in posting order, but
+ *  different handlers run in parallel. A worker that runs out of strands
+ *  steals from the others.
+ *
+ *  Delayed messages wait on the looper thread as usual and join their
+ *  handler's strand once due. A strand delivers in arrival order whatever
+ *  the priority, only postAtFront() jumps its queue.
+ */
+class LooperPool : public Looper {
+public:
+    // 0 starts one worker per hardware thread.
+    explicit LooperPool(size_t numWorkers = 0);
+
+    virtual ~LooperPool();
+
+    size_t numWorkers() const { return mWorkers.size(); }
+
+    virtual Result start(bool runOnCallingThread = false);
+
+    virtual Result stop();
+
+    virtual size_t removeMessages(handler_id target, uint32_t what);
+
+    virtual void getActiveDispatches(std::vector<ActiveDispatch>* dispatches);
+
+protected:
+    virtual Result post(const std::shared_ptr<Message>& msg, const clock::time_point& when);
+
+    virtual Result postAtFront(const std::shared_ptr<Message>& msg);
+
+    virtual Result cancel(const std::shared_ptr<Message>& msg);
+
+    virtual bool keepsDispatchedQueued() const;
+
+    // The workers too.
+    virtual bool isDeliveryThread_l() const;
+
+    virtual void dispatch(const std::shared_ptr<Message>& msg);
+
+    virtual void dispatchBatch(const std::vector<std::shared_ptr<Message>>& msgs);
+
+    virtual bool makeRoom(const std::shared_ptr<Message>& msg, OverflowPolicy policy);
+
+private:
+    enum {
+        kNumBuckets = 64,
+        // Messages a strand delivers before letting other strands run.
+        kStrandBatch = 16,
+    };
+
+    /**
+     * Pending messages of one handler. A strand only exists while it has
+     * messages, and at most one worker runs it at a time. Cancelled events
+     * stay queued, without a message, until the strand runs.
+     */
+    struct Strand {
+        handler_id mId;
+        std::deque<Event*> mQueue;
+        // Queued on a worker or running.
+        bool mScheduled;
+
+        Strand() : mId(0), mScheduled(false) {}
+    };
+
+    // Strands hashed by handler id, each bucket guards its strands.
+    struct Bucket {
+        std::mutex mLock;
+        std::unordered_map<handler_id, Strand> mStrands;
+    };
+
+    class WorkerThread;
+
+    // Strands ready to run. The owner takes from the front, thieves from
+    // the back.
+    struct Worker {
+        std::mutex mLock;
+        std::deque<Strand*> mStrands;
+        std::shared_ptr<WorkerThread> mThread;
+        DispatchSlot mDispatchSlot;
+    };
+
+    Bucket mBuckets[kNumBuckets];
+    std::vector<std::unique_ptr<Worker>> mWorkers;
+    std::atomic<size_t> mNextWorker;
+
+    // Keeps the pool alive while a worker runs a strand.
+    std::weak_ptr<Looper> mSelf;
+
+    std::mutex mIdleLock;
+    std::condition_variable mIdleCondition;
+    // Strands scheduled but not yet taken, and workers waiting for one.
+    std::atomic<size_t> mPendingStrands;
+    std::atomic<size_t> mIdleWorkers;
+    std::atomic<bool> mStopping;
+
+    Bucket& bucketFor(handler_id id) { return mBuckets[(uint32_t)id % kNumBuckets]; }
+
+    // Queues msg on its handler's strand. A claimed msg is tracked, so that
+    // cancel() finds it without a search.
+    void enqueue(const std::shared_ptr<Message>& msg, bool claimed, bool atFront = false);
+
+    // Links event to its message, under the lock of the strand's bucket.
+    void trackStrandEvent_l(Event* event);
+
+    // Unlinks event, releasing its claim if it was tracked.
+    void untrackStrandEvent_l(Event* event);
+
+    // Marks a queued event cancelled, leaving it for the strand to skip.
+    void cancelStrandEvent_l(Event* event);
+
+    void schedule(Strand* strand);
+
+    // Takes a strand from worker index, or steals one.
+    Strand* take(size_t index);
+
+    void runStrand(Strand* strand, Worker* worker);
+
+    bool runWorker(size_t index);
+
+    LooperPool(const LooperPool&) = delete;
+
+    LooperPool& operator=(const LooperPool&) = delete;
+};
+
+} // namespace baseutils
+
+#endif  // LOOPER_POOL_H_
@@ -17,15 +17,21 @@
 #ifndef MESSAGE_H_
 #define MESSAGE_H_
 
+#include <atomic>
 #include <chrono>
+#include <functional>
+#include <future>
 #include <string>
 #include <memory>
 #include <vector>
+#include <baseutils/InlineVector.h>
 #include <baseutils/Looper.h>
+#include <baseutils/MessageKey.h>
 
 namespace baseutils {
 
 class Buffer;
+class BufferChain;
 class Parcelable;
 
 /**
@@ -39,14 +45,41 @@ public:
 
     virtual ~Message();
 
+    // Returns an empty message from a per-thread pool. The message and its
+    // shared_ptr control block are recycled once the last reference goes
+    // away, so steady traffic doesn't hit malloc.
+    static std::shared_ptr<Message> obtain(const Looper::handler_id target = 0,
+                                           const uint32_t what = 0);
+
+    struct PoolStats {
+        // Messages obtain() served from the pool.
+        uint64_t hits;
+        // Messages obtain() had to allocate.
+        uint64_t misses;
+    };
+
+    // Pool counters of the calling thread.
+    static PoolStats GetPoolStats();
+
+    // Caps the idle messages each thread keeps, and those parked in the pool
+    // shared by all threads. 0 disables recycling.
+    static void SetPoolCapacity(size_t capacity);
+
     void setWhat(const uint32_t what);
     uint32_t what() const;
 
     void setTarget(const Looper::handler_id target);
     Looper::handler_id target() const;
 
+    // Lane the message is queued in, kPriorityNormal by default.
+    void setPriority(const Looper::Priority priority);
+    Looper::Priority priority() const;
+
     void clear();
 
+    // The string overloads look the name up on every call, prefer passing a
+    // MessageKey created once up front on hot paths. A name no MessageKey
+    // was created for is kept with the field and freed with it.
     void setBoolean(const std::string& name, bool value);
     void setInt32(const std::string& name, int32_t value);
     void setInt64(const std::string& name, int64_t value);
@@ -56,6 +89,7 @@ public:
     void setPointer(const std::string& name, void* value);
     void setString(const std::string& name, const std::string& str);
     void setBuffer(const std::string& name, const std::shared_ptr<Buffer>& buffer);
+    void setBufferChain(const std::string& name, const std::shared_ptr<BufferChain>& chain);
     void setMessage(const std::string& name, const std::shared_ptr<Message>& message);
     void setObject(const std::string& name, const std::shared_ptr<Parcelable>& object);
     bool findBoolean(const std::string& name, bool* const value) const;
@@ -67,22 +101,109 @@ public:
     bool findPointer(const std::string& name, void** const value) const;
     bool findString(const std::string& name, std::string* const value) const;
     bool findBuffer(const std::string& name, std::shared_ptr<Buffer>* const buffer) const;
+    bool findBufferChain(const std::string& name, std::shared_ptr<BufferChain>* const chain) const;
     bool findMessage(const std::string& name, std::shared_ptr<Message>* const message) const;
     bool findObject(const std::string& name, std::shared_ptr<Parcelable>* const obj) const;
 
+    void setBoolean(const MessageKey& key, bool value);
+    void setInt32(const MessageKey& key, int32_t value);
+    void setInt64(const MessageKey& key, int64_t value);
+    void setSize(const MessageKey& key, size_t value);
+    void setFloat(const MessageKey& key, float value);
+    void setDouble(const MessageKey& key, double value);
+    void setPointer(const MessageKey& key, void* value);
+    void setString(const MessageKey& key, const std::string& str);
+    void setBuffer(const MessageKey& key, const std::shared_ptr<Buffer>& buffer);
+    void setBufferChain(const MessageKey& key, const std::shared_ptr<BufferChain>& chain);
+    void setMessage(const MessageKey& key, const std::shared_ptr<Message>& message);
+    void setObject(const MessageKey& key, const std::shared_ptr<Parcelable>& object);
+    bool findBoolean(const MessageKey& key, bool* const value) const;
+    bool findInt32(const MessageKey& key, int32_t* const value) const;
+    bool findInt64(const MessageKey& key, int64_t* const value) const;
+    bool findSize(const MessageKey& key, size_t* const value) const;
+    bool findFloat(const MessageKey& key, float* const value) const;
+    bool findDouble(const MessageKey& key, double* const value) const;
+    bool findPointer(const MessageKey& key, void** const value) const;
+    bool findString(const MessageKey& key, std::string* const value) const;
+    bool findBuffer(const MessageKey& key, std::shared_ptr<Buffer>* const buffer) const;
+    bool findBufferChain(const MessageKey& key, std::shared_ptr<BufferChain>* const chain) const;
+    bool findMessage(const MessageKey& key, std::shared_ptr<Message>* const message) const;
+    bool findObject(const MessageKey& key, std::shared_ptr<Parcelable>* const obj) const;
+
     Result post(const int64_t delayUs = 0);
 
     template<typename T>
     Result post(const T& delay) {
-        return postMessage(std::chrono::duration_cast<std::chrono::system_clock::duration>(delay));
+        return postMessage(std::chrono::duration_cast<Looper::clock::duration>(delay));
     }
 
+    // Posts the message to be delivered at an absolute deadline on
+    // Looper::clock. Deadlines in the past are delivered right away.
+    Result postAt(const Looper::clock::time_point& when);
+
+    // Cancels the latest pending post of the message, in constant time. A
+    // message is only ever pending on one looper at a time: posting it to
+    // another, after changing its target, fails with ER_INVALID_OPERATION
+    // until the earlier posts are delivered or cancelled.
     Result cancel();
 
+    // Posts the message ahead of everything already pending in its lane.
+    Result postAtFront();
+
+    // For state updates where only the newest value matters: if a message
+    // with the same target and what posted this way is still pending, this
+    // one replaces it, keeping its place in the queue. O(1).
+    Result postReplacing(const int64_t delayUs = 0);
+
+    // Posts the message on its looper's timer wheel instead: the delay is
+    // rounded up to the wheel's tick, but arming and cancelling through
+    // handle cost O(1) however many timers are pending. Message::cancel()
+    // doesn't see these. handle may be NULL.
+    template<typename T>
+    Result postTimer(const T& delay, Looper::TimerHandle* handle) {
+        return postTimerMessage(std::chrono::duration_cast<Looper::clock::duration>(delay), handle);
+    }
+
     // Posts the message to its target and waits for a response (or error)
-    // before returning.
+    // before returning. A request that can't be answered any more fails
+    // with ER_DEAD_OBJECT: its message was cancelled or dropped without
+    // being delivered, or its handler was unregistered or its looper
+    // stopped before replying.
     Result postAndAwaitResponse(std::shared_ptr<Message>& response);
 
+    // Same, but gives up after timeout with ER_TIMED_OUT. A reply posted
+    // after that is dropped.
+    template<typename T>
+    Result postAndAwaitResponse(std::shared_ptr<Message>& response, const T& timeout) {
+        return postAndAwaitResponseUntil(response,
+                Looper::GetNow() + std::chrono::duration_cast<Looper::clock::duration>(timeout));
+    }
+
+    typedef std::function<void(const std::shared_ptr<Message>& response)> ReplyCallback;
+
+    // Posts the message without waiting, the response arrives through the
+    // future once the target calls postReply(). It is NULL if the request
+    // fails as above.
+    Result postWithReply(std::future<std::shared_ptr<Message>>* response);
+
+    // Same, but the response is NULL if it didn't arrive within timeout.
+    template<typename T>
+    Result postWithReply(std::future<std::shared_ptr<Message>>* response, const T& timeout) {
+        return postWithReplyUntil(response,
+                Looper::GetNow() + std::chrono::duration_cast<Looper::clock::duration>(timeout));
+    }
+
+    // Posts the message without waiting, callback is called with the
+    // response on the thread that calls postReply(). If the request fails,
+    // it is called with NULL from a thread of the roster's.
+    Result postWithReply(const ReplyCallback& callback);
+
+    template<typename T>
+    Result postWithReply(const ReplyCallback& callback, const T& timeout) {
+        return postWithReplyUntil(callback,
+                Looper::GetNow() + std::chrono::duration_cast<Looper::clock::duration>(timeout));
+    }
+
     // If this returns true, the sender of this message is synchronously
     // awaiting a response, the "replyID" can be used to send the response
     // via "postReply" below.
@@ -95,6 +216,52 @@ public:
 
     std::string debugString(int32_t indent = 0) const;
 
+    // Fields written by reference rather than by value, see writeTo(). The
+    // reader must be handed the same table.
+    struct References {
+        References() : mMinBufferSize(0) {}
+
+        // Buffers smaller than this are still written inline.
+        size_t mMinBufferSize;
+        std::vector<std::shared_ptr<Buffer>> mBuffers;
+        std::vector<std::shared_ptr<Parcelable>> mObjects;
+    };
+
+    // Appends a compact binary encoding of the message: what, target,
+    // priority and every field, nested messages included. It is in host
+    // byte order and meant for logs and processes on the same host.
+    // Pointers are written as plain addresses. The range of a buffer is
+    // written inline (its meta is not), or, if refs is given, appended to
+    // refs and written as an index. Objects can only be written that way,
+    // without refs they fail with ER_BAD_TYPE. Messages nested more than
+    // 32 deep, or holding themselves, fail with ER_BAD_VALUE.
+    //
+    // Large inline buffers are appended to chain as segments of their own
+    // rather than copied, so their bytes must not change until the chain is
+    // consumed.
+    Result writeTo(BufferChain* chain, References* refs = NULL) const;
+
+    // Same, appended after the range of buffer, which then covers it.
+    // ER_NO_MEMORY, leaving buffer alone, if it doesn't fit.
+    Result writeTo(const std::shared_ptr<Buffer>& buffer, References* refs = NULL) const;
+
+    // Decodes a message written by writeTo() from the front of the range of
+    // buffer and consumes it, so a log can be read back one message after
+    // the other. Inline buffers decode to slices of buffer, sharing (and
+    // keeping alive) its memory instead of copying it. Returns
+    // ER_NOT_ENOUGH_DATA, consuming nothing, if buffer holds only part of
+    // a message, ER_BAD_VALUE if it isn't one and ER_BAD_INDEX if it
+    // references something refs doesn't hold. msg is only set on success.
+    // Field names new to this process aren't interned, see
+    // MessageKey::Named().
+    static Result readFrom(const std::shared_ptr<Buffer>& buffer, std::shared_ptr<Message>* msg,
+                           const References* refs = NULL);
+
+    // Same, from the front of chain. Inline buffers that straddle segments
+    // are the only bytes copied.
+    static Result readFrom(BufferChain* chain, std::shared_ptr<Message>* msg,
+                           const References* refs = NULL);
+
     enum Type {
         kTypeBoolean,
         kTypeInt32,
@@ -107,6 +274,7 @@ public:
         kTypeMessage,
         kTypeBuffer,
         kTypeObject,
+        kTypeBufferChain,
         kTypeUnknown,
     };
 
@@ -114,12 +282,37 @@ public:
     const std::string getEntryNameAt(const size_t index, Type& type) const;
 
 private:
+    friend class Looper;
+    friend class LooperPool;
+    friend class Tracer;
+
     uint32_t mWhat;
     Looper::handler_id mTarget;
+    Looper::Priority mPriority;
 
+    // Events of the looper the message is pending on, latest first. Only
+    // that looper touches it, under its lock.
+    Looper::Event* mPendingEvents;
+
+    // Events of a LooperPool strand the message is queued on, latest first,
+    // guarded by the lock of the strand's bucket.
+    Looper::Event* mStrandEvents;
+
+    // That looper's serial in the high half, and its posts of the message
+    // not yet delivered or cancelled in the low half. Posts to another
+    // looper are refused while there are any.
+    std::atomic<uint64_t> mPendingOn;
+
+    // Flow id of the latest post while tracing, see Tracer.
+    std::atomic<uint64_t> mTraceFlow;
+
+    /**
+     * One field, a tagged union. Only the member selected by mType is
+     * constructed; Item takes care of building and destroying it.
+     */
     class Item {
     public:
-        union {
+        union Value {
             bool boolValue;
             int32_t int32Value;
             int64_t int64Value;
@@ -127,36 +320,76 @@ private:
             float floatValue;
             double doubleValue;
             void* ptrValue;
+            std::string stringValue;
+            std::shared_ptr<Message> messagePtr;
+            std::shared_ptr<Buffer> bufferPtr;
+            std::shared_ptr<Parcelable> objectPtr;
+            std::shared_ptr<BufferChain> chainPtr;
+
+            Value() {}
+            ~Value() {}
         } value;
-        std::string stringValue;
-        std::shared_ptr<Message> messagePtr;
-        std::shared_ptr<Buffer> bufferPtr;
-        std::shared_ptr<Parcelable> objectPtr;
 
-        std::string mName;
+        MessageKey mKey;
         Type mType;
 
-        Item() : mType(kTypeUnknown) {}
-        ~Item() = default;
+        explicit Item(const MessageKey& key) : mKey(key), mType(kTypeUnknown) {}
+        Item(const Item& other);
+        Item(Item&& other) noexcept;
+        ~Item() { clear(); }
+
+        // Destroys the value, leaving the item typeless.
+        void clear();
+
+    private:
+        Item& operator=(const Item&) = delete;
     };
 
     enum {
-        kMaxNumItems = 64
+        kMaxNumItems = 64,
+        // Fields stored inside the Message itself before spilling to the heap.
+        kNumInlineItems = 8,
     };
 
-    std::vector<std::shared_ptr<Item>> mItems;
+    InlineVector<Item, kNumInlineItems> mItems;
 
     Message(const Message&) = delete;
 
     Message& operator=(const Message&) = delete;
 
-    void clearItem(std::shared_ptr<Item>& item);
+    // Returns the field called key, emptied, appending it if it's missing.
+    // The pointer is good until the next allocateItem().
+    Item* allocateItem(const MessageKey& key);
+
+    const Item* findItem(const MessageKey& key, Type type) const;
+
+    const Item* findItem(const std::string& name, Type type) const;
+
+    class Writer;
+    class Reader;
+
+    Result writeTo(Writer* writer, References* refs) const;
+
+    Result writeFields(Writer* writer, References* refs, int32_t depth) const;
+
+    static Result readFrom(Reader* reader, const References* refs, std::shared_ptr<Message>* msg);
+
+    static Result readFields(Reader* reader, const References* refs, int32_t depth,
+                             std::shared_ptr<Message>* msg);
+
+
+    Result postMessage(const Looper::clock::duration& delay);
+
+    Result postTimerMessage(const Looper::clock::duration& delay, Looper::TimerHandle* handle);
 
-    std::shared_ptr<Item> allocateItem(const std::string& name);
+    Result postAndAwaitResponseUntil(std::shared_ptr<Message>& response,
+                                     const Looper::clock::time_point& deadline);
 
-    const std::shared_ptr<Item> findItem(const std::string& name, Type type) const;
+    Result postWithReplyUntil(std::future<std::shared_ptr<Message>>* response,
+                              const Looper::clock::time_point& deadline);
 
-    Result postMessage(const std::chrono::system_clock::duration& delay);
+    Result postWithReplyUntil(const ReplyCallback& callback,
+                              const Looper::clock::time_point& deadline);
 };
 
 } // namespace baseutils
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MESSAGE_KEY_H_
+#define MESSAGE_KEY_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace baseutils {
+
+/**
+ *  @class MessageKey
+ *  @brief Interned name of a Message field
+ *
+ *  Interning happens once, when the key is constructed. Every key with the
+ *  same name shares one id, so Message compares keys as integers. Keys are
+ *  meant to be created once and reused, e.g.
+ *
+ *      static const MessageKey kKeyEventType("event-type");
+ *      msg->setInt32(kKeyEventType, kEventStart);
+ *
+ *  Names made up at runtime go through Named() instead, which doesn't
+ *  intern them.
+ */
+class MessageKey {
+public:
+    // A key that matches no field.
+    MessageKey();
+
+    explicit MessageKey(const char* name);
+
+    explicit MessageKey(const std::string& name);
+
+    uint32_t id() const { return mId; }
+
+    const std::string& name() const { return *mName; }
+
+    bool operator==(const MessageKey& other) const {
+        if (mId != 0 && other.mId != 0) {
+            return mId == other.mId;
+        }
+        return sameName(other);
+    }
+
+    bool operator!=(const MessageKey& other) const { return !(*this == other); }
+
+    // The interned key of name if there is one. Otherwise a key holding its
+    // own copy of name, freed with the last copy of the key, which equals
+    // any key of the same name. The table doesn't grow either way, which
+    // suits names built at runtime, e.g. "track-" + n.
+    static MessageKey Named(const std::string& name);
+
+    // Looks up an already interned name without interning it. Only finds
+    // interned keys, fields may also have keys from Named(), so match a
+    // field by name with Named() instead.
+    static bool Find(const std::string& name, MessageKey* key);
+
+private:
+    // 0 for a key from Named() that isn't interned, and for no key at all.
+    uint32_t mId;
+    // Interned names are never freed, others are in mOwnedName.
+    const std::string* mName;
+    std::shared_ptr<const std::string> mOwnedName;
+
+    void intern(const std::string& name);
+
+    // For keys that aren't both interned. No key only equals no key.
+    bool sameName(const MessageKey& other) const;
+};
+
+} // namespace baseutils
+
+#endif  // MESSAGE_KEY_H_
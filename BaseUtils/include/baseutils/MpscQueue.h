@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MPSC_QUEUE_H_
+#define MPSC_QUEUE_H_
+
+#include <atomic>
+
+namespace baseutils {
+
+/**
+ *  @class MpscQueue
+ *  @brief Intrusive lock-free multi-producer/single-consumer FIFO
+ *
+ *  Dmitry Vyukov's non-blocking MPSC queue. T must be default constructible
+ *  and provide a "std::atomic<T*> mNext" member; the queue never allocates.
+ *
+ *  push() may be called from any thread. pop() and empty() must only be
+ *  called by one consumer at a time, the caller is responsible for that.
+ */
+template<typename T>
+class MpscQueue {
+public:
+    MpscQueue() : mHead(&mStub), mPadding(), mTail(&mStub) {
+        mStub.mNext.store(nullptr, std::memory_order_relaxed);
+    }
+
+    void push(T* node) {
+        node->mNext.store(nullptr, std::memory_order_relaxed);
+        T* prev = mHead.exchange(node, std::memory_order_seq_cst);
+        // Between the exchange and this store the queue is briefly
+        // disconnected, pop() reports it as empty until the link lands.
+        prev->mNext.store(node, std::memory_order_release);
+    }
+
+    // Pushes first to last, already linked through mNext, with a single
+    // exchange. last->mNext must be NULL.
+    void pushChain(T* first, T* last) {
+        T* prev = mHead.exchange(last, std::memory_order_seq_cst);
+        prev->mNext.store(first, std::memory_order_release);
+    }
+
+    // Returns NULL if the queue is empty or a producer is halfway through
+    // push(). Check empty() to tell the two apart.
+    T* pop() {
+        T* tail = mTail;
+        T* next = tail->mNext.load(std::memory_order_acquire);
+
+        if (tail == &mStub) {
+            if (next == nullptr) {
+                return nullptr;
+            }
+            mTail = next;
+            tail = next;
+            next = next->mNext.load(std::memory_order_acquire);
+        }
+
+        if (next != nullptr) {
+            mTail = next;
+            return tail;
+        }
+
+        if (tail != mHead.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+
+        push(&mStub);
+
+        next = tail->mNext.load(std::memory_order_acquire);
+        if (next != nullptr) {
+            mTail = next;
+            return tail;
+        }
+        return nullptr;
+    }
+
+    bool empty() const {
+        return mTail == &mStub && mHead.load(std::memory_order_seq_cst) == &mStub;
+    }
+
+private:
+    enum {
+        kCacheLineSize = 64
+    };
+
+    // Producers swing mHead, the consumer owns mTail; keep them on separate
+    // cache lines.
+    std::atomic<T*> mHead;
+    char mPadding[kCacheLineSize - sizeof(std::atomic<T*>)];
+    T* mTail;
+    T mStub;
+
+    MpscQueue(const MpscQueue&) = delete;
+
+    MpscQueue& operator=(const MpscQueue&) = delete;
+};
+
+} // namespace baseutils
+
+#endif  // MPSC_QUEUE_H_
@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef REMOTE_LOOPER_H_
+#define REMOTE_LOOPER_H_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <baseutils/Looper.h>
+
+namespace baseutils {
+
+class Buffer;
+
+/**
+ *  @class RemoteLooper
+ *  @brief Looper whose handlers live in another process on the same host
+ *
+ *  A channel is a memfd segment shared by two processes, each attaching a
+ *  RemoteLooper to one side of it. The segment holds a ring per direction
+ *  and a pool of blocks for large buffers; an eventfd per side wakes it up.
+ *
+ *  A handler of the other process is imported once under a local id, and
+ *  messages posted to that id the usual way, Message::post() and friends,
+ *  are written to the ring and posted to the handler over there. Immediate
+ *  posts go straight to the ring, lock-free, from the posting thread;
+ *  delayed ones wait on the looper thread as usual. cancel() of a message
+ *  already sent and Parcelable objects don't cross, and messages awaiting
+ *  a reply are refused with ER_INVALID_OPERATION.
+ *
+ *  Buffers of kMinSharedBufferSize bytes or more are passed as an offset
+ *  into the block pool. Those from allocateBuffer() already live there and
+ *  are shared, not copied; others are copied there once.
+ */
+class RemoteLooper : public Looper {
+public:
+    enum Side {
+        kSideA,
+        kSideB,
+    };
+
+    // Descriptors of a channel. They are not close-on-exec, so a child can
+    // inherit them, or they can be sent over a unix socket.
+    struct Channel {
+        int mMemFd;
+        // Written to wake side A and side B respectively.
+        int mEventFds[2];
+
+        Channel() : mMemFd(-1), mEventFds{-1, -1} {}
+    };
+
+    enum {
+        kMinSharedBufferSize = 4096,
+    };
+
+    // Each ring holds ringSize bytes, rounded up to a power of two. Buffers
+    // bigger than blockSize are written to the ring instead.
+    static Result CreateChannel(Channel* channel, size_t ringSize = 1 << 20,
+                                size_t blockSize = 64 << 10, size_t numBlocks = 64);
+
+    static void CloseChannel(Channel* channel);
+
+    RemoteLooper();
+
+    virtual ~RemoteLooper();
+
+    // Maps the channel, keeping its own copies of the descriptors. Must be
+    // called once, before start().
+    Result attach(const Channel& channel, Side side);
+
+    // ER_NO_INIT if not attached.
+    virtual Result start(bool runOnCallingThread = false);
+
+    virtual Result stop();
+
+    // Returns a local id for handler remoteId of the other side, 0 on
+    // failure. Messages posted to it reach that handler.
+    handler_id importHandler(handler_id remoteId);
+
+    // A buffer in the block pool of the channel, sent without copying.
+    // NULL if size exceeds the block size or the pool is exhausted.
+    std::shared_ptr<Buffer> allocateBuffer(size_t size);
+
+    // Delayed messages that couldn't be sent once due, because the ring
+    // was full or the message can't be encoded. Immediate posts report it
+    // to the sender instead.
+    uint64_t droppedMessages() const { return mDropped.load(std::memory_order_relaxed); }
+
+    // Whether the other side wrote something into the ring that can't be a
+    // record. Nothing more is received then, and posts fail with
+    // ER_DEAD_OBJECT.
+    bool isBroken() const { return mBroken.load(std::memory_order_relaxed); }
+
+protected:
+    virtual Result post(const std::shared_ptr<Message>& msg, const clock::time_point& when);
+
+    virtual void dispatch(const std::shared_ptr<Message>& msg);
+
+    virtual void dispatchBatch(const std::vector<std::shared_ptr<Message>>& msgs);
+
+private:
+    enum {
+        // Messages received per wakeup before letting other work run.
+        kReceiveBatch = 64,
+    };
+
+    class Segment;
+    class Proxy;
+
+    std::shared_ptr<Segment> mSegment;
+    Side mSide;
+    // Our own eventfd, and the other side's.
+    int mEventFd;
+    int mPeerEventFd;
+
+    std::mutex mImportLock;
+    // Local id to the id of the handler in the other process.
+    std::unordered_map<handler_id, handler_id> mImports;
+
+    std::atomic<uint64_t> mDropped;
+    std::atomic<bool> mBroken;
+
+    Result send(const std::shared_ptr<Message>& msg);
+
+    // Called on the looper thread when the other side woke us up.
+    void receive();
+
+    RemoteLooper(const RemoteLooper&) = delete;
+
+    RemoteLooper& operator=(const RemoteLooper&) = delete;
+};
+
+} // namespace baseutils
+
+#endif  // REMOTE_LOOPER_H_
@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+namespace baseutils {
+
+class Message;
+
+/**
+ *  @class TimerWheel
+ *  @brief Hierarchical timing wheel of messages
+ *
+ *  Deadlines are rounded up to whole ticks. Four levels of 256 slots cover
+ *  2^32 ticks, later deadlines wait in an overflow list. Adding and removing
+ *  are O(1), and everything due in a tick expires as one batch.
+ *
+ *  Not thread safe, the owning Looper guards it with its lock.
+ */
+class TimerWheel {
+public:
+    typedef std::chrono::steady_clock clock;
+
+    // 0 is never a valid id.
+    typedef uint64_t timer_id;
+
+    explicit TimerWheel(const clock::duration& tick = std::chrono::milliseconds(1));
+
+    clock::duration tick() const { return mTick; }
+
+    // Only possible while the wheel is empty.
+    bool setTick(const clock::duration& tick);
+
+    size_t size() const { return mSize; }
+
+    bool empty() const { return mSize == 0; }
+
+    // now is the caller's current time, on the clock it passes to
+    // advance(). An empty wheel skips ahead to it.
+    timer_id add(const clock::time_point& when, const clock::time_point& now,
+                 const std::shared_ptr<Message>& msg);
+
+    // Returns false if id expired or was removed already.
+    bool remove(timer_id id);
+
+    // Removes every timer whose message has this target and what, returns
+    // how many. Walks all timers.
+    size_t removeMessages(int32_t target, uint32_t what);
+
+    // Appends the messages of every tick up to now to expired, in order.
+    void advance(const clock::time_point& now, std::deque<std::shared_ptr<Message>>* expired);
+
+    // When advance() next has work to do, clock::time_point::max() if the
+    // wheel is empty. Can be early, never late.
+    clock::time_point nextDeadline() const;
+
+private:
+    enum {
+        kSlotBits = 8,
+        kNumSlots = 1 << kSlotBits,
+        kNumLevels = 4,
+        // Slot index of the overflow list.
+        kOverflow = kNumLevels * kNumSlots,
+        kNumLists = kOverflow + 1,
+    };
+
+    static const uint32_t kNil = UINT32_MAX;
+
+    struct Node {
+        std::shared_ptr<Message> mMessage;
+        uint64_t mExpiry;
+        uint32_t mPrev;
+        uint32_t mNext;
+        // Bumped every time the node is freed, invalidating old ids.
+        uint32_t mGeneration;
+        // List the node is on, kNil while free.
+        uint32_t mList;
+    };
+
+    clock::duration mTick;
+    std::vector<Node> mNodes;
+    std::vector<uint32_t> mFreeNodes;
+    uint32_t mHeads[kNumLists];
+    uint32_t mTails[kNumLists];
+    // Non-empty slots of level 0.
+    uint64_t mLevel0Bits[kNumSlots / 64];
+    // The next tick to expire, every timer is due at or after it.
+    uint64_t mCurrent;
+    size_t mSize;
+
+    uint64_t tickOf(const clock::time_point& when, bool roundUp) const;
+
+    void link(uint32_t index);
+
+    void unlink(uint32_t index);
+
+    void release(uint32_t index);
+
+    // Moves the timers of a list back in, relative to mCurrent.
+    void cascade(uint32_t list);
+
+    TimerWheel(const TimerWheel&) = delete;
+
+    TimerWheel& operator=(const TimerWheel&) = delete;
+};
+
+} // namespace baseutils
+
+#endif  // TIMER_WHEEL_H_
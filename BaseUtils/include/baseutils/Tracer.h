@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef TRACER_H_
+#define TRACER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <baseutils/Result.h>
+
+namespace baseutils {
+
+class Message;
+
+/**
+ *  @class Tracer
+ *  @brief Records the lifecycle of messages for chrome://tracing
+ *
+ *  While enabled, posting a message, a looper taking it off its queue and
+ *  the handler running it are recorded, each to a ring buffer of the
+ *  calling thread without locking. Every post gives the message a new flow
+ *  id, so the trace links the three across threads and, for a handler that
+ *  posts on, hop to hop along a pipeline of loopers. While disabled, each
+ *  hook costs a relaxed load and a branch.
+ */
+class Tracer {
+public:
+    // Off by default.
+    static void setEnabled(bool enable);
+
+    static bool isEnabled() { return sEnabled.load(std::memory_order_relaxed); }
+
+    // Events kept per thread, the oldest get overwritten. 16384 by default,
+    // taken by threads when they record their first event.
+    static void setBufferCapacity(size_t events);
+
+    // Names the calling thread in the trace. Loopers name their thread
+    // after Looper::setName().
+    static void setThreadName(const std::string& name);
+
+    // Writes the recorded events in the Chrome trace event JSON format,
+    // which Perfetto opens as well.
+    static void dump(std::string* json);
+
+    static Result dump(int fd);
+
+    // Drops everything recorded so far.
+    static void clear();
+
+private:
+    friend class Looper;
+    friend class LooperPool;
+    friend class LooperRoster;
+
+    static std::atomic<bool> sEnabled;
+
+    // Gives msg a new flow id and records the post. Called before msg is
+    // queued.
+    static void tracePost(Message& msg);
+
+    static void traceDequeue(const Message& msg);
+
+    // A handler call covers one message, or a batch of them: the first
+    // goes to traceHandlerBegin(), the others to traceHandlerJoin().
+    static void traceHandlerBegin(const Message& msg);
+
+    static void traceHandlerJoin(const Message& msg);
+
+    static void traceHandlerEnd();
+
+    Tracer() = delete;
+};
+
+} // namespace baseutils
+
+#endif  // TRACER_H_
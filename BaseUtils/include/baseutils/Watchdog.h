@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef WATCHDOG_H_
+#define WATCHDOG_H_
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <baseutils/Handler.h>
+#include <baseutils/Looper.h>
+
+namespace baseutils {
+
+/**
+ *  @class Watchdog
+ *  @brief Reports handlers that run too long and queues that stall
+ *
+ *  Samples the loopers it watches from the outside: a handler that blocks
+ *  holds up every other handler of its looper, which otherwise only shows
+ *  as timeouts further down. Register it with a looper of its own, not one
+ *  it watches, and start() it; or call check() from wherever suits.
+ */
+class Watchdog : public Handler {
+public:
+    struct Report {
+        enum Kind {
+            // A handler call has been running longer than the budget.
+            kSlowHandler,
+            // A due message has been waiting longer than the age limit.
+            kStaleQueue,
+        };
+
+        Kind mKind;
+        std::string mLooperName;
+        // The handler running and the what of its message, kSlowHandler
+        // only.
+        Looper::handler_id mTarget;
+        uint32_t mWhat;
+        // Time in the handler so far, or age of the oldest due message.
+        Looper::clock::duration mElapsed;
+        // Messages pending on the looper.
+        size_t mQueueDepth;
+    };
+
+    // Called on the thread running check(), with no lock held.
+    typedef std::function<void(const Report& report)> ReportCallback;
+
+    // A zero budget or limit turns that check off.
+    Watchdog(const Looper::clock::duration& handlerBudget,
+             const Looper::clock::duration& queueAgeLimit,
+             const ReportCallback& callback);
+
+    virtual ~Watchdog();
+
+    // Turns on dispatch tracking of looper, and its latency tracking if
+    // queue age is checked, until unwatched or the watchdog is gone. Only a
+    // weak reference is kept.
+    Result watch(const std::shared_ptr<Looper>& looper);
+
+    // Turns off again what watch() turned on, if looper is watched.
+    void unwatch(const std::shared_ptr<Looper>& looper);
+
+    // Samples every watched looper once. Each slow handler call is
+    // reported once, and a stale queue once until it catches up again.
+    void check();
+
+    // Calls check() every interval on the looper this is registered with.
+    Result start(const Looper::clock::duration& interval);
+
+    void stop();
+
+protected:
+    virtual void onMessageReceived(const std::shared_ptr<Message>& msg);
+
+private:
+    enum {
+        kWhatCheck,
+    };
+
+    struct Watched {
+        std::weak_ptr<Looper> mLooper;
+        // Start of the handler calls reported already.
+        std::vector<Looper::clock::time_point> mReportedDispatches;
+        bool mStale;
+    };
+
+    const Looper::clock::duration mHandlerBudget;
+    const Looper::clock::duration mQueueAgeLimit;
+    const ReportCallback mCallback;
+
+    std::mutex mLock;
+    std::vector<Watched> mWatched;
+    Looper::clock::duration mInterval;
+    // Bumped by start() and stop(), checks posted before are dropped.
+    int32_t mGeneration;
+
+    void scheduleCheck_l();
+
+    // Undoes the tracking watch() turned on for looper.
+    void untrack(const std::shared_ptr<Looper>& looper);
+};
+
+} // namespace baseutils
+
+#endif  // WATCHDOG_H_
@@ -0,0 +1,76 @@
+#include <benchmark/benchmark.h>
+#include <baseutils/Buffer.h>
+#include <baseutils/BufferChain.h>
+#include <baseutils/BufferPool.h>
+#include <cstring>
+#include <memory>
+
+using namespace std;
+using namespace baseutils;
+
+// Allocates a buffer of state.range(0) bytes, writes its first byte of every
+// page, as a producer filling it would, and drops it.
+static void BM_BufferMakeShared(benchmark::State& state) {
+	size_t size = state.range(0);
+	for (auto _ : state) {
+		auto buffer(make_shared<Buffer>(size));
+		for (size_t offset = 0; offset < size; offset += 4096) {
+			buffer->base()[offset] = 1;
+		}
+		benchmark::DoNotOptimize(buffer);
+	}
+	state.SetBytesProcessed(state.iterations() * size);
+}
+
+static void BM_BufferPoolAcquire(benchmark::State& state) {
+	size_t size = state.range(0);
+	BufferPool* pool = BufferPool::getInstance();
+	for (auto _ : state) {
+		auto buffer(pool->acquire(size));
+		for (size_t offset = 0; offset < size; offset += 4096) {
+			buffer->base()[offset] = 1;
+		}
+		benchmark::DoNotOptimize(buffer);
+	}
+	state.SetBytesProcessed(state.iterations() * size);
+}
+
+BENCHMARK(BM_BufferMakeShared)->RangeMultiplier(16)->Range(4 << 10, 2 << 20)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_BufferPoolAcquire)->RangeMultiplier(16)->Range(4 << 10, 2 << 20)->ThreadRange(1, 8)->UseRealTime();
+
+// Frames a state.range(0) byte body with a small header and trailer by
+// copying everything into one buffer.
+static void BM_FrameByCopy(benchmark::State& state) {
+	auto header(make_shared<Buffer>(16));
+	auto body(make_shared<Buffer>(state.range(0)));
+	auto trailer(make_shared<Buffer>(4));
+	header->setSize(16);
+	body->setSize(state.range(0));
+	trailer->setSize(4);
+	for (auto _ : state) {
+		auto frame(BufferPool::getInstance()->acquire(header->size() + body->size() + trailer->size()));
+		uint8_t* out = frame->base();
+		memcpy(out, header->data(), header->size());
+		memcpy(out + header->size(), body->data(), body->size());
+		memcpy(out + header->size() + body->size(), trailer->data(), trailer->size());
+		benchmark::DoNotOptimize(frame);
+	}
+}
+
+static void BM_FrameByChain(benchmark::State& state) {
+	auto header(make_shared<Buffer>(16));
+	auto body(make_shared<Buffer>(state.range(0)));
+	auto trailer(make_shared<Buffer>(4));
+	header->setSize(16);
+	body->setSize(state.range(0));
+	trailer->setSize(4);
+	for (auto _ : state) {
+		BufferChain frame(body);
+		frame.prepend(header);
+		frame.append(trailer);
+		benchmark::DoNotOptimize(frame);
+	}
+}
+
+BENCHMARK(BM_FrameByCopy)->Arg(4 << 10)->Arg(256 << 10)->Arg(1 << 20);
+BENCHMARK(BM_FrameByChain)->Arg(4 << 10)->Arg(256 << 10)->Arg(1 << 20);
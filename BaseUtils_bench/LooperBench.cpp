@@ -0,0 +1,501 @@
+#include <benchmark/benchmark.h>
+#include <baseutils/Looper.h>
+#include <baseutils/Handler.h>
+#include <baseutils/LooperPool.h>
+#include <baseutils/Message.h>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+using namespace baseutils;
+
+class NullHandler : public Handler {
+protected:
+	virtual void onMessageReceived(const shared_ptr<Message>&) { }
+};
+
+static shared_ptr<Looper> sLooper;
+static shared_ptr<NullHandler> sHandler;
+
+static void StartSharedLooper(const benchmark::State&) {
+	sLooper = make_shared<Looper>();
+	sHandler = make_shared<NullHandler>();
+	sLooper->registerHandler(sHandler);
+	sLooper->start();
+}
+
+static void StopSharedLooper(const benchmark::State&) {
+	sLooper->stop();
+	sLooper.reset();
+	sHandler.reset();
+}
+
+// The looper is never started, so every post stays queued behind
+// state.range(0) timers that are due far in the future.
+static void BM_LooperPostWithPendingTimers(benchmark::State& state, bool delayed) {
+	auto looper(make_shared<Looper>());
+	auto handler(make_shared<NullHandler>());
+	looper->registerHandler(handler);
+
+	mt19937 random(0);
+	uniform_int_distribution<int64_t> delayUs(3600000000LL, 7200000000LL);
+	for (int64_t i = 0; i < state.range(0); i++) {
+		make_shared<Message>(handler->id(), 0)->post(delayUs(random));
+	}
+
+	auto msg(make_shared<Message>(handler->id(), 1));
+	for (auto _ : state) {
+		msg->post(delayed ? delayUs(random) : 0);
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_LooperPostDelayed(benchmark::State& state) {
+	BM_LooperPostWithPendingTimers(state, true);
+}
+
+static void BM_LooperPostImmediate(benchmark::State& state) {
+	BM_LooperPostWithPendingTimers(state, false);
+}
+
+// A fixed iteration count keeps the queue from growing far past the
+// requested depth while the benchmark runs.
+BENCHMARK(BM_LooperPostDelayed)->Arg(0)->Arg(100)->Arg(1000)->Arg(10000)->Arg(100000)->Iterations(10000);
+BENCHMARK(BM_LooperPostImmediate)->Arg(0)->Arg(100)->Arg(1000)->Arg(10000)->Arg(100000)->Iterations(10000);
+
+// Arms a timeout and cancels it again, as a request that gets its answer in
+// time does, with state.range(0) other timeouts pending.
+static void BM_TimeoutArmCancel(benchmark::State& state, bool wheel) {
+	auto looper(make_shared<Looper>());
+	auto handler(make_shared<NullHandler>());
+	looper->registerHandler(handler);
+
+	mt19937 random(0);
+	uniform_int_distribution<int64_t> delayMs(1000, 60000);
+	vector<Looper::TimerHandle> pending(state.range(0));
+	for (int64_t i = 0; i < state.range(0); i++) {
+		auto msg(make_shared<Message>(handler->id(), 0));
+		if (wheel) {
+			msg->postTimer(milliseconds(delayMs(random)), &pending[i]);
+		} else {
+			msg->post(milliseconds(delayMs(random)));
+		}
+	}
+
+	auto msg(make_shared<Message>(handler->id(), 1));
+	Looper::TimerHandle handle;
+	for (auto _ : state) {
+		if (wheel) {
+			msg->postTimer(milliseconds(delayMs(random)), &handle);
+			handle.cancel();
+		} else {
+			msg->post(milliseconds(delayMs(random)));
+			msg->cancel();
+		}
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_TimeoutArmCancelHeap(benchmark::State& state) {
+	BM_TimeoutArmCancel(state, false);
+}
+
+static void BM_TimeoutArmCancelWheel(benchmark::State& state) {
+	BM_TimeoutArmCancel(state, true);
+}
+
+BENCHMARK(BM_TimeoutArmCancelHeap)->Arg(1000)->Arg(100000);
+BENCHMARK(BM_TimeoutArmCancelWheel)->Arg(1000)->Arg(100000);
+
+// state.threads() producers post to one running looper.
+static void BM_LooperPostContended(benchmark::State& state) {
+	auto msg(make_shared<Message>(sHandler->id(), 0));
+	for (auto _ : state) {
+		msg->post();
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_LooperPostContended)
+		->Setup(StartSharedLooper)->Teardown(StopSharedLooper)
+		->ThreadRange(1, 32)->Iterations(20000)->UseRealTime();
+
+static vector<shared_ptr<Looper>> sLoopers;
+static vector<shared_ptr<NullHandler>> sHandlers;
+
+static void StartLooperPerThread(const benchmark::State& state) {
+	for (int i = 0; i < state.threads(); i++) {
+		sLoopers.push_back(make_shared<Looper>());
+		sHandlers.push_back(make_shared<NullHandler>());
+		sLoopers.back()->registerHandler(sHandlers.back());
+		sLoopers.back()->start();
+	}
+}
+
+static void StopLooperPerThread(const benchmark::State&) {
+	for (auto& looper : sLoopers) {
+		looper->stop();
+	}
+	sLoopers.clear();
+	sHandlers.clear();
+}
+
+// Every producer thread feeds its own looper, so the only state they share
+// is the handler registry.
+static void BM_LooperPostScaling(benchmark::State& state) {
+	auto msg(make_shared<Message>(sHandlers[state.thread_index()]->id(), 0));
+	for (auto _ : state) {
+		msg->post();
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_LooperPostScaling)
+		->Setup(StartLooperPerThread)->Teardown(StopLooperPerThread)
+		->ThreadRange(1, 16)->Iterations(20000)->UseRealTime();
+
+class CountingHandler : public Handler {
+public:
+	CountingHandler() : mCount(0) {}
+
+	atomic<int64_t> mCount;
+
+protected:
+	virtual void onMessageReceived(const shared_ptr<Message>&) {
+		mCount.fetch_add(1, memory_order_relaxed);
+	}
+
+	virtual bool wantsBatches() const { return true; }
+
+	virtual void onMessagesReceived(const vector<shared_ptr<Message>> &msgs) {
+		mCount.fetch_add(msgs.size(), memory_order_relaxed);
+	}
+};
+
+static vector<shared_ptr<CountingHandler>> sFanInHandlers;
+
+static void StartFanIn(const benchmark::State& state) {
+	StartSharedLooper(state);
+	for (int i = 0; i < state.threads(); i++) {
+		sFanInHandlers.push_back(make_shared<CountingHandler>());
+		sLooper->registerHandler(sFanInHandlers.back());
+	}
+}
+
+static void StopFanIn(const benchmark::State& state) {
+	StopSharedLooper(state);
+	sFanInHandlers.clear();
+}
+
+// state.threads() producers each send bursts of 256 to their own handler on
+// one shared looper, and wait for them to be delivered. Unlike
+// BM_LooperPostContended, the looper thread's side is part of the cost.
+static void BM_LooperFanIn(benchmark::State& state) {
+	CountingHandler& handler = *sFanInHandlers[state.thread_index()];
+	int64_t sent = 0;
+	for (auto _ : state) {
+		for (int i = 0; i < 256; i++) {
+			Message::obtain(handler.id(), 0)->post();
+		}
+		sent += 256;
+		while (handler.mCount.load() < sent) {
+			this_thread::yield();
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * 256);
+}
+
+BENCHMARK(BM_LooperFanIn)
+		->Setup(StartFanIn)->Teardown(StopFanIn)
+		->ThreadRange(1, 8)->UseRealTime();
+
+class EchoHandler : public Handler {
+protected:
+	virtual void onMessageReceived(const shared_ptr<Message> &msg) {
+		uint32_t replyId;
+		if (msg->senderAwaitsResponse(replyId)) {
+			Message::obtain()->postReply(replyId);
+		}
+	}
+};
+
+static vector<shared_ptr<Looper>> sEchoLoopers;
+static vector<shared_ptr<EchoHandler>> sEchoHandlers;
+
+static void StartEchoPerThread(const benchmark::State& state) {
+	for (int i = 0; i < state.threads(); i++) {
+		sEchoLoopers.push_back(make_shared<Looper>());
+		sEchoHandlers.push_back(make_shared<EchoHandler>());
+		sEchoLoopers.back()->registerHandler(sEchoHandlers.back());
+		sEchoLoopers.back()->start();
+	}
+}
+
+static void StopEchoPerThread(const benchmark::State&) {
+	for (auto& looper : sEchoLoopers) {
+		looper->stop();
+	}
+	sEchoLoopers.clear();
+	sEchoHandlers.clear();
+}
+
+// state.threads() callers each wait on a reply from their own looper, so
+// every pending request has a distinct waiter.
+static void BM_RequestReply(benchmark::State& state) {
+	Looper::handler_id target = sEchoHandlers[state.thread_index()]->id();
+	for (auto _ : state) {
+		shared_ptr<Message> response;
+		Message::obtain(target)->postAndAwaitResponse(response);
+		benchmark::DoNotOptimize(response);
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_RequestReply)
+		->Setup(StartEchoPerThread)->Teardown(StopEchoPerThread)
+		->Threads(1)->Threads(8)->Threads(64)->Iterations(2000)->UseRealTime();
+
+// Passes a message back and forth between handlers on two loopers until it
+// made mHops hops.
+class PingPongHandler : public Handler {
+public:
+	PingPongHandler() : mPeer(0), mHops(0), mDone(false) {}
+
+	Looper::handler_id mPeer;
+	int64_t mHops;
+	atomic<bool> mDone;
+
+protected:
+	virtual void onMessageReceived(const shared_ptr<Message> &msg) {
+		int64_t hop = 0;
+		msg->findInt64("hop", &hop);
+		if (++hop == mHops) {
+			mDone.store(true);
+			return;
+		}
+		msg->setTarget(mPeer);
+		msg->setInt64("hop", hop);
+		msg->post();
+	}
+};
+
+// Post to deliver latency between two loopers, one hop at a time.
+static void BM_LooperPingPong(benchmark::State& state) {
+	const int64_t kHops = 1000;
+	auto ping(make_shared<Looper>());
+	auto pong(make_shared<Looper>());
+	auto pingHandler(make_shared<PingPongHandler>());
+	auto pongHandler(make_shared<PingPongHandler>());
+	ping->registerHandler(pingHandler);
+	pong->registerHandler(pongHandler);
+	pingHandler->mPeer = pongHandler->id();
+	pongHandler->mPeer = pingHandler->id();
+	ping->start();
+	pong->start();
+
+	for (auto _ : state) {
+		pingHandler->mHops = pongHandler->mHops = kHops;
+		pingHandler->mDone.store(false);
+		pongHandler->mDone.store(false);
+		Message::obtain(pingHandler->id(), 0)->post();
+		while (!pingHandler->mDone.load() && !pongHandler->mDone.load()) {
+			this_thread::yield();
+		}
+	}
+	ping->stop();
+	pong->stop();
+	state.counters["per_hop"] = benchmark::Counter(kHops,
+			benchmark::Counter::kIsIterationInvariantRate | benchmark::Counter::kInvert);
+}
+
+BENCHMARK(BM_LooperPingPong)->UseRealTime();
+
+// Burns a little CPU per message, then counts it.
+class BusyHandler : public Handler {
+public:
+	explicit BusyHandler(atomic<int64_t>* done) : mDone(done) {}
+
+protected:
+	virtual void onMessageReceived(const shared_ptr<Message> &msg) {
+		uint64_t x = msg->what();
+		for (int i = 0; i < 2000; i++) {
+			x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+		}
+		benchmark::DoNotOptimize(x);
+		mDone->fetch_add(1, memory_order_relaxed);
+	}
+
+private:
+	atomic<int64_t>* mDone;
+};
+
+// Spreads 1000 messages over 16 busy handlers, on one Looper when
+// state.range(0) is 0, otherwise on a LooperPool with that many workers.
+static void BM_LooperFanOut(benchmark::State& state) {
+	const int64_t kMessages = 1000;
+	atomic<int64_t> done(0);
+	shared_ptr<Looper> looper;
+	if (state.range(0) == 0) {
+		looper = make_shared<Looper>();
+	} else {
+		looper = make_shared<LooperPool>(state.range(0));
+	}
+	vector<shared_ptr<BusyHandler>> handlers;
+	for (int i = 0; i < 16; i++) {
+		handlers.push_back(make_shared<BusyHandler>(&done));
+		looper->registerHandler(handlers.back());
+	}
+	looper->start();
+
+	int64_t expected = 0;
+	for (auto _ : state) {
+		for (int64_t i = 0; i < kMessages; i++) {
+			Message::obtain(handlers[i % handlers.size()]->id(), i)->post();
+		}
+		expected += kMessages;
+		while (done.load() < expected) {
+			this_thread::yield();
+		}
+	}
+	looper->stop();
+	state.SetItemsProcessed(state.iterations() * kMessages);
+}
+
+BENCHMARK(BM_LooperFanOut)->Arg(0)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->UseRealTime();
+
+class ControlHandler : public Handler {
+public:
+	ControlHandler() : mControlledAt(0) {}
+
+	// steady_clock ticks at delivery of the control message, 0 before.
+	atomic<steady_clock::rep> mControlledAt;
+
+protected:
+	virtual void onMessageReceived(const shared_ptr<Message> &msg) {
+		if (msg->what() == 1) {
+			mControlledAt.store(steady_clock::now().time_since_epoch().count());
+			return;
+		}
+		uint64_t x = msg->what();
+		for (int i = 0; i < 2000; i++) {
+			x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+		}
+		benchmark::DoNotOptimize(x);
+	}
+};
+
+// Time from posting a control message behind 1000 bulk messages to its
+// delivery, as kPriorityNormal (0) or kPriorityUrgent (1). Stamped by the
+// handler, so it doesn't depend on when this thread gets to look.
+static void BM_ControlBehindBulk(benchmark::State& state) {
+	auto looper(make_shared<Looper>());
+	auto handler(make_shared<ControlHandler>());
+	looper->registerHandler(handler);
+	looper->start();
+
+	for (auto _ : state) {
+		for (int i = 0; i < 1000; i++) {
+			Message::obtain(handler->id(), 0)->post();
+		}
+		auto control(Message::obtain(handler->id(), 1));
+		control->setPriority(state.range(0) ? Looper::kPriorityUrgent : Looper::kPriorityNormal);
+
+		steady_clock::time_point start = steady_clock::now();
+		control->post();
+		while (handler->mControlledAt.load() == 0) {
+			this_thread::yield();
+		}
+		steady_clock::time_point delivered(steady_clock::duration(handler->mControlledAt.load()));
+		state.SetIterationTime(duration<double>(delivered - start).count());
+		handler->mControlledAt.store(0);
+		looper->removeMessages(handler->id(), 0);
+	}
+	looper->stop();
+}
+
+BENCHMARK(BM_ControlBehindBulk)->Arg(0)->Arg(1)->UseManualTime();
+
+class StateHandler : public Handler {
+public:
+	StateHandler() : mLatest(-1) {}
+
+	atomic<int64_t> mLatest;
+
+protected:
+	virtual void onMessageReceived(const shared_ptr<Message> &msg) {
+		uint64_t x = msg->what();
+		for (int i = 0; i < 2000; i++) {
+			x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+		}
+		benchmark::DoNotOptimize(x);
+
+		int64_t value;
+		msg->findInt64("value", &value);
+		mLatest.store(value);
+	}
+};
+
+// Posts 1000 state updates and waits for the handler to see the last one,
+// with post() (0) or postReplacing() (1).
+static void BM_StateUpdates(benchmark::State& state) {
+	auto looper(make_shared<Looper>());
+	auto handler(make_shared<StateHandler>());
+	looper->registerHandler(handler);
+	looper->start();
+
+	int64_t value = 0;
+	for (auto _ : state) {
+		for (int i = 0; i < 1000; i++) {
+			auto msg(Message::obtain(handler->id(), 0));
+			msg->setInt64("value", ++value);
+			if (state.range(0)) {
+				msg->postReplacing();
+			} else {
+				msg->post();
+			}
+		}
+		while (handler->mLatest.load() != value) {
+			this_thread::yield();
+		}
+	}
+	looper->stop();
+	state.SetItemsProcessed(state.iterations() * 1000);
+}
+
+BENCHMARK(BM_StateUpdates)->Arg(0)->Arg(1)->UseRealTime();
+
+// Sending a burst of 64 one post at a time (0) or in a single postBatch() (1).
+static void BM_PostBatch(benchmark::State& state) {
+	auto looper(make_shared<Looper>());
+	auto handler(make_shared<CountingHandler>());
+	looper->registerHandler(handler);
+	looper->start();
+
+	vector<shared_ptr<Message>> burst;
+	int64_t sent = 0;
+	for (auto _ : state) {
+		burst.clear();
+		for (int i = 0; i < 64; i++) {
+			burst.push_back(Message::obtain(handler->id(), i));
+		}
+		if (state.range(0)) {
+			looper->postBatch(burst);
+		} else {
+			for (auto& msg : burst) {
+				msg->post();
+			}
+		}
+		sent += burst.size();
+		while (handler->mCount.load() != sent) {
+			this_thread::yield();
+		}
+	}
+	looper->stop();
+	state.SetItemsProcessed(state.iterations() * 64);
+}
+
+BENCHMARK(BM_PostBatch)->Arg(0)->Arg(1)->UseRealTime();
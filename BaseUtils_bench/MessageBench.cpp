@@ -0,0 +1,262 @@
+#include <benchmark/benchmark.h>
+#include <baseutils/Buffer.h>
+#include <baseutils/Message.h>
+#include <baseutils/MessageKey.h>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace baseutils;
+
+// Counts every heap allocation made by the benchmark binary, so each
+// benchmark can report allocations per operation. Every form of the global
+// operators is replaced, so whatever allocates goes through the same pair.
+static atomic<uint64_t> sAllocations(0);
+
+static void* countedAlloc(size_t size, size_t alignment) {
+	sAllocations.fetch_add(1, memory_order_relaxed);
+	if (size == 0) {
+		size = 1;
+	}
+	if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+		return malloc(size);
+	}
+	// aligned_alloc wants the size to be a multiple of the alignment.
+	return aligned_alloc(alignment, (size + alignment - 1) & ~(alignment - 1));
+}
+
+static void* countedNew(size_t size, size_t alignment) {
+	void* ptr = countedAlloc(size, alignment);
+	if (ptr == nullptr) {
+		throw bad_alloc();
+	}
+	return ptr;
+}
+
+void* operator new(size_t size) {
+	return countedNew(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void* operator new[](size_t size) {
+	return countedNew(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void* operator new(size_t size, align_val_t alignment) {
+	return countedNew(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, align_val_t alignment) {
+	return countedNew(size, static_cast<size_t>(alignment));
+}
+
+void* operator new(size_t size, const nothrow_t&) noexcept {
+	return countedAlloc(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void* operator new[](size_t size, const nothrow_t&) noexcept {
+	return countedAlloc(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void* operator new(size_t size, align_val_t alignment, const nothrow_t&) noexcept {
+	return countedAlloc(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, align_val_t alignment, const nothrow_t&) noexcept {
+	return countedAlloc(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete[](void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { free(ptr); }
+void operator delete(void* ptr, align_val_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, align_val_t) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t, align_val_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t, align_val_t) noexcept { free(ptr); }
+void operator delete(void* ptr, const nothrow_t&) noexcept { free(ptr); }
+void operator delete[](void* ptr, const nothrow_t&) noexcept { free(ptr); }
+void operator delete(void* ptr, align_val_t, const nothrow_t&) noexcept { free(ptr); }
+void operator delete[](void* ptr, align_val_t, const nothrow_t&) noexcept { free(ptr); }
+
+static vector<MessageKey> makeKeys(int64_t count) {
+	vector<MessageKey> keys;
+	for (int64_t i = 0; i < count; i++) {
+		keys.push_back(MessageKey("field-" + to_string(i)));
+	}
+	return keys;
+}
+
+static void reportAllocations(benchmark::State& state, uint64_t start) {
+	state.counters["allocs/op"] = benchmark::Counter(
+			(double)(sAllocations.load() - start) / state.iterations());
+}
+
+// Builds a message with state.range(0) int32 fields.
+static void BM_MessageSet(benchmark::State& state) {
+	vector<MessageKey> keys = makeKeys(state.range(0));
+	uint64_t start = sAllocations.load();
+	for (auto _ : state) {
+		auto msg(make_shared<Message>(1, 0));
+		for (auto& key : keys) {
+			msg->setInt32(key, 1);
+		}
+		benchmark::DoNotOptimize(msg);
+	}
+	reportAllocations(state, start);
+}
+
+// Looks up every field of a message with state.range(0) fields.
+static void BM_MessageFind(benchmark::State& state) {
+	vector<MessageKey> keys = makeKeys(state.range(0));
+	auto msg(make_shared<Message>(1, 0));
+	for (auto& key : keys) {
+		msg->setInt32(key, 1);
+	}
+
+	uint64_t start = sAllocations.load();
+	for (auto _ : state) {
+		int32_t value;
+		for (auto& key : keys) {
+			benchmark::DoNotOptimize(msg->findInt32(key, &value));
+		}
+	}
+	reportAllocations(state, start);
+}
+
+static void BM_MessageFindByName(benchmark::State& state) {
+	vector<MessageKey> keys = makeKeys(state.range(0));
+	auto msg(make_shared<Message>(1, 0));
+	for (auto& key : keys) {
+		msg->setInt32(key, 1);
+	}
+
+	uint64_t start = sAllocations.load();
+	for (auto _ : state) {
+		int32_t value;
+		for (auto& key : keys) {
+			benchmark::DoNotOptimize(msg->findInt32(key.name(), &value));
+		}
+	}
+	reportAllocations(state, start);
+}
+
+// Duplicates a message with state.range(0) fields, half of them strings.
+static void BM_MessageDuplicate(benchmark::State& state) {
+	vector<MessageKey> keys = makeKeys(state.range(0));
+	auto msg(make_shared<Message>(1, 0));
+	for (size_t i = 0; i < keys.size(); i++) {
+		if (i % 2) {
+			msg->setString(keys[i], "value");
+		} else {
+			msg->setInt64(keys[i], i);
+		}
+	}
+
+	uint64_t start = sAllocations.load();
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(msg->duplicate());
+	}
+	reportAllocations(state, start);
+}
+
+// Creates and drops a message with a couple of fields, the common shape of
+// a posted event.
+static void BM_MessageMakeShared(benchmark::State& state) {
+	MessageKey key("value");
+	uint64_t start = sAllocations.load();
+	for (auto _ : state) {
+		auto msg(make_shared<Message>(1, 0));
+		msg->setInt32(key, 1);
+		benchmark::DoNotOptimize(msg);
+	}
+	reportAllocations(state, start);
+}
+
+static void BM_MessageObtain(benchmark::State& state) {
+	MessageKey key("value");
+	uint64_t start = sAllocations.load();
+	for (auto _ : state) {
+		auto msg(Message::obtain(1, 0));
+		msg->setInt32(key, 1);
+		benchmark::DoNotOptimize(msg);
+	}
+	reportAllocations(state, start);
+}
+
+// Obtains messages in batches and releases them on another thread, as a
+// producer posting to a looper does.
+static void BM_MessageObtainReleasedElsewhere(benchmark::State& state) {
+	const size_t kBatch = 64;
+	vector<shared_ptr<Message>> batch;
+	uint64_t start = sAllocations.load();
+	for (auto _ : state) {
+		for (size_t i = 0; i < kBatch; i++) {
+			batch.push_back(Message::obtain(1, 0));
+		}
+		thread releaser([&batch] {
+			batch.clear();
+		});
+		releaser.join();
+	}
+	state.SetItemsProcessed(state.iterations() * kBatch);
+	state.counters["allocs/op"] = benchmark::Counter(
+			(double)(sAllocations.load() - start) / (state.iterations() * kBatch));
+}
+
+// Same shape as BM_MessageDuplicate, plus a 4 KiB buffer.
+static shared_ptr<Message> makeWireMessage(const vector<MessageKey>& keys) {
+	auto msg(make_shared<Message>(1, 0));
+	for (size_t i = 0; i < keys.size(); i++) {
+		if (i % 2) {
+			msg->setString(keys[i], "value");
+		} else {
+			msg->setInt64(keys[i], i);
+		}
+	}
+	msg->setBuffer("payload", make_shared<Buffer>(string(4096, 'p').data(), 4096));
+	return msg;
+}
+
+static void BM_MessageWriteTo(benchmark::State& state) {
+	vector<MessageKey> keys = makeKeys(state.range(0));
+	auto msg(makeWireMessage(keys));
+	auto buffer(make_shared<Buffer>(65536));
+
+	uint64_t start = sAllocations.load();
+	for (auto _ : state) {
+		buffer->setSize(0);
+		msg->writeTo(buffer);
+	}
+	reportAllocations(state, start);
+}
+
+// Decoding slices the payload out of the source instead of copying it.
+static void BM_MessageReadFrom(benchmark::State& state) {
+	vector<MessageKey> keys = makeKeys(state.range(0));
+	auto buffer(make_shared<Buffer>(65536));
+	makeWireMessage(keys)->writeTo(buffer);
+	size_t size = buffer->size();
+
+	uint64_t start = sAllocations.load();
+	for (auto _ : state) {
+		shared_ptr<Message> msg;
+		buffer->setSize(size);
+		Message::readFrom(buffer, &msg);
+		benchmark::DoNotOptimize(msg);
+	}
+	reportAllocations(state, start);
+}
+
+BENCHMARK(BM_MessageMakeShared);
+BENCHMARK(BM_MessageObtain);
+BENCHMARK(BM_MessageObtainReleasedElsewhere);
+BENCHMARK(BM_MessageSet)->Arg(1)->Arg(3)->Arg(8)->Arg(16);
+BENCHMARK(BM_MessageFind)->Arg(1)->Arg(3)->Arg(8)->Arg(16);
+BENCHMARK(BM_MessageFindByName)->Arg(1)->Arg(3)->Arg(8)->Arg(16);
+BENCHMARK(BM_MessageDuplicate)->Arg(1)->Arg(3)->Arg(8)->Arg(16);
+BENCHMARK(BM_MessageWriteTo)->Arg(1)->Arg(3)->Arg(8)->Arg(16);
+BENCHMARK(BM_MessageReadFrom)->Arg(1)->Arg(3)->Arg(8)->Arg(16);
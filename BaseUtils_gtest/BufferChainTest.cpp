@@ -0,0 +1,108 @@
+#include <gtest/gtest.h>
+#include <baseutils/Buffer.h>
+#include <baseutils/BufferChain.h>
+#include <baseutils/Message.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cstring>
+#include <memory>
+#include <string>
+
+using namespace std;
+using namespace baseutils;
+
+static shared_ptr<Buffer> makeBuffer(const string& str) {
+	return make_shared<Buffer>(str.data(), str.size());
+}
+
+static string contents(const BufferChain& chain) {
+	string str(chain.size(), '\0');
+	chain.copyTo(&str[0], 0, str.size());
+	return str;
+}
+
+TEST(BufferChainTest, AppendAndPrependFrame) {
+	auto body(makeBuffer("body"));
+	BufferChain chain(body);
+	chain.prepend(makeBuffer("head:"));
+	chain.append(makeBuffer(":tail"));
+	chain.append(shared_ptr<Buffer>());
+
+	ASSERT_EQ(3u, chain.countSegments());
+	ASSERT_EQ(14u, chain.size());
+	ASSERT_EQ(string("head:body:tail"), contents(chain));
+	ASSERT_EQ(body, chain.segmentAt(1));
+
+	BufferChain twice;
+	twice.append(chain);
+	twice.prepend(chain);
+	ASSERT_EQ(string("head:body:tailhead:body:tail"), contents(twice));
+}
+
+TEST(BufferChainTest, SplitSlicesWithoutCopying) {
+	auto first(makeBuffer("0123"));
+	auto second(makeBuffer("4567"));
+	BufferChain chain(first);
+	chain.append(second);
+
+	auto tail(chain.split(6));
+	ASSERT_EQ(string("012345"), contents(chain));
+	ASSERT_EQ(string("67"), contents(*tail));
+	ASSERT_EQ(second->data() + 2, tail->segmentAt(0)->data());
+	ASSERT_EQ(second->data(), chain.segmentAt(1)->data());
+
+	auto rest(chain.split(4));
+	ASSERT_EQ(string("0123"), contents(chain));
+	ASSERT_EQ(first, chain.segmentAt(0));
+	ASSERT_EQ(string("45"), contents(*rest));
+
+	ASSERT_TRUE(chain.split(4)->empty());
+}
+
+TEST(BufferChainTest, CoalesceJoinsSegments) {
+	BufferChain chain(makeBuffer("ab"));
+	ASSERT_EQ(chain.segmentAt(0), chain.coalesce());
+
+	chain.append(makeBuffer("cd"));
+	chain.append(makeBuffer("ef"));
+	auto buffer(chain.coalesce());
+	ASSERT_EQ(1u, chain.countSegments());
+	ASSERT_EQ(6u, buffer->size());
+	ASSERT_EQ(0, memcmp("abcdef", buffer->data(), 6));
+}
+
+TEST(BufferChainTest, WritevSendsEverySegment) {
+	BufferChain chain(makeBuffer("scatter"));
+	chain.append(makeBuffer("-"));
+	chain.append(makeBuffer("gather"));
+
+	int fds[2];
+	ASSERT_EQ(0, pipe(fds));
+	struct iovec iov[8];
+	size_t count = chain.fillIovec(iov, 8);
+	ASSERT_EQ(3u, count);
+	ASSERT_EQ((ssize_t)chain.size(), writev(fds[1], iov, count));
+
+	char received[32];
+	ASSERT_EQ((ssize_t)chain.size(), read(fds[0], received, sizeof(received)));
+	ASSERT_EQ(string("scatter-gather"), string(received, chain.size()));
+	close(fds[0]);
+	close(fds[1]);
+}
+
+TEST(BufferChainTest, StoredInMessage) {
+	auto chain(make_shared<BufferChain>(makeBuffer("payload")));
+	auto msg(Message::obtain());
+	msg->setBufferChain("chain", chain);
+
+	shared_ptr<BufferChain> found;
+	ASSERT_TRUE(msg->duplicate()->findBufferChain("chain", &found));
+	ASSERT_EQ(chain, found);
+
+	shared_ptr<Buffer> buffer;
+	ASSERT_FALSE(msg->findBuffer("chain", &buffer));
+
+	Message::Type type;
+	msg->getEntryNameAt(0, type);
+	ASSERT_EQ(Message::kTypeBufferChain, type);
+}
@@ -0,0 +1,92 @@
+#include <gtest/gtest.h>
+#include <baseutils/Buffer.h>
+#include <baseutils/BufferPool.h>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace baseutils;
+
+TEST(BufferPoolTest, ReleasedBufferIsReused) {
+	BufferPool* pool = BufferPool::getInstance();
+	auto buffer(pool->acquire(5000));
+	ASSERT_EQ(5000u, buffer->capacity());
+	ASSERT_EQ(0u, buffer->size());
+	uint8_t* base = buffer->base();
+	memset(base, 0xff, buffer->capacity());
+	buffer.reset();
+
+	uint64_t allocations = pool->systemAllocations();
+	buffer = pool->acquire(8192);
+	ASSERT_EQ(base, buffer->base());
+	ASSERT_EQ(allocations, pool->systemAllocations());
+}
+
+TEST(BufferPoolTest, OversizedBufferIsNotPooled) {
+	BufferPool* pool = BufferPool::getInstance();
+	uint64_t allocations = pool->systemAllocations();
+	size_t idle = pool->idleBytes();
+
+	auto buffer(pool->acquire(BufferPool::kMaxClassSize + 1));
+	ASSERT_EQ((size_t)BufferPool::kMaxClassSize + 1, buffer->capacity());
+	buffer.reset();
+
+	ASSERT_EQ(allocations, pool->systemAllocations());
+	ASSERT_EQ(idle, pool->idleBytes());
+}
+
+TEST(BufferPoolTest, IdleMemoryStaysUnderHighWaterMark) {
+	const size_t kSize = 64 * 1024;
+	BufferPool* pool = BufferPool::getInstance();
+
+	// Holds whatever blocks of the class earlier tests left idle, in this
+	// thread's cache or the shared list, so only this test's own count.
+	vector<shared_ptr<Buffer>> drained;
+	uint64_t allocations = pool->systemAllocations();
+	while (pool->systemAllocations() == allocations) {
+		drained.push_back(pool->acquire(kSize));
+	}
+
+	size_t idle = pool->idleBytes();
+	pool->setHighWaterMark(idle + 3 * kSize);
+
+	// The thread's cache goes back to the shared lists when it exits.
+	thread worker([pool, kSize] {
+		vector<shared_ptr<Buffer>> buffers;
+		for (int32_t i = 0; i < 8; i++) {
+			buffers.push_back(pool->acquire(kSize));
+		}
+	});
+	worker.join();
+
+	ASSERT_EQ(idle + 3 * kSize, pool->idleBytes());
+	pool->setHighWaterMark(64 * 1024 * 1024);
+
+	allocations = pool->systemAllocations();
+	vector<shared_ptr<Buffer>> buffers;
+	for (int32_t i = 0; i < 3; i++) {
+		buffers.push_back(pool->acquire(kSize));
+	}
+	ASSERT_EQ(allocations, pool->systemAllocations());
+	buffers.push_back(pool->acquire(kSize));
+	ASSERT_EQ(allocations + 1, pool->systemAllocations());
+}
+
+TEST(BufferPoolTest, ReserveWithPrefaultAndLock) {
+	const size_t kSize = 512 * 1024;
+	BufferPool* pool = BufferPool::getInstance();
+	pool->setPrefault(true);
+	pool->setLockMemory(true);
+	pool->reserve(kSize, 2);
+	pool->setPrefault(false);
+	pool->setLockMemory(false);
+
+	uint64_t allocations = pool->systemAllocations();
+	auto first(pool->acquire(kSize));
+	auto second(pool->acquire(kSize));
+	ASSERT_EQ(allocations, pool->systemAllocations());
+	memset(first->base(), 0, kSize);
+	memset(second->base(), 0, kSize);
+}
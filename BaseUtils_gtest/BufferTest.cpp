@@ -0,0 +1,104 @@
+#include <gtest/gtest.h>
+#include <baseutils/Buffer.h>
+#include <baseutils/Handler.h>
+#include <baseutils/Looper.h>
+#include <baseutils/Message.h>
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <memory>
+
+using namespace std;
+using namespace std::chrono;
+using namespace baseutils;
+
+TEST(BufferTest, WrapCallsReleaseOnce) {
+	uint8_t storage[64];
+	int32_t released = 0;
+	{
+		auto buffer(Buffer::Wrap(storage, sizeof(storage), [&](void* data) {
+			ASSERT_EQ(storage, data);
+			released++;
+		}));
+		ASSERT_EQ(storage, buffer->base());
+		ASSERT_EQ(sizeof(storage), buffer->size());
+
+		auto slice(buffer->slice(8, 16));
+		buffer.reset();
+		ASSERT_EQ(0, released);
+	}
+	ASSERT_EQ(1, released);
+}
+
+TEST(BufferTest, SliceSharesMemoryWithParent) {
+	auto buffer(make_shared<Buffer>(32));
+	for (uint8_t i = 0; i < 32; i++) {
+		buffer->base()[i] = i;
+	}
+
+	auto slice(buffer->slice(8, 16));
+	ASSERT_EQ(buffer->base() + 8, slice->base());
+	ASSERT_EQ(16u, slice->capacity());
+	ASSERT_EQ(16u, slice->size());
+	ASSERT_EQ(8, slice->data()[0]);
+
+	slice->consume(4);
+	ASSERT_EQ(12u, slice->size());
+	ASSERT_EQ(12, slice->data()[0]);
+	slice->setRange(2, 4);
+	ASSERT_EQ(10, slice->data()[0]);
+
+	auto inner(slice->slice(4, 4));
+	buffer.reset();
+	slice.reset();
+	ASSERT_EQ(12, inner->data()[0]);
+	ASSERT_EQ(15, inner->data()[3]);
+}
+
+class Forwarder : public Handler {
+public:
+	explicit Forwarder(Looper::handler_id next) : mNext(next) {}
+
+	virtual ~Forwarder() = default;
+
+	future<shared_ptr<Buffer>> received() { return mReceived.get_future(); }
+
+protected:
+	virtual void onMessageReceived(const shared_ptr<Message> &msg) {
+		shared_ptr<Buffer> buffer;
+		msg->findBuffer("payload", &buffer);
+		if (mNext == 0) {
+			mReceived.set_value(buffer);
+			return;
+		}
+		auto forward(Message::obtain(mNext, msg->what()));
+		forward->setBuffer("payload", buffer->slice(1, buffer->capacity() - 1));
+		forward->post();
+	}
+
+private:
+	Looper::handler_id mNext;
+	promise<shared_ptr<Buffer>> mReceived;
+};
+
+TEST(BufferTest, ForwardingAcrossLoopersDoesNotCopy) {
+	auto first(make_shared<Looper>());
+	auto second(make_shared<Looper>());
+	auto last(make_shared<Forwarder>(0));
+	second->registerHandler(last);
+	auto forwarder(make_shared<Forwarder>(last->id()));
+	first->registerHandler(forwarder);
+	ASSERT_EQ(Result::OK, first->start());
+	ASSERT_EQ(Result::OK, second->start());
+
+	auto payload(make_shared<Buffer>("0123456789", 10));
+	auto msg(Message::obtain(forwarder->id(), 1));
+	msg->setBuffer("payload", payload);
+	auto received(last->received());
+	ASSERT_EQ(Result::OK, msg->post());
+
+	ASSERT_EQ(future_status::ready, received.wait_for(seconds(5)));
+	auto buffer(received.get());
+	ASSERT_EQ(payload->base() + 1, buffer->data());
+	ASSERT_EQ(0, memcmp("123456789", buffer->data(), buffer->size()));
+}
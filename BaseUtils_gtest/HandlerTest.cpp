@@ -0,0 +1,291 @@
+#include <gtest/gtest.h>
+#include <baseutils/Looper.h>
+#include <baseutils/Handler.h>
+#include <baseutils/LooperPool.h>
+#include <baseutils/Message.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace baseutils;
+
+class CountingHandler : public Handler {
+public:
+	CountingHandler() : mCount(0) {}
+
+	virtual ~CountingHandler() = default;
+
+	int32_t count() const { return mCount.load(); }
+
+protected:
+	virtual void onMessageReceived(const shared_ptr<Message>&) { ++mCount; }
+
+private:
+	atomic<int32_t> mCount;
+};
+
+TEST(HandlerTest, UnregisterResetsId) {
+	auto looper(make_shared<Looper>());
+	auto handler(make_shared<CountingHandler>());
+
+	Looper::handler_id id = looper->registerHandler(handler);
+	ASSERT_GT(id, 0);
+	ASSERT_EQ(looper, handler->looper());
+
+	looper->unregisterHandler(id);
+	ASSERT_EQ(0, handler->id());
+	ASSERT_EQ(nullptr, handler->looper());
+	ASSERT_EQ(Result::ER_NAME_NOT_FOUND, make_shared<Message>(id, 0)->post());
+}
+
+TEST(HandlerTest, StaleIdDoesNotReachNewHandler) {
+	auto looper(make_shared<Looper>());
+	auto first(make_shared<CountingHandler>());
+	Looper::handler_id staleId = looper->registerHandler(first);
+	looper->unregisterHandler(staleId);
+
+	auto second(make_shared<CountingHandler>());
+	Looper::handler_id id = looper->registerHandler(second);
+	ASSERT_GT(id, 0);
+	ASSERT_NE(staleId, id);
+
+	ASSERT_EQ(Result::ER_NAME_NOT_FOUND, make_shared<Message>(staleId, 0)->post());
+	ASSERT_EQ(Result::OK, make_shared<Message>(id, 0)->post());
+}
+
+TEST(HandlerTest, LooperGoneMakesTargetUnreachable) {
+	auto handler(make_shared<CountingHandler>());
+	Looper::handler_id id;
+	{
+		auto looper(make_shared<Looper>());
+		id = looper->registerHandler(handler);
+	}
+
+	ASSERT_EQ(Result::ER_NAME_NOT_FOUND, make_shared<Message>(id, 0)->post());
+	ASSERT_EQ(0, handler->id());
+}
+
+TEST(HandlerTest, RegisterWhilePosting) {
+	auto looper(make_shared<Looper>());
+	auto target(make_shared<CountingHandler>());
+	looper->registerHandler(target);
+	ASSERT_EQ(Result::OK, looper->start());
+
+	const int32_t kPosts = 20000;
+	thread producer([&target, kPosts] {
+		auto msg(make_shared<Message>(target->id(), 0));
+		for (int32_t i = 0; i < kPosts; i++) {
+			msg->post();
+		}
+	});
+
+	for (int32_t i = 0; i < 1000; i++) {
+		auto handler(make_shared<CountingHandler>());
+		looper->unregisterHandler(looper->registerHandler(handler));
+	}
+	producer.join();
+
+	while (target->count() < kPosts) {
+		this_thread::yield();
+	}
+	ASSERT_EQ(kPosts, target->count());
+}
+
+TEST(HandlerTest, StatsCountMessagesPerWhat) {
+	auto looper(make_shared<Looper>());
+	auto handler(make_shared<CountingHandler>());
+	looper->registerHandler(handler);
+
+	Handler::Stats stats;
+	// Counted when delivered, not when posted.
+	make_shared<Message>(handler->id(), 1)->post();
+	handler->setStatsEnabled(true);
+	for (int32_t i = 0; i < 3; i++) {
+		make_shared<Message>(handler->id(), 1)->post();
+		make_shared<Message>(handler->id(), 2)->post();
+	}
+	make_shared<Message>(handler->id(), 2)->post();
+	ASSERT_EQ(Result::OK, looper->start());
+	while (handler->count() < 8) {
+		this_thread::yield();
+	}
+	// Recorded once the handler returns, the looper is done with it after
+	// stop().
+	looper->stop();
+
+	handler->getStats(&stats);
+	ASSERT_EQ(8u, stats.mMessages);
+	ASSERT_EQ(8u, stats.mExecTimes.count());
+	ASSERT_EQ(4u, stats.mMessagesPerWhat[1]);
+	ASSERT_EQ(4u, stats.mMessagesPerWhat[2]);
+	ASSERT_GT(stats.mPeriod.count(), 0);
+	ASSERT_GT(stats.rate(1), 0);
+	ASSERT_EQ(0, stats.rate(3));
+
+	handler->setStatsEnabled(false);
+	handler->resetStats();
+	make_shared<Message>(handler->id(), 1)->post();
+	ASSERT_EQ(Result::OK, looper->start());
+	while (handler->count() < 9) {
+		this_thread::yield();
+	}
+	looper->stop();
+	handler->getStats(&stats);
+	ASSERT_EQ(0u, stats.mMessages);
+}
+
+TEST(HandlerTest, StatsNeverEnabledStayEmpty) {
+	// The stats only take room once turned on.
+	ASSERT_LT(sizeof(Handler), sizeof(Histogram));
+
+	auto looper(make_shared<Looper>());
+	auto handler(make_shared<CountingHandler>());
+	looper->registerHandler(handler);
+	handler->setStatsEnabled(false);
+	handler->resetStats();
+
+	make_shared<Message>(handler->id(), 1)->post();
+	ASSERT_EQ(Result::OK, looper->start());
+	while (handler->count() < 1) {
+		this_thread::yield();
+	}
+	looper->stop();
+
+	Handler::Stats stats;
+	stats.mMessages = 5;
+	handler->getStats(&stats);
+	ASSERT_EQ(0u, stats.mMessages);
+	ASSERT_EQ(0u, stats.mExecTimes.count());
+	ASSERT_TRUE(stats.mMessagesPerWhat.empty());
+	ASSERT_EQ(Looper::clock::duration::zero(), stats.mPeriod);
+}
+
+// Reuses every message of a batch for something else once done with it.
+class RewritingBatchHandler : public CountingHandler {
+public:
+	RewritingBatchHandler() : mBatches(0) {}
+
+	virtual ~RewritingBatchHandler() = default;
+
+	int32_t batches() const { return mBatches.load(); }
+
+protected:
+	virtual bool wantsBatches() const { return true; }
+
+	virtual void onMessagesReceived(const vector<shared_ptr<Message>> &msgs) {
+		Handler::onMessagesReceived(msgs);
+		for (const shared_ptr<Message>& msg : msgs) {
+			msg->setWhat(99);
+		}
+		++mBatches;
+	}
+
+private:
+	atomic<int32_t> mBatches;
+};
+
+TEST(HandlerTest, StatsCountBatchesByWhatAsDelivered) {
+	auto looper(make_shared<Looper>());
+	auto handler(make_shared<RewritingBatchHandler>());
+	looper->registerHandler(handler);
+	handler->setStatsEnabled(true);
+
+	for (uint32_t i = 0; i < 4; i++) {
+		make_shared<Message>(handler->id(), i % 2)->post();
+	}
+	ASSERT_EQ(Result::OK, looper->start());
+	while (handler->count() < 4) {
+		this_thread::yield();
+	}
+	looper->stop();
+
+	Handler::Stats stats;
+	handler->getStats(&stats);
+	ASSERT_GT(handler->batches(), 0);
+	ASSERT_EQ(4u, stats.mMessages);
+	ASSERT_EQ(2u, stats.mMessagesPerWhat[0]);
+	ASSERT_EQ(2u, stats.mMessagesPerWhat[1]);
+	ASSERT_EQ(0u, stats.mMessagesPerWhat.count(99));
+}
+
+// Cancels the message after it from its first, and removes what 4 from its
+// third.
+class CancellingHandler : public CountingHandler {
+public:
+	CancellingHandler() : mCancelResult(Result::ER_UNKNOWN_ERROR), mRemoved(0) {}
+
+	virtual ~CancellingHandler() = default;
+
+	void setVictim(const shared_ptr<Message>& victim) { mVictim = victim; }
+
+	Result cancelResult() {
+		unique_lock<mutex> lock(mLock);
+		return mCancelResult;
+	}
+
+	size_t removed() {
+		unique_lock<mutex> lock(mLock);
+		return mRemoved;
+	}
+
+	vector<uint32_t> received() {
+		unique_lock<mutex> lock(mLock);
+		return mReceived;
+	}
+
+protected:
+	virtual void onMessageReceived(const shared_ptr<Message>& msg) {
+		{
+			unique_lock<mutex> lock(mLock);
+			mReceived.push_back(msg->what());
+			if (msg->what() == 1) {
+				mCancelResult = mVictim->cancel();
+			} else if (msg->what() == 3) {
+				mRemoved = looper()->removeMessages(id(), 4);
+			}
+		}
+		CountingHandler::onMessageReceived(msg);
+	}
+
+private:
+	mutex mLock;
+	shared_ptr<Message> mVictim;
+	Result mCancelResult;
+	size_t mRemoved;
+	vector<uint32_t> mReceived;
+};
+
+static void CheckCancelFromHandler(const shared_ptr<Looper>& looper) {
+	auto handler(make_shared<CancellingHandler>());
+	looper->registerHandler(handler);
+
+	// Queued before the start, so they would all make one batch.
+	for (uint32_t what = 1; what <= 5; what++) {
+		auto msg(make_shared<Message>(handler->id(), what));
+		if (what == 2) {
+			handler->setVictim(msg);
+		}
+		ASSERT_EQ(Result::OK, msg->post());
+	}
+	ASSERT_EQ(Result::OK, looper->start());
+	while (handler->count() < 3) {
+		this_thread::yield();
+	}
+	looper->stop();
+
+	// What 5 came after the others, so they are gone for good.
+	vector<uint32_t> expected = { 1, 3, 5 };
+	ASSERT_EQ(expected, handler->received());
+	ASSERT_EQ(Result::OK, handler->cancelResult());
+	ASSERT_EQ(1u, handler->removed());
+}
+
+TEST(HandlerTest, CancelFromHandlerStopsLaterMessages) {
+	CheckCancelFromHandler(make_shared<Looper>());
+}
+
+TEST(HandlerTest, CancelFromPoolHandlerStopsLaterMessages) {
+	CheckCancelFromHandler(make_shared<LooperPool>(2));
+}
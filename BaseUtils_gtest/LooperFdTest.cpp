@@ -0,0 +1,142 @@
+#include <gtest/gtest.h>
+#include <baseutils/Handler.h>
+#include <baseutils/Looper.h>
+#include <baseutils/Message.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <thread>
+
+using namespace std;
+using namespace std::chrono;
+using namespace baseutils;
+
+class Pipe {
+public:
+	Pipe() { mValid = pipe(mFds) == 0; }
+
+	~Pipe() {
+		close(mFds[0]);
+		close(mFds[1]);
+	}
+
+	bool valid() const { return mValid; }
+
+	int readFd() const { return mFds[0]; }
+
+	void write(char c) { ASSERT_EQ(1, ::write(mFds[1], &c, 1)); }
+
+	char read() {
+		char c = 0;
+		::read(mFds[0], &c, 1);
+		return c;
+	}
+
+private:
+	int mFds[2];
+	bool mValid;
+};
+
+class FdNotifyHandler : public Handler {
+public:
+	FdNotifyHandler() : mCount(0) {}
+
+	virtual ~FdNotifyHandler() = default;
+
+	future<pair<int32_t, int32_t>> notified() { return mNotified.get_future(); }
+
+	int32_t count() const { return mCount.load(); }
+
+protected:
+	virtual void onMessageReceived(const shared_ptr<Message> &msg) {
+		int32_t fd = -1;
+		int32_t events = 0;
+		// The pipe stays readable, so it keeps notifying until removed.
+		if (mCount++ == 0 && msg->findInt32("fd", &fd) && msg->findInt32("events", &events)) {
+			mNotified.set_value(make_pair(fd, events));
+		}
+	}
+
+private:
+	promise<pair<int32_t, int32_t>> mNotified;
+	atomic<int32_t> mCount;
+};
+
+TEST(LooperFdTest, CallbackRunsOnLooperThreadUntilRemoved) {
+	Pipe pipe;
+	ASSERT_TRUE(pipe.valid());
+	auto looper(make_shared<Looper>());
+	ASSERT_EQ(Result::OK, looper->start());
+
+	promise<thread::id> first;
+	atomic<int32_t> calls(0);
+	ASSERT_EQ(Result::OK, looper->addFd(pipe.readFd(), Looper::kEventInput,
+			[&](int fd, uint32_t events) {
+		if (calls++ == 0) {
+			first.set_value(this_thread::get_id());
+		}
+		EXPECT_EQ(pipe.readFd(), fd);
+		EXPECT_TRUE(events & Looper::kEventInput);
+		pipe.read();
+		return false;
+	}));
+
+	auto firstCall(first.get_future());
+	pipe.write('a');
+	ASSERT_EQ(future_status::ready, firstCall.wait_for(seconds(5)));
+	ASSERT_NE(this_thread::get_id(), firstCall.get());
+
+	// The callback returned false, so further data goes unnoticed.
+	pipe.write('b');
+	this_thread::sleep_for(milliseconds(50));
+	ASSERT_EQ(1, calls.load());
+	ASSERT_EQ(Result::ER_NAME_NOT_FOUND, looper->removeFd(pipe.readFd()));
+}
+
+TEST(LooperFdTest, NotifyMessageCarriesFdAndEvents) {
+	Pipe pipe;
+	ASSERT_TRUE(pipe.valid());
+	auto looper(make_shared<Looper>());
+	auto handler(make_shared<FdNotifyHandler>());
+	looper->registerHandler(handler);
+	ASSERT_EQ(Result::OK, looper->addFd(pipe.readFd(), Looper::kEventInput, Message::obtain(handler->id(), 7)));
+	ASSERT_EQ(Result::OK, looper->start());
+
+	auto notified(handler->notified());
+	pipe.write('a');
+	ASSERT_EQ(future_status::ready, notified.wait_for(seconds(5)));
+	pair<int32_t, int32_t> result = notified.get();
+	ASSERT_EQ(pipe.readFd(), result.first);
+	ASSERT_TRUE(result.second & Looper::kEventInput);
+
+	ASSERT_EQ(Result::OK, looper->removeFd(pipe.readFd()));
+	ASSERT_EQ(Result::ER_BAD_VALUE, looper->addFd(-1, Looper::kEventInput, Message::obtain(handler->id())));
+}
+
+TEST(LooperFdTest, FdsAreServicedWhileMessagesQueueUp) {
+	Pipe pipe;
+	ASSERT_TRUE(pipe.valid());
+	auto looper(make_shared<Looper>());
+	auto handler(make_shared<FdNotifyHandler>());
+	looper->registerHandler(handler);
+
+	const int32_t kMessages = 10000;
+	for (int32_t i = 0; i < kMessages; i++) {
+		Message::obtain(handler->id(), 0)->post();
+	}
+
+	promise<int32_t> deliveredBefore;
+	looper->addFd(pipe.readFd(), Looper::kEventInput, [&](int, uint32_t) {
+		pipe.read();
+		deliveredBefore.set_value(handler->count());
+		return false;
+	});
+	pipe.write('a');
+
+	auto delivered(deliveredBefore.get_future());
+	ASSERT_EQ(Result::OK, looper->start());
+	ASSERT_EQ(future_status::ready, delivered.wait_for(seconds(5)));
+	ASSERT_LT(delivered.get(), kMessages);
+}
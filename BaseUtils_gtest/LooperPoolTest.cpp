@@ -0,0 +1,274 @@
+#include <gtest/gtest.h>
+#include <baseutils/Handler.h>
+#include <baseutils/LooperPool.h>
+#include <baseutils/Message.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+using namespace baseutils;
+
+static const MessageKey kKeyProducer("producer");
+
+// Checks that messages arrive one at a time and, per producer, in order.
+class StrandChecker : public Handler {
+public:
+	explicit StrandChecker(int32_t producers)
+		: mInside(false), mViolations(0), mReceived(0), mNext(producers, 0) {}
+
+	virtual ~StrandChecker() = default;
+
+	int32_t violations() const { return mViolations.load(); }
+
+	int32_t received() const { return mReceived.load(); }
+
+protected:
+	virtual void onMessageReceived(const shared_ptr<Message> &msg) {
+		if (mInside.exchange(true)) {
+			mViolations++;
+		}
+		int32_t producer = 0;
+		msg->findInt32(kKeyProducer, &producer);
+		if (msg->what() != mNext[producer]++) {
+			mViolations++;
+		}
+		this_thread::yield();
+		mInside.store(false);
+		mReceived++;
+	}
+
+private:
+	atomic<bool> mInside;
+	atomic<int32_t> mViolations;
+	atomic<int32_t> mReceived;
+	vector<uint32_t> mNext;
+};
+
+TEST(LooperPoolTest, HandlersRunSeriallyAndInOrder) {
+	const int32_t kHandlers = 8;
+	const int32_t kProducers = 4;
+	const uint32_t kMessages = 2000;
+
+	auto pool(make_shared<LooperPool>(4));
+	ASSERT_EQ(4u, pool->numWorkers());
+	vector<shared_ptr<StrandChecker>> handlers;
+	for (int32_t i = 0; i < kHandlers; i++) {
+		handlers.push_back(make_shared<StrandChecker>(kProducers));
+		pool->registerHandler(handlers.back());
+		ASSERT_EQ(pool, handlers.back()->looper());
+	}
+	ASSERT_EQ(Result::OK, pool->start());
+
+	vector<thread> producers;
+	for (int32_t p = 0; p < kProducers; p++) {
+		producers.push_back(thread([&handlers, p, kMessages] {
+			for (uint32_t i = 0; i < kMessages; i++) {
+				for (auto& handler : handlers) {
+					auto msg(Message::obtain(handler->id(), i));
+					msg->setInt32(kKeyProducer, p);
+					msg->post();
+				}
+			}
+		}));
+	}
+	for (auto& producer : producers) {
+		producer.join();
+	}
+
+	auto deadline = steady_clock::now() + seconds(20);
+	for (auto& handler : handlers) {
+		while (handler->received() < (int32_t)(kProducers * kMessages) && steady_clock::now() < deadline) {
+			this_thread::sleep_for(milliseconds(1));
+		}
+		ASSERT_EQ((int32_t)(kProducers * kMessages), handler->received());
+		ASSERT_EQ(0, handler->violations());
+	}
+}
+
+TEST(LooperPoolTest, BoundedQueueHandsOverWithoutOvershoot) {
+	const int32_t kProducers = 4;
+	const uint32_t kMessages = 1000;
+	const size_t kCapacity = 4;
+
+	auto pool(make_shared<LooperPool>(2));
+	auto handler(make_shared<StrandChecker>(kProducers));
+	pool->registerHandler(handler);
+	pool->setQueueCapacity(kCapacity, Looper::kOverflowBlock, seconds(5));
+	ASSERT_EQ(Result::OK, pool->start());
+
+	// Due right away, but timed, so each passes the looper thread on its way
+	// to the strand while the producers wait for room.
+	atomic<int32_t> failures(0);
+	vector<thread> producers;
+	for (int32_t p = 0; p < kProducers; p++) {
+		producers.push_back(thread([&handler, &failures, p, kMessages] {
+			for (uint32_t i = 0; i < kMessages; i++) {
+				auto msg(Message::obtain(handler->id(), i));
+				msg->setInt32(kKeyProducer, p);
+				if (msg->postAt(Looper::GetNow()) != Result::OK) {
+					failures++;
+				}
+			}
+		}));
+	}
+	for (auto& producer : producers) {
+		producer.join();
+	}
+
+	auto deadline = steady_clock::now() + seconds(20);
+	while (handler->received() < (int32_t)(kProducers * kMessages) && steady_clock::now() < deadline) {
+		this_thread::sleep_for(milliseconds(1));
+	}
+	ASSERT_EQ(0, failures.load());
+	ASSERT_EQ((int32_t)(kProducers * kMessages), handler->received());
+	ASSERT_EQ(0, handler->violations());
+	ASSERT_LE(pool->queueHighWaterMark(), kCapacity);
+	ASSERT_EQ(0u, pool->queueDepth());
+}
+
+// Posts to itself from its first message, into its own full pool.
+class SelfPoster : public Handler {
+public:
+	future<Result> posted() { return mPosted.get_future(); }
+
+protected:
+	virtual void onMessageReceived(const shared_ptr<Message> &msg) {
+		if (msg->what() == 0) {
+			mPosted.set_value(Message::obtain(id(), 1)->post());
+		}
+	}
+
+private:
+	promise<Result> mPosted;
+};
+
+TEST(LooperPoolTest, WorkerPostingToItsFullPoolFailsRightAway) {
+	auto pool(make_shared<LooperPool>(1));
+	auto handler(make_shared<SelfPoster>());
+	auto other(make_shared<SelfPoster>());
+	pool->registerHandler(handler);
+	pool->registerHandler(other);
+	ASSERT_EQ(Result::OK, Message::obtain(handler->id(), 0)->post());
+	// Still full once the only worker took the first message.
+	ASSERT_EQ(Result::OK, Message::obtain(other->id(), 2)->post());
+	ASSERT_EQ(Result::OK, Message::obtain(other->id(), 2)->post());
+	pool->setQueueCapacity(2, Looper::kOverflowBlock, seconds(60));
+
+	auto posted(handler->posted());
+	ASSERT_EQ(Result::OK, pool->start());
+	ASSERT_EQ(future_status::ready, posted.wait_for(seconds(5)));
+	ASSERT_EQ(Result::ER_WOULD_BLOCK, posted.get());
+}
+
+// Blocks until every handler of the group has been entered at once.
+class Rendezvous : public Handler {
+public:
+	Rendezvous(mutex* lock, condition_variable* condition, int32_t* arrived, int32_t total)
+		: mLock(lock), mCondition(condition), mArrived(arrived), mTotal(total) {}
+
+	virtual ~Rendezvous() = default;
+
+	future<bool> met() { return mMet.get_future(); }
+
+protected:
+	virtual void onMessageReceived(const shared_ptr<Message>&) {
+		unique_lock<mutex> autoLock(*mLock);
+		++*mArrived;
+		mCondition->notify_all();
+		mMet.set_value(mCondition->wait_for(autoLock, seconds(5), [this] {
+			return *mArrived == mTotal;
+		}));
+	}
+
+private:
+	mutex* mLock;
+	condition_variable* mCondition;
+	int32_t* mArrived;
+	int32_t mTotal;
+	promise<bool> mMet;
+};
+
+TEST(LooperPoolTest, DifferentHandlersRunInParallel) {
+	mutex lock;
+	condition_variable condition;
+	int32_t arrived = 0;
+	auto pool(make_shared<LooperPool>(2));
+	auto first(make_shared<Rendezvous>(&lock, &condition, &arrived, 2));
+	auto second(make_shared<Rendezvous>(&lock, &condition, &arrived, 2));
+	pool->registerHandler(first);
+	pool->registerHandler(second);
+	ASSERT_EQ(Result::OK, pool->start());
+
+	auto firstMet(first->met());
+	auto secondMet(second->met());
+	Message::obtain(first->id())->post();
+	Message::obtain(second->id())->post();
+	ASSERT_TRUE(firstMet.get());
+	ASSERT_TRUE(secondMet.get());
+}
+
+TEST(LooperPoolTest, DelayedAndCancelledMessages) {
+	auto pool(make_shared<LooperPool>(2));
+	auto handler(make_shared<StrandChecker>(1));
+	pool->registerHandler(handler);
+
+	auto cancelled(Message::obtain(handler->id(), 5));
+	ASSERT_EQ(Result::OK, Message::obtain(handler->id(), 0)->post());
+	ASSERT_EQ(Result::OK, cancelled->post());
+	ASSERT_EQ(Result::OK, Message::obtain(handler->id(), 1)->post(milliseconds(20)));
+	ASSERT_EQ(Result::OK, cancelled->cancel());
+	ASSERT_EQ(Result::ER_NAME_NOT_FOUND, cancelled->cancel());
+	ASSERT_EQ(Result::OK, pool->start());
+
+	auto deadline = steady_clock::now() + seconds(5);
+	while (handler->received() < 2 && steady_clock::now() < deadline) {
+		this_thread::sleep_for(milliseconds(1));
+	}
+	// Queued behind the cancelled one, had it been left in.
+	ASSERT_EQ(Result::OK, Message::obtain(handler->id(), 2)->post());
+	while (handler->received() < 3 && steady_clock::now() < deadline) {
+		this_thread::sleep_for(milliseconds(1));
+	}
+	ASSERT_EQ(3, handler->received());
+	ASSERT_EQ(0, handler->violations());
+}
+
+TEST(LooperPoolTest, ImmediatePostsArePendingOnThePool) {
+	// Not started, so whatever is posted stays on the strand.
+	auto pool(make_shared<LooperPool>(2));
+	auto handler(make_shared<StrandChecker>(1));
+	pool->registerHandler(handler);
+	auto other(make_shared<Looper>());
+	Looper::handler_id otherId = other->registerHandler(make_shared<StrandChecker>(1));
+
+	auto msg(Message::obtain(handler->id(), 0));
+	ASSERT_EQ(Result::OK, msg->post());
+	ASSERT_EQ(Result::OK, msg->postAtFront());
+
+	// Pending on the pool, so the other looper refuses it.
+	msg->setTarget(otherId);
+	ASSERT_EQ(Result::ER_INVALID_OPERATION, msg->post());
+	msg->setTarget(handler->id());
+
+	ASSERT_EQ(Result::OK, msg->cancel());
+	ASSERT_EQ(Result::OK, msg->cancel());
+	ASSERT_EQ(Result::ER_NAME_NOT_FOUND, msg->cancel());
+
+	ASSERT_EQ(Result::OK, Message::obtain(handler->id(), 0)->post());
+	ASSERT_EQ(Result::OK, Message::obtain(handler->id(), 7)->post());
+	ASSERT_EQ(1u, pool->removeMessages(handler->id(), 7));
+
+	ASSERT_EQ(Result::OK, pool->start());
+	auto deadline = steady_clock::now() + seconds(5);
+	while (handler->received() < 1 && steady_clock::now() < deadline) {
+		this_thread::sleep_for(milliseconds(1));
+	}
+	ASSERT_EQ(1, handler->received());
+	ASSERT_EQ(0, handler->violations());
+}
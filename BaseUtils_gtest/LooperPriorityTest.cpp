@@ -0,0 +1,153 @@
+#include <gtest/gtest.h>
+#include <baseutils/Handler.h>
+#include <baseutils/Histogram.h>
+#include <baseutils/Looper.h>
+#include <baseutils/Message.h>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+using namespace baseutils;
+
+class PriorityRecorder : public Handler {
+public:
+	PriorityRecorder() = default;
+
+	virtual ~PriorityRecorder() = default;
+
+	bool waitFor(size_t count, milliseconds timeout) {
+		unique_lock<mutex> lock(mLock);
+		return mCondition.wait_for(lock, timeout, [&] { return mReceived.size() >= count; });
+	}
+
+	vector<uint32_t> received() {
+		unique_lock<mutex> lock(mLock);
+		return mReceived;
+	}
+
+protected:
+	virtual void onMessageReceived(const shared_ptr<Message> &msg) {
+		unique_lock<mutex> lock(mLock);
+		mReceived.push_back(msg->what());
+		mCondition.notify_all();
+	}
+
+private:
+	mutex mLock;
+	condition_variable mCondition;
+	vector<uint32_t> mReceived;
+};
+
+static void postWithPriority(Looper::handler_id target, uint32_t what, Looper::Priority priority) {
+	auto msg(Message::obtain(target, what));
+	msg->setPriority(priority);
+	ASSERT_EQ(Result::OK, msg->post());
+}
+
+TEST(LooperPriorityTest, UrgentOvertakesQueuedBulk) {
+	auto looper(make_shared<Looper>());
+	auto recorder(make_shared<PriorityRecorder>());
+	looper->registerHandler(recorder);
+
+	for (uint32_t i = 0; i < 100; i++) {
+		postWithPriority(recorder->id(), 2, i % 2 ? Looper::kPriorityBackground : Looper::kPriorityNormal);
+	}
+	postWithPriority(recorder->id(), 0, Looper::kPriorityUrgent);
+	ASSERT_EQ(Result::OK, looper->start());
+
+	ASSERT_TRUE(recorder->waitFor(101, milliseconds(5000)));
+	vector<uint32_t> received = recorder->received();
+	ASSERT_EQ(0u, received[0]);
+}
+
+TEST(LooperPriorityTest, WeightedLanesTakeTurns) {
+	auto looper(make_shared<Looper>());
+	auto recorder(make_shared<PriorityRecorder>());
+	looper->registerHandler(recorder);
+	looper->setSchedulingPolicy(Looper::kSchedulingWeighted);
+	ASSERT_EQ(Result::OK, looper->setLaneWeight(Looper::kPriorityUrgent, 2));
+	ASSERT_EQ(Result::OK, looper->setLaneWeight(Looper::kPriorityNormal, 1));
+	ASSERT_EQ(Result::ER_BAD_VALUE, looper->setLaneWeight(Looper::kPriorityNormal, 0));
+
+	for (uint32_t i = 0; i < 6; i++) {
+		postWithPriority(recorder->id(), 1, Looper::kPriorityNormal);
+		postWithPriority(recorder->id(), 0, Looper::kPriorityUrgent);
+	}
+	ASSERT_EQ(Result::OK, looper->start());
+
+	ASSERT_TRUE(recorder->waitFor(12, milliseconds(5000)));
+	vector<uint32_t> expected = { 0, 0, 1, 0, 0, 1, 0, 0, 1, 1, 1, 1 };
+	ASSERT_EQ(expected, recorder->received());
+}
+
+TEST(LooperPriorityTest, PostAtFrontJumpsItsLane) {
+	auto looper(make_shared<Looper>());
+	auto recorder(make_shared<PriorityRecorder>());
+	looper->registerHandler(recorder);
+
+	for (uint32_t i = 1; i <= 3; i++) {
+		ASSERT_EQ(Result::OK, Message::obtain(recorder->id(), i)->post());
+	}
+	ASSERT_EQ(Result::OK, Message::obtain(recorder->id(), 0)->postAtFront());
+	ASSERT_EQ(Result::OK, looper->start());
+
+	ASSERT_TRUE(recorder->waitFor(4, milliseconds(5000)));
+	vector<uint32_t> expected = { 0, 1, 2, 3 };
+	ASSERT_EQ(expected, recorder->received());
+}
+
+TEST(LooperPriorityTest, QueueLatencyRecordedPerLane) {
+	auto looper(make_shared<Looper>());
+	auto recorder(make_shared<PriorityRecorder>());
+	looper->registerHandler(recorder);
+	looper->setLatencyTracking(true);
+
+	for (uint32_t i = 0; i < 10; i++) {
+		postWithPriority(recorder->id(), 0, Looper::kPriorityUrgent);
+	}
+	for (uint32_t i = 0; i < 5; i++) {
+		postWithPriority(recorder->id(), 2, Looper::kPriorityBackground);
+	}
+	this_thread::sleep_for(milliseconds(20));
+	ASSERT_EQ(Result::OK, looper->start());
+	ASSERT_TRUE(recorder->waitFor(15, milliseconds(5000)));
+
+	Histogram urgent, normal, background;
+	ASSERT_EQ(Result::OK, looper->getQueueLatency(Looper::kPriorityUrgent, &urgent));
+	ASSERT_EQ(Result::OK, looper->getQueueLatency(Looper::kPriorityNormal, &normal));
+	ASSERT_EQ(Result::OK, looper->getQueueLatency(Looper::kPriorityBackground, &background));
+	ASSERT_EQ(10u, urgent.count());
+	ASSERT_EQ(0u, normal.count());
+	ASSERT_EQ(5u, background.count());
+	ASSERT_GE(urgent.min(), duration_cast<nanoseconds>(milliseconds(20)).count());
+
+	looper->resetQueueLatency();
+	ASSERT_EQ(Result::OK, looper->getQueueLatency(Looper::kPriorityUrgent, &urgent));
+	ASSERT_EQ(0u, urgent.count());
+}
+
+TEST(LooperPriorityTest, HistogramPercentilesWithinBucketError) {
+	Histogram histogram;
+	ASSERT_EQ(0, histogram.percentile(50));
+	for (int64_t i = 1; i <= 100000; i++) {
+		histogram.record(i);
+	}
+	ASSERT_EQ(100000u, histogram.count());
+	ASSERT_EQ(1, histogram.min());
+	ASSERT_EQ(100000, histogram.max());
+	ASSERT_NEAR(50000.5, histogram.mean(), 0.01);
+	ASSERT_NEAR(50000, histogram.percentile(50), 50000 * 0.07);
+	ASSERT_NEAR(99000, histogram.percentile(99), 99000 * 0.07);
+	ASSERT_EQ(100000, histogram.percentile(100));
+
+	Histogram other;
+	other.record(1000000);
+	histogram.merge(other);
+	ASSERT_EQ(100001u, histogram.count());
+	ASSERT_EQ(1000000, histogram.percentile(100));
+}
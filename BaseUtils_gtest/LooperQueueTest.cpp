@@ -0,0 +1,490 @@
+#include <gtest/gtest.h>
+#include <baseutils/Looper.h>
+#include <baseutils/Handler.h>
+#include <baseutils/Message.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+using namespace baseutils;
+
+class OrderRecorder : public Handler {
+public:
+	OrderRecorder() = default;
+
+	virtual ~OrderRecorder() = default;
+
+	bool waitFor(size_t count, milliseconds timeout) {
+		unique_lock<mutex> lock(mLock);
+		return mCondition.wait_for(lock, timeout, [&] { return mReceived.size() >= count; });
+	}
+
+	vector<uint32_t> received() {
+		unique_lock<mutex> lock(mLock);
+		return mReceived;
+	}
+
+	shared_ptr<Message> last() {
+		unique_lock<mutex> lock(mLock);
+		return mLast;
+	}
+
+protected:
+	virtual void onMessageReceived(const shared_ptr<Message> &msg) {
+		unique_lock<mutex> lock(mLock);
+		mReceived.push_back(msg->what());
+		mLast = msg;
+		mCondition.notify_all();
+	}
+
+private:
+	mutex mLock;
+	condition_variable mCondition;
+	vector<uint32_t> mReceived;
+	shared_ptr<Message> mLast;
+};
+
+TEST(LooperQueueTest, ImmediatePostsKeepFifoOrder) {
+	auto looper(make_shared<Looper>());
+	auto recorder(make_shared<OrderRecorder>());
+	looper->registerHandler(recorder);
+
+	const uint32_t kCount = 1000;
+	for (uint32_t i = 0; i < kCount; i++) {
+		ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), i)->post());
+	}
+	ASSERT_EQ(Result::OK, looper->start());
+
+	ASSERT_TRUE(recorder->waitFor(kCount, milliseconds(5000)));
+	vector<uint32_t> received = recorder->received();
+	for (uint32_t i = 0; i < kCount; i++) {
+		ASSERT_EQ(i, received[i]);
+	}
+}
+
+TEST(LooperQueueTest, DelayedPostsDeliveredByDeadline) {
+	auto looper(make_shared<Looper>());
+	auto recorder(make_shared<OrderRecorder>());
+	looper->registerHandler(recorder);
+	ASSERT_EQ(Result::OK, looper->start());
+
+	ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), 0)->post(milliseconds(60)));
+	ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), 1)->post(milliseconds(20)));
+	ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), 2)->post(milliseconds(40)));
+	ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), 3)->post());
+
+	ASSERT_TRUE(recorder->waitFor(4, milliseconds(5000)));
+	vector<uint32_t> expected = { 3, 1, 2, 0 };
+	ASSERT_EQ(expected, recorder->received());
+}
+
+TEST(LooperQueueTest, PostAtAbsoluteDeadline) {
+	auto looper(make_shared<Looper>());
+	auto recorder(make_shared<OrderRecorder>());
+	looper->registerHandler(recorder);
+	ASSERT_EQ(Result::OK, looper->start());
+
+	Looper::clock::time_point start = Looper::GetNow();
+	ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), 0)->postAt(start + milliseconds(40)));
+	ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), 1)->postAt(start - milliseconds(40)));
+
+	ASSERT_TRUE(recorder->waitFor(1, milliseconds(5000)));
+	ASSERT_EQ(1u, recorder->received()[0]);
+	ASSERT_TRUE(recorder->waitFor(2, milliseconds(5000)));
+	ASSERT_GE(Looper::GetNow() - start, milliseconds(40));
+	ASSERT_EQ(0u, recorder->received()[1]);
+}
+
+TEST(LooperQueueTest, CancelDelayedPost) {
+	auto looper(make_shared<Looper>());
+	auto recorder(make_shared<OrderRecorder>());
+	looper->registerHandler(recorder);
+	ASSERT_EQ(Result::OK, looper->start());
+
+	auto cancelled(make_shared<Message>(recorder->id(), 0));
+	ASSERT_EQ(Result::OK, cancelled->post(milliseconds(50)));
+	ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), 1)->post(milliseconds(100)));
+	ASSERT_EQ(Result::OK, cancelled->cancel());
+	ASSERT_EQ(Result::ER_NAME_NOT_FOUND, cancelled->cancel());
+
+	ASSERT_TRUE(recorder->waitFor(1, milliseconds(5000)));
+	vector<uint32_t> expected = { 1 };
+	ASSERT_EQ(expected, recorder->received());
+}
+
+TEST(LooperQueueTest, CancelAndRepostRepeatedly) {
+	auto looper(make_shared<Looper>());
+	auto recorder(make_shared<OrderRecorder>());
+	looper->registerHandler(recorder);
+
+	// Enough cancelled posts to get the queues compacted on the way.
+	auto periodic(make_shared<Message>(recorder->id(), 0));
+	for (uint32_t i = 0; i < 1000; i++) {
+		ASSERT_EQ(Result::OK, periodic->post(milliseconds(10)));
+		ASSERT_EQ(Result::OK, periodic->post());
+		ASSERT_EQ(Result::OK, periodic->cancel());
+		ASSERT_EQ(Result::OK, periodic->cancel());
+	}
+	ASSERT_EQ(Result::ER_NAME_NOT_FOUND, periodic->cancel());
+	ASSERT_EQ(Result::OK, periodic->post(milliseconds(10)));
+	ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), 1)->post());
+	ASSERT_EQ(Result::OK, looper->start());
+
+	ASSERT_TRUE(recorder->waitFor(2, milliseconds(5000)));
+	ASSERT_FALSE(recorder->waitFor(3, milliseconds(50)));
+	vector<uint32_t> expected = { 1, 0 };
+	ASSERT_EQ(expected, recorder->received());
+}
+
+TEST(LooperQueueTest, PendingMessageStaysOnItsLooper) {
+	auto first(make_shared<Looper>());
+	auto second(make_shared<Looper>());
+	auto firstRecorder(make_shared<OrderRecorder>());
+	auto secondRecorder(make_shared<OrderRecorder>());
+	first->registerHandler(firstRecorder);
+	second->registerHandler(secondRecorder);
+
+	auto msg(make_shared<Message>(firstRecorder->id(), 0));
+	ASSERT_EQ(Result::OK, msg->post(seconds(60)));
+	msg->setTarget(secondRecorder->id());
+	ASSERT_EQ(Result::ER_INVALID_OPERATION, msg->post());
+	ASSERT_EQ(Result::ER_INVALID_OPERATION, msg->postAtFront());
+	ASSERT_EQ(Result::ER_INVALID_OPERATION, msg->postReplacing());
+	ASSERT_EQ(Result::ER_NAME_NOT_FOUND, msg->cancel());
+
+	msg->setTarget(firstRecorder->id());
+	ASSERT_EQ(Result::OK, msg->cancel());
+	msg->setTarget(secondRecorder->id());
+	ASSERT_EQ(Result::OK, msg->post());
+	ASSERT_EQ(Result::OK, second->start());
+	ASSERT_TRUE(secondRecorder->waitFor(1, milliseconds(5000)));
+	second->stop();
+
+	// Delivered, so it may move again.
+	msg->setTarget(firstRecorder->id());
+	ASSERT_EQ(Result::OK, msg->post());
+	ASSERT_EQ(Result::OK, first->start());
+	ASSERT_TRUE(firstRecorder->waitFor(1, milliseconds(5000)));
+}
+
+TEST(LooperQueueTest, RemoveMessagesDropsEveryMatch) {
+	auto looper(make_shared<Looper>());
+	auto recorder(make_shared<OrderRecorder>());
+	looper->registerHandler(recorder);
+
+	for (uint32_t i = 0; i < 10; i++) {
+		ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), 5)->post());
+		ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), 5)->post(milliseconds(10)));
+		ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), 5)->postTimer(milliseconds(10), NULL));
+	}
+	ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), 6)->post());
+	ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), 6)->post(milliseconds(10)));
+
+	ASSERT_EQ(30u, looper->removeMessages(recorder->id(), 5));
+	ASSERT_EQ(0u, looper->removeMessages(recorder->id(), 5));
+	ASSERT_EQ(Result::OK, looper->start());
+
+	ASSERT_TRUE(recorder->waitFor(2, milliseconds(5000)));
+	ASSERT_FALSE(recorder->waitFor(3, milliseconds(50)));
+	vector<uint32_t> expected = { 6, 6 };
+	ASSERT_EQ(expected, recorder->received());
+}
+
+TEST(LooperQueueTest, FullQueueFailsWithWouldBlock) {
+	auto looper(make_shared<Looper>());
+	auto recorder(make_shared<OrderRecorder>());
+	looper->registerHandler(recorder);
+	looper->setQueueCapacity(4, Looper::kOverflowFail);
+
+	for (uint32_t i = 0; i < 3; i++) {
+		ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), i)->post());
+	}
+	ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), 3)->post(milliseconds(1)));
+	ASSERT_EQ(Result::ER_WOULD_BLOCK, make_shared<Message>(recorder->id(), 4)->post());
+	ASSERT_EQ(4u, looper->queueDepth());
+
+	ASSERT_EQ(Result::OK, looper->start());
+	ASSERT_TRUE(recorder->waitFor(4, milliseconds(5000)));
+	looper->stop();
+	ASSERT_EQ(0u, looper->queueDepth());
+	ASSERT_EQ(4u, looper->queueHighWaterMark());
+}
+
+TEST(LooperQueueTest, FullQueueDropsOldest) {
+	auto looper(make_shared<Looper>());
+	auto recorder(make_shared<OrderRecorder>());
+	looper->registerHandler(recorder);
+	looper->setQueueCapacity(3, Looper::kOverflowDropOldest);
+
+	for (uint32_t i = 0; i < 6; i++) {
+		ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), i)->post());
+	}
+	ASSERT_EQ(3u, looper->queueDepth());
+
+	ASSERT_EQ(Result::OK, looper->start());
+	ASSERT_TRUE(recorder->waitFor(3, milliseconds(5000)));
+	ASSERT_FALSE(recorder->waitFor(4, milliseconds(50)));
+	vector<uint32_t> expected = { 3, 4, 5 };
+	ASSERT_EQ(expected, recorder->received());
+}
+
+TEST(LooperQueueTest, FullQueueCoalescesSameWhat) {
+	auto looper(make_shared<Looper>());
+	auto recorder(make_shared<OrderRecorder>());
+	looper->registerHandler(recorder);
+	looper->setQueueCapacity(2, Looper::kOverflowCoalesce);
+
+	ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), 1)->post());
+	ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), 2)->post());
+	ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), 1)->post());
+	ASSERT_EQ(Result::ER_WOULD_BLOCK, make_shared<Message>(recorder->id(), 3)->post());
+
+	ASSERT_EQ(Result::OK, looper->start());
+	ASSERT_TRUE(recorder->waitFor(2, milliseconds(5000)));
+	ASSERT_FALSE(recorder->waitFor(3, milliseconds(50)));
+	vector<uint32_t> expected = { 2, 1 };
+	ASSERT_EQ(expected, recorder->received());
+}
+
+TEST(LooperQueueTest, FullQueueBlocksProducerUntilDrained) {
+	auto looper(make_shared<Looper>());
+	auto recorder(make_shared<OrderRecorder>());
+	looper->registerHandler(recorder);
+
+	looper->setQueueCapacity(1, Looper::kOverflowBlock, milliseconds(20));
+	ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), 0)->post());
+	ASSERT_EQ(Result::ER_TIMED_OUT, make_shared<Message>(recorder->id(), 1)->post());
+
+	looper->setQueueCapacity(1, Looper::kOverflowBlock, seconds(5));
+	Result blocked = Result::ER_UNKNOWN_ERROR;
+	thread producer([&] {
+		blocked = make_shared<Message>(recorder->id(), 1)->post();
+	});
+	ASSERT_EQ(Result::OK, looper->start());
+	producer.join();
+
+	ASSERT_EQ(Result::OK, blocked);
+	ASSERT_TRUE(recorder->waitFor(2, milliseconds(5000)));
+	vector<uint32_t> expected = { 0, 1 };
+	ASSERT_EQ(expected, recorder->received());
+}
+
+TEST(LooperQueueTest, PostReplacingKeepsOnlyNewest) {
+	auto looper(make_shared<Looper>());
+	auto recorder(make_shared<OrderRecorder>());
+	looper->registerHandler(recorder);
+
+	auto progress = [&](int32_t percent) {
+		auto msg(make_shared<Message>(recorder->id(), 7));
+		msg->setInt32("percent", percent);
+		return msg;
+	};
+	ASSERT_EQ(Result::OK, progress(0)->postReplacing());
+	ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), 8)->post());
+	for (int32_t percent = 1; percent <= 100; percent++) {
+		ASSERT_EQ(Result::OK, progress(percent)->postReplacing());
+	}
+	ASSERT_EQ(2u, looper->queueDepth());
+	ASSERT_EQ(Result::OK, looper->start());
+
+	ASSERT_TRUE(recorder->waitFor(2, milliseconds(5000)));
+	vector<uint32_t> expected = { 7, 8 };
+	ASSERT_EQ(expected, recorder->received());
+
+	// Delivered, so the next one queues again.
+	ASSERT_EQ(Result::OK, progress(5)->postReplacing());
+	ASSERT_TRUE(recorder->waitFor(3, milliseconds(5000)));
+	int32_t percent = 0;
+	ASSERT_TRUE(recorder->last()->findInt32("percent", &percent));
+	ASSERT_EQ(5, percent);
+	looper->stop();
+}
+
+TEST(LooperQueueTest, CancelReplacedMessage) {
+	auto looper(make_shared<Looper>());
+	auto recorder(make_shared<OrderRecorder>());
+	looper->registerHandler(recorder);
+
+	auto first(make_shared<Message>(recorder->id(), 7));
+	auto second(make_shared<Message>(recorder->id(), 7));
+	ASSERT_EQ(Result::OK, first->postReplacing(10000));
+	ASSERT_EQ(Result::OK, second->postReplacing());
+	ASSERT_EQ(Result::ER_NAME_NOT_FOUND, first->cancel());
+	ASSERT_EQ(Result::OK, second->cancel());
+	ASSERT_EQ(0u, looper->queueDepth());
+
+	// Nothing pending under the key any more.
+	ASSERT_EQ(Result::OK, first->postReplacing());
+	ASSERT_EQ(Result::OK, looper->start());
+	ASSERT_TRUE(recorder->waitFor(1, milliseconds(5000)));
+	ASSERT_EQ(first, recorder->last());
+	looper->stop();
+}
+
+class BatchRecorder : public OrderRecorder {
+public:
+	BatchRecorder() = default;
+
+	virtual ~BatchRecorder() = default;
+
+	vector<size_t> batchSizes() {
+		unique_lock<mutex> lock(mBatchLock);
+		return mBatchSizes;
+	}
+
+protected:
+	virtual bool wantsBatches() const { return true; }
+
+	virtual void onMessagesReceived(const vector<shared_ptr<Message>> &msgs) {
+		{
+			unique_lock<mutex> lock(mBatchLock);
+			mBatchSizes.push_back(msgs.size());
+		}
+		Handler::onMessagesReceived(msgs);
+	}
+
+private:
+	mutex mBatchLock;
+	vector<size_t> mBatchSizes;
+};
+
+TEST(LooperQueueTest, PostBatchKeepsOrder) {
+	auto looper(make_shared<Looper>());
+	auto recorder(make_shared<OrderRecorder>());
+	looper->registerHandler(recorder);
+
+	vector<shared_ptr<Message>> batch;
+	vector<uint32_t> expected;
+	for (uint32_t i = 0; i < 40; i++) {
+		batch.push_back(make_shared<Message>(recorder->id(), i));
+		expected.push_back(i);
+	}
+	ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), 100)->post());
+	ASSERT_EQ(Result::OK, looper->postBatch(batch));
+	expected.insert(expected.begin(), 100);
+	ASSERT_EQ(41u, looper->queueDepth());
+	ASSERT_EQ(Result::OK, looper->start());
+
+	ASSERT_TRUE(recorder->waitFor(expected.size(), milliseconds(5000)));
+	ASSERT_EQ(expected, recorder->received());
+	looper->stop();
+}
+
+TEST(LooperQueueTest, PostBatchRejectsForeignTarget) {
+	auto looper(make_shared<Looper>());
+	auto other(make_shared<Looper>());
+	auto recorder(make_shared<OrderRecorder>());
+	auto stranger(make_shared<OrderRecorder>());
+	looper->registerHandler(recorder);
+	other->registerHandler(stranger);
+
+	vector<shared_ptr<Message>> batch = {
+		make_shared<Message>(recorder->id(), 1),
+		make_shared<Message>(stranger->id(), 2),
+	};
+	ASSERT_EQ(Result::ER_BAD_VALUE, looper->postBatch(batch));
+	ASSERT_EQ(0u, looper->queueDepth());
+	ASSERT_EQ(0u, other->queueDepth());
+}
+
+TEST(LooperQueueTest, PostBatchIntoFullQueueFails) {
+	auto looper(make_shared<Looper>());
+	auto recorder(make_shared<OrderRecorder>());
+	looper->registerHandler(recorder);
+	looper->setQueueCapacity(4);
+
+	ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), 1)->post());
+	vector<shared_ptr<Message>> batch;
+	for (uint32_t i = 0; i < 4; i++) {
+		batch.push_back(make_shared<Message>(recorder->id(), 2 + i));
+	}
+	// Nothing of a batch that doesn't fit is queued.
+	ASSERT_EQ(Result::ER_WOULD_BLOCK, looper->postBatch(batch));
+	ASSERT_EQ(1u, looper->queueDepth());
+
+	batch.pop_back();
+	ASSERT_EQ(Result::OK, looper->postBatch(batch));
+	ASSERT_EQ(4u, looper->queueDepth());
+}
+
+TEST(LooperQueueTest, BatchHandlerReceivesBoundedBatches) {
+	auto looper(make_shared<Looper>());
+	auto recorder(make_shared<BatchRecorder>());
+	looper->registerHandler(recorder);
+
+	vector<shared_ptr<Message>> batch;
+	for (uint32_t i = 0; i < 40; i++) {
+		batch.push_back(make_shared<Message>(recorder->id(), i));
+	}
+	ASSERT_EQ(Result::OK, looper->postBatch(batch));
+	ASSERT_EQ(Result::OK, looper->start());
+	ASSERT_TRUE(recorder->waitFor(batch.size(), milliseconds(5000)));
+	looper->stop();
+
+	// Queued before the start, so they are split only by the batch limit.
+	vector<size_t> expected = { 16, 16, 8 };
+	ASSERT_EQ(expected, recorder->batchSizes());
+	ASSERT_EQ(batch.size(), recorder->received().size());
+}
+
+TEST(LooperQueueTest, StatsSnapshot) {
+	auto looper(make_shared<Looper>());
+	auto recorder(make_shared<OrderRecorder>());
+	looper->registerHandler(recorder);
+	looper->setLatencyTracking(true);
+
+	for (uint32_t i = 0; i < 5; i++) {
+		ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), i)->post());
+	}
+	Looper::TimerHandle timer;
+	ASSERT_EQ(Result::OK, make_shared<Message>(recorder->id(), 9)->postTimer(seconds(60), &timer));
+
+	Looper::Stats stats;
+	looper->getStats(&stats);
+	ASSERT_EQ(5u, stats.mQueueDepth);
+	ASSERT_EQ(1u, stats.mPendingTimers);
+	ASSERT_EQ(0u, stats.mDelivered);
+
+	ASSERT_EQ(Result::OK, looper->start());
+	ASSERT_TRUE(recorder->waitFor(5, milliseconds(5000)));
+	looper->stop();
+
+	looper->getStats(&stats);
+	ASSERT_EQ(0u, stats.mQueueDepth);
+	ASSERT_EQ(5u, stats.mQueueHighWaterMark);
+	ASSERT_EQ(5u, stats.mDelivered);
+	ASSERT_EQ(5u, stats.mQueueLatency[Looper::kPriorityNormal].count());
+	ASSERT_EQ(0u, stats.mQueueLatency[Looper::kPriorityUrgent].count());
+	ASSERT_EQ(Result::OK, timer.cancel());
+}
+
+TEST(LooperQueueTest, ConcurrentProducersKeepPerProducerOrder) {
+	auto looper(make_shared<Looper>());
+	auto recorder(make_shared<OrderRecorder>());
+	looper->registerHandler(recorder);
+	ASSERT_EQ(Result::OK, looper->start());
+
+	const uint32_t kProducers = 8;
+	const uint32_t kPerProducer = 2000;
+	vector<thread> producers;
+	for (uint32_t p = 0; p < kProducers; p++) {
+		producers.push_back(thread([&recorder, p, kPerProducer] {
+			for (uint32_t i = 0; i < kPerProducer; i++) {
+				make_shared<Message>(recorder->id(), (p << 16) | i)->post();
+			}
+		}));
+	}
+	for (auto& producer : producers) {
+		producer.join();
+	}
+
+	ASSERT_TRUE(recorder->waitFor(kProducers * kPerProducer, milliseconds(5000)));
+	vector<uint32_t> next(kProducers, 0);
+	for (uint32_t what : recorder->received()) {
+		ASSERT_EQ(next[what >> 16]++, what & 0xffff);
+	}
+}
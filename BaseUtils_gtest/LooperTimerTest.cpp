@@ -0,0 +1,189 @@
+#include <gtest/gtest.h>
+#include <baseutils/Handler.h>
+#include <baseutils/Looper.h>
+#include <baseutils/Message.h>
+#include <baseutils/TimerWheel.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+using namespace baseutils;
+
+TEST(LooperTimerTest, WheelExpiresEachTimerOnItsTick) {
+	TimerWheel wheel(milliseconds(1));
+	// Between ticks, so that each timer is due on a tick of its own.
+	TimerWheel::clock::time_point base(seconds(1000) + microseconds(500));
+
+	// Spans every level, the overflow list aside.
+	const int64_t kDelays[] = { 0, 1, 5, 255, 256, 300, 65535, 65536, 70000, 1 << 24, (1 << 24) + 3 };
+	for (int64_t delay : kDelays) {
+		wheel.add(base + milliseconds(delay), base, Message::obtain(0, (uint32_t)delay));
+	}
+	ASSERT_EQ(sizeof(kDelays) / sizeof(kDelays[0]), wheel.size());
+
+	deque<shared_ptr<Message>> expired;
+	for (int64_t delay : kDelays) {
+		// Never early...
+		wheel.advance(base + milliseconds(delay) - microseconds(1500), &expired);
+		ASSERT_TRUE(expired.empty()) << delay;
+		ASSERT_LE(wheel.nextDeadline(), base + milliseconds(delay) + milliseconds(1));
+
+		// ...and at most a tick late.
+		wheel.advance(base + milliseconds(delay + 1), &expired);
+		ASSERT_EQ(1u, expired.size()) << delay;
+		ASSERT_EQ((uint32_t)delay, expired.front()->what());
+		expired.clear();
+	}
+	ASSERT_TRUE(wheel.empty());
+	ASSERT_EQ(TimerWheel::clock::time_point::max(), wheel.nextDeadline());
+}
+
+TEST(LooperTimerTest, WheelDeadlineCoversPendingCascade) {
+	TimerWheel wheel(milliseconds(1));
+	// The start of a block of 256 ticks.
+	TimerWheel::clock::time_point block(milliseconds(256 * 1000));
+
+	wheel.add(block + milliseconds(10), block, Message::obtain(0, 1));
+	wheel.add(block + milliseconds(300), block, Message::obtain(0, 2));
+
+	// Leaves the wheel on the next block boundary, not yet cascaded.
+	deque<shared_ptr<Message>> expired;
+	wheel.advance(block + milliseconds(255), &expired);
+	ASSERT_EQ(1u, expired.size());
+	ASSERT_LE(wheel.nextDeadline(), block + milliseconds(300));
+
+	expired.clear();
+	wheel.advance(block + milliseconds(300), &expired);
+	ASSERT_EQ(1u, expired.size());
+	ASSERT_EQ(2u, expired.front()->what());
+}
+
+TEST(LooperTimerTest, WheelAddsOnTimeBehindALongTimer) {
+	TimerWheel wheel(milliseconds(1));
+	TimerWheel::clock::time_point base(seconds(1000));
+
+	wheel.add(base + seconds(10), base, Message::obtain(0, 1));
+	wheel.add(base + milliseconds(2), base, Message::obtain(0, 2));
+
+	deque<shared_ptr<Message>> expired;
+	wheel.advance(base + milliseconds(3), &expired);
+	ASSERT_EQ(1u, expired.size());
+	ASSERT_EQ(2u, expired.front()->what());
+	expired.clear();
+
+	// The long timer must not drag the new one out to its own slot.
+	wheel.add(base + milliseconds(8), base + milliseconds(3), Message::obtain(0, 3));
+	ASSERT_LE(wheel.nextDeadline(), base + milliseconds(8));
+
+	wheel.advance(base + milliseconds(7), &expired);
+	ASSERT_TRUE(expired.empty());
+	wheel.advance(base + milliseconds(8), &expired);
+	ASSERT_EQ(1u, expired.size());
+	ASSERT_EQ(3u, expired.front()->what());
+	ASSERT_EQ(1u, wheel.size());
+}
+
+TEST(LooperTimerTest, WheelRemovesByIdOnlyOnce) {
+	TimerWheel wheel(milliseconds(1));
+	TimerWheel::clock::time_point base(seconds(1000));
+
+	TimerWheel::timer_id first = wheel.add(base + milliseconds(10), base, Message::obtain(0, 1));
+	TimerWheel::timer_id second = wheel.add(base + milliseconds(10), base, Message::obtain(0, 2));
+	ASSERT_TRUE(wheel.remove(first));
+	ASSERT_FALSE(wheel.remove(first));
+
+	// The node is reused, the old id must not reach the new timer.
+	TimerWheel::timer_id third = wheel.add(base + milliseconds(20), base, Message::obtain(0, 3));
+	ASSERT_NE(first, third);
+	ASSERT_FALSE(wheel.remove(first));
+
+	deque<shared_ptr<Message>> expired;
+	wheel.advance(base + milliseconds(30), &expired);
+	ASSERT_EQ(2u, expired.size());
+	ASSERT_EQ(2u, expired[0]->what());
+	ASSERT_EQ(3u, expired[1]->what());
+	ASSERT_FALSE(wheel.remove(second));
+}
+
+class TimerHandler : public Handler {
+public:
+	explicit TimerHandler(size_t expected) : mExpected(expected) {}
+
+	virtual ~TimerHandler() = default;
+
+	future<vector<uint32_t>> done() { return mDone.get_future(); }
+
+protected:
+	virtual void onMessageReceived(const shared_ptr<Message> &msg) {
+		lock_guard<mutex> lock(mLock);
+		mReceived.push_back(msg->what());
+		if (mReceived.size() == mExpected) {
+			mDone.set_value(mReceived);
+		}
+	}
+
+private:
+	size_t mExpected;
+	mutex mLock;
+	vector<uint32_t> mReceived;
+	promise<vector<uint32_t>> mDone;
+};
+
+TEST(LooperTimerTest, CancelledTimersAreNotDelivered) {
+	const uint32_t kTimers = 1000;
+	auto looper(make_shared<Looper>());
+	auto handler(make_shared<TimerHandler>(kTimers / 2));
+	Looper::handler_id id = looper->registerHandler(handler);
+	ASSERT_EQ(Result::OK, looper->start());
+
+	vector<Looper::TimerHandle> handles(kTimers);
+	for (uint32_t i = 0; i < kTimers; i++) {
+		ASSERT_EQ(Result::OK, Message::obtain(id, i)->postTimer(milliseconds(20 + i % 50), &handles[i]));
+	}
+	for (uint32_t i = 1; i < kTimers; i += 2) {
+		ASSERT_EQ(Result::OK, handles[i].cancel());
+	}
+
+	future<vector<uint32_t>> done(handler->done());
+	ASSERT_EQ(future_status::ready, done.wait_for(seconds(5)));
+	vector<uint32_t> received(done.get());
+	sort(received.begin(), received.end());
+	for (uint32_t i = 0; i < kTimers / 2; i++) {
+		ASSERT_EQ(i * 2, received[i]);
+	}
+
+	// Fired already.
+	ASSERT_EQ(Result::ER_NAME_NOT_FOUND, handles[0].cancel());
+	ASSERT_EQ(Result::ER_NAME_NOT_FOUND, Looper::TimerHandle().cancel());
+
+	looper->stop();
+	looper->unregisterHandler(id);
+}
+
+TEST(LooperTimerTest, TickOnlyChangesWhileIdle) {
+	auto looper(make_shared<Looper>());
+	auto handler(make_shared<TimerHandler>(1));
+	Looper::handler_id id = looper->registerHandler(handler);
+	ASSERT_EQ(Result::OK, looper->setTimerTick(milliseconds(10)));
+	ASSERT_EQ(Result::ER_BAD_VALUE, looper->setTimerTick(milliseconds(0)));
+
+	Looper::TimerHandle handle;
+	ASSERT_EQ(Result::OK, Message::obtain(id, 7)->postTimer(milliseconds(15), &handle));
+	ASSERT_EQ(Result::ER_INVALID_OPERATION, looper->setTimerTick(milliseconds(1)));
+
+	steady_clock::time_point start = steady_clock::now();
+	ASSERT_EQ(Result::OK, looper->start());
+	future<vector<uint32_t>> done(handler->done());
+	ASSERT_EQ(future_status::ready, done.wait_for(seconds(5)));
+	ASSERT_GE(steady_clock::now() - start, milliseconds(10));
+	ASSERT_EQ(7u, done.get().front());
+
+	looper->stop();
+	looper->unregisterHandler(id);
+}
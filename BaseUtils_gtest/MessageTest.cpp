@@ -0,0 +1,449 @@
+#include <gtest/gtest.h>
+#include <baseutils/Buffer.h>
+#include <baseutils/BufferChain.h>
+#include <baseutils/Message.h>
+#include <baseutils/MessageKey.h>
+#include <baseutils/Parcelable.h>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace baseutils;
+
+static const MessageKey kKeyWidth("width");
+static const MessageKey kKeyHeight("height");
+
+TEST(MessageTest, KeysWithSameNameShareId) {
+	MessageKey width("width");
+	ASSERT_EQ(kKeyWidth, width);
+	ASSERT_EQ(kKeyWidth.id(), width.id());
+	ASSERT_NE(kKeyWidth, kKeyHeight);
+	ASSERT_EQ(string("height"), kKeyHeight.name());
+
+	MessageKey found;
+	ASSERT_TRUE(MessageKey::Find("width", &found));
+	ASSERT_EQ(kKeyWidth, found);
+	ASSERT_FALSE(MessageKey::Find("never-interned-name", &found));
+}
+
+TEST(MessageTest, KeyAndStringAccessorsAgree) {
+	auto msg(make_shared<Message>());
+	msg->setInt32(kKeyWidth, 1920);
+	msg->setInt32("height", 1080);
+
+	int32_t value;
+	ASSERT_TRUE(msg->findInt32("width", &value));
+	ASSERT_EQ(1920, value);
+	ASSERT_TRUE(msg->findInt32(kKeyHeight, &value));
+	ASSERT_EQ(1080, value);
+
+	Message::Type type;
+	ASSERT_EQ(2u, msg->countEntries());
+	ASSERT_EQ(string("width"), msg->getEntryNameAt(0, type));
+	ASSERT_EQ(Message::kTypeInt32, type);
+}
+
+TEST(MessageTest, RuntimeNamesAreNotInterned) {
+	auto msg(make_shared<Message>());
+	for (int32_t i = 0; i < 100; i++) {
+		msg->setInt32("runtime-track-" + to_string(i), i);
+	}
+
+	MessageKey key;
+	ASSERT_FALSE(MessageKey::Find("runtime-track-7", &key));
+	int32_t value;
+	ASSERT_TRUE(msg->findInt32("runtime-track-7", &value));
+	ASSERT_EQ(7, value);
+	ASSERT_TRUE(msg->findInt32(MessageKey::Named("runtime-track-8"), &value));
+	ASSERT_EQ(8, value);
+	ASSERT_FALSE(msg->findInt32("runtime-track-100", &value));
+	ASSERT_NE(MessageKey(), MessageKey::Named(""));
+
+	// A key interned later still finds the field, and setting it replaces
+	// the field rather than adding one.
+	MessageKey interned("runtime-track-9");
+	ASSERT_EQ(interned, MessageKey::Named("runtime-track-9"));
+	ASSERT_TRUE(msg->findInt32(interned, &value));
+	ASSERT_EQ(9, value);
+	msg->setInt32(interned, 90);
+	ASSERT_EQ(100u, msg->countEntries());
+	ASSERT_TRUE(msg->findInt32("runtime-track-9", &value));
+	ASSERT_EQ(90, value);
+}
+
+TEST(MessageTest, SetReplacesExistingField) {
+	auto msg(make_shared<Message>());
+	msg->setInt32(kKeyWidth, 1);
+	msg->setString(kKeyWidth, "wide");
+
+	int32_t value;
+	string str;
+	ASSERT_EQ(1u, msg->countEntries());
+	ASSERT_FALSE(msg->findInt32(kKeyWidth, &value));
+	ASSERT_TRUE(msg->findString(kKeyWidth, &str));
+	ASSERT_EQ(string("wide"), str);
+}
+
+TEST(MessageTest, DuplicateCopiesAllTypes) {
+	auto inner(make_shared<Message>(0, 7));
+	auto buffer(make_shared<Buffer>(16));
+
+	auto msg(make_shared<Message>(3, 5));
+	msg->setBoolean("bool", true);
+	msg->setInt64("int64", -1);
+	msg->setDouble("double", 0.5);
+	msg->setString("string", "text");
+	msg->setBuffer("buffer", buffer);
+	msg->setMessage("message", inner);
+
+	auto dup(msg->duplicate());
+	ASSERT_EQ(3, dup->target());
+	ASSERT_EQ(5u, dup->what());
+	ASSERT_EQ(msg->countEntries(), dup->countEntries());
+
+	bool b = false;
+	int64_t i64 = 0;
+	double d = 0;
+	string str;
+	shared_ptr<Buffer> buf;
+	shared_ptr<Message> m;
+	ASSERT_TRUE(dup->findBoolean("bool", &b));
+	ASSERT_TRUE(b);
+	ASSERT_TRUE(dup->findInt64("int64", &i64));
+	ASSERT_EQ(-1, i64);
+	ASSERT_TRUE(dup->findDouble("double", &d));
+	ASSERT_EQ(0.5, d);
+	ASSERT_TRUE(dup->findString("string", &str));
+	ASSERT_EQ(string("text"), str);
+	ASSERT_TRUE(dup->findBuffer("buffer", &buf));
+	ASSERT_EQ(buffer, buf);
+	ASSERT_TRUE(dup->findMessage("message", &m));
+	ASSERT_EQ(inner, m);
+}
+
+TEST(MessageTest, ManyFieldsSpillPastInlineStorage) {
+	auto msg(make_shared<Message>());
+	const int32_t kFields = 40;
+	for (int32_t i = 0; i < kFields; i++) {
+		msg->setString("field-" + to_string(i), to_string(i));
+	}
+	ASSERT_EQ((size_t)kFields, msg->countEntries());
+
+	auto dup(msg->duplicate());
+	msg->clear();
+	ASSERT_EQ(0u, msg->countEntries());
+
+	for (int32_t i = 0; i < kFields; i++) {
+		string value;
+		ASSERT_TRUE(dup->findString("field-" + to_string(i), &value));
+		ASSERT_EQ(to_string(i), value);
+	}
+}
+
+TEST(MessageTest, ObtainRecyclesReleasedMessages) {
+	{
+		auto msg(Message::obtain(3, 5));
+		msg->setString(kKeyWidth, "wide");
+	}
+
+	Message::PoolStats before = Message::GetPoolStats();
+	auto msg(Message::obtain(4, 6));
+	Message::PoolStats after = Message::GetPoolStats();
+	ASSERT_EQ(before.hits + 1, after.hits);
+	ASSERT_EQ(before.misses, after.misses);
+
+	string str;
+	ASSERT_EQ(4, msg->target());
+	ASSERT_EQ(6u, msg->what());
+	ASSERT_EQ(0u, msg->countEntries());
+	ASSERT_FALSE(msg->findString(kKeyWidth, &str));
+}
+
+TEST(MessageTest, ZeroPoolCapacityDisablesRecycling) {
+	// Use up whatever earlier tests left in the pool.
+	vector<shared_ptr<Message>> held;
+	uint64_t misses = Message::GetPoolStats().misses;
+	while (Message::GetPoolStats().misses == misses) {
+		held.push_back(Message::obtain());
+	}
+	Message::SetPoolCapacity(0);
+	held.clear();
+
+	Message::PoolStats before = Message::GetPoolStats();
+	Message::obtain();
+	Message::obtain();
+	Message::PoolStats after = Message::GetPoolStats();
+	Message::SetPoolCapacity(256);
+
+	ASSERT_EQ(before.hits, after.hits);
+	ASSERT_EQ(before.misses + 2, after.misses);
+}
+
+TEST(MessageTest, MessagesReleasedOnAnotherThreadAreReused) {
+	const int32_t kMessages = 256;
+	vector<shared_ptr<Message>> messages;
+	for (int32_t i = 0; i < kMessages; i++) {
+		messages.push_back(Message::obtain());
+	}
+	thread releaser([&messages] {
+		messages.clear();
+	});
+	releaser.join();
+
+	Message::PoolStats before = Message::GetPoolStats();
+	for (int32_t i = 0; i < kMessages; i++) {
+		messages.push_back(Message::obtain());
+	}
+	Message::PoolStats after = Message::GetPoolStats();
+	ASSERT_GT(after.hits, before.hits);
+}
+
+static shared_ptr<Message> makeWireMessage() {
+	auto inner(make_shared<Message>(0, 7));
+	inner->setString("name", "inner");
+
+	auto chain(make_shared<BufferChain>(make_shared<Buffer>("head", 4)));
+	chain->append(make_shared<Buffer>(string(300, 't').data(), 300));
+
+	auto msg(make_shared<Message>(3, 5));
+	msg->setPriority(Looper::kPriorityUrgent);
+	msg->setBoolean("bool", true);
+	msg->setInt32("int32", -32);
+	msg->setInt64("int64", -64);
+	msg->setSize("size", 42);
+	msg->setFloat("float", 0.25f);
+	msg->setDouble("double", 0.5);
+	msg->setPointer("pointer", msg.get());
+	msg->setString("string", "text");
+	msg->setBuffer("small", make_shared<Buffer>("abc", 3));
+	msg->setBuffer("large", make_shared<Buffer>(string(1000, 'x').data(), 1000));
+	msg->setBufferChain("chain", chain);
+	msg->setMessage("message", inner);
+	return msg;
+}
+
+static void expectWireMessage(const shared_ptr<Message>& msg, const shared_ptr<Message>& original) {
+	bool b = false;
+	int32_t i32 = 0;
+	int64_t i64 = 0;
+	size_t size = 0;
+	float f = 0;
+	double d = 0;
+	void* ptr = NULL;
+	string str;
+	shared_ptr<Buffer> buf;
+	shared_ptr<BufferChain> chain;
+	shared_ptr<Message> inner;
+
+	ASSERT_EQ(3, msg->target());
+	ASSERT_EQ(5u, msg->what());
+	ASSERT_EQ(Looper::kPriorityUrgent, msg->priority());
+	ASSERT_EQ(original->countEntries(), msg->countEntries());
+	ASSERT_TRUE(msg->findBoolean("bool", &b));
+	ASSERT_TRUE(b);
+	ASSERT_TRUE(msg->findInt32("int32", &i32));
+	ASSERT_EQ(-32, i32);
+	ASSERT_TRUE(msg->findInt64("int64", &i64));
+	ASSERT_EQ(-64, i64);
+	ASSERT_TRUE(msg->findSize("size", &size));
+	ASSERT_EQ(42u, size);
+	ASSERT_TRUE(msg->findFloat("float", &f));
+	ASSERT_EQ(0.25f, f);
+	ASSERT_TRUE(msg->findDouble("double", &d));
+	ASSERT_EQ(0.5, d);
+	ASSERT_TRUE(msg->findPointer("pointer", &ptr));
+	ASSERT_EQ(original.get(), ptr);
+	ASSERT_TRUE(msg->findString("string", &str));
+	ASSERT_EQ(string("text"), str);
+	ASSERT_TRUE(msg->findBuffer("small", &buf));
+	ASSERT_EQ(string("abc"), string((const char*)buf->data(), buf->size()));
+	ASSERT_TRUE(msg->findBuffer("large", &buf));
+	ASSERT_EQ(string(1000, 'x'), string((const char*)buf->data(), buf->size()));
+	ASSERT_TRUE(msg->findBufferChain("chain", &chain));
+	ASSERT_EQ(304u, chain->size());
+	ASSERT_EQ(2u, chain->countSegments());
+	ASSERT_TRUE(msg->findMessage("message", &inner));
+	ASSERT_EQ(7u, inner->what());
+	ASSERT_TRUE(inner->findString("name", &str));
+	ASSERT_EQ(string("inner"), str);
+}
+
+TEST(MessageTest, WireRoundTripThroughBuffer) {
+	auto msg(makeWireMessage());
+	auto buffer(make_shared<Buffer>(4096));
+	ASSERT_EQ(Result::OK, msg->writeTo(buffer));
+	ASSERT_EQ(Result::OK, msg->writeTo(buffer));
+
+	// Both come back, one after the other.
+	shared_ptr<Message> decoded;
+	ASSERT_EQ(Result::OK, Message::readFrom(buffer, &decoded));
+	expectWireMessage(decoded, msg);
+
+	// Inline buffers point into the source instead of being copied.
+	shared_ptr<Buffer> large;
+	ASSERT_TRUE(decoded->findBuffer("large", &large));
+	ASSERT_GE(large->data(), buffer->base());
+	ASSERT_LT(large->data(), buffer->base() + buffer->capacity());
+
+	ASSERT_EQ(Result::OK, Message::readFrom(buffer, &decoded));
+	expectWireMessage(decoded, msg);
+	ASSERT_EQ(0u, buffer->size());
+	ASSERT_EQ(Result::ER_NOT_ENOUGH_DATA, Message::readFrom(buffer, &decoded));
+}
+
+TEST(MessageTest, WireRoundTripThroughChain) {
+	auto msg(makeWireMessage());
+	BufferChain chain;
+	ASSERT_EQ(Result::OK, msg->writeTo(&chain));
+
+	// The large buffer was appended, not copied.
+	shared_ptr<Buffer> large;
+	ASSERT_TRUE(msg->findBuffer("large", &large));
+	bool shared = false;
+	for (size_t i = 0; i < chain.countSegments(); i++) {
+		shared |= chain.segmentAt(i)->data() == large->data();
+	}
+	ASSERT_TRUE(shared);
+
+	shared_ptr<Message> decoded;
+	ASSERT_EQ(Result::OK, Message::readFrom(&chain, &decoded));
+	expectWireMessage(decoded, msg);
+	ASSERT_TRUE(chain.empty());
+}
+
+TEST(MessageTest, WireReferencesBuffersAndObjects) {
+	auto object(make_shared<Parcelable>());
+	auto buffer(make_shared<Buffer>(string(512, 'r').data(), 512));
+	auto msg(make_shared<Message>(1, 2));
+	msg->setObject("object", object);
+	msg->setBuffer("buffer", buffer);
+	msg->setBuffer("small", make_shared<Buffer>("abc", 3));
+
+	// Objects can't be written inline, and a failed write leaves no trace.
+	BufferChain chain;
+	ASSERT_EQ(Result::ER_BAD_TYPE, msg->writeTo(&chain));
+	ASSERT_TRUE(chain.empty());
+
+	Message::References refs;
+	refs.mMinBufferSize = 256;
+	ASSERT_EQ(Result::OK, msg->writeTo(&chain, &refs));
+	ASSERT_EQ(1u, refs.mObjects.size());
+	ASSERT_EQ(1u, refs.mBuffers.size());
+	ASSERT_LT(chain.size(), 100u);
+
+	BufferChain copy(chain);
+	shared_ptr<Message> decoded;
+	ASSERT_EQ(Result::ER_BAD_INDEX, Message::readFrom(&copy, &decoded));
+	ASSERT_EQ(Result::OK, Message::readFrom(&chain, &decoded, &refs));
+
+	shared_ptr<Parcelable> obj;
+	shared_ptr<Buffer> buf;
+	ASSERT_TRUE(decoded->findObject("object", &obj));
+	ASSERT_EQ(object, obj);
+	ASSERT_TRUE(decoded->findBuffer("buffer", &buf));
+	ASSERT_EQ(buffer, buf);
+	ASSERT_TRUE(decoded->findBuffer("small", &buf));
+	ASSERT_EQ(3u, buf->size());
+}
+
+TEST(MessageTest, WireRejectsShortAndCorruptInput) {
+	auto msg(makeWireMessage());
+	auto buffer(make_shared<Buffer>(64));
+	ASSERT_EQ(Result::ER_NO_MEMORY, msg->writeTo(buffer));
+	ASSERT_EQ(0u, buffer->size());
+
+	buffer = make_shared<Buffer>(4096);
+	ASSERT_EQ(Result::OK, msg->writeTo(buffer));
+	size_t size = buffer->size();
+
+	// Part of a message is left alone until the rest arrives.
+	shared_ptr<Message> decoded;
+	buffer->setRange(0, size - 1);
+	ASSERT_EQ(Result::ER_NOT_ENOUGH_DATA, Message::readFrom(buffer, &decoded));
+	ASSERT_EQ(size - 1, buffer->size());
+
+	buffer->setRange(0, size);
+	buffer->data()[0] ^= 0xff;
+	ASSERT_EQ(Result::ER_BAD_VALUE, Message::readFrom(buffer, &decoded));
+	buffer->data()[0] ^= 0xff;
+
+	// An unknown field type.
+	buffer->data()[12 + 13] = 0x7f;
+	ASSERT_EQ(Result::ER_BAD_VALUE, Message::readFrom(buffer, &decoded));
+	ASSERT_TRUE(decoded == NULL);
+}
+
+TEST(MessageTest, WireRefusesWhatCantBeReadBack) {
+	static const MessageKey kKeyNested("nested");
+
+	// As deep as readFrom() goes.
+	auto deepest(make_shared<Message>(1, 0));
+	for (uint32_t i = 1; i <= 32; i++) {
+		auto outer(make_shared<Message>(1, i));
+		outer->setMessage(kKeyNested, deepest);
+		deepest = outer;
+	}
+	auto buffer(make_shared<Buffer>(4096));
+	ASSERT_EQ(Result::OK, deepest->writeTo(buffer));
+	shared_ptr<Message> decoded;
+	ASSERT_EQ(Result::OK, Message::readFrom(buffer, &decoded));
+
+	auto tooDeep(make_shared<Message>(1, 33));
+	tooDeep->setMessage(kKeyNested, deepest);
+	buffer = make_shared<Buffer>(4096);
+	ASSERT_EQ(Result::ER_BAD_VALUE, tooDeep->writeTo(buffer));
+	ASSERT_EQ(0u, buffer->size());
+
+	auto cyclic(make_shared<Message>(1, 0));
+	cyclic->setMessage(kKeyNested, cyclic);
+	BufferChain chain;
+	ASSERT_EQ(Result::ER_BAD_VALUE, cyclic->writeTo(&chain));
+	ASSERT_EQ(0u, chain.size());
+	cyclic->clear();
+}
+
+TEST(MessageTest, WireKeepsFieldsWithNewNames) {
+	auto msg(make_shared<Message>(1, 2));
+	msg->setInt32("wire-field-a", 1);
+	msg->setString("wire-field-b", "kept");
+	auto buffer(make_shared<Buffer>(1024));
+	ASSERT_EQ(Result::OK, msg->writeTo(buffer));
+
+	// Renames the first field to something this process never interned,
+	// as a peer might send before the key here is first constructed.
+	uint8_t* name = (uint8_t*)memmem(buffer->data(), buffer->size(), "wire-field-a", 12);
+	ASSERT_TRUE(name != NULL);
+	name[11] = 'Q';
+
+	shared_ptr<Message> decoded;
+	ASSERT_EQ(Result::OK, Message::readFrom(buffer, &decoded));
+	ASSERT_EQ(2u, decoded->countEntries());
+	int32_t value = 0;
+	ASSERT_TRUE(decoded->findInt32("wire-field-Q", &value));
+	ASSERT_EQ(1, value);
+	MessageKey key;
+	ASSERT_FALSE(MessageKey::Find("wire-field-Q", &key));
+	string str;
+	ASSERT_TRUE(decoded->findString("wire-field-b", &str));
+	ASSERT_EQ(string("kept"), str);
+
+	// And it travels on when forwarded.
+	buffer = make_shared<Buffer>(1024);
+	ASSERT_EQ(Result::OK, decoded->writeTo(buffer));
+	ASSERT_EQ(Result::OK, Message::readFrom(buffer, &decoded));
+	ASSERT_TRUE(decoded->findInt32("wire-field-Q", &value));
+
+	// However many fresh names a long-lived reader sees.
+	for (int32_t i = 0; i < 5000; i++) {
+		auto named(make_shared<Message>(1, 2));
+		named->setInt32("wire-track-" + to_string(i), i);
+		buffer = make_shared<Buffer>(1024);
+		ASSERT_EQ(Result::OK, named->writeTo(buffer));
+		ASSERT_EQ(Result::OK, Message::readFrom(buffer, &decoded)) << i;
+		ASSERT_TRUE(decoded->findInt32("wire-track-" + to_string(i), &value));
+		ASSERT_EQ(i, value);
+	}
+}
@@ -0,0 +1,386 @@
+#include <gtest/gtest.h>
+#include <baseutils/Buffer.h>
+#include <baseutils/Handler.h>
+#include <baseutils/Looper.h>
+#include <baseutils/Message.h>
+#include <baseutils/Parcelable.h>
+#include <baseutils/RemoteLooper.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+using namespace baseutils;
+
+class RecordingHandler : public Handler {
+public:
+	bool waitFor(size_t count) {
+		unique_lock<mutex> lock(mLock);
+		return mCondition.wait_for(lock, seconds(5), [this, count] {
+			return mMessages.size() >= count;
+		});
+	}
+
+	vector<shared_ptr<Message>> take() {
+		unique_lock<mutex> lock(mLock);
+		vector<shared_ptr<Message>> messages;
+		messages.swap(mMessages);
+		return messages;
+	}
+
+protected:
+	virtual void onMessageReceived(const shared_ptr<Message> &msg) {
+		unique_lock<mutex> lock(mLock);
+		mMessages.push_back(msg);
+		mCondition.notify_all();
+	}
+
+private:
+	mutex mLock;
+	condition_variable mCondition;
+	vector<shared_ptr<Message>> mMessages;
+};
+
+// Both sides of a channel in one process, mapped twice as two processes
+// would. Side B delivers to handler on its own looper.
+class RemoteLooperTest : public ::testing::Test {
+protected:
+	void open(size_t ringSize = 1 << 16, size_t numBlocks = 4) {
+		map(ringSize, numBlocks);
+		ASSERT_EQ(Result::OK, mLooper->start());
+	}
+
+	// As open(), but starts no thread.
+	void map(size_t ringSize = 1 << 16, size_t numBlocks = 4) {
+		ASSERT_EQ(Result::OK, RemoteLooper::CreateChannel(&mChannel, ringSize, 64 << 10, numBlocks));
+		mSideA = make_shared<RemoteLooper>();
+		mSideB = make_shared<RemoteLooper>();
+		ASSERT_EQ(Result::OK, mSideA->attach(mChannel, RemoteLooper::kSideA));
+		ASSERT_EQ(Result::OK, mSideB->attach(mChannel, RemoteLooper::kSideB));
+
+		mLooper = make_shared<Looper>();
+		mHandler = make_shared<RecordingHandler>();
+		mLooper->registerHandler(mHandler);
+		mTarget = mSideA->importHandler(mHandler->id());
+		ASSERT_NE(0, mTarget);
+	}
+
+	virtual void TearDown() {
+		if (mSideA != NULL) {
+			mSideA->stop();
+			mSideB->stop();
+			mLooper->stop();
+		}
+		RemoteLooper::CloseChannel(&mChannel);
+	}
+
+	RemoteLooper::Channel mChannel;
+	shared_ptr<RemoteLooper> mSideA;
+	shared_ptr<RemoteLooper> mSideB;
+	shared_ptr<Looper> mLooper;
+	shared_ptr<RecordingHandler> mHandler;
+	Looper::handler_id mTarget;
+};
+
+TEST_F(RemoteLooperTest, PostReachesHandlerOnOtherSide) {
+	open();
+	ASSERT_EQ(Result::OK, mSideA->start());
+	ASSERT_EQ(Result::OK, mSideB->start());
+
+	for (int32_t i = 0; i < 100; i++) {
+		auto msg(Message::obtain(mTarget, 9));
+		msg->setInt32("seq", i);
+		msg->setString("text", "over there");
+		ASSERT_EQ(Result::OK, msg->post());
+	}
+	ASSERT_EQ(Result::OK, Message::obtain(mTarget, 10)->post(milliseconds(20)));
+	ASSERT_TRUE(mHandler->waitFor(101));
+
+	vector<shared_ptr<Message>> messages = mHandler->take();
+	for (int32_t i = 0; i < 100; i++) {
+		int32_t seq;
+		string text;
+		ASSERT_EQ(mHandler->id(), messages[i]->target());
+		ASSERT_EQ(9u, messages[i]->what());
+		ASSERT_TRUE(messages[i]->findInt32("seq", &seq));
+		ASSERT_EQ(i, seq);
+		ASSERT_TRUE(messages[i]->findString("text", &text));
+		ASSERT_EQ(string("over there"), text);
+	}
+	ASSERT_EQ(10u, messages[100]->what());
+}
+
+TEST_F(RemoteLooperTest, LargeBuffersGoThroughTheBlockPool) {
+	open(1 << 16, 2);
+	ASSERT_EQ(Result::OK, mSideB->start());
+
+	// Allocated in the segment, the other side sees the same bytes.
+	auto buffer(mSideA->allocateBuffer(8192));
+	ASSERT_TRUE(buffer != NULL);
+	memset(buffer->data(), 'a', buffer->size());
+	auto msg(Message::obtain(mTarget, 1));
+	msg->setBuffer("payload", buffer);
+	ASSERT_EQ(Result::OK, msg->post());
+	ASSERT_TRUE(mHandler->waitFor(1));
+
+	shared_ptr<Buffer> received;
+	ASSERT_TRUE(mHandler->take()[0]->findBuffer("payload", &received));
+	ASSERT_EQ(8192u, received->size());
+	ASSERT_EQ('a', received->data()[8191]);
+	buffer->data()[0] = 'z';
+	ASSERT_EQ('z', received->data()[0]);
+	msg.reset();
+	buffer.reset();
+	received.reset();
+
+	// Others are copied to a block, which is freed again once both sides
+	// are done with it.
+	for (int32_t i = 0; i < 8; i++) {
+		string bytes(10000, 'a' + i);
+		auto msg(Message::obtain(mTarget, 2));
+		msg->setBuffer("payload", make_shared<Buffer>(bytes.data(), bytes.size()));
+		ASSERT_EQ(Result::OK, msg->post());
+		ASSERT_TRUE(mHandler->waitFor(1));
+
+		ASSERT_TRUE(mHandler->take()[0]->findBuffer("payload", &received));
+		ASSERT_EQ(bytes, string((const char*)received->data(), received->size()));
+		received.reset();
+	}
+
+	// With the pool used up, buffers are written to the ring instead. The
+	// looper may not have let go of the last message just yet.
+	vector<shared_ptr<Buffer>> held;
+	for (int32_t i = 0; i < 1000 && held.size() < 2; i++) {
+		auto block(mSideA->allocateBuffer(100));
+		if (block != NULL) {
+			held.push_back(block);
+		} else {
+			this_thread::sleep_for(milliseconds(1));
+		}
+	}
+	ASSERT_EQ(2u, held.size());
+	ASSERT_TRUE(mSideA->allocateBuffer(100) == NULL);
+	msg = Message::obtain(mTarget, 3);
+	msg->setBuffer("payload", make_shared<Buffer>(string(5000, 'r').data(), 5000));
+	ASSERT_EQ(Result::OK, msg->post());
+	ASSERT_TRUE(mHandler->waitFor(1));
+	ASSERT_TRUE(mHandler->take()[0]->findBuffer("payload", &received));
+	ASSERT_EQ(5000u, received->size());
+}
+
+TEST_F(RemoteLooperTest, FullRingFailsUntilDrained) {
+	open(4096);
+
+	// Nobody reads side B yet.
+	int32_t posted = 0;
+	Result err;
+	while ((err = Message::obtain(mTarget, 4)->post()) == Result::OK) {
+		posted++;
+	}
+	ASSERT_EQ(Result::ER_WOULD_BLOCK, err);
+	ASSERT_GT(posted, 0);
+
+	ASSERT_EQ(Result::OK, mSideB->start());
+	ASSERT_TRUE(mHandler->waitFor(posted));
+	ASSERT_EQ(Result::OK, Message::obtain(mTarget, 4)->post());
+	ASSERT_TRUE(mHandler->waitFor(posted + 1));
+}
+
+TEST_F(RemoteLooperTest, RejectsWhatCantCross) {
+	auto unattached(make_shared<RemoteLooper>());
+	ASSERT_EQ(Result::ER_NO_INIT, unattached->start());
+
+	open();
+	auto msg(Message::obtain(mTarget, 5));
+	msg->setObject("object", make_shared<Parcelable>());
+	ASSERT_EQ(Result::ER_BAD_TYPE, msg->post());
+	ASSERT_EQ(Result::ER_ALREADY_OPERATED, mSideA->attach(mChannel, RemoteLooper::kSideA));
+}
+
+TEST_F(RemoteLooperTest, RefusesMessagesAwaitingReply) {
+	open();
+	ASSERT_EQ(Result::OK, mSideA->start());
+	ASSERT_EQ(Result::OK, mSideB->start());
+
+	// The reply id only means something to this side's roster.
+	shared_ptr<Message> response;
+	ASSERT_EQ(Result::ER_INVALID_OPERATION,
+			Message::obtain(mTarget, 6)->postAndAwaitResponse(response, seconds(1)));
+	future<shared_ptr<Message>> reply;
+	ASSERT_EQ(Result::ER_INVALID_OPERATION, Message::obtain(mTarget, 6)->postWithReply(&reply));
+
+	// Plain posts still go through.
+	ASSERT_EQ(Result::OK, Message::obtain(mTarget, 7)->post());
+	ASSERT_TRUE(mHandler->waitFor(1));
+	ASSERT_EQ(7u, mHandler->take()[0]->what());
+}
+
+TEST_F(RemoteLooperTest, BadRecordLengthBreaksTheChannel) {
+	// Shorter than a record header, unaligned, and past the end of the ring.
+	const uint32_t kBadLengths[] = { 0, 8, 40, 1 << 20 };
+	for (uint32_t bad : kBadLengths) {
+		open(4096);
+		ASSERT_EQ(Result::OK, Message::obtain(mTarget, 1)->post());
+
+		// Plays the other side gone wrong: the first record starts with
+		// its header and frame, 16 bytes each, then the encoded message.
+		struct stat st;
+		ASSERT_EQ(0, fstat(mChannel.mMemFd, &st));
+		void* base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, mChannel.mMemFd, 0);
+		ASSERT_NE(MAP_FAILED, base);
+		const uint32_t kWireMagic = 0x424d5347;
+		uint8_t* encoded = (uint8_t*)memmem(base, st.st_size, &kWireMagic, sizeof(kWireMagic));
+		ASSERT_TRUE(encoded != NULL);
+		memcpy(encoded - 32 + 8, &bad, sizeof(bad));
+		munmap(base, st.st_size);
+
+		ASSERT_FALSE(mSideB->isBroken());
+		ASSERT_EQ(Result::OK, mSideB->start());
+		auto deadline = steady_clock::now() + seconds(5);
+		while (!mSideB->isBroken() && steady_clock::now() < deadline) {
+			this_thread::sleep_for(milliseconds(1));
+		}
+		ASSERT_TRUE(mSideB->isBroken());
+		ASSERT_TRUE(mHandler->take().empty());
+		Looper::handler_id back = mSideB->importHandler(1);
+		ASSERT_EQ(Result::ER_DEAD_OBJECT, Message::obtain(back, 2)->post());
+		TearDown();
+	}
+}
+
+TEST_F(RemoteLooperTest, PayloadNeverPassesForARecord) {
+	const size_t kRingSize = 4096;
+	const size_t kPayloadSize = 1024;
+
+	// Finds where the payload of the first record starts, relative to the
+	// record: its header and frame, 16 bytes each, come before the encoded
+	// message.
+	open(kRingSize);
+	auto probe(Message::obtain(mTarget, 1));
+	string marker(kPayloadSize, 'p');
+	probe->setBuffer("payload", make_shared<Buffer>(marker.data(), marker.size()));
+	ASSERT_EQ(Result::OK, probe->post());
+	struct stat st;
+	ASSERT_EQ(0, fstat(mChannel.mMemFd, &st));
+	void* base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, mChannel.mMemFd, 0);
+	ASSERT_NE(MAP_FAILED, base);
+	const uint32_t kWireMagic = 0x424d5347;
+	uint8_t* encoded = (uint8_t*)memmem(base, st.st_size, &kWireMagic, sizeof(kWireMagic));
+	ASSERT_TRUE(encoded != NULL);
+	uint8_t* payload = (uint8_t*)memmem(encoded, st.st_size - (encoded - (uint8_t*)base),
+			marker.data(), marker.size());
+	ASSERT_TRUE(payload != NULL);
+	size_t payloadOffset = payload - (encoded - 32);
+	munmap(base, st.st_size);
+	TearDown();
+
+	// The same payload, but every word of it on a record boundary holds the
+	// position that boundary has on the next lap, followed by a length the
+	// other side would take for a broken ring.
+	open(kRingSize);
+	ASSERT_EQ(Result::OK, mSideA->start());
+	ASSERT_EQ(Result::OK, mSideB->start());
+	vector<uint8_t> bytes(kPayloadSize, 0);
+	for (size_t i = (16 - payloadOffset % 16) % 16; i + 16 <= kPayloadSize; i += 16) {
+		uint64_t position = kRingSize + payloadOffset + i;
+		memcpy(&bytes[i], &position, sizeof(position));
+	}
+	auto msg(Message::obtain(mTarget, 1));
+	msg->setBuffer("payload", make_shared<Buffer>(bytes.data(), bytes.size()));
+	ASSERT_EQ(Result::OK, msg->post());
+	ASSERT_TRUE(mHandler->waitFor(1));
+	mHandler->take();
+
+	// One at a time, so the other side looks at each boundary before
+	// anything is written there.
+	for (int32_t i = 0; i < 200; i++) {
+		ASSERT_EQ(Result::OK, Message::obtain(mTarget, 2)->post());
+		ASSERT_TRUE(mHandler->waitFor(1));
+		ASSERT_EQ(2u, mHandler->take()[0]->what());
+	}
+	ASSERT_FALSE(mSideB->isBroken());
+}
+
+// Answers a ping from the other process with a pong to the handler id it
+// carries.
+class PingHandler : public Handler {
+public:
+	future<shared_ptr<Message>> pong() { return mPong.get_future(); }
+
+protected:
+	virtual void onMessageReceived(const shared_ptr<Message> &msg) {
+		mPong.set_value(msg);
+	}
+
+private:
+	promise<shared_ptr<Message>> mPong;
+};
+
+TEST_F(RemoteLooperTest, CrossesProcesses) {
+	// Before any thread is started here, so that the child can start its own.
+	map();
+	pid_t pid = fork();
+	ASSERT_GE(pid, 0);
+	if (pid == 0) {
+		// Only side A lives here. Any failure is the exit status.
+		auto looper(make_shared<Looper>());
+		auto handler(make_shared<PingHandler>());
+		looper->registerHandler(handler);
+		auto side(make_shared<RemoteLooper>());
+		if (side->attach(mChannel, RemoteLooper::kSideA) != Result::OK
+				|| looper->start() != Result::OK || side->start() != Result::OK) {
+			_exit(1);
+		}
+		auto buffer(side->allocateBuffer(8192));
+		if (buffer == NULL) {
+			_exit(2);
+		}
+		memset(buffer->data(), 'c', buffer->size());
+		auto ping(Message::obtain(side->importHandler(mHandler->id()), 1));
+		ping->setInt32("reply-to", handler->id());
+		ping->setBuffer("payload", buffer);
+		if (ping->post() != Result::OK) {
+			_exit(3);
+		}
+		auto pong(handler->pong());
+		if (pong.wait_for(seconds(5)) != future_status::ready) {
+			_exit(4);
+		}
+		string text;
+		if (!pong.get()->findString("text", &text) || text != "pong") {
+			_exit(5);
+		}
+		_exit(0);
+	}
+
+	ASSERT_EQ(Result::OK, mLooper->start());
+	ASSERT_EQ(Result::OK, mSideB->start());
+	ASSERT_TRUE(mHandler->waitFor(1));
+	shared_ptr<Message> ping = mHandler->take()[0];
+	shared_ptr<Buffer> payload;
+	int32_t replyTo = 0;
+	ASSERT_TRUE(ping->findBuffer("payload", &payload));
+	ASSERT_EQ(8192u, payload->size());
+	ASSERT_EQ('c', payload->data()[8191]);
+	ASSERT_TRUE(ping->findInt32("reply-to", &replyTo));
+
+	auto pong(Message::obtain(mSideB->importHandler(replyTo), 2));
+	pong->setString("text", "pong");
+	ASSERT_EQ(Result::OK, pong->post());
+
+	int status = -1;
+	ASSERT_EQ(pid, waitpid(pid, &status, 0));
+	ASSERT_TRUE(WIFEXITED(status));
+	ASSERT_EQ(0, WEXITSTATUS(status));
+}
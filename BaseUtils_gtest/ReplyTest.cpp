@@ -0,0 +1,254 @@
+#include <gtest/gtest.h>
+#include <baseutils/Handler.h>
+#include <baseutils/Looper.h>
+#include <baseutils/Message.h>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+using namespace baseutils;
+
+static const MessageKey kKeyValue("value");
+
+// Replies with the request's value plus one, after holding on to the
+// request for "delay-ms" if set.
+class EchoHandler : public Handler {
+public:
+	EchoHandler() = default;
+
+	virtual ~EchoHandler() = default;
+
+protected:
+	virtual void onMessageReceived(const shared_ptr<Message> &msg) {
+		int32_t delayMs = 0;
+		if (msg->findInt32("delay-ms", &delayMs)) {
+			this_thread::sleep_for(milliseconds(delayMs));
+		}
+
+		int32_t value = 0;
+		msg->findInt32(kKeyValue, &value);
+		uint32_t replyId;
+		if (msg->senderAwaitsResponse(replyId)) {
+			auto reply(Message::obtain());
+			reply->setInt32(kKeyValue, value + 1);
+			reply->postReply(replyId);
+		}
+	}
+};
+
+class ReplyTest : public ::testing::Test {
+protected:
+	virtual void SetUp() {
+		mLooper = make_shared<Looper>();
+		mEcho = make_shared<EchoHandler>();
+		mLooper->registerHandler(mEcho);
+		ASSERT_EQ(Result::OK, mLooper->start());
+	}
+
+	shared_ptr<Message> request(int32_t value) {
+		auto msg(Message::obtain(mEcho->id()));
+		msg->setInt32(kKeyValue, value);
+		return msg;
+	}
+
+	shared_ptr<Looper> mLooper;
+	shared_ptr<EchoHandler> mEcho;
+};
+
+TEST_F(ReplyTest, AwaitResponse) {
+	shared_ptr<Message> response;
+	int32_t value = 0;
+	ASSERT_EQ(Result::OK, request(1)->postAndAwaitResponse(response));
+	ASSERT_TRUE(response->findInt32(kKeyValue, &value));
+	ASSERT_EQ(2, value);
+
+	ASSERT_EQ(Result::OK, request(2)->postAndAwaitResponse(response, seconds(5)));
+	ASSERT_TRUE(response->findInt32(kKeyValue, &value));
+	ASSERT_EQ(3, value);
+}
+
+TEST_F(ReplyTest, AwaitResponseTimesOut) {
+	auto msg(request(1));
+	msg->setInt32("delay-ms", 200);
+	shared_ptr<Message> response;
+	ASSERT_EQ(Result::ER_TIMED_OUT, msg->postAndAwaitResponse(response, milliseconds(20)));
+	ASSERT_EQ(nullptr, response);
+
+	// The late reply is dropped, and doesn't get in the way of the next one.
+	int32_t value = 0;
+	ASSERT_EQ(Result::OK, request(5)->postAndAwaitResponse(response, seconds(5)));
+	ASSERT_TRUE(response->findInt32(kKeyValue, &value));
+	ASSERT_EQ(6, value);
+}
+
+TEST_F(ReplyTest, UnreachableTargetFailsRightAway) {
+	shared_ptr<Message> response;
+	ASSERT_EQ(Result::ER_NAME_NOT_FOUND, Message::obtain(0)->postAndAwaitResponse(response, seconds(5)));
+	future<shared_ptr<Message>> reply;
+	ASSERT_EQ(Result::ER_NAME_NOT_FOUND, Message::obtain(0)->postWithReply(&reply));
+}
+
+TEST_F(ReplyTest, ReplyThroughFutureAndCallback) {
+	future<shared_ptr<Message>> reply;
+	ASSERT_EQ(Result::OK, request(10)->postWithReply(&reply));
+
+	promise<int32_t> called;
+	ASSERT_EQ(Result::OK, request(20)->postWithReply([&called](const shared_ptr<Message>& response) {
+		int32_t value = 0;
+		response->findInt32(kKeyValue, &value);
+		called.set_value(value);
+	}));
+
+	int32_t value = 0;
+	ASSERT_EQ(future_status::ready, reply.wait_for(seconds(5)));
+	ASSERT_TRUE(reply.get()->findInt32(kKeyValue, &value));
+	ASSERT_EQ(11, value);
+
+	future<int32_t> callback(called.get_future());
+	ASSERT_EQ(future_status::ready, callback.wait_for(seconds(5)));
+	ASSERT_EQ(21, callback.get());
+}
+
+TEST_F(ReplyTest, ConcurrentCallersGetTheirOwnReply) {
+	const int32_t kCallers = 64;
+	const int32_t kRequests = 50;
+	vector<thread> callers;
+	atomic<int32_t> mismatches(0);
+	for (int32_t i = 0; i < kCallers; i++) {
+		callers.push_back(thread([this, i, kRequests, &mismatches] {
+			for (int32_t j = 0; j < kRequests; j++) {
+				int32_t sent = i * kRequests + j;
+				shared_ptr<Message> response;
+				int32_t value = 0;
+				if (request(sent)->postAndAwaitResponse(response, seconds(10)) != Result::OK
+						|| !response->findInt32(kKeyValue, &value) || value != sent + 1) {
+					mismatches++;
+				}
+			}
+		}));
+	}
+	for (auto& caller : callers) {
+		caller.join();
+	}
+	ASSERT_EQ(0, mismatches.load());
+}
+
+// Takes requests and never answers them.
+class SilentHandler : public Handler {
+public:
+	SilentHandler() : mReceived(0) {}
+
+	virtual ~SilentHandler() = default;
+
+	int32_t received() const { return mReceived.load(); }
+
+protected:
+	virtual void onMessageReceived(const shared_ptr<Message>&) { ++mReceived; }
+
+private:
+	atomic<int32_t> mReceived;
+};
+
+static shared_ptr<Message> waitForResponse(future<shared_ptr<Message>>& reply) {
+	if (reply.wait_for(seconds(5)) != future_status::ready) {
+		ADD_FAILURE() << "no response";
+		return NULL;
+	}
+	return reply.get();
+}
+
+TEST_F(ReplyTest, CancelledRequestFails) {
+	// Keeps the looper busy, so the request is still queued when cancelled.
+	auto busy(request(0));
+	busy->setInt32("delay-ms", 100);
+	ASSERT_EQ(Result::OK, busy->post());
+
+	auto msg(request(1));
+	future<shared_ptr<Message>> reply;
+	ASSERT_EQ(Result::OK, msg->postWithReply(&reply));
+	ASSERT_EQ(Result::OK, msg->cancel());
+	ASSERT_EQ(nullptr, waitForResponse(reply));
+}
+
+TEST_F(ReplyTest, DroppedRequestFails) {
+	auto looper(make_shared<Looper>());
+	auto silent(make_shared<SilentHandler>());
+	looper->registerHandler(silent);
+	looper->setQueueCapacity(1, Looper::kOverflowDropOldest);
+
+	future<shared_ptr<Message>> reply;
+	ASSERT_EQ(Result::OK, Message::obtain(silent->id())->postWithReply(&reply));
+	ASSERT_EQ(Result::OK, Message::obtain(silent->id())->post());
+	ASSERT_EQ(nullptr, waitForResponse(reply));
+}
+
+TEST_F(ReplyTest, UnregisteringTheTargetFailsItsRequests) {
+	auto silent(make_shared<SilentHandler>());
+	Looper::handler_id id = mLooper->registerHandler(silent);
+
+	future<shared_ptr<Message>> reply;
+	promise<shared_ptr<Message>> called;
+	ASSERT_EQ(Result::OK, Message::obtain(id)->postWithReply(&reply));
+	ASSERT_EQ(Result::OK, Message::obtain(id)->postWithReply([&called](const shared_ptr<Message>& response) {
+		called.set_value(response);
+	}));
+	mLooper->unregisterHandler(id);
+
+	ASSERT_EQ(nullptr, waitForResponse(reply));
+	future<shared_ptr<Message>> callback(called.get_future());
+	ASSERT_EQ(nullptr, waitForResponse(callback));
+}
+
+TEST_F(ReplyTest, StoppingTheLooperFailsItsRequests) {
+	auto looper(make_shared<Looper>());
+	auto silent(make_shared<SilentHandler>());
+	looper->registerHandler(silent);
+	ASSERT_EQ(Result::OK, looper->start());
+
+	Result status = Result::OK;
+	thread caller([&silent, &status] {
+		shared_ptr<Message> response;
+		status = Message::obtain(silent->id())->postAndAwaitResponse(response);
+	});
+	while (silent->received() < 1) {
+		this_thread::yield();
+	}
+	looper->stop();
+	caller.join();
+	ASSERT_EQ(Result::ER_DEAD_OBJECT, status);
+
+	// Other loopers' requests are left alone.
+	shared_ptr<Message> response;
+	ASSERT_EQ(Result::OK, request(1)->postAndAwaitResponse(response, seconds(5)));
+}
+
+TEST_F(ReplyTest, UnansweredRequestsExpire) {
+	auto silent(make_shared<SilentHandler>());
+	mLooper->registerHandler(silent);
+
+	future<shared_ptr<Message>> reply;
+	promise<shared_ptr<Message>> called;
+	ASSERT_EQ(Result::OK, Message::obtain(silent->id())->postWithReply(&reply, milliseconds(20)));
+	ASSERT_EQ(Result::OK, Message::obtain(silent->id())->postWithReply(
+			[&called](const shared_ptr<Message>& response) {
+		called.set_value(response);
+	}, milliseconds(20)));
+
+	ASSERT_EQ(nullptr, waitForResponse(reply));
+	future<shared_ptr<Message>> callback(called.get_future());
+	ASSERT_EQ(nullptr, waitForResponse(callback));
+
+	// Answered in time, a deadline changes nothing.
+	future<shared_ptr<Message>> answered;
+	int32_t value = 0;
+	ASSERT_EQ(Result::OK, request(7)->postWithReply(&answered, seconds(5)));
+	shared_ptr<Message> response(waitForResponse(answered));
+	ASSERT_TRUE(response != NULL);
+	ASSERT_TRUE(response->findInt32(kKeyValue, &value));
+	ASSERT_EQ(8, value);
+}
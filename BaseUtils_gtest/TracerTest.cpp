@@ -0,0 +1,139 @@
+#include <gtest/gtest.h>
+#include <baseutils/Handler.h>
+#include <baseutils/Looper.h>
+#include <baseutils/LooperPool.h>
+#include <baseutils/Message.h>
+#include <baseutils/Tracer.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+using namespace std;
+using namespace std::chrono;
+using namespace baseutils;
+
+// Hands every message on to the next stage, if any.
+class StageHandler : public Handler {
+public:
+	StageHandler() : mNext(0), mCount(0) {}
+
+	virtual ~StageHandler() = default;
+
+	Looper::handler_id mNext;
+	atomic<int32_t> mCount;
+
+protected:
+	virtual void onMessageReceived(const shared_ptr<Message> &msg) {
+		if (mNext != 0) {
+			Message::obtain(mNext, msg->what())->post();
+		}
+		++mCount;
+	}
+};
+
+// 'ping'
+static const uint32_t kWhatPing = 0x70696e67;
+
+static size_t countOf(const string& json, const string& text) {
+	size_t count = 0;
+	for (size_t pos = json.find(text); pos != string::npos; pos = json.find(text, pos + 1)) {
+		count++;
+	}
+	return count;
+}
+
+TEST(TracerTest, DisabledRecordsNothing) {
+	Tracer::clear();
+	auto looper(make_shared<Looper>());
+	auto handler(make_shared<StageHandler>());
+	looper->registerHandler(handler);
+	ASSERT_EQ(Result::OK, looper->start());
+
+	Message::obtain(handler->id(), 1)->post();
+	while (handler->mCount.load() < 1) {
+		this_thread::yield();
+	}
+	looper->stop();
+
+	string json;
+	Tracer::dump(&json);
+	ASSERT_EQ(0u, countOf(json, "\"ph\":\"X\""));
+	ASSERT_EQ(0u, countOf(json, "\"ph\":\"B\""));
+}
+
+TEST(TracerTest, FlowFollowsMessageAcrossLoopers) {
+	Tracer::clear();
+	auto first(make_shared<Looper>());
+	auto second(make_shared<Looper>());
+	first->setName("first");
+	second->setName("second");
+	auto head(make_shared<StageHandler>());
+	auto tail(make_shared<StageHandler>());
+	first->registerHandler(head);
+	second->registerHandler(tail);
+	head->mNext = tail->id();
+	ASSERT_EQ(Result::OK, first->start());
+	ASSERT_EQ(Result::OK, second->start());
+
+	Tracer::setEnabled(true);
+	Message::obtain(head->id(), kWhatPing)->post();
+	while (tail->mCount.load() < 1) {
+		this_thread::yield();
+	}
+	// Both are done with the handlers once stopped.
+	first->stop();
+	second->stop();
+	Tracer::setEnabled(false);
+
+	string json;
+	Tracer::dump(&json);
+	ASSERT_EQ(0u, json.find("{\"traceEvents\":["));
+	ASSERT_NE(string::npos, json.find("\"args\":{\"name\":\"first\"}"));
+	ASSERT_NE(string::npos, json.find("\"args\":{\"name\":\"second\"}"));
+
+	// Two hops, each posted, dequeued and handled.
+	ASSERT_EQ(2u, countOf(json, "\"name\":\"post\""));
+	ASSERT_EQ(2u, countOf(json, "\"name\":\"dequeue\""));
+	ASSERT_EQ(2u, countOf(json, "\"name\":\"'ping'\",\"cat\":\"handler\",\"ph\":\"B\""));
+	ASSERT_EQ(2u, countOf(json, "\"ph\":\"E\""));
+	ASSERT_EQ(2u, countOf(json, "\"ph\":\"s\""));
+	ASSERT_EQ(2u, countOf(json, "\"ph\":\"t\""));
+	ASSERT_EQ(2u, countOf(json, "\"ph\":\"f\""));
+
+	// The second hop is posted from within the first handler call.
+	size_t firstEnd = json.find("\"ph\":\"E\"");
+	size_t secondPost = json.find("\"name\":\"post\"", json.find("\"name\":\"post\"") + 1);
+	ASSERT_LT(secondPost, firstEnd);
+
+	Tracer::clear();
+	Tracer::dump(&json);
+	ASSERT_EQ(0u, countOf(json, "\"ph\":\"X\""));
+}
+
+TEST(TracerTest, PoolDequeuesDelayedMessagesOnce) {
+	Tracer::clear();
+	auto pool(make_shared<LooperPool>(2));
+	auto handler(make_shared<StageHandler>());
+	pool->registerHandler(handler);
+	ASSERT_EQ(Result::OK, pool->start());
+
+	Tracer::setEnabled(true);
+	Message::obtain(handler->id(), kWhatPing)->post(milliseconds(5));
+	while (handler->mCount.load() < 1) {
+		this_thread::yield();
+	}
+	pool->stop();
+	Tracer::setEnabled(false);
+
+	// The looper thread only hands it to a strand, the worker dequeues it.
+	string json;
+	Tracer::dump(&json);
+	ASSERT_EQ(1u, countOf(json, "\"name\":\"post\""));
+	ASSERT_EQ(1u, countOf(json, "\"name\":\"dequeue\""));
+	ASSERT_EQ(1u, countOf(json, "\"ph\":\"s\""));
+	ASSERT_EQ(1u, countOf(json, "\"ph\":\"t\""));
+	ASSERT_EQ(1u, countOf(json, "\"ph\":\"f\""));
+	Tracer::clear();
+}
@@ -0,0 +1,251 @@
+#include <gtest/gtest.h>
+#include <baseutils/Handler.h>
+#include <baseutils/Looper.h>
+#include <baseutils/LooperPool.h>
+#include <baseutils/Message.h>
+#include <baseutils/Watchdog.h>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+using namespace baseutils;
+
+// Blocks in its first message until released.
+class BlockingHandler : public Handler {
+public:
+	BlockingHandler() : mGate(mRelease.get_future().share()), mEntered(0), mCount(0) {}
+
+	virtual ~BlockingHandler() = default;
+
+	void release() { mRelease.set_value(); }
+
+	void waitEntered() {
+		while (mEntered.load() == 0) {
+			this_thread::yield();
+		}
+	}
+
+	int32_t count() const { return mCount.load(); }
+
+protected:
+	virtual void onMessageReceived(const shared_ptr<Message>&) {
+		if (mEntered++ == 0) {
+			mGate.wait();
+		}
+		++mCount;
+	}
+
+private:
+	promise<void> mRelease;
+	shared_future<void> mGate;
+	atomic<int32_t> mEntered;
+	atomic<int32_t> mCount;
+};
+
+class ReportRecorder {
+public:
+	Watchdog::ReportCallback callback() {
+		return [this](const Watchdog::Report& report) {
+			unique_lock<mutex> lock(mLock);
+			mReports.push_back(report);
+		};
+	}
+
+	vector<Watchdog::Report> reports() {
+		unique_lock<mutex> lock(mLock);
+		return mReports;
+	}
+
+	// Checks until something is reported, for up to five seconds.
+	void checkUntilReported(Watchdog* watchdog) {
+		auto deadline = steady_clock::now() + seconds(5);
+		while (reports().empty() && steady_clock::now() < deadline) {
+			watchdog->check();
+			this_thread::yield();
+		}
+	}
+
+private:
+	mutex mLock;
+	vector<Watchdog::Report> mReports;
+};
+
+TEST(WatchdogTest, SlowHandlerReportedOnce) {
+	auto looper(make_shared<Looper>());
+	looper->setName("slow");
+	auto handler(make_shared<BlockingHandler>());
+	looper->registerHandler(handler);
+	ReportRecorder recorder;
+	auto watchdog(make_shared<Watchdog>(milliseconds(20), Looper::clock::duration::zero(), recorder.callback()));
+	ASSERT_EQ(Result::OK, watchdog->watch(looper));
+	ASSERT_EQ(Result::ER_ALREADY_EXISTS, watchdog->watch(looper));
+	ASSERT_EQ(Result::OK, looper->start());
+
+	auto posted(Looper::GetNow());
+	Message::obtain(handler->id(), 7)->post();
+	handler->waitEntered();
+	Message::obtain(handler->id(), 8)->post();
+	Message::obtain(handler->id(), 8)->post();
+	watchdog->check();
+	// Unless this thread was held up past the budget itself.
+	if (Looper::GetNow() - posted < milliseconds(20)) {
+		ASSERT_TRUE(recorder.reports().empty());
+	}
+
+	recorder.checkUntilReported(watchdog.get());
+	watchdog->check();
+	watchdog->check();
+	vector<Watchdog::Report> reports = recorder.reports();
+	ASSERT_EQ(1u, reports.size());
+	ASSERT_EQ(Watchdog::Report::kSlowHandler, reports[0].mKind);
+	ASSERT_EQ("slow", reports[0].mLooperName);
+	ASSERT_EQ(handler->id(), reports[0].mTarget);
+	ASSERT_EQ(7u, reports[0].mWhat);
+	ASSERT_GE(reports[0].mElapsed, milliseconds(20));
+	ASSERT_EQ(2u, reports[0].mQueueDepth);
+
+	handler->release();
+	while (handler->count() < 3) {
+		this_thread::yield();
+	}
+	looper->stop();
+	watchdog->check();
+	ASSERT_EQ(1u, recorder.reports().size());
+}
+
+TEST(WatchdogTest, StaleQueueReportedUntilItCatchesUp) {
+	auto looper(make_shared<Looper>());
+	auto handler(make_shared<BlockingHandler>());
+	looper->registerHandler(handler);
+	ReportRecorder recorder;
+	auto watchdog(make_shared<Watchdog>(Looper::clock::duration::zero(), milliseconds(20), recorder.callback()));
+	ASSERT_EQ(Result::OK, watchdog->watch(looper));
+	ASSERT_EQ(Result::OK, looper->start());
+
+	Message::obtain(handler->id(), 1)->post();
+	handler->waitEntered();
+	auto posted(Looper::GetNow());
+	Message::obtain(handler->id(), 2)->post();
+	watchdog->check();
+	if (Looper::GetNow() - posted < milliseconds(20)) {
+		ASSERT_TRUE(recorder.reports().empty());
+	}
+
+	recorder.checkUntilReported(watchdog.get());
+	watchdog->check();
+	watchdog->check();
+	vector<Watchdog::Report> reports = recorder.reports();
+	ASSERT_EQ(1u, reports.size());
+	ASSERT_EQ(Watchdog::Report::kStaleQueue, reports[0].mKind);
+	ASSERT_GE(reports[0].mElapsed, milliseconds(20));
+	ASSERT_EQ(1u, reports[0].mQueueDepth);
+
+	handler->release();
+	while (handler->count() < 2) {
+		this_thread::yield();
+	}
+	looper->stop();
+	watchdog->check();
+	ASSERT_EQ(1u, recorder.reports().size());
+	ASSERT_EQ(Looper::clock::duration::zero(), looper->oldestPendingAge());
+}
+
+TEST(WatchdogTest, PeriodicCheckCoversPoolWorkers) {
+	auto pool(make_shared<LooperPool>(2));
+	auto handler(make_shared<BlockingHandler>());
+	pool->registerHandler(handler);
+
+	promise<Watchdog::Report> reported;
+	atomic<int32_t> reports(0);
+	auto watchdog(make_shared<Watchdog>(milliseconds(10), Looper::clock::duration::zero(),
+			[&](const Watchdog::Report& report) {
+				if (reports++ == 0) {
+					reported.set_value(report);
+				}
+			}));
+	auto watchdogLooper(make_shared<Looper>());
+	ASSERT_EQ(Result::ER_NO_INIT, watchdog->start(milliseconds(5)));
+	watchdogLooper->registerHandler(watchdog);
+	ASSERT_EQ(Result::OK, watchdog->watch(pool));
+	ASSERT_EQ(Result::OK, watchdogLooper->start());
+	ASSERT_EQ(Result::OK, watchdog->start(milliseconds(5)));
+	ASSERT_EQ(Result::OK, pool->start());
+
+	Message::obtain(handler->id(), 3)->post();
+	auto future(reported.get_future());
+	ASSERT_EQ(future_status::ready, future.wait_for(seconds(5)));
+	Watchdog::Report report = future.get();
+	ASSERT_EQ(Watchdog::Report::kSlowHandler, report.mKind);
+	ASSERT_EQ(handler->id(), report.mTarget);
+	ASSERT_EQ(3u, report.mWhat);
+
+	watchdog->stop();
+	watchdogLooper->stop();
+	handler->release();
+	pool->stop();
+	ASSERT_EQ(1, reports.load());
+}
+
+TEST(WatchdogTest, TrackingStaysOnWhileAnyoneNeedsIt) {
+	auto looper(make_shared<Looper>());
+	auto first(make_shared<BlockingHandler>());
+	auto second(make_shared<BlockingHandler>());
+	looper->registerHandler(first);
+	looper->registerHandler(second);
+	// The application wants queue latency for itself.
+	looper->setLatencyTracking(true);
+
+	ReportRecorder recorder;
+	auto watchdog(make_shared<Watchdog>(seconds(60), seconds(60), recorder.callback()));
+	auto other(make_shared<Watchdog>(seconds(60), seconds(60), recorder.callback()));
+	auto bystander(make_shared<Watchdog>(seconds(60), seconds(60), recorder.callback()));
+	ASSERT_EQ(Result::OK, watchdog->watch(looper));
+	ASSERT_EQ(Result::OK, other->watch(looper));
+	bystander->unwatch(NULL);
+	bystander->unwatch(looper);
+	ASSERT_EQ(Result::OK, looper->start());
+
+	// The other watchdog still sees deliveries.
+	watchdog->unwatch(looper);
+	vector<Looper::ActiveDispatch> active;
+	Message::obtain(first->id(), 1)->post();
+	first->waitEntered();
+	looper->getActiveDispatches(&active);
+	ASSERT_EQ(1u, active.size());
+	first->release();
+	while (first->count() < 1) {
+		this_thread::yield();
+	}
+
+	// Nobody does now, but the application still gets its latency.
+	other->unwatch(looper);
+	Message::obtain(second->id(), 2)->post();
+	second->waitEntered();
+	active.clear();
+	looper->getActiveDispatches(&active);
+	ASSERT_TRUE(active.empty());
+	second->release();
+	while (second->count() < 1) {
+		this_thread::yield();
+	}
+	Histogram waits;
+	ASSERT_EQ(Result::OK, looper->getQueueLatency(Looper::kPriorityNormal, &waits));
+	ASSERT_EQ(2u, waits.count());
+
+	looper->setLatencyTracking(false);
+	Message::obtain(first->id(), 3)->post();
+	while (first->count() < 2) {
+		this_thread::yield();
+	}
+	ASSERT_EQ(Result::OK, looper->getQueueLatency(Looper::kPriorityNormal, &waits));
+	ASSERT_EQ(2u, waits.count());
+
+	looper->stop();
+	ASSERT_TRUE(recorder.reports().empty());
+}